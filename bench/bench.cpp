@@ -0,0 +1,743 @@
+
+// CPU-side microbenchmarks, printed as one JSON object per line:
+//   3dGameEngineBench [model.gltf|model.glb ...]
+// Passing a model along with its EXT_meshopt_compression version (as
+// written by gltfpack -c) compares their size and load time.
+// Every case runs a fixed number of iterations after one warm-up
+// iteration, so runs are comparable across builds and machines.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "AssetManager.hpp"
+#include "MeshoptDecoder.hpp"
+#include "TransformHierarchy.hpp"
+#include "Animation.hpp"
+#include "ThreadPool.hpp"
+#include "World.hpp"
+#include "Occlusion.hpp"
+#include "LightGrid.hpp"
+#include "draw.hpp"
+
+// Keeps the optimizer from dropping the measured work
+static volatile float g_sink = 0;
+
+template <typename Body>
+static void _run(
+  const std::string& name, const std::string& subject,
+  uint32_t iterations, uint32_t threads, Body&& body
+) {
+  body();
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; ++i) {
+    body();
+  }
+  double totalMs = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+
+  nlohmann::json result = {
+    { "benchmark", name },
+    { "subject", subject },
+    { "threads", threads },
+    { "iterations", iterations },
+    { "total_ms", totalMs },
+    { "mean_us", totalMs * 1000 / iterations }
+  };
+  printf("%s\n", result.dump().c_str());
+  fflush(stdout);
+}
+
+// Moves the root back and forth, so every world matrix is dirty
+static glm::mat4 _rootTransform(uint32_t frame) {
+  return glm::translate(glm::mat4(1), glm::vec3(0, 0, (frame & 1) * 0.001f));
+}
+
+// The file and the external buffers it references
+static size_t _assetFileBytes(
+  const std::string& path, const fx::gltf::Document& document
+) {
+  size_t byteCount = std::filesystem::file_size(path);
+  for (const fx::gltf::Buffer& buffer: document.buffers) {
+    if (!buffer.uri.empty() && !buffer.IsEmbeddedResource()) {
+      byteCount += std::filesystem::file_size(
+        std::filesystem::path(path).parent_path() / buffer.uri
+      );
+    }
+  }
+  return byteCount;
+}
+
+static void _benchModel(const std::string& path) {
+  std::string subject = std::filesystem::path(path).filename().string();
+
+  {
+    AssetManager assets;
+    const fx::gltf::Document& document = *assets.getAsset(assets.loadAsset(path));
+    size_t compressedViews = 0;
+    for (const fx::gltf::BufferView& bufferView: document.bufferViews) {
+      compressedViews += MeshoptCompression::fromJson(
+        bufferView.extensionsAndExtras
+      ).has_value();
+    }
+    nlohmann::json result = {
+      { "benchmark", "assetFile" },
+      { "subject", subject },
+      { "file_bytes", _assetFileBytes(path, document) },
+      { "buffer_views", document.bufferViews.size() },
+      { "meshopt_views", compressedViews }
+    };
+    printf("%s\n", result.dump().c_str());
+  }
+
+  _run("loadAsset", subject, 20, 1, [&]() {
+    AssetManager assets;
+    assets.loadAsset(path);
+  });
+  // Only compressed buffer views are decoded in parallel
+  {
+    ThreadPool threadPool;
+    _run("loadAsset", subject, 20, threadPool.getThreadCount(), [&]() {
+      AssetManager assets;
+      assets.loadAsset(path, true, false, &threadPool);
+    });
+  }
+
+  // Post-transform cache efficiency before and after the mesh optimizer,
+  // from a simulated FIFO cache
+  {
+    AssetManager optimized;
+    size_t optimizedId = optimized.loadAsset(path);
+    auto start = std::chrono::steady_clock::now();
+    MeshOptimizationReport report = optimized.optimizeMeshes(optimizedId);
+    nlohmann::json result = {
+      { "benchmark", "optimizeMeshes" },
+      { "subject", subject },
+      { "total_ms", std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start
+      ).count() },
+      { "triangles", report.triangleCount },
+      { "acmr_before", report.acmrBefore() },
+      { "acmr_after", report.acmrAfter() },
+      { "atvr_before", report.atvrBefore() },
+      { "atvr_after", report.atvrAfter() },
+      { "index_bytes_before", report.indexBytesBefore },
+      { "index_bytes_after", report.indexBytesAfter }
+    };
+    printf("%s\n", result.dump().c_str());
+    fflush(stdout);
+  }
+
+  AssetManager assets;
+  size_t assetId = assets.loadAsset(path);
+  const fx::gltf::Document& document = *assets.getAsset(assetId);
+
+  _run("Accessor::getComponent", subject, 20, 1, [&]() {
+    float sum = 0;
+    for (size_t i = 0; i < document.accessors.size(); ++i) {
+      const Accessor& accessor = *assets.getAccessor(assetId, i);
+      uint32_t componentCount = accessor.getComponentCount();
+      for (uint32_t element = 0; element < accessor.count; ++element) {
+        for (uint32_t component = 0; component < componentCount; ++component) {
+          sum += accessor.getComponent(element, component);
+        }
+      }
+    }
+    g_sink = sum;
+  });
+
+  TransformHierarchy hierarchy(assets, assetId);
+  uint32_t frame = 0;
+
+  if (document.animations.size() > 0) {
+    _run("animateHierarchy", subject, 10000, 1, [&]() {
+      animateHierarchy(assets, assetId, 0, (frame++ % 240) / 60.f, hierarchy);
+    });
+  }
+
+  _run("TransformHierarchy::update", subject, 10000, 1, [&]() {
+    hierarchy.setRootTransform(_rootTransform(frame++));
+    g_sink = hierarchy.update();
+  });
+
+  if (document.skins.size() > 0) {
+    std::vector<glm::mat4> joints;
+    _run("getJointMatrices", subject, 10000, 1, [&]() {
+      for (const fx::gltf::Skin& skin: document.skins) {
+        getJointMatrices(assets, assetId, skin, hierarchy, joints);
+      }
+      g_sink = joints.size();
+    });
+  }
+}
+
+// Three levels of fan-out below the root, with a single triangle mesh on
+// every node: 195 * (1 + 10 * (1 + 25)) + 1 = 50896 nodes
+static std::string _writeLargeScene(const std::filesystem::path& directory) {
+  const uint32_t GROUPS = 195;
+  const uint32_t SUBGROUPS = 10;
+  const uint32_t LEAVES = 25;
+
+  fx::gltf::Document document;
+  document.asset.version = "2.0";
+
+  std::vector<float> positions = { 0, 0, 0, 0.1f, 0, 0, 0, 0.1f, 0 };
+  fx::gltf::Buffer buffer;
+  buffer.uri = "largeScene.bin";
+  buffer.byteLength = positions.size() * sizeof(float);
+  buffer.data.resize(buffer.byteLength);
+  std::copy_n(
+    reinterpret_cast<const uint8_t*>(positions.data()), buffer.byteLength,
+    buffer.data.begin()
+  );
+  document.buffers.push_back(buffer);
+
+  fx::gltf::BufferView bufferView;
+  bufferView.buffer = 0;
+  bufferView.byteLength = buffer.byteLength;
+  document.bufferViews.push_back(bufferView);
+
+  fx::gltf::Accessor accessor;
+  accessor.bufferView = 0;
+  accessor.count = 3;
+  accessor.type = fx::gltf::Accessor::Type::Vec3;
+  accessor.componentType = fx::gltf::Accessor::ComponentType::Float;
+  accessor.min = { 0, 0, 0 };
+  accessor.max = { 0.1f, 0.1f, 0 };
+  document.accessors.push_back(accessor);
+
+  fx::gltf::Primitive primitive;
+  primitive.attributes["POSITION"] = 0;
+  fx::gltf::Mesh mesh;
+  mesh.primitives.push_back(primitive);
+  document.meshes.push_back(mesh);
+
+  auto addNode = [&](int32_t parent, float x, float y) {
+    fx::gltf::Node node;
+    node.mesh = 0;
+    node.translation = { x, y, 0 };
+    document.nodes.push_back(node);
+    int32_t index = document.nodes.size() - 1;
+    if (parent != -1) {
+      document.nodes[parent].children.push_back(index);
+    }
+    return index;
+  };
+
+  int32_t root = addNode(-1, 0, 0);
+  for (uint32_t i = 0; i < GROUPS; ++i) {
+    int32_t group = addNode(root, i % 15 - 7.f, i / 15 - 6.f);
+    for (uint32_t j = 0; j < SUBGROUPS; ++j) {
+      int32_t subgroup = addNode(group, 0.1f * j, 0);
+      for (uint32_t k = 0; k < LEAVES; ++k) {
+        addNode(subgroup, 0, 0.02f * k);
+      }
+    }
+  }
+
+  fx::gltf::Scene scene;
+  scene.nodes.push_back(root);
+  document.scenes.push_back(scene);
+  document.scene = 0;
+
+  std::string path = (directory / "largeScene.gltf").string();
+  fx::gltf::Save(document, path, false);
+  return path;
+}
+
+// Draw preparation on a large hierarchy, from one thread up to every
+// hardware thread
+static void _benchLargeScene() {
+  std::filesystem::path directory = std::filesystem::temp_directory_path();
+  std::string path = _writeLargeScene(directory);
+  std::string subject = "largeScene";
+
+  AssetManager assets;
+  size_t assetId = assets.loadAsset(path);
+  TransformHierarchy hierarchy(assets, assetId);
+  std::vector<DrawList> drawLists;
+  subject += "-" + std::to_string(hierarchy.size());
+
+  glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 12), glm::vec3(0), glm::vec3(0, 1, 0));
+  glm::mat4 projection = glm::perspective(45.0f, 1.0f, 0.1f, 500.0f);
+
+  uint32_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (uint32_t threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+    ThreadPool threadPool(threads);
+    uint32_t frame = 0;
+
+    _run("TransformHierarchy::update", subject, 100, threads, [&]() {
+      hierarchy.setRootTransform(_rootTransform(frame++));
+      g_sink = hierarchy.update(&threadPool);
+    });
+
+    _run("extractDrawLists", subject, 100, threads, [&]() {
+      extractDrawLists(
+        assets, assetId,
+        hierarchy,
+        _rootTransform(frame++), view, projection,
+        0,
+        drawLists,
+        &threadPool
+      );
+      g_sink = drawLists.size();
+    });
+
+    if (threads == maxThreads) {
+      break;
+    }
+  }
+
+  std::filesystem::remove(path);
+  std::filesystem::remove(directory / "largeScene.bin");
+}
+
+// A wavy grid of about a million triangles, built over one thread then
+// the pool, read back from the cache, and cast coherent rays from a
+// camera above it and random rays through its bounds
+static void _benchTriangleBvh() {
+  const uint32_t gridSize = 708;
+  std::vector<uint32_t> indices;
+  OwnedAccessor positions(
+    (gridSize + 1) * (gridSize + 1), Accessor::Type::Vec3,
+    Accessor::ComponentType::Float, false, 0, BufferView::TargetType::ArrayBuffer
+  );
+  for (uint32_t y = 0; y <= gridSize; ++y) {
+    for (uint32_t x = 0; x <= gridSize; ++x) {
+      uint32_t vertex = y * (gridSize + 1) + x;
+      float height = std::sin(x * 0.1f) * std::cos(y * 0.07f);
+      glm::vec3 position(x * 0.1f, height, y * 0.1f);
+      memcpy(positions.getElement(vertex), &position, sizeof(position));
+      if (x < gridSize && y < gridSize) {
+        uint32_t below = vertex + gridSize + 1;
+        indices.insert(indices.end(), { vertex, vertex + 1, below, vertex + 1, below + 1, below });
+      }
+    }
+  }
+  std::unique_ptr<OwnedAccessor> indexAccessor = createIndexAccessor(
+    indices, positions.accessor.count
+  );
+  MeshPrimitive primitive;
+  primitive.attributes["POSITION"] = &positions.accessor;
+  primitive.indices = &indexAccessor->accessor;
+  std::string subject = "grid-" + std::to_string(indices.size() / 3);
+
+  ThreadPool threadPool;
+  uint32_t threads = threadPool.getThreadCount();
+  TriangleBvh triangleBvh;
+  _run("buildTriangleBvh", subject, 3, 1, [&]() {
+    triangleBvh = buildTriangleBvh(primitive);
+  });
+  _run("buildTriangleBvh", subject, 3, threads, [&]() {
+    triangleBvh = buildTriangleBvh(primitive, &threadPool);
+  });
+
+  std::string cachePath = (
+    std::filesystem::temp_directory_path() / (getTriangleBvhCacheKey(primitive) + ".bvh")
+  ).string();
+  saveTriangleBvh(cachePath, triangleBvh);
+  _run("loadTriangleBvh", subject, 3, 1, [&]() {
+    TriangleBvh loaded;
+    g_sink = loadTriangleBvh(cachePath, indices.size() / 3, loaded);
+  });
+  std::filesystem::remove(cachePath);
+
+  const uint32_t rayCount = 1 << 16;
+  float extent = gridSize * 0.1f;
+  std::vector<Ray> coherentRays;
+  std::vector<Ray> randomRays;
+  for (uint32_t i = 0; i < rayCount; ++i) {
+    float u = (i % 256) / 256.f;
+    float v = (i / 256) / 256.f;
+    Ray ray;
+    ray.origin = glm::vec3(extent * 0.5f, 20, -10);
+    ray.direction = glm::vec3(u - 0.5f, -0.6f, v + 0.2f);
+    coherentRays.push_back(ray);
+
+    // Low discrepancy points on the grid, from random points above it
+    float x = std::fmod(i * 0.618034f, 1.f) * extent;
+    float z = std::fmod(i * 0.754878f, 1.f) * extent;
+    ray.origin = glm::vec3(std::fmod(i * 0.569840f, 1.f) * extent, 5, std::fmod(i * 0.245122f, 1.f) * extent);
+    ray.direction = glm::vec3(x, 0, z) - ray.origin;
+    randomRays.push_back(ray);
+  }
+  for (auto rays: { std::make_pair("coherent", &coherentRays), std::make_pair("random", &randomRays) }) {
+    uint32_t hitCount = 0;
+    _run(std::string("TriangleBvh::intersect ") + rays.first, subject, 10, 1, [&]() {
+      hitCount = 0;
+      for (const Ray& ray: *rays.second) {
+        TriangleHit hit;
+        hitCount += triangleBvh.intersect(ray, hit);
+      }
+      g_sink = hitCount;
+    });
+    nlohmann::json result = {
+      { "benchmark", "raycast" },
+      { "subject", subject },
+      { "rays", rays.first },
+      { "ray_count", rayCount },
+      { "hit_count", hitCount }
+    };
+    printf("%s\n", result.dump().c_str());
+  }
+}
+
+// A street seen from eye level: rows of walls, each a grid of 2k
+// triangles, in front of 100k boxes, most of them behind the walls
+static void _benchOcclusion() {
+  std::string subject = "walls-64";
+  const uint32_t wallCells = 32;
+  OccluderMesh wall;
+  for (uint32_t y = 0; y < wallCells; ++y) {
+    for (uint32_t x = 0; x < wallCells; ++x) {
+      glm::vec3 corner(x / (float)wallCells - 0.5f, y / (float)wallCells, 0);
+      glm::vec3 right(1.f / wallCells, 0, 0);
+      glm::vec3 up(0, 1.f / wallCells, 0);
+      wall.vertices.insert(wall.vertices.end(), {
+        corner, corner + right, corner + right + up,
+        corner, corner + right + up, corner + up
+      });
+    }
+  }
+  std::vector<glm::mat4> walls;
+  for (uint32_t i = 0; i < 64; ++i) {
+    glm::vec3 position((i % 8) * 12.f - 42, 0, -(float)(i / 8) * 15 - 10);
+    walls.push_back(glm::scale(glm::translate(glm::mat4(1), position), glm::vec3(10, 6, 1)));
+  }
+  std::vector<Aabb> boxes;
+  for (uint32_t i = 0; i < 100000; ++i) {
+    glm::vec3 center(
+      std::fmod(i * 0.618034f, 1.f) * 100 - 50, 1, -std::fmod(i * 0.754878f, 1.f) * 120 - 12
+    );
+    boxes.push_back(Aabb { center - glm::vec3(0.5f), center + glm::vec3(0.5f) });
+  }
+
+  glm::mat4 view = glm::lookAt(glm::vec3(0, 1.7f, 0), glm::vec3(0, 1.7f, -1), glm::vec3(0, 1, 0));
+  glm::mat4 projection = glm::perspective(1.0f, 16 / 9.f, 0.1f, 500.0f);
+  OcclusionBuffer occlusionBuffer;
+  ThreadPool threadPool;
+  uint32_t threads = threadPool.getThreadCount();
+  std::vector<uint8_t> occluded;
+  for (ThreadPool* pool: { (ThreadPool*)nullptr, &threadPool }) {
+    _run("OcclusionBuffer::rasterize", subject, 100, pool ? threads : 1, [&]() {
+      occlusionBuffer.begin(projection * view);
+      for (const glm::mat4& model: walls) {
+        occlusionBuffer.addOccluder(wall, model);
+      }
+      occlusionBuffer.rasterize(pool);
+    });
+    _run("OcclusionBuffer::test", subject, 100, pool ? threads : 1, [&]() {
+      occlusionBuffer.test(boxes, occluded, pool);
+      g_sink = occluded[0];
+    });
+  }
+
+  const OcclusionStats& stats = occlusionBuffer.getStats();
+  nlohmann::json result = {
+    { "benchmark", "occlusion" },
+    { "subject", subject },
+    { "occluder_triangles", stats.occluderTriangles },
+    { "rasterized_triangles", stats.rasterizedTriangles },
+    { "tested_boxes", boxes.size() },
+    { "occluded_boxes", std::count(occluded.begin(), occluded.end(), 1) }
+  };
+  printf("%s\n", result.dump().c_str());
+}
+
+// Point lights, and a tenth of spot lights, scattered in front of the
+// camera with ranges of a few units, assigned to the default grid
+static void _benchLightGrid() {
+  glm::mat4 view = glm::lookAt(glm::vec3(0, 2, 0), glm::vec3(0, 2, -1), glm::vec3(0, 1, 0));
+  glm::mat4 projection = glm::perspective(1.0f, 16 / 9.f, 0.1f, 500.0f);
+  ThreadPool threadPool;
+  uint32_t threads = threadPool.getThreadCount();
+  for (uint32_t lightCount: { 1000u, 4000u }) {
+    std::string subject = "lights-" + std::to_string(lightCount);
+    std::vector<Light> lights(lightCount);
+    for (uint32_t i = 0; i < lightCount; ++i) {
+      lights[i].position = glm::vec3(
+        std::fmod(i * 0.618034f, 1.f) * 200 - 100, 1,
+        -std::fmod(i * 0.754878f, 1.f) * 200
+      );
+      lights[i].range = 2 + std::fmod(i * 0.569840f, 1.f) * 6;
+      if (i % 10 == 0) {
+        lights[i].direction = glm::vec3(0, -1, 0);
+        lights[i].innerConeAngle = 0.5f;
+        lights[i].outerConeAngle = 0.7f;
+      }
+    }
+
+    LightGrid lightGrid;
+    lightGrid.setViewportSize(1920, 1080);
+    for (ThreadPool* pool: { (ThreadPool*)nullptr, &threadPool }) {
+      _run("LightGrid::update", subject, 100, pool ? threads : 1, [&]() {
+        lightGrid.update(lights, view, projection, pool);
+        g_sink = lightGrid.getLightIndices().size();
+      });
+    }
+
+    const LightGridStats& stats = lightGrid.getStats();
+    nlohmann::json result = {
+      { "benchmark", "light_grid" },
+      { "subject", subject },
+      { "clusters", stats.clusterCount },
+      { "light_indices", stats.lightIndexCount },
+      { "max_cluster_lights", stats.maxClusterLights }
+    };
+    printf("%s\n", result.dump().c_str());
+  }
+}
+
+// A small asset to place many times: a root with two children, each with
+// a single triangle mesh, and an animation turning the root
+static std::string _writeInstanceAsset(const std::filesystem::path& directory) {
+  fx::gltf::Document document;
+  document.asset.version = "2.0";
+
+  std::vector<float> positions = { 0, 0, 0, 0.5f, 0, 0, 0, 0.5f, 0 };
+  std::vector<float> times = { 0, 1 };
+  std::vector<float> rotations = { 0, 0, 0, 1, 0, 0.7071068f, 0, 0.7071068f };
+  fx::gltf::Buffer buffer;
+  buffer.uri = "instanceAsset.bin";
+  for (const std::vector<float>* values: { &positions, &times, &rotations }) {
+    fx::gltf::BufferView bufferView;
+    bufferView.buffer = 0;
+    bufferView.byteOffset = buffer.data.size();
+    bufferView.byteLength = values->size() * sizeof(float);
+    document.bufferViews.push_back(bufferView);
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values->data());
+    buffer.data.insert(buffer.data.end(), bytes, bytes + bufferView.byteLength);
+  }
+  buffer.byteLength = buffer.data.size();
+  document.buffers.push_back(buffer);
+
+  auto addAccessor = [&](fx::gltf::Accessor::Type type, uint32_t count) {
+    fx::gltf::Accessor accessor;
+    accessor.bufferView = document.accessors.size();
+    accessor.count = count;
+    accessor.type = type;
+    accessor.componentType = fx::gltf::Accessor::ComponentType::Float;
+    document.accessors.push_back(accessor);
+    return document.accessors.size() - 1;
+  };
+  addAccessor(fx::gltf::Accessor::Type::Vec3, 3);
+  document.accessors[0].min = { 0, 0, 0 };
+  document.accessors[0].max = { 0.5f, 0.5f, 0 };
+  addAccessor(fx::gltf::Accessor::Type::Scalar, 2);
+  document.accessors[1].min = { 0 };
+  document.accessors[1].max = { 1 };
+  addAccessor(fx::gltf::Accessor::Type::Vec4, 2);
+
+  fx::gltf::Primitive primitive;
+  primitive.attributes["POSITION"] = 0;
+  fx::gltf::Mesh mesh;
+  mesh.primitives.push_back(primitive);
+  document.meshes.push_back(mesh);
+
+  for (float x: { 0.f, 0.5f, -0.5f }) {
+    fx::gltf::Node node;
+    node.mesh = 0;
+    node.translation = { x, 0, 0 };
+    document.nodes.push_back(node);
+  }
+  document.nodes[0].children = { 1, 2 };
+
+  fx::gltf::Animation animation;
+  fx::gltf::Animation::Sampler sampler;
+  sampler.input = 1;
+  sampler.output = 2;
+  animation.samplers.push_back(sampler);
+  fx::gltf::Animation::Channel channel;
+  channel.sampler = 0;
+  channel.target.node = 0;
+  channel.target.path = "rotation";
+  animation.channels.push_back(channel);
+  document.animations.push_back(animation);
+
+  fx::gltf::Scene scene;
+  scene.nodes.push_back(0);
+  document.scenes.push_back(scene);
+  document.scene = 0;
+
+  std::string path = (directory / "instanceAsset.gltf").string();
+  fx::gltf::Save(document, path, false);
+  return path;
+}
+
+// Frames of worlds of 1k, 10k and 100k instances on a grid, a tenth of
+// them animated, seen from above one corner, so that part of the grid is
+// culled. Churn removes and adds back a hundredth of the instances.
+// Rays cast along the rows pass through many instances' bounds.
+static void _benchWorld() {
+  std::filesystem::path directory = std::filesystem::temp_directory_path();
+  std::string path = _writeInstanceAsset(directory);
+
+  AssetManager assets;
+  size_t assetId = assets.loadAsset(path);
+  ThreadPool threadPool;
+  uint32_t threads = threadPool.getThreadCount();
+  std::vector<DrawList> drawLists;
+  assets.buildTriangleBvhs(assetId, &threadPool);
+
+  for (uint32_t instanceCount: { 1000u, 10000u, 100000u }) {
+    std::string subject = "world-" + std::to_string(instanceCount);
+    uint32_t iterations = instanceCount >= 100000 ? 20 : 100;
+
+    World world(assets);
+    uint32_t gridSize = (uint32_t)std::ceil(std::sqrt((double)instanceCount));
+    std::vector<InstanceId> ids;
+    for (uint32_t i = 0; i < instanceCount; ++i) {
+      glm::vec3 position(i % gridSize * 2.f, 0, i / gridSize * 2.f);
+      ids.push_back(world.add(assetId, glm::translate(glm::mat4(1), position)));
+      if (i % 10 == 0) {
+        world.setAnimation(ids.back(), 0, (i % 60) / 60.f);
+      }
+    }
+
+    float center = gridSize * 0.5f;
+    glm::mat4 view = glm::lookAt(
+      glm::vec3(0, center, 0), glm::vec3(center, 0, center), glm::vec3(0, 1, 0)
+    );
+    glm::mat4 projection = glm::perspective(45.0f, 1.0f, 0.1f, 1000.0f);
+
+    _run("World::animate", subject, iterations, threads, [&]() {
+      world.animate(1 / 60.f, &threadPool);
+    });
+
+    _run("World::updateBounds", subject, iterations, threads, [&]() {
+      for (uint32_t i = 0; i < world.size(); i += 10) {
+        world.setTransform(world.getId(i), world.getTransform(i));
+      }
+      world.updateBounds(&threadPool);
+    });
+
+    DrawStats stats;
+    _run("world frame", subject, iterations, threads, [&]() {
+      world.animate(1 / 60.f, &threadPool);
+      world.updateBounds(&threadPool);
+      stats = DrawStats {};
+      extractDrawLists(
+        assets, world, view, projection, drawLists, &threadPool, &stats
+      );
+      g_sink = stats.visiblePrimitives;
+    });
+    nlohmann::json result = {
+      { "benchmark", "worldCulling" },
+      { "subject", subject },
+      { "culled_instances", stats.culledInstances },
+      { "visible_primitives", stats.visiblePrimitives },
+      { "draw_lists", drawLists.size() }
+    };
+    printf("%s\n", result.dump().c_str());
+
+    const BvhStats& bvhStats = world.getBvh().getStats();
+    nlohmann::json bvhResult = {
+      { "benchmark", "bvh" },
+      { "subject", subject },
+      { "nodes", bvhStats.nodeCount },
+      { "wide_nodes", bvhStats.wideNodeCount },
+      { "refit_nodes", bvhStats.refitNodes },
+      { "rotations", bvhStats.rotations },
+      { "flattened", bvhStats.flattened }
+    };
+    printf("%s\n", bvhResult.dump().c_str());
+
+    Frustum frustum = Frustum::fromMatrix(projection * view);
+    std::vector<uint32_t> found;
+    _run("frustum scan", subject, iterations, 1, [&]() {
+      found.clear();
+      for (uint32_t i = 0; i < world.size(); ++i) {
+        if (frustum.isVisible(world.getBounds(i))) {
+          found.push_back(i);
+        }
+      }
+      g_sink = found.size();
+    });
+    _run("Bvh::queryFrustum", subject, iterations, 1, [&]() {
+      found.clear();
+      world.getBvh().queryFrustum(frustum, found);
+      g_sink = found.size();
+    });
+
+    // Gameplay queries around a thousand instances
+    std::vector<Aabb> boxes;
+    std::vector<BoundingSphere> spheres;
+    for (uint32_t i = 0; i < 1000; ++i) {
+      glm::vec3 center = world.getBounds((i * 7919) % world.size()).getCenter();
+      boxes.push_back(Aabb { center - glm::vec3(3), center + glm::vec3(3) });
+      spheres.push_back(BoundingSphere { center, 3 });
+    }
+    BvhQueryResults queryResults;
+    _run("Bvh::queryBoxes", subject, iterations, threads, [&]() {
+      world.getBvh().queryBoxes(boxes, queryResults, &threadPool);
+      g_sink = queryResults.items.size();
+    });
+    _run("Bvh::querySpheres", subject, iterations, threads, [&]() {
+      world.getBvh().querySpheres(spheres, queryResults, &threadPool);
+      g_sink = queryResults.items.size();
+    });
+
+    // Picking rays toward a thousand instances, along the grid's rows
+    std::vector<Ray> rays;
+    for (uint32_t i = 0; i < 1000; ++i) {
+      Ray ray;
+      ray.origin = world.getBounds((i * 7919) % world.size()).getCenter() + glm::vec3(0, 0, 1);
+      ray.direction = glm::vec3(0, 0, -1);
+      rays.push_back(ray);
+    }
+    _run("World::raycast", subject, iterations, 1, [&]() {
+      uint32_t hitCount = 0;
+      for (const Ray& ray: rays) {
+        RaycastHit hit;
+        hitCount += world.raycast(ray, hit);
+      }
+      g_sink = hitCount;
+    });
+
+    uint32_t churn = instanceCount / 100;
+    _run("World::add/remove", subject, iterations, 1, [&]() {
+      for (uint32_t i = 0; i < churn; ++i) {
+        InstanceId& id = ids[(i * 97) % ids.size()];
+        glm::mat4 transform = world.getTransform(world.getIndex(id));
+        world.remove(id);
+        id = world.add(assetId, transform);
+      }
+      world.updateBounds();
+    });
+  }
+
+  std::filesystem::remove(path);
+  std::filesystem::remove(directory / "instanceAsset.bin");
+}
+
+int main(int argc, char** argv)
+{
+  try {
+    for (int i = 1; i < argc; ++i) {
+      _benchModel(argv[i]);
+    }
+    _benchLargeScene();
+    _benchTriangleBvh();
+    _benchOcclusion();
+    _benchLightGrid();
+    _benchWorld();
+  }
+  catch (const std::exception& err) {
+    fprintf(stderr, "An error occured: %s\n", err.what());
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,51 @@
+#
+# Find EGL
+#
+# Try to find EGL, used for OpenGL contexts without a window.
+# This module defines the following variables:
+# - EGL_INCLUDE_DIRS
+# - EGL_LIBRARIES
+# - EGL_FOUND
+#
+# The following variables can be set as arguments for the module.
+# - EGL_ROOT_DIR : Root library directory of EGL
+#
+
+# Additional modules
+include(FindPackageHandleStandardArgs)
+
+# Find include files
+find_path(
+	EGL_INCLUDE_DIR
+	NAMES EGL/egl.h
+	PATHS
+	/usr/include
+	/usr/local/include
+	/opt/local/include
+	${EGL_ROOT_DIR}/include
+	DOC "The directory where EGL/egl.h resides")
+
+# Find library files
+find_library(
+	EGL_LIBRARY
+	NAMES EGL
+	PATHS
+	/usr/lib64
+	/usr/lib
+	/usr/local/lib64
+	/usr/local/lib
+	/opt/local/lib
+	${EGL_ROOT_DIR}/lib
+	DOC "The EGL library")
+
+# Handle REQUIRD argument, define *_FOUND variable
+find_package_handle_standard_args(EGL DEFAULT_MSG EGL_INCLUDE_DIR EGL_LIBRARY)
+
+# Define EGL_LIBRARIES and EGL_INCLUDE_DIRS
+if (EGL_FOUND)
+	set(EGL_LIBRARIES ${EGL_LIBRARY})
+	set(EGL_INCLUDE_DIRS ${EGL_INCLUDE_DIR})
+endif()
+
+# Hide some variables
+mark_as_advanced(EGL_INCLUDE_DIR EGL_LIBRARY)
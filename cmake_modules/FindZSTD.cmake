@@ -0,0 +1,51 @@
+#
+# Find zstd
+#
+# Try to find zstd, used for supercompressed KTX2 textures.
+# This module defines the following variables:
+# - ZSTD_INCLUDE_DIRS
+# - ZSTD_LIBRARIES
+# - ZSTD_FOUND
+#
+# The following variables can be set as arguments for the module.
+# - ZSTD_ROOT_DIR : Root library directory of zstd
+#
+
+# Additional modules
+include(FindPackageHandleStandardArgs)
+
+# Find include files
+find_path(
+	ZSTD_INCLUDE_DIR
+	NAMES zstd.h
+	PATHS
+	/usr/include
+	/usr/local/include
+	/opt/local/include
+	${ZSTD_ROOT_DIR}/include
+	DOC "The directory where zstd.h resides")
+
+# Find library files
+find_library(
+	ZSTD_LIBRARY
+	NAMES zstd
+	PATHS
+	/usr/lib64
+	/usr/lib
+	/usr/local/lib64
+	/usr/local/lib
+	/opt/local/lib
+	${ZSTD_ROOT_DIR}/lib
+	DOC "The zstd library")
+
+# Handle REQUIRD argument, define *_FOUND variable
+find_package_handle_standard_args(ZSTD DEFAULT_MSG ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
+
+# Define ZSTD_LIBRARIES and ZSTD_INCLUDE_DIRS
+if (ZSTD_FOUND)
+	set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+	set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+endif()
+
+# Hide some variables
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
@@ -1,14 +1,91 @@
-#version 400
+#version 430
+#ifdef USE_BINDLESS_TEXTURES
+#extension GL_ARB_bindless_texture : require
+#endif
 
 // c_ : color
 // cc_ : camera coordinates
+// tsc_ : tangentSpace coordinates
+// tc_ : texture coordinates
 
-uniform mat4 modelView;
-uniform vec3 cc_lightPos;
+// Features, defined by the program variant:
+// HAS_NORMAL_MAP, HAS_BASE_COLOR_TEXTURE, USE_TEXTURE_ARRAYS,
+// USE_BINDLESS_TEXTURES
 
-uniform vec4 c_materialColor;
-uniform sampler2D textureId;
+// Must match the blocks of phong.vert
+layout(std140) uniform FrameData {
+  mat4 view;
+  mat4 projection;
+  mat4 viewProjection;
+  mat3 viewNormal;
+  uvec4 clusterCounts;
+  vec4 clusterParameters;
+};
 
+layout(std140) uniform DrawData {
+  mat4 model;
+  mat3 normalMatrix;
+  vec4 c_materialColor;
+  vec2 texcoordScale;
+  vec2 texcoordOffset;
+  vec3 positionScale;
+  vec3 positionOffset;
+  uvec4 textureLayers;
+  uvec4 textureHandles;
+};
+
+// Camera space lights, see LightGrid::GpuLight
+struct Light {
+  // w is 1 / range^2, 0 without falloff
+  vec4 cc_positionInverseRangeSquared;
+  // w is the cosine of the outer cone
+  vec4 c_colorOuterCos;
+  // w is the cosine of the inner cone
+  vec4 cc_directionInnerCos;
+};
+
+// Storage buffer bindings, see LIGHTS_BINDING
+layout(std430) readonly buffer Lights {
+  Light lights[];
+};
+
+// Offset in lightIndices and count of each cluster, x fastest
+layout(std430) readonly buffer LightClusters {
+  uvec2 clusters[];
+};
+
+layout(std430) readonly buffer LightIndices {
+  uint lightIndices[];
+};
+
+// Array variants sample the layer of the draw, from the bound arrays or
+// from the arrays' handles
+#if defined(USE_BINDLESS_TEXTURES)
+#define SAMPLE_TEXTURE(sampler, handle, layer, tc) texture(sampler2DArray(handle), vec3(tc, layer))
+#elif defined(USE_TEXTURE_ARRAYS)
+#define SAMPLE_TEXTURE(sampler, handle, layer, tc) texture(sampler, vec3(tc, layer))
+#else
+#define SAMPLE_TEXTURE(sampler, handle, layer, tc) texture(sampler, tc)
+#endif
+
+#if defined(USE_TEXTURE_ARRAYS) && !defined(USE_BINDLESS_TEXTURES)
+#define TEXTURE_SAMPLER sampler2DArray
+#else
+#define TEXTURE_SAMPLER sampler2D
+#endif
+
+#if defined(HAS_BASE_COLOR_TEXTURE) && !defined(USE_BINDLESS_TEXTURES)
+uniform TEXTURE_SAMPLER textureId;
+#endif
+
+#ifdef HAS_NORMAL_MAP
+#ifndef USE_BINDLESS_TEXTURES
+uniform TEXTURE_SAMPLER normalMapId;
+#endif
+
+in vec3 cc_tangent;
+in vec3 cc_bitangent;
+#endif
 in vec3 cc_pos;
 in vec3 cc_normal;
 in vec2 tc_texture;
@@ -17,17 +94,39 @@ out vec4 c_fragColor;
 
 void main()
 {
-  vec3 cc_lightdir = normalize(cc_lightPos - cc_pos);
+#ifdef HAS_NORMAL_MAP
+  mat3 tbn = mat3(normalize(cc_tangent), normalize(cc_bitangent), normalize(cc_normal));
+  vec3 c_normalMap = SAMPLE_TEXTURE(
+    normalMapId, textureHandles.zw, textureLayers.y, tc_texture
+  ).xyz;
+  vec3 normal = normalize(tbn * (c_normalMap * 2.0 - 1.0));
+#else
+  vec3 normal = normalize(cc_normal);
+#endif
+
+  uvec2 tile = min(uvec2(gl_FragCoord.xy * clusterParameters.xy), clusterCounts.xy - 1);
+  float slice = log(-cc_pos.z) * clusterParameters.z + clusterParameters.w;
+  uint z = uint(clamp(slice, 0.0, float(clusterCounts.z - 1)));
+  uvec2 cluster = clusters[(z * clusterCounts.y + tile.y) * clusterCounts.x + tile.x];
 
-  vec3 cc_reflectedLight = normalize(cc_lightdir - cc_pos);
-  float specularShine = max(dot(cc_reflectedLight, cc_normal), 0.0);
+  vec3 c_diffuse = vec3(0);
+  for (uint i = cluster.x; i < cluster.x + cluster.y; ++i) {
+    Light light = lights[lightIndices[i]];
+    vec3 toLight = light.cc_positionInverseRangeSquared.xyz - cc_pos;
+    float distanceSquared = dot(toLight, toLight);
+    vec3 lightDir = toLight * inversesqrt(distanceSquared);
 
-  float diffuseIntensity = max(dot(cc_lightdir, cc_normal), 0);
+    float falloff = clamp(1.0 - distanceSquared * light.cc_positionInverseRangeSquared.w, 0.0, 1.0);
+    float spot = smoothstep(
+      light.c_colorOuterCos.w, light.cc_directionInnerCos.w,
+      dot(-lightDir, light.cc_directionInnerCos.xyz)
+    );
+    float diffuseIntensity = max(dot(lightDir, normal), 0);
+    c_diffuse += light.c_colorOuterCos.rgb * diffuseIntensity * falloff * falloff * spot;
+  }
 
-  vec4 c_textureColor = texture(textureId, tc_texture);
-  c_fragColor = (
-    vec4(vec3(diffuseIntensity), 1)
-    * c_materialColor
-    * c_textureColor
-  );
+  c_fragColor = vec4(c_diffuse, 1) * c_materialColor;
+#ifdef HAS_BASE_COLOR_TEXTURE
+  c_fragColor *= SAMPLE_TEXTURE(textureId, textureHandles.xy, textureLayers.x, tc_texture);
+#endif
 }
@@ -1,36 +1,131 @@
-#version 400
+#version 430
+#extension GL_ARB_explicit_attrib_location : require
 
 // oc_ : object coordinates
+// wc_ : world coordinates
 // cc_ : camera coordinates
+// tsc_ : tangentSpace coordinates
+// tc_ : texture coordinates
 
-uniform mat4 mvp;
-uniform mat4 modelView;
-uniform mat3 normalMatrix;
+// Features, defined by the program variant:
+// HAS_SKINNING, HAS_NORMAL_MAP, HAS_BASE_COLOR_TEXTURE, USE_INSTANCING,
+// HAS_OCTAHEDRAL_NORMALS, USE_TEXTURE_ARRAYS, USE_BINDLESS_TEXTURES
 
-uniform mat4 oc_jointMatrices[16];
+// Blocks are shared with phong.frag and must match it, see
+// FrameDataBlock and DrawDataBlock
+layout(std140) uniform FrameData {
+  mat4 view;
+  mat4 projection;
+  mat4 viewProjection;
+  mat3 viewNormal;
+  // See LightGrid::getClusterCounts and getClusterParameters
+  uvec4 clusterCounts;
+  vec4 clusterParameters;
+};
 
-in vec3 POSITION;
-in vec3 NORMAL;
-in vec2 TEXCOORD_0;
-in vec4 JOINTS_0;
-in vec4 WEIGHTS_0;
+// Per draw, in a ring buffer range
+layout(std140) uniform DrawData {
+  mat4 model;
+  mat3 normalMatrix;
+  vec4 c_materialColor;
+  // See Material::texcoordScale
+  vec2 texcoordScale;
+  vec2 texcoordOffset;
+  // Decodes quantized positions, see MeshPrimitive::positionScale
+  vec3 positionScale;
+  vec3 positionOffset;
+  // Layers of the base color texture and normal map in their arrays
+  uvec4 textureLayers;
+  // Bindless handles of these arrays, as two pairs of 32 bit halves
+  uvec4 textureHandles;
+};
+
+#ifdef HAS_SKINNING
+layout(std140) uniform JointPalette {
+  mat4 oc_jointMatrices[16];
+};
+#endif
+
+// Locations match the attribute map used to load the meshes
+layout(location = 0) in vec3 POSITION;
+#ifdef HAS_OCTAHEDRAL_NORMALS
+layout(location = 1) in vec2 NORMAL;
+#else
+layout(location = 1) in vec3 NORMAL;
+#endif
+layout(location = 2) in vec2 TEXCOORD_0;
+#ifdef HAS_SKINNING
+layout(location = 3) in vec4 JOINTS_0;
+layout(location = 4) in vec4 WEIGHTS_0;
+#endif
+#ifdef HAS_NORMAL_MAP
+layout(location = 5) in vec4 TANGENT;
+#endif
+#ifdef USE_INSTANCING
+// One model matrix per instance, takes locations 6 to 9
+layout(location = 6) in mat4 wc_instanceModel;
+#endif
 
 out vec3 cc_pos;
 out vec3 cc_normal;
+#ifdef HAS_NORMAL_MAP
+out vec3 cc_tangent;
+out vec3 cc_bitangent;
+#endif
 out vec2 tc_texture;
 
+#ifdef HAS_OCTAHEDRAL_NORMALS
+vec3 octahedralDecode(vec2 encoded)
+{
+  vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+  float fold = max(-normal.z, 0.0);
+  normal.xy += mix(vec2(fold), vec2(-fold), greaterThanEqual(normal.xy, vec2(0.0)));
+  return normalize(normal);
+}
+#endif
+
 void main(void)
 {
+#ifdef USE_INSTANCING
+  mat4 wc_model = wc_instanceModel;
+  // Instances are assumed to be scaled uniformly
+  mat3 wc_normalMatrix = mat3(wc_instanceModel);
+#else
+  mat4 wc_model = model;
+  mat3 wc_normalMatrix = normalMatrix;
+#endif
+
+  vec4 oc_position = vec4(POSITION * positionScale + positionOffset, 1.0);
+#ifdef HAS_OCTAHEDRAL_NORMALS
+  vec3 oc_normal = octahedralDecode(NORMAL);
+#else
+  vec3 oc_normal = NORMAL;
+#endif
+#ifdef HAS_SKINNING
   mat4 skinMatrix = (
     WEIGHTS_0.x * oc_jointMatrices[int(JOINTS_0.x)]
     + WEIGHTS_0.y * oc_jointMatrices[int(JOINTS_0.y)]
     + WEIGHTS_0.z * oc_jointMatrices[int(JOINTS_0.z)]
     + WEIGHTS_0.w * oc_jointMatrices[int(JOINTS_0.w)]
   );
+  oc_position = skinMatrix * oc_position;
+  oc_normal = mat3(skinMatrix) * oc_normal;
+#endif
+
+  vec4 wc_position = wc_model * oc_position;
+  gl_Position = viewProjection * wc_position;
+  tc_texture = TEXCOORD_0 * texcoordScale + texcoordOffset;
 
-  gl_Position = mvp * skinMatrix * vec4(POSITION, 1.0);
+  cc_pos = (view * wc_position).xyz;
+  cc_normal = normalize(viewNormal * (wc_normalMatrix * oc_normal));
 
-  cc_pos = (modelView * vec4(POSITION, 1.0)).xyz;
-  cc_normal = normalize(normalMatrix * NORMAL);
-  tc_texture = TEXCOORD_0;
+#ifdef HAS_NORMAL_MAP
+  // Lights are in camera space, the fragments bring the normal map there
+  vec3 oc_tangent = TANGENT.xyz;
+#ifdef HAS_SKINNING
+  oc_tangent = mat3(skinMatrix) * oc_tangent;
+#endif
+  cc_tangent = normalize(mat3(view) * (mat3(wc_model) * oc_tangent));
+  cc_bitangent = cross(cc_normal, cc_tangent) * TANGENT.w;
+#endif
 }
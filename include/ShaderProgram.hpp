@@ -10,6 +10,11 @@ version : 0.3 - 15 / 01 / 2014
 			via calls to addAttribute(<name - of - attribute>) and then the attribute
 			index can be obtained via myProgram.attribute(<name - of - attribute>) - Uniforms
 			work in the exact same way.
+
+		When a binary cache directory is set via ShaderProgram::setBinaryCacheDirectory(), linked
+			programs are saved with glGetProgramBinary, keyed by a hash of the sources, defines and
+			driver strings, and later launches load them back with glProgramBinary instead of
+			compiling. Validation is left to validate(), to be called once the GL state is set up.
 */
 
 
@@ -21,6 +26,10 @@ version : 0.3 - 15 / 01 / 2014
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
 
 #include "GL/glew.h"
 #include <GL/gl.h>
@@ -55,6 +64,19 @@ private:
 	// Has this shader program been initialised?
 	bool initialised;
 
+	// Was the program loaded from the binary cache rather than compiled?
+	bool loadedFromCache;
+
+	// Where the linked program binary goes, empty when not caching
+	std::string cachePath;
+
+	// Directory holding cached program binaries, caching is disabled when empty
+	static inline std::string binaryCacheDirectory;
+
+	// Tag and version at the start of every cache file, bump the version if the layout changes
+	static const uint32_t BINARY_CACHE_MAGIC = 0x43425053; // "SPBC"
+	static const uint32_t BINARY_CACHE_VERSION = 1;
+
 	// ---------- PRIVATE METHODS ----------
 
 	// Private method to compile a shader of a given type
@@ -95,9 +117,17 @@ private:
 		glShaderSource(shaderId, 1, &shaderSourceChars, NULL);
 
 		// Compile the shader
+		// Note: The status is only checked by checkShader(), so that drivers compiling in the background
+		// (GL_KHR_parallel_shader_compile) are not forced to finish here.
 		glCompileShader(shaderId);
 
-		// Check the compilation status and throw a runtime_error if shader compilation failed
+		// If everything went well, return the shader id
+		return shaderId;
+	}
+
+	// Private method to check the compilation status of a shader
+	void checkShader(GLuint shaderId, const std::string& shaderTypeString)
+	{
 		GLint shaderStatus;
 		glGetShaderiv(shaderId, GL_COMPILE_STATUS, &shaderStatus);
 		if (shaderStatus == GL_FALSE)
@@ -111,63 +141,216 @@ private:
 				std::cout << shaderTypeString << " shader compilation successful." << std::endl;
 			}
 		}
+	}
 
-		// If everything went well, return the shader id
-		return shaderId;
+	// Private method to insert #define lines right after the #version directive (which must stay first)
+	static std::string injectDefines(const std::string& source, const std::string& defines)
+	{
+		if (defines.empty())
+		{
+			return source;
+		}
+
+		size_t versionPos = source.find("#version");
+		size_t insertPos = (versionPos == std::string::npos) ? 0 : source.find('\n', versionPos);
+		if (insertPos == std::string::npos)
+		{
+			insertPos = source.size();
+		}
+		else if (versionPos != std::string::npos)
+		{
+			insertPos++;
+		}
+
+		return source.substr(0, insertPos) + defines + "\n" + source.substr(insertPos);
 	}
 
-	// Private method to compile/attach/link/verify the shaders.
-	// Note: Rather than returning a boolean as a success/fail status we'll just consider
-	// a failure here to be an unrecoverable error and throw a runtime_error.
-	void initialise(std::string vertexShaderSource, std::string fragmentShaderSource)
+	// Private method to hash the inputs of a program binary (64 bit FNV-1a). The driver strings are included
+	// because binaries are only valid for the driver which produced them.
+	static std::string getBinaryCacheKey(const std::string& vertexShaderSource, const std::string& fragmentShaderSource, const std::string& defines)
 	{
-		// Compile the shaders and return their id values
-		vertexShaderId = compileShader(vertexShaderSource, GL_VERTEX_SHADER);
-		fragmentShaderId = compileShader(fragmentShaderSource, GL_FRAGMENT_SHADER);
+		uint64_t hash = 14695981039346656037ull;
+		auto hashString = [&hash](const std::string& value)
+		{
+			for (unsigned char c : value)
+			{
+				hash = (hash ^ c) * 1099511628211ull;
+			}
+			// Separator, so that moving text from one string to the next changes the hash
+			hash = (hash ^ 0xff) * 1099511628211ull;
+		};
+
+		hashString(vertexShaderSource);
+		hashString(fragmentShaderSource);
+		hashString(defines);
+		for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+		{
+			const GLubyte* value = glGetString(name);
+			hashString(value ? reinterpret_cast<const char*>(value) : "");
+		}
 
-		// Attach the compiled shaders to the shader program
-		glAttachShader(programId, vertexShaderId);
-		glAttachShader(programId, fragmentShaderId);
+		char key[17];
+		snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+		return key;
+	}
 
-		// Link the shader program - details are placed in the program info log
-		glLinkProgram(programId);
+	// Can this context save and load program binaries at all?
+	static bool programBinariesSupported()
+	{
+		if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+		{
+			return false;
+		}
+
+		GLint formatCount = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+		return formatCount > 0;
+	}
+
+	// Private method to load the program from the binary cache. Returns false on a missing or stale entry,
+	// which leaves the program untouched so that it can be compiled instead.
+	bool loadProgramBinary(const std::string& cachePath)
+	{
+		std::ifstream file(cachePath.c_str(), std::ios::binary);
+		if (!file.good())
+		{
+			return false;
+		}
+
+		uint32_t header[3] = { 0, 0, 0 };
+		if (!file.read(reinterpret_cast<char*>(header), sizeof(header)))
+		{
+			return false;
+		}
+		std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (header[0] != BINARY_CACHE_MAGIC || header[1] != BINARY_CACHE_VERSION || binary.empty())
+		{
+			return false;
+		}
 
-		// Once the shader program has the shaders attached and linked, the shaders are no longer required.
-		// If the linking failed, then we're going to abort anyway so we still detach the shaders.
-		glDetachShader(programId, vertexShaderId);
-		glDetachShader(programId, fragmentShaderId);
+		glProgramBinary(programId, header[2], binary.data(), (GLsizei)binary.size());
 
-		// Check the program link status and throw a runtime_error if program linkage failed.
+		// The driver may reject a binary even with a matching key, e.g. after an update which kept its version string
 		GLint programLinkSuccess = GL_FALSE;
 		glGetProgramiv(programId, GL_LINK_STATUS, &programLinkSuccess);
-		if (programLinkSuccess == GL_TRUE)
+		if (programLinkSuccess != GL_TRUE)
 		{
 			if (DEBUG)
 			{
-				std::cout << "Shader program link successful." << std::endl;
+				std::cout << "Cached shader program binary rejected, recompiling." << std::endl;
 			}
+			return false;
 		}
-		else
+
+		if (DEBUG)
 		{
-			std::cout << "Shader program link failed: "  << getInfoLog(ObjectType::PROGRAM, programId) << std::endl;
+			std::cout << "Shader program loaded from binary cache." << std::endl;
 		}
+		return true;
+	}
 
-		// Validate the shader program
-		glValidateProgram(programId);
+	// Private method to save the linked program to the binary cache. Failures only cost a recompile next time.
+	void saveProgramBinary(const std::string& cachePath)
+	{
+		GLint binaryLength = 0;
+		glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+		if (binaryLength <= 0)
+		{
+			return;
+		}
 
-		// Check the validation status and throw a runtime_error if program validation failed
-		GLint programValidatationStatus;
-		glGetProgramiv(programId, GL_VALIDATE_STATUS, &programValidatationStatus);
-		if (programValidatationStatus == GL_TRUE)
+		std::vector<char> binary(binaryLength);
+		GLenum binaryFormat = 0;
+		glGetProgramBinary(programId, binaryLength, NULL, &binaryFormat, binary.data());
+
+		std::error_code error;
+		std::filesystem::create_directories(binaryCacheDirectory, error);
+
+		// Write to a temporary file first, so that a concurrent launch never reads half a binary
+		std::string tempPath = cachePath + ".tmp";
 		{
-			if (DEBUG)
+			std::ofstream file(tempPath.c_str(), std::ios::binary);
+			uint32_t header[3] = { BINARY_CACHE_MAGIC, BINARY_CACHE_VERSION, binaryFormat };
+			file.write(reinterpret_cast<const char*>(header), sizeof(header));
+			file.write(binary.data(), binary.size());
+			if (!file.good())
 			{
-				std::cout << "Shader program validation successful." << std::endl;
+				std::cout << "Failed to write shader program binary: " << tempPath << std::endl;
+				return;
 			}
 		}
-		else
+		std::filesystem::rename(tempPath, cachePath, error);
+	}
+
+	// Private method to compile/attach/link the shaders, or load them from the binary cache.
+	// Nothing here waits for the driver, the results are checked by finishInitialise().
+	void startInitialise(std::string vertexShaderSource, std::string fragmentShaderSource, const std::string& defines)
+	{
+		vertexShaderSource = injectDefines(vertexShaderSource, defines);
+		fragmentShaderSource = injectDefines(fragmentShaderSource, defines);
+
+		cachePath.clear();
+		if (!binaryCacheDirectory.empty() && programBinariesSupported())
 		{
-			 std::cout << "Shader program validation failed: "  << getInfoLog(ObjectType::PROGRAM, programId) << std::endl;
+			cachePath = binaryCacheDirectory + "/" + getBinaryCacheKey(vertexShaderSource, fragmentShaderSource, defines) + ".bin";
+			if (loadProgramBinary(cachePath))
+			{
+				loadedFromCache = true;
+				return;
+			}
+
+			// Binaries can only be retrieved if we ask for it before linking
+			glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+
+		// Compile the shaders and return their id values
+		vertexShaderId = compileShader(vertexShaderSource, GL_VERTEX_SHADER);
+		fragmentShaderId = compileShader(fragmentShaderSource, GL_FRAGMENT_SHADER);
+
+		// Attach the compiled shaders to the shader program
+		glAttachShader(programId, vertexShaderId);
+		glAttachShader(programId, fragmentShaderId);
+
+		// Link the shader program - details are placed in the program info log
+		glLinkProgram(programId);
+	}
+
+	// Private method to check the results of startInitialise(), and save the binary of a newly linked program.
+	// Note: Rather than returning a boolean as a success/fail status we'll just consider
+	// a failure here to be an unrecoverable error and throw a runtime_error.
+	void finishInitialise()
+	{
+		if (!loadedFromCache)
+		{
+			checkShader(vertexShaderId, "GL_VERTEX_SHADER");
+			checkShader(fragmentShaderId, "GL_FRAGMENT_SHADER");
+
+			// Once the shader program has the shaders attached and linked, the shaders are no longer required.
+			// If the linking failed, then we're going to abort anyway so we still detach the shaders.
+			glDetachShader(programId, vertexShaderId);
+			glDetachShader(programId, fragmentShaderId);
+			glDeleteShader(vertexShaderId);
+			glDeleteShader(fragmentShaderId);
+
+			// Check the program link status and throw a runtime_error if program linkage failed.
+			GLint programLinkSuccess = GL_FALSE;
+			glGetProgramiv(programId, GL_LINK_STATUS, &programLinkSuccess);
+			if (programLinkSuccess == GL_TRUE)
+			{
+				if (DEBUG)
+				{
+					std::cout << "Shader program link successful." << std::endl;
+				}
+
+				if (!cachePath.empty())
+				{
+					saveProgramBinary(cachePath);
+				}
+			}
+			else
+			{
+				std::cout << "Shader program link failed: "  << getInfoLog(ObjectType::PROGRAM, programId) << std::endl;
+			}
 		}
 
 		// Finally, the shader program is initialised
@@ -239,11 +422,11 @@ public:
 		// We start in a non-initialised state - calling initFromFiles() or initFromStrings() will
 		// initialise us.
 		initialised = false;
+		loadedFromCache = false;
 
 		// Generate a unique Id / handle for the shader program
 		// Note: We MUST have a valid rendering context before generating the programId or we'll segfault!
 		programId = glCreateProgram();
-		glUseProgram(programId);
 
 		// Initially, we have zero shaders attached to the program
 		shaderCount = 0;
@@ -257,20 +440,82 @@ public:
 		glDeleteProgram(programId);
 	}
 
-	// Method to initialise a shader program from shaders provided as files
-	void initFromFiles(std::string vertexShaderFilename, std::string fragmentShaderFilename)
+	// Method to set the directory for cached program binaries, shared by every shader program.
+	// An empty path (the default) disables the cache.
+	static void setBinaryCacheDirectory(const std::string& directory)
+	{
+		binaryCacheDirectory = directory;
+	}
+
+	// Method to initialise a shader program from shaders provided as files.
+	// The defines are #define lines, inserted after the #version directive of both shaders.
+	void initFromFiles(std::string vertexShaderFilename, std::string fragmentShaderFilename, const std::string& defines = "")
+	{
+		startInitFromFiles(vertexShaderFilename, fragmentShaderFilename, defines);
+		finishInit();
+	}
+
+	// Method to initialise a shader program from shaders provided as strings
+	void initFromStrings(std::string vertexShaderSource, std::string fragmentShaderSource, const std::string& defines = "")
+	{
+		startInitialise(vertexShaderSource, fragmentShaderSource, defines);
+		finishInit();
+	}
+
+	// Methods to initialise several shader programs at once: start all of them, then finish all of them,
+	// so that the driver can compile them in parallel
+	void startInitFromFiles(std::string vertexShaderFilename, std::string fragmentShaderFilename, const std::string& defines = "")
 	{
 		// Get the shader file contents as strings
 		std::string vertexShaderSource = loadShaderFromFile(vertexShaderFilename);
 		std::string fragmentShaderSource = loadShaderFromFile(fragmentShaderFilename);
 
-		initialise(vertexShaderSource, fragmentShaderSource);
+		startInitialise(vertexShaderSource, fragmentShaderSource, defines);
 	}
 
-	// Method to initialise a shader program from shaders provided as strings
-	void initFromStrings(std::string vertexShaderSource, std::string fragmentShaderSource)
+	void startInitFromStrings(std::string vertexShaderSource, std::string fragmentShaderSource, const std::string& defines = "")
+	{
+		startInitialise(vertexShaderSource, fragmentShaderSource, defines);
+	}
+
+	void finishInit()
+	{
+		finishInitialise();
+	}
+
+	// Method to check whether the program can run in the current GL state (textures, samplers...).
+	// This is slow, so it is not done on initialisation - call it once everything is bound, in debug builds.
+	bool validate()
+	{
+		glValidateProgram(programId);
+
+		// Check the validation status
+		GLint programValidatationStatus;
+		glGetProgramiv(programId, GL_VALIDATE_STATUS, &programValidatationStatus);
+		if (programValidatationStatus == GL_TRUE)
+		{
+			if (DEBUG)
+			{
+				std::cout << "Shader program validation successful." << std::endl;
+			}
+		}
+		else
+		{
+			 std::cout << "Shader program validation failed: "  << getInfoLog(ObjectType::PROGRAM, programId) << std::endl;
+		}
+		return programValidatationStatus == GL_TRUE;
+	}
+
+	// Method to return the program handle
+	GLuint getProgramId() const
+	{
+		return programId;
+	}
+
+	// Method to tell whether the program came from the binary cache
+	bool isLoadedFromCache() const
 	{
-		initialise(vertexShaderSource, fragmentShaderSource);
+		return loadedFromCache;
 	}
 
 	// Method to enable the shader program - we'll suggest this for inlining
@@ -0,0 +1,153 @@
+
+#include <cassert>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Animation.hpp"
+
+static glm::vec4 _sampleChannel(
+  const AssetManager& assets, size_t assetId,
+  const fx::gltf::Animation::Sampler& sampler,
+  float animTime
+) {
+  const Accessor& times = *assets.getAccessor(assetId, sampler.input);
+  const Accessor& values = *assets.getAccessor(assetId, sampler.output);
+
+  assert(times.count == values.count);
+  assert(times.type == Accessor::Type::Scalar);
+  assert(times.componentType == Accessor::ComponentType::Float);
+
+  glm::vec4 value(0);
+  if (times.count == 0)
+    return value;
+
+  // Keyframes, nextKf is the first one at or after animTime
+  uint32_t prevKf;
+  uint32_t nextKf = 0;
+  uint32_t lastKf = times.count;
+  while (nextKf < lastKf) {
+    uint32_t middleKf = (nextKf + lastKf) / 2;
+    if (times.getComponent(middleKf) < animTime) {
+      nextKf = middleKf + 1;
+    }
+    else {
+      lastKf = middleKf;
+    }
+  }
+  prevKf = std::max<uint32_t>(1, nextKf) - 1;
+  nextKf = std::min<uint32_t>(nextKf, times.count - 1);
+
+  float prevTime = times.getComponent(prevKf);
+  float nextTime = times.getComponent(nextKf);
+  float transition = (nextKf != prevKf) ?
+    (animTime - prevTime) / (nextTime - prevTime)
+    : 0;
+
+  for (uint32_t i = 0; i < values.getComponentCount(); ++i) {
+    value[i] = (
+      values.getComponent(prevKf, i) * (1 - transition)
+      + values.getComponent(nextKf, i) * transition
+    );
+  }
+  return value;
+}
+
+void animateHierarchy(
+  const AssetManager& assets, size_t assetId,
+  uint32_t animIndex, float animTime,
+  TransformHierarchy& hierarchy,
+  ThreadPool* threadPool
+) {
+  const fx::gltf::Document& document = *assets.getAsset(assetId);
+  const fx::gltf::Animation& anim = document.animations[animIndex];
+
+  // Sampling only reads the asset; the hierarchy setters are not thread
+  // safe, so they run afterwards
+  thread_local std::vector<glm::vec4> threadChannelValues;
+  // Workers must see the calling thread's buffer, not their own
+  std::vector<glm::vec4>& channelValues = threadChannelValues;
+  channelValues.resize(anim.channels.size());
+  parallelFor(
+    threadPool, anim.channels.size(),
+    [&](uint32_t i, uint32_t) {
+      const auto& channel = anim.channels[i];
+      channelValues[i] = _sampleChannel(
+        assets, assetId, anim.samplers[channel.sampler], animTime
+      );
+    }
+  );
+
+  for (size_t i = 0; i < anim.channels.size(); ++i) {
+    const auto& channel = anim.channels[i];
+    uint32_t slot = hierarchy.getSlot(channel.target.node);
+    if (slot == TransformHierarchy::NONE) {
+      continue;
+    }
+    const glm::vec4& value = channelValues[i];
+
+    if (channel.target.path == "translation") {
+      hierarchy.setTranslation(slot, glm::vec3(value));
+    }
+    else if (channel.target.path == "rotation") {
+      // The matrix expansion expects a unit quaternion
+      glm::quat rotation = glm::make_quat(glm::value_ptr(value));
+      hierarchy.setRotation(slot, glm::normalize(rotation));
+    }
+    else if (channel.target.path == "scale") {
+      hierarchy.setScale(slot, glm::vec3(value));
+    }
+  }
+}
+
+void getJointMatrices(
+  const AssetManager& assets, size_t assetId,
+  const fx::gltf::Skin& skin,
+  const TransformHierarchy& hierarchy,
+  std::vector<glm::mat4>& joints,
+  std::vector<float>* lineData
+) {
+  glm::mat4 skeletonBase = glm::mat4(1);
+  if (skin.skeleton != -1) {
+    uint32_t skeletonSlot = hierarchy.getSlot(skin.skeleton);
+    if (skeletonSlot != TransformHierarchy::NONE) {
+      skeletonBase = glm::inverse(hierarchy.getParentWorld(skeletonSlot));
+    }
+  }
+
+  joints.assign(skin.joints.size(), glm::mat4(1));
+  if (lineData) {
+    lineData->assign(3 * 2 * skin.joints.size(), 0);
+  }
+
+  const Accessor* inverseBindMatrices = skin.inverseBindMatrices != -1
+    ? assets.getAccessor(assetId, skin.inverseBindMatrices)
+    : nullptr;
+  assert(!inverseBindMatrices || joints.size() == inverseBindMatrices->count);
+
+  for (size_t i = 0; i < joints.size(); ++i) {
+    uint32_t slot = hierarchy.getSlot(skin.joints[i]);
+    if (slot == TransformHierarchy::NONE) {
+      continue;
+    }
+    joints[i] = skeletonBase * hierarchy.getWorld(slot);
+
+    if (lineData) {
+      glm::vec4 parentPos = (
+        skeletonBase * hierarchy.getParentWorld(slot) * glm::vec4(0, 0, 0, 1)
+      );
+      glm::vec4 jointPos = joints[i] * glm::vec4(0, 0, 0, 1);
+      for (int j = 0; j < 3; ++j) {
+        (*lineData)[i * 6 + j] = parentPos[j];
+        (*lineData)[i * 6 + 3 + j] = jointPos[j];
+      }
+    }
+
+    if (inverseBindMatrices) {
+      std::array<float, 16> inverseBindMatrixData;
+      for (size_t j = 0; j < 16; ++j) {
+        inverseBindMatrixData[j] = inverseBindMatrices->getComponent(i, j);
+      }
+      joints[i] = joints[i] * glm::make_mat4(inverseBindMatrixData.data());
+    }
+  }
+}
@@ -0,0 +1,34 @@
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <glm/mat4x4.hpp>
+
+#include <vector>
+
+#include "AssetManager.hpp"
+#include "TransformHierarchy.hpp"
+#include "ThreadPool.hpp"
+
+// Writes the animated TRS values at animTime into the hierarchy.
+// Channels are sampled in parallel, then applied in order.
+void animateHierarchy(
+  const AssetManager& assets, size_t assetId,
+  uint32_t animIndex, float animTime,
+  TransformHierarchy& hierarchy,
+  ThreadPool* threadPool = nullptr
+);
+
+// Joint matrices relative to the parent of the skeleton root, with the
+// inverse bind matrices applied.
+// If lineData is given, it receives a line from each joint's parent to
+// the joint, for debugging.
+void getJointMatrices(
+  const AssetManager& assets, size_t assetId,
+  const fx::gltf::Skin& skin,
+  const TransformHierarchy& hierarchy,
+  std::vector<glm::mat4>& joints,
+  std::vector<float>* lineData = nullptr
+);
+
+#endif // !ANIMATION_H
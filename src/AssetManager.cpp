@@ -1,8 +1,146 @@
 #include <cassert>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
 #include <glm/gtc/type_ptr.hpp>
 #include <stb/stb_image.h>
 
 #include "AssetManager.hpp"
+#include "MeshoptDecoder.hpp"
+#include "Ktx2.hpp"
+#include "ThreadPool.hpp"
+
+// KHR_texture_basisu points to a KTX2 image in place of the PNG or JPEG
+// fallback
+static int32_t _getTextureSource(const fx::gltf::Texture& texture) {
+  auto extensions = texture.extensionsAndExtras.find("extensions");
+  if (extensions != texture.extensionsAndExtras.end()) {
+    auto basisu = extensions->find("KHR_texture_basisu");
+    if (basisu != extensions->end() && basisu->contains("source")) {
+      return (*basisu)["source"].get<int32_t>();
+    }
+  }
+  return texture.source;
+}
+
+// KTX2 containers are read as they are, other images are decoded to RGBA8
+static void _loadImage(
+  const fx::gltf::Image& imageData,
+  const std::vector<std::optional<BufferView>>& bufferViews,
+  TextureData& texture
+) {
+  std::vector<uint8_t> fileData;
+  const uint8_t* imageBytes = nullptr;
+  size_t imageSize = 0;
+  if (imageData.uri != "") {
+    std::ifstream file(imageData.uri, std::ios::binary);
+    assert(file);
+    // TODO - if (!file)
+    fileData.assign(
+      std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()
+    );
+    imageBytes = fileData.data();
+    imageSize = fileData.size();
+  }
+  else {
+    const BufferView& bufferedImage = *bufferViews[imageData.bufferView];
+    assert(bufferedImage.byteStride == 0);
+    imageBytes = bufferedImage.buffer->data.data() + bufferedImage.byteOffset;
+    imageSize = bufferedImage.byteLength;
+  }
+
+  if (isKtx2(imageBytes, imageSize)) {
+    loadKtx2(imageBytes, imageSize, texture);
+    return;
+  }
+
+  int x, y;
+  uint8_t* rawData = stbi_load_from_memory(imageBytes, imageSize, &x, &y, nullptr, 4);
+  assert(rawData);
+  // TODO - if (!rawData)
+  texture.data = std::vector<uint8_t>(rawData, rawData + x * y * 4);
+  texture.width = x;
+  texture.height = y;
+  stbi_image_free(rawData);
+}
+
+// gltfpack -c writes the EXT_meshopt_compression fallback buffer of a GLB
+// file without a uri. fx-gltf would fill it from the start of the binary
+// chunk, and fail when it is the larger of the two. It is never read, so
+// fx-gltf is handed a 1 byte length instead, and the buffer gets its own
+// back, without data.
+static fx::gltf::Document _loadBinaryDocument(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  std::string bytes(
+    (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()
+  );
+  // 12 byte header, then the length and type of the JSON chunk
+  uint32_t jsonLength = 0;
+  if (bytes.size() >= 20) {
+    memcpy(&jsonLength, bytes.data() + 12, sizeof(jsonLength));
+  }
+  if (bytes.size() < 20 || jsonLength > bytes.size() - 20) {
+    // Left for fx-gltf to report
+    return fx::gltf::LoadFromBinary(path);
+  }
+
+  nlohmann::json json = nlohmann::json::parse(
+    bytes.begin() + 20, bytes.begin() + 20 + jsonLength, nullptr, false
+  );
+  std::vector<std::pair<size_t, uint32_t>> fallbacks;
+  if (json.is_object() && json.contains("buffers") && json["buffers"].is_array()) {
+    nlohmann::json& buffers = json["buffers"];
+    for (size_t i = 0; i < buffers.size(); ++i) {
+      nlohmann::json& buffer = buffers[i];
+      if (
+        buffer.is_object() && !buffer.contains("uri")
+        && buffer.value(
+          "/extensions/EXT_meshopt_compression/fallback"_json_pointer, false
+        )
+      ) {
+        fallbacks.emplace_back(i, buffer.value("byteLength", 0u));
+        buffer["byteLength"] = 1;
+      }
+    }
+  }
+  if (fallbacks.empty()) {
+    return fx::gltf::LoadFromBinary(path);
+  }
+
+  // Chunks are 4 byte aligned, JSON is padded with spaces
+  std::string text = json.dump();
+  text.resize((text.size() + 3) / 4 * 4, ' ');
+  uint32_t textLength = text.size();
+  uint32_t fileLength = bytes.size() - jsonLength + textLength;
+  bytes.replace(20, jsonLength, text);
+  memcpy(&bytes[8], &fileLength, sizeof(fileLength));
+  memcpy(&bytes[12], &textLength, sizeof(textLength));
+
+  std::istringstream stream(bytes);
+  fx::gltf::Document document = fx::gltf::LoadFromBinary(
+    stream, std::filesystem::path(path).parent_path().string()
+  );
+  for (const auto& [index, byteLength]: fallbacks) {
+    document.buffers[index].byteLength = byteLength;
+    document.buffers[index].data.clear();
+  }
+  return document;
+}
+
+// Files are allowed to omit bufferView.target
+// Files are allowed to omit bufferView.target
+static void _inferTarget(BufferView& bufferView, BufferView::TargetType usage) {
+  if (bufferView.target == BufferView::TargetType::None) {
+    bufferView.target = usage;
+  }
+  assert(bufferView.target == usage);
+}
 
 AssetManager::AssetManager() {
   m_defaultColorTexture = {
@@ -15,18 +153,25 @@ AssetManager::AssetManager() {
     1, 1,
     fx::gltf::Sampler {}
   };
+  m_defaultMaterial = {
+    glm::vec4(1),
+    &m_defaultColorTexture,
+    &m_defaultNormalMap
+  };
 }
 
 AssetManager::~AssetManager() {
   // TODO - unload
 }
 
-size_t AssetManager::loadAsset(const std::string& path, bool loadAll, bool reload) {
+size_t AssetManager::loadAsset(
+  const std::string& path, bool loadAll, bool reload, ThreadPool* threadPool
+) {
   m_assetPaths[path] = m_nextAssetId;
   if (path.find(".gltf") == path.size() - 5) {
     m_assets[m_nextAssetId] = fx::gltf::LoadFromText(path);
   } else {
-    m_assets[m_nextAssetId] = fx::gltf::LoadFromBinary(path);
+    m_assets[m_nextAssetId] = _loadBinaryDocument(path);
   }
 
   const fx::gltf::Document& document = m_assets[m_nextAssetId];
@@ -36,7 +181,21 @@ size_t AssetManager::loadAsset(const std::string& path, bool loadAll, bool reloa
   m_textures[m_nextAssetId].resize(document.textures.size());
   m_accessors[m_nextAssetId].resize(document.accessors.size());
   m_bufferViews[m_nextAssetId].resize(document.bufferViews.size());
-  m_buffers[m_nextAssetId].resize(document.buffers.size());
+
+  // Compressed views are decoded into buffers of their own, after the
+  // ones of the file
+  std::vector<std::pair<size_t, MeshoptCompression>> compressedViews;
+  for (size_t i = 0; i < document.bufferViews.size(); ++i) {
+    auto compression = MeshoptCompression::fromJson(
+      document.bufferViews[i].extensionsAndExtras
+    );
+    if (compression) {
+      compressedViews.emplace_back(i, *compression);
+    }
+  }
+  m_buffers[m_nextAssetId].resize(
+    document.buffers.size() + compressedViews.size()
+  );
 
   auto& buffers = m_buffers[m_nextAssetId];
   for (size_t i = 0; i < document.buffers.size(); ++i) {
@@ -45,6 +204,30 @@ size_t AssetManager::loadAsset(const std::string& path, bool loadAll, bool reloa
     };
   }
 
+  std::vector<uint8_t> decoded(compressedViews.size(), false);
+  parallelFor(threadPool, compressedViews.size(), [&](uint32_t index, uint32_t) {
+    const auto& [viewIndex, compression] = compressedViews[index];
+    auto& buffer = buffers[document.buffers.size() + index];
+    buffer = BufferData {};
+    if (compression.buffer >= document.buffers.size()) {
+      return;
+    }
+    const std::vector<uint8_t>& source = buffers[compression.buffer]->data;
+    decoded[index] = (
+      (size_t)compression.byteOffset + compression.byteLength <= source.size()
+      && decodeMeshopt(compression, source.data() + compression.byteOffset, buffer->data)
+      && buffer->data.size() >= document.bufferViews[viewIndex].byteLength
+    );
+  });
+  for (size_t i = 0; i < compressedViews.size(); ++i) {
+    if (!decoded[i]) {
+      throw std::runtime_error(
+        "Invalid EXT_meshopt_compression data in buffer view "
+        + std::to_string(compressedViews[i].first) + " of " + path
+      );
+    }
+  }
+
   auto& bufferViews = m_bufferViews[m_nextAssetId];
   for (size_t i = 0; i < document.bufferViews.size(); ++i) {
     const fx::gltf::BufferView& bufferViewData = document.bufferViews[i];
@@ -52,9 +235,15 @@ size_t AssetManager::loadAsset(const std::string& path, bool loadAll, bool reloa
       &*buffers[bufferViewData.buffer],
       bufferViewData.byteOffset,
       bufferViewData.byteLength,
-      bufferViewData.byteStride
+      bufferViewData.byteStride,
+      bufferViewData.target
     };
   }
+  for (size_t i = 0; i < compressedViews.size(); ++i) {
+    BufferView& bufferView = *bufferViews[compressedViews[i].first];
+    bufferView.buffer = &*buffers[document.buffers.size() + i];
+    bufferView.byteOffset = 0;
+  }
 
   auto& accessors = m_accessors[m_nextAssetId];
   for (size_t i = 0; i < document.accessors.size(); ++i) {
@@ -67,6 +256,9 @@ size_t AssetManager::loadAsset(const std::string& path, bool loadAll, bool reloa
       accessorData.componentType,
       accessorData.normalized
     };
+    accessors[i]->max = accessorData.max;
+    accessors[i]->min = accessorData.min;
+    accessors[i]->bufferView->addReference(*accessors[i]);
   }
 
   auto& meshes = m_meshes[m_nextAssetId];
@@ -83,51 +275,64 @@ size_t AssetManager::loadAsset(const std::string& path, bool loadAll, bool reloa
 
       for (const auto& pair: meshPrimitiveData.attributes) {
         meshPrimitive.attributes[pair.first] = &*accessors[pair.second];
+        _inferTarget(
+          *meshPrimitive.attributes[pair.first]->bufferView,
+          BufferView::TargetType::ArrayBuffer
+        );
       }
 
       if (meshPrimitiveData.indices != -1) {
         meshPrimitive.indices = &*accessors[meshPrimitiveData.indices];
+        _inferTarget(
+          *meshPrimitive.indices->bufferView,
+          BufferView::TargetType::ElementArrayBuffer
+        );
       }
+
+      meshPrimitive.computeBounds();
+      meshPrimitive.computeTexcoordDensity();
+      meshes[i]->bounds.expand(meshPrimitive.bounds);
     }
   }
 
+  // Decoded on the pool, errors are rethrown once all are done
   auto& textures = m_textures[m_nextAssetId];
-  for (size_t i = 0; i < document.textures.size(); ++i) {
+  std::vector<std::exception_ptr> textureErrors(document.textures.size());
+  parallelFor(threadPool, document.textures.size(), [&](uint32_t i, uint32_t) {
     const fx::gltf::Texture& textureObj = document.textures[i];
-    const fx::gltf::Image& imageData = document.images[textureObj.source];
-
-    std::vector<uint8_t> textureData;
-    int x, y;
-    if (imageData.uri != "") {
-      uint8_t* rawData = stbi_load(imageData.uri.c_str(), &x, &y, nullptr, 4);
-      assert(rawData);
-      // TODO - if (!rawData)
-      textureData = std::vector<uint8_t>(rawData, rawData + x * y * 4);
-      stbi_image_free(rawData);
-    }
-    else {
-      const BufferView& bufferedImage = *bufferViews[imageData.bufferView];
-
-      assert(bufferedImage.byteStride == 0);
-      uint8_t* rawData = stbi_load_from_memory(
-        bufferedImage.buffer->data.data() + bufferedImage.byteOffset,
-        bufferedImage.byteLength,
-        &x, &y, nullptr, 4
-      );
-      assert(rawData);
-      // TODO - if (!rawData)
-      textureData = std::vector<uint8_t>(rawData, rawData + x * y * 4);
-      stbi_image_free(rawData);
-    }
-
     int32_t samplerId = textureObj.sampler;
 
-    textures[i] = TextureData {
-      std::move(textureData), x, y,
-      samplerId != (int32_t)(-1)
-        ? document.samplers[samplerId]
-        : fx::gltf::Sampler {}
-    };
+    TextureData texture;
+    texture.sampler = samplerId != (int32_t)(-1)
+      ? document.samplers[samplerId]
+      : fx::gltf::Sampler {};
+
+    int32_t source = _getTextureSource(textureObj);
+    try {
+      _loadImage(document.images[source], bufferViews, texture);
+    }
+    catch (...) {
+      // KTX2 formats that are not supported, such as Basis Universal
+      // ones, fall back on the regular image when there is one
+      if (source != textureObj.source && textureObj.source != -1) {
+        texture = TextureData { {}, 0, 0, texture.sampler };
+        try {
+          _loadImage(document.images[textureObj.source], bufferViews, texture);
+        }
+        catch (...) {
+          textureErrors[i] = std::current_exception();
+        }
+      }
+      else {
+        textureErrors[i] = std::current_exception();
+      }
+    }
+    textures[i] = std::move(texture);
+  });
+  for (const std::exception_ptr& error: textureErrors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
   }
 
   auto& materials = m_materials[m_nextAssetId];
@@ -140,19 +345,201 @@ size_t AssetManager::loadAsset(const std::string& path, bool loadAll, bool reloa
     materials[i] = Material {
       glm::make_vec4(materialData.pbrMetallicRoughness.baseColorFactor.data()),
       textureId != -1 ? &*textures[textureId] : &m_defaultColorTexture,
-      normalMapId != -1 ? &*textures[normalMapId] : &m_defaultNormalMap
+      normalMapId != -1 ? &*textures[normalMapId] : &m_defaultNormalMap,
+      materialData.doubleSided
     };
+
+    // Rotation is not supported, quantized texture coordinates only use
+    // the offset and scale
+    const nlohmann::json& textureExtras = (
+      materialData.pbrMetallicRoughness.baseColorTexture.extensionsAndExtras
+    );
+    auto extensions = textureExtras.find("extensions");
+    if (extensions != textureExtras.end()) {
+      auto transform = extensions->find("KHR_texture_transform");
+      if (transform != extensions->end()) {
+        std::array<float, 2> offset = transform->value("offset", std::array<float, 2> { 0, 0 });
+        std::array<float, 2> scale = transform->value("scale", std::array<float, 2> { 1, 1 });
+        materials[i]->texcoordOffset = glm::make_vec2(offset.data());
+        materials[i]->texcoordScale = glm::make_vec2(scale.data());
+      }
+    }
   }
 
   return m_nextAssetId++;
 }
 
+MeshOptimizationReport AssetManager::optimizeMeshes(size_t assetId) {
+  MeshOptimizationReport report;
+  auto it = m_meshes.find(assetId);
+  if (it == m_meshes.end()) {
+    return report;
+  }
+
+  // Primitives sharing vertices must be optimized together
+  std::map<
+    std::vector<std::pair<std::string, const Accessor*>>,
+    std::vector<MeshPrimitive*>
+  > primitiveGroups;
+  for (auto& optMesh: it->second) {
+    if (optMesh) {
+      for (MeshPrimitive& primitive: optMesh->primitives) {
+        std::vector<std::pair<std::string, const Accessor*>> key(
+          primitive.attributes.begin(), primitive.attributes.end()
+        );
+        std::sort(key.begin(), key.end());
+        primitiveGroups[key].push_back(&primitive);
+      }
+    }
+  }
+
+  auto& storage = m_optimizedAccessors[assetId];
+  for (const auto& group: primitiveGroups) {
+    report.add(optimizeMeshPrimitives(group.second, storage));
+  }
+  return report;
+}
+
+size_t AssetManager::generateLods(
+  size_t assetId, const SimplifierSettings& settings
+) {
+  size_t lodCount = 0;
+  auto it = m_meshes.find(assetId);
+  if (it == m_meshes.end()) {
+    return lodCount;
+  }
+
+  auto& storage = m_lodAccessors[assetId];
+  for (auto& optMesh: it->second) {
+    if (!optMesh) {
+      continue;
+    }
+    uint32_t meshLodCount = 1;
+    for (MeshPrimitive& primitive: optMesh->primitives) {
+      lodCount += ::generateLods(primitive, storage, settings);
+      meshLodCount = std::max(meshLodCount, primitive.getLodCount());
+    }
+
+    // Primitives with fewer levels stay at their coarsest one
+    optMesh->lodErrors.assign(meshLodCount, 0);
+    for (uint32_t lod = 0; lod < meshLodCount; ++lod) {
+      for (const MeshPrimitive& primitive: optMesh->primitives) {
+        optMesh->lodErrors[lod] = std::max(
+          optMesh->lodErrors[lod],
+          primitive.getLodError(std::min(lod, primitive.getLodCount() - 1))
+        );
+      }
+    }
+  }
+  return lodCount;
+}
+
+size_t AssetManager::buildMeshlets(size_t assetId) {
+  size_t meshletCount = 0;
+  auto it = m_meshes.find(assetId);
+  if (it == m_meshes.end()) {
+    return meshletCount;
+  }
+
+  for (auto& optMesh: it->second) {
+    if (optMesh) {
+      for (MeshPrimitive& primitive: optMesh->primitives) {
+        primitive.meshlets = ::buildMeshlets(primitive);
+        meshletCount += primitive.meshlets.size();
+      }
+    }
+  }
+  return meshletCount;
+}
+
+QuantizationReport AssetManager::quantizeAttributes(size_t assetId) {
+  QuantizationReport report;
+  auto it = m_meshes.find(assetId);
+  if (it == m_meshes.end()) {
+    return report;
+  }
+
+  QuantizedAttributes& quantized = m_quantizedAttributes[assetId];
+  for (auto& optMesh: it->second) {
+    if (optMesh) {
+      report.add(quantizeMesh(*optMesh, quantized));
+    }
+  }
+  return report;
+}
+
+TriangleBvhReport AssetManager::buildTriangleBvhs(
+  size_t assetId, ThreadPool* threadPool, const std::string& cacheDirectory
+) {
+  TriangleBvhReport report;
+  auto it = m_meshes.find(assetId);
+  if (it == m_meshes.end()) {
+    return report;
+  }
+
+  for (auto& optMesh: it->second) {
+    if (!optMesh) {
+      continue;
+    }
+    for (MeshPrimitive& primitive: optMesh->primitives) {
+      auto positionIt = primitive.attributes.find("POSITION");
+      if (
+        positionIt == primitive.attributes.end()
+        || primitive.mode != MeshPrimitive::Mode::Triangles
+      ) {
+        continue;
+      }
+      uint32_t triangleCount = (
+        primitive.indices ? primitive.indices->count : positionIt->second->count
+      ) / 3;
+      if (triangleCount == 0) {
+        continue;
+      }
+
+      std::string cachePath = cacheDirectory.empty()
+        ? ""
+        : cacheDirectory + "/" + getTriangleBvhCacheKey(primitive) + ".bvh";
+      if (!cachePath.empty() && loadTriangleBvh(cachePath, triangleCount, primitive.triangleBvh)) {
+        report.cachedCount++;
+      }
+      else {
+        primitive.triangleBvh = buildTriangleBvh(primitive, threadPool);
+        if (!cachePath.empty()) {
+          saveTriangleBvh(cachePath, primitive.triangleBvh);
+        }
+      }
+      report.primitiveCount++;
+      report.triangleCount += primitive.triangleBvh.triangles.size();
+      report.nodeCount += primitive.triangleBvh.nodes.size();
+    }
+  }
+  return report;
+}
+
+size_t AssetManager::buildOccluderMeshes(size_t assetId, float maxError) {
+  size_t triangleCount = 0;
+  auto it = m_meshes.find(assetId);
+  if (it == m_meshes.end()) {
+    return triangleCount;
+  }
+
+  for (auto& optMesh: it->second) {
+    if (optMesh) {
+      for (MeshPrimitive& primitive: optMesh->primitives) {
+        primitive.occluderMesh = buildOccluderMesh(primitive, maxError);
+        triangleCount += primitive.occluderMesh.vertices.size() / 3;
+      }
+    }
+  }
+  return triangleCount;
+}
+
 void AssetManager::gpuLoadAll(const MeshPrimitive::AttributeMap& attributeMap) {
   for (auto& meshesIt: m_meshes) {
     for (auto& optMesh: meshesIt.second) {
       if (optMesh) {
         for (MeshPrimitive& primitive: optMesh->primitives) {
-          primitive.loadToGpu(attributeMap);
+          primitive.loadToGpu(attributeMap, &m_gpuBuffers);
         }
       }
     }
@@ -164,6 +551,7 @@ void AssetManager::gpuLoadAll(const MeshPrimitive::AttributeMap& attributeMap) {
       }
     }
   }
+  m_defaultMaterial.loadToGpu();
 }
 
 const Mesh* AssetManager::getMesh(const std::string& assetPath, size_t meshIndex) const {
@@ -232,3 +620,24 @@ const fx::gltf::Document* AssetManager::getAsset(size_t assetId) const {
   auto it = m_assets.find(assetId);
   return (it != m_assets.end()) ? &it->second : nullptr;
 }
+
+std::vector<TextureData*> AssetManager::getTextures(size_t assetId) {
+  std::vector<TextureData*> textures;
+  auto it = m_textures.find(assetId);
+  if (it != m_textures.end()) {
+    for (auto& optTexture: it->second) {
+      if (optTexture) {
+        textures.push_back(&*optTexture);
+      }
+    }
+  }
+  return textures;
+}
+
+const Material& AssetManager::getDefaultMaterial() const {
+  return m_defaultMaterial;
+}
+
+const GpuBufferAllocator& AssetManager::getGpuBuffers() const {
+  return m_gpuBuffers;
+}
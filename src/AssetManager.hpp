@@ -9,6 +9,11 @@
 #include <fx/gltf.h>
 
 #include "Primitives.hpp"
+#include "Quantization.hpp"
+#include "MeshOptimizer.hpp"
+#include "Simplifier.hpp"
+
+class ThreadPool;
 
 class AssetManager {
 public:
@@ -17,10 +22,46 @@ public:
   AssetManager(AssetManager&&) = delete;
   ~AssetManager();
 
-  size_t loadAsset(const std::string& path, bool loadAll = true, bool reload = false);
+  // Buffer views compressed with EXT_meshopt_compression are decoded on
+  // the pool's threads
+  size_t loadAsset(
+    const std::string& path, bool loadAll = true, bool reload = false,
+    ThreadPool* threadPool = nullptr
+  );
   // size_t loadRawData(const std::string& path, size_t byteLength = -1, bool reload = false);
   //void loadImageData(std::string_view path);
 
+  // Reorders the triangles and vertices of the asset, see
+  // optimizeMeshPrimitives. Must be called before gpuLoadAll.
+  MeshOptimizationReport optimizeMeshes(size_t assetId);
+
+  // Builds simplified index buffers for the primitives of the asset, see
+  // generateLods. Must be called before gpuLoadAll. Returns the number
+  // of levels added.
+  size_t generateLods(size_t assetId, const SimplifierSettings& settings = {});
+
+  // Splits the primitives of the asset for culling, see buildMeshlets.
+  // Must be called after optimizeMeshes. Returns the number of meshlets.
+  size_t buildMeshlets(size_t assetId);
+
+  // Compacts the vertex attributes of the asset, see quantizeMesh.
+  // Must be called before gpuLoadAll.
+  QuantizationReport quantizeAttributes(size_t assetId);
+
+  // Builds the triangle BVHs of the primitives, see buildTriangleBvh, once
+  // the asset is cooked by the steps above. With a cache directory, each
+  // is stored under the hash of its positions and indices, and read back
+  // instead of built while they do not change.
+  TriangleBvhReport buildTriangleBvhs(
+    size_t assetId, ThreadPool* threadPool = nullptr,
+    const std::string& cacheDirectory = ""
+  );
+
+  // Decodes the occluder meshes of the primitives, see buildOccluderMesh,
+  // from the coarsest levels of detail within maxError. Must be called
+  // after generateLods. Returns the number of triangles.
+  size_t buildOccluderMeshes(size_t assetId, float maxError = 0);
+
   void gpuLoadAll(const MeshPrimitive::AttributeMap& attributeMap);
 
   const Mesh* getMesh(const std::string& assetPath, size_t meshIndex) const;
@@ -34,6 +75,15 @@ public:
 
   const fx::gltf::Document* getAsset(size_t assetId) const;
 
+  // Textures of the asset, without the placeholders, to hand them to a
+  // TextureStreamer before gpuLoadAll
+  std::vector<TextureData*> getTextures(size_t assetId);
+
+  // White, flat material for primitives without one
+  const Material& getDefaultMaterial() const;
+
+  const GpuBufferAllocator& getGpuBuffers() const;
+
 private:
   void loadMesh(size_t assetId, size_t meshIndex);
   void loadMaterial(size_t assetId, size_t materialIndex);
@@ -48,9 +98,15 @@ private:
   std::unordered_map<size_t, std::vector<std::optional<Accessor>>> m_accessors;
   std::unordered_map<size_t, std::vector<std::optional<BufferView>>> m_bufferViews;
   std::unordered_map<size_t, std::vector<std::optional<BufferData>>> m_buffers;
+  std::unordered_map<size_t, QuantizedAttributes> m_quantizedAttributes;
+  std::unordered_map<size_t, std::vector<std::unique_ptr<OwnedAccessor>>> m_optimizedAccessors;
+  std::unordered_map<size_t, std::vector<std::unique_ptr<OwnedAccessor>>> m_lodAccessors;
+
+  GpuBufferAllocator m_gpuBuffers;
 
   TextureData m_defaultColorTexture;
   TextureData m_defaultNormalMap;
+  Material m_defaultMaterial;
 };
 
 #endif // !ASSET_MANAGER_H
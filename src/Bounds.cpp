@@ -0,0 +1,63 @@
+
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "Bounds.hpp"
+
+Aabb Aabb::infinite() {
+  return Aabb { glm::vec3(-INFINITY), glm::vec3(INFINITY) };
+}
+
+bool Aabb::isEmpty() const {
+  return this->min.x > this->max.x
+    || this->min.y > this->max.y
+    || this->min.z > this->max.z;
+}
+
+bool Aabb::isInfinite() const {
+  return std::isinf(this->min.x) && !this->isEmpty();
+}
+
+glm::vec3 Aabb::getCenter() const {
+  return (this->min + this->max) * 0.5f;
+}
+
+glm::vec3 Aabb::getExtents() const {
+  return (this->max - this->min) * 0.5f;
+}
+
+void Aabb::expand(const glm::vec3& point) {
+  this->min = glm::min(this->min, point);
+  this->max = glm::max(this->max, point);
+}
+
+void Aabb::expand(const Aabb& other) {
+  this->min = glm::min(this->min, other.min);
+  this->max = glm::max(this->max, other.max);
+}
+
+Aabb Aabb::transformed(const glm::mat4& matrix) const {
+  if (this->isEmpty() || this->isInfinite()) {
+    return *this;
+  }
+
+  // Arvo's method: transform the center, and project the extents on
+  // each axis with the absolute value of the rotation part
+  glm::vec3 center = glm::vec3(matrix * glm::vec4(this->getCenter(), 1));
+  glm::vec3 extents = this->getExtents();
+  glm::vec3 newExtents(0);
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      newExtents[i] += std::abs(matrix[j][i]) * extents[j];
+    }
+  }
+  return Aabb { center - newExtents, center + newExtents };
+}
+
+Ray Ray::transformed(const glm::mat4& matrix) const {
+  return Ray {
+    glm::vec3(matrix * glm::vec4(this->origin, 1)),
+    glm::mat3(matrix) * this->direction,
+    this->maxDistance
+  };
+}
@@ -0,0 +1,39 @@
+
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <cmath>
+#include <glm/vec3.hpp>
+#include <glm/mat4x4.hpp>
+
+struct Aabb {
+  // Empty by default, so that expanding it with anything yields that thing
+  glm::vec3 min = glm::vec3(INFINITY);
+  glm::vec3 max = glm::vec3(-INFINITY);
+
+  static Aabb infinite();
+
+  bool isEmpty() const;
+  bool isInfinite() const;
+
+  glm::vec3 getCenter() const;
+  glm::vec3 getExtents() const;
+
+  void expand(const glm::vec3& point);
+  void expand(const Aabb& other);
+
+  // Bounds of the transformed box, not of the transformed content
+  Aabb transformed(const glm::mat4& matrix) const;
+};
+
+// Points origin + t * direction, for t from 0 to maxDistance. Distances
+// are in units of the direction, which transforming the ray keeps.
+struct Ray {
+  glm::vec3 origin = glm::vec3(0);
+  glm::vec3 direction = glm::vec3(0, 0, -1);
+  float maxDistance = INFINITY;
+
+  Ray transformed(const glm::mat4& matrix) const;
+};
+
+#endif // !BOUNDS_H
@@ -0,0 +1,958 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BVH_SSE
+#endif
+
+#include "Bvh.hpp"
+
+// Binned surface area heuristic
+static constexpr int BIN_COUNT = 16;
+// Queries per unit of work of a batch
+static constexpr uint32_t QUERY_GRAIN = 64;
+
+static float _area(const Aabb& box) {
+  if (box.isEmpty()) {
+    return 0;
+  }
+  glm::vec3 size = box.max - box.min;
+  return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+static Aabb _merge(const Aabb& a, const Aabb& b) {
+  Aabb merged = a;
+  merged.expand(b);
+  return merged;
+}
+
+void Bvh::set(uint32_t item, const Aabb& bounds) {
+  if (item >= m_itemPlaces.size()) {
+    m_itemPlaces.resize(item + 1, NONE);
+    m_itemBounds.resize(item + 1);
+    m_itemChanged.resize(item + 1, 0);
+  }
+  if (m_itemPlaces[item] == NONE) {
+    m_itemPlaces[item] = EMPTY;
+    m_itemCount++;
+  }
+  m_itemBounds[item] = bounds;
+  if (!m_itemChanged[item]) {
+    m_itemChanged[item] = 1;
+    m_changedItems.push_back(item);
+  }
+}
+
+void Bvh::remove(uint32_t item) {
+  assert(this->contains(item));
+  this->unplace(item);
+  m_itemPlaces[item] = NONE;
+  m_itemCount--;
+}
+
+void Bvh::renameItem(uint32_t item, uint32_t newItem) {
+  assert(this->contains(item) && !this->contains(newItem));
+  if (newItem >= m_itemPlaces.size()) {
+    m_itemPlaces.resize(newItem + 1, NONE);
+    m_itemBounds.resize(newItem + 1);
+    m_itemChanged.resize(newItem + 1, 0);
+  }
+
+  uint32_t place = m_itemPlaces[item];
+  m_itemPlaces[newItem] = place;
+  m_itemBounds[newItem] = m_itemBounds[item];
+  m_itemPlaces[item] = NONE;
+  if (m_itemChanged[item] && !m_itemChanged[newItem]) {
+    m_itemChanged[newItem] = 1;
+    m_changedItems.push_back(newItem);
+  }
+
+  if (place == UNBOUNDED) {
+    *std::find(m_unboundedItems.begin(), m_unboundedItems.end(), item) = newItem;
+  }
+  else if (place != EMPTY) {
+    m_nodes[place].item = newItem;
+    // Queries see the new number right away
+    uint32_t lane = place < m_nodeLanes.size() ? m_nodeLanes[place] : NONE;
+    if (lane != NONE) {
+      m_wideNodes[lane / 4].children[lane % 4] = LEAF | newItem;
+    }
+  }
+}
+
+bool Bvh::contains(uint32_t item) const {
+  return item < m_itemPlaces.size() && m_itemPlaces[item] != NONE;
+}
+
+uint32_t Bvh::allocateNode() {
+  uint32_t node;
+  if (!m_freeNodes.empty()) {
+    node = m_freeNodes.back();
+    m_freeNodes.pop_back();
+  }
+  else {
+    node = m_nodes.size();
+    m_nodes.emplace_back();
+  }
+  m_nodes[node] = Node { Aabb {}, NONE, { NONE, NONE }, NONE };
+  return node;
+}
+
+void Bvh::freeNode(uint32_t node) {
+  m_freeNodes.push_back(node);
+  if (node < m_nodeLanes.size()) {
+    m_nodeLanes[node] = NONE;
+  }
+}
+
+bool Bvh::isLeaf(uint32_t node) const {
+  return m_nodes[node].children[0] == NONE;
+}
+
+void Bvh::unplace(uint32_t item) {
+  uint32_t place = m_itemPlaces[item];
+  if (place == UNBOUNDED) {
+    m_unboundedItems.erase(
+      std::find(m_unboundedItems.begin(), m_unboundedItems.end(), item)
+    );
+  }
+  else if (place != EMPTY) {
+    // Hidden from the queries until the next update
+    uint32_t lane = place < m_nodeLanes.size() ? m_nodeLanes[place] : NONE;
+    if (lane != NONE) {
+      this->setLane(m_wideNodes[lane / 4], lane % 4, Aabb {}, NONE);
+    }
+    this->removeLeaf(place);
+    this->freeNode(place);
+  }
+  m_itemPlaces[item] = EMPTY;
+}
+
+void Bvh::update() {
+  m_stats.refitNodes = 0;
+  m_stats.rotations = 0;
+  m_stats.rebuilt = false;
+  m_stats.flattened = false;
+
+  uint32_t newCount = 0;
+  for (uint32_t item: m_changedItems) {
+    newCount += (m_itemPlaces[item] == EMPTY);
+  }
+
+  if (newCount > 0 && newCount >= m_itemCount / 2) {
+    this->build();
+  }
+  else {
+    for (uint32_t item: m_changedItems) {
+      uint32_t place = m_itemPlaces[item];
+      if (place == NONE) {
+        continue;
+      }
+      const Aabb& bounds = m_itemBounds[item];
+      bool bounded = !bounds.isEmpty() && !bounds.isInfinite();
+      if (place != UNBOUNDED && place != EMPTY && bounded) {
+        m_nodes[place].bounds = bounds;
+        m_refitNodes.push_back(place);
+        this->refit(m_nodes[place].parent);
+        continue;
+      }
+
+      this->unplace(item);
+      if (bounds.isInfinite()) {
+        m_itemPlaces[item] = UNBOUNDED;
+        m_unboundedItems.push_back(item);
+      }
+      else if (bounded) {
+        uint32_t leaf = this->allocateNode();
+        m_nodes[leaf].bounds = bounds;
+        m_nodes[leaf].item = item;
+        m_itemPlaces[item] = leaf;
+        this->insertLeaf(leaf);
+      }
+    }
+  }
+  for (uint32_t item: m_changedItems) {
+    m_itemChanged[item] = 0;
+  }
+  m_changedItems.clear();
+
+  if (m_shapeChanged) {
+    this->flatten();
+  }
+  else {
+    this->refitLanes();
+  }
+  m_refitNodes.clear();
+  m_shapeChanged = false;
+
+  m_stats.itemCount = m_itemCount;
+  m_stats.nodeCount = m_nodes.size() - m_freeNodes.size();
+  m_stats.wideNodeCount = m_wideNodes.size();
+}
+
+void Bvh::build() {
+  m_stats.rebuilt = true;
+  m_shapeChanged = true;
+  m_nodes.clear();
+  m_freeNodes.clear();
+  m_unboundedItems.clear();
+  m_root = NONE;
+
+  // Leaves are the first nodes, centers are indexed by them
+  std::vector<uint32_t> leaves;
+  std::vector<glm::vec3> centers;
+  for (uint32_t item = 0; item < m_itemPlaces.size(); ++item) {
+    if (m_itemPlaces[item] == NONE) {
+      continue;
+    }
+    const Aabb& bounds = m_itemBounds[item];
+    if (bounds.isInfinite()) {
+      m_itemPlaces[item] = UNBOUNDED;
+      m_unboundedItems.push_back(item);
+    }
+    else if (bounds.isEmpty()) {
+      m_itemPlaces[item] = EMPTY;
+    }
+    else {
+      uint32_t leaf = this->allocateNode();
+      m_nodes[leaf].bounds = bounds;
+      m_nodes[leaf].item = item;
+      m_itemPlaces[item] = leaf;
+      leaves.push_back(leaf);
+      centers.push_back(bounds.getCenter());
+    }
+  }
+  if (leaves.empty()) {
+    return;
+  }
+
+  // Top-down, splitting each range of leaves where the summed areas of
+  // the two sides, weighted by their leaf counts, are the smallest
+  struct BuildTask {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t parent;
+    int slot;
+  };
+  std::vector<BuildTask> tasks = { BuildTask { 0, (uint32_t)leaves.size(), NONE, 0 } };
+  while (!tasks.empty()) {
+    BuildTask task = tasks.back();
+    tasks.pop_back();
+
+    uint32_t node;
+    uint32_t middle = task.begin;
+    if (task.end - task.begin == 1) {
+      node = leaves[task.begin];
+    }
+    else {
+      node = this->allocateNode();
+      Aabb bounds;
+      Aabb centerBounds;
+      for (uint32_t i = task.begin; i < task.end; ++i) {
+        bounds.expand(m_nodes[leaves[i]].bounds);
+        centerBounds.expand(centers[leaves[i]]);
+      }
+      m_nodes[node].bounds = bounds;
+
+      glm::vec3 extents = centerBounds.max - centerBounds.min;
+      int axis = extents.x > extents.y
+        ? (extents.x > extents.z ? 0 : 2)
+        : (extents.y > extents.z ? 1 : 2);
+      float axisMin = centerBounds.min[axis];
+      float binScale = extents[axis] > 0 ? BIN_COUNT / extents[axis] : 0;
+      auto binOf = [&](uint32_t leaf) {
+        int bin = (int)((centers[leaf][axis] - axisMin) * binScale);
+        return std::min(bin, BIN_COUNT - 1);
+      };
+
+      if (binScale > 0) {
+        Aabb binBounds[BIN_COUNT];
+        uint32_t binCounts[BIN_COUNT] = {};
+        for (uint32_t i = task.begin; i < task.end; ++i) {
+          int bin = binOf(leaves[i]);
+          binBounds[bin].expand(m_nodes[leaves[i]].bounds);
+          binCounts[bin]++;
+        }
+
+        // Right sides swept from the end, then left sides from the start
+        float rightCosts[BIN_COUNT];
+        Aabb rightBounds;
+        uint32_t rightCount = 0;
+        for (int bin = BIN_COUNT - 1; bin > 0; --bin) {
+          rightBounds.expand(binBounds[bin]);
+          rightCount += binCounts[bin];
+          rightCosts[bin] = _area(rightBounds) * rightCount;
+        }
+        float bestCost = INFINITY;
+        int bestSplit = 0;
+        Aabb leftBounds;
+        uint32_t leftCount = 0;
+        for (int bin = 0; bin + 1 < BIN_COUNT; ++bin) {
+          leftBounds.expand(binBounds[bin]);
+          leftCount += binCounts[bin];
+          float cost = _area(leftBounds) * leftCount + rightCosts[bin + 1];
+          if (leftCount > 0 && leftCount < task.end - task.begin && cost < bestCost) {
+            bestCost = cost;
+            bestSplit = bin + 1;
+          }
+        }
+        if (bestSplit > 0) {
+          middle = std::partition(
+            leaves.begin() + task.begin, leaves.begin() + task.end,
+            [&](uint32_t leaf) { return binOf(leaf) < bestSplit; }
+          ) - leaves.begin();
+        }
+      }
+      // Coincident centers, or no split separates them: halve the range
+      if (middle == task.begin || middle == task.end) {
+        middle = (task.begin + task.end) / 2;
+      }
+    }
+
+    m_nodes[node].parent = task.parent;
+    if (task.parent == NONE) {
+      m_root = node;
+    }
+    else {
+      m_nodes[task.parent].children[task.slot] = node;
+    }
+    if (middle != task.begin) {
+      tasks.push_back(BuildTask { task.begin, middle, node, 0 });
+      tasks.push_back(BuildTask { middle, task.end, node, 1 });
+    }
+  }
+}
+
+void Bvh::insertLeaf(uint32_t leaf) {
+  m_shapeChanged = true;
+  if (m_root == NONE) {
+    m_root = leaf;
+    m_nodes[leaf].parent = NONE;
+    return;
+  }
+
+  // Descends while a child is a cheaper sibling than the node itself,
+  // counting the growth of the ancestors on the way
+  const Aabb& bounds = m_nodes[leaf].bounds;
+  uint32_t sibling = m_root;
+  while (!this->isLeaf(sibling)) {
+    const Node& node = m_nodes[sibling];
+    float area = _area(node.bounds);
+    float mergedArea = _area(_merge(node.bounds, bounds));
+    float cost = 2 * mergedArea;
+    float inheritedCost = 2 * (mergedArea - area);
+
+    float childCosts[2];
+    for (int i = 0; i < 2; ++i) {
+      const Node& child = m_nodes[node.children[i]];
+      float childMergedArea = _area(_merge(child.bounds, bounds));
+      childCosts[i] = inheritedCost + (
+        this->isLeaf(node.children[i])
+          ? childMergedArea
+          : childMergedArea - _area(child.bounds)
+      );
+    }
+    if (cost < childCosts[0] && cost < childCosts[1]) {
+      break;
+    }
+    sibling = node.children[childCosts[0] < childCosts[1] ? 0 : 1];
+  }
+
+  uint32_t oldParent = m_nodes[sibling].parent;
+  uint32_t newParent = this->allocateNode();
+  m_nodes[newParent].parent = oldParent;
+  m_nodes[newParent].children[0] = sibling;
+  m_nodes[newParent].children[1] = leaf;
+  m_nodes[sibling].parent = newParent;
+  m_nodes[leaf].parent = newParent;
+  if (oldParent == NONE) {
+    m_root = newParent;
+  }
+  else {
+    Node& parent = m_nodes[oldParent];
+    parent.children[parent.children[0] == sibling ? 0 : 1] = newParent;
+  }
+  this->refit(newParent);
+}
+
+void Bvh::removeLeaf(uint32_t leaf) {
+  m_shapeChanged = true;
+  if (leaf == m_root) {
+    m_root = NONE;
+    return;
+  }
+
+  uint32_t parent = m_nodes[leaf].parent;
+  uint32_t grandParent = m_nodes[parent].parent;
+  const Node& parentNode = m_nodes[parent];
+  uint32_t sibling = parentNode.children[parentNode.children[0] == leaf ? 1 : 0];
+
+  m_nodes[sibling].parent = grandParent;
+  if (grandParent == NONE) {
+    m_root = sibling;
+  }
+  else {
+    Node& grandParentNode = m_nodes[grandParent];
+    grandParentNode.children[grandParentNode.children[0] == parent ? 0 : 1] = sibling;
+  }
+  this->freeNode(parent);
+  this->refit(grandParent);
+}
+
+void Bvh::refit(uint32_t node) {
+  while (node != NONE) {
+    Node& current = m_nodes[node];
+    Aabb bounds = _merge(
+      m_nodes[current.children[0]].bounds, m_nodes[current.children[1]].bounds
+    );
+    bool changed = (bounds.min != current.bounds.min || bounds.max != current.bounds.max);
+    current.bounds = bounds;
+    changed |= this->rotate(node);
+    // Ancestors of an unchanged node are unchanged too
+    if (!changed) {
+      break;
+    }
+    m_refitNodes.push_back(node);
+    m_stats.refitNodes++;
+    node = m_nodes[node].parent;
+  }
+}
+
+// Swaps a child with a grandchild on the other side, when that shrinks
+// the other child the most
+bool Bvh::rotate(uint32_t node) {
+  const Node& current = m_nodes[node];
+  float bestGain = 0;
+  int bestChild = -1;
+  int bestGrandChild = -1;
+  for (int side = 0; side < 2; ++side) {
+    uint32_t child = current.children[side];
+    uint32_t other = current.children[1 - side];
+    if (this->isLeaf(other)) {
+      continue;
+    }
+    // Moving child down into other, in place of one of its children
+    const Node& otherNode = m_nodes[other];
+    float otherArea = _area(otherNode.bounds);
+    for (int i = 0; i < 2; ++i) {
+      float area = _area(_merge(
+        m_nodes[child].bounds, m_nodes[otherNode.children[1 - i]].bounds
+      ));
+      float gain = otherArea - area;
+      if (gain > bestGain) {
+        bestGain = gain;
+        bestChild = side;
+        bestGrandChild = i;
+      }
+    }
+  }
+  // Small gains are not worth reshaping the flattened tree
+  if (bestChild < 0 || bestGain <= 1e-3f * _area(current.bounds)) {
+    return false;
+  }
+
+  uint32_t child = current.children[bestChild];
+  uint32_t other = current.children[1 - bestChild];
+  uint32_t grandChild = m_nodes[other].children[bestGrandChild];
+  m_nodes[node].children[bestChild] = grandChild;
+  m_nodes[grandChild].parent = node;
+  m_nodes[other].children[bestGrandChild] = child;
+  m_nodes[child].parent = other;
+  Node& otherNode = m_nodes[other];
+  otherNode.bounds = _merge(
+    m_nodes[otherNode.children[0]].bounds, m_nodes[otherNode.children[1]].bounds
+  );
+
+  m_shapeChanged = true;
+  m_stats.rotations++;
+  return true;
+}
+
+void Bvh::setLane(WideNode& wideNode, int lane, const Aabb& bounds, uint32_t child) {
+  wideNode.minX[lane] = bounds.min.x;
+  wideNode.minY[lane] = bounds.min.y;
+  wideNode.minZ[lane] = bounds.min.z;
+  wideNode.maxX[lane] = bounds.max.x;
+  wideNode.maxY[lane] = bounds.max.y;
+  wideNode.maxZ[lane] = bounds.max.z;
+  wideNode.children[lane] = child;
+}
+
+void Bvh::flatten() {
+  m_stats.flattened = true;
+  m_wideNodes.clear();
+  m_nodeLanes.assign(m_nodes.size(), NONE);
+  if (m_root == NONE) {
+    return;
+  }
+
+  // Each wide node takes the children of a binary node, then replaces
+  // the largest internal ones with their own children while there is room
+  std::vector<std::pair<uint32_t, uint32_t>> stack;
+  m_wideNodes.emplace_back();
+  stack.push_back({ m_root, 0 });
+  while (!stack.empty()) {
+    auto [node, wideIndex] = stack.back();
+    stack.pop_back();
+
+    uint32_t lanes[4];
+    int laneCount = 0;
+    if (this->isLeaf(node)) {
+      lanes[laneCount++] = node;
+    }
+    else {
+      lanes[laneCount++] = m_nodes[node].children[0];
+      lanes[laneCount++] = m_nodes[node].children[1];
+    }
+    while (laneCount < 4) {
+      int largest = -1;
+      float largestArea = -1;
+      for (int lane = 0; lane < laneCount; ++lane) {
+        float area = _area(m_nodes[lanes[lane]].bounds);
+        if (!this->isLeaf(lanes[lane]) && area > largestArea) {
+          largest = lane;
+          largestArea = area;
+        }
+      }
+      if (largest < 0) {
+        break;
+      }
+      const Node& expanded = m_nodes[lanes[largest]];
+      lanes[largest] = expanded.children[0];
+      lanes[laneCount++] = expanded.children[1];
+    }
+
+    for (int lane = 0; lane < 4; ++lane) {
+      if (lane >= laneCount) {
+        this->setLane(m_wideNodes[wideIndex], lane, Aabb {}, NONE);
+        continue;
+      }
+      uint32_t child = lanes[lane];
+      uint32_t childRef;
+      if (this->isLeaf(child)) {
+        childRef = LEAF | m_nodes[child].item;
+      }
+      else {
+        childRef = m_wideNodes.size();
+        m_wideNodes.emplace_back();
+        stack.push_back({ child, childRef });
+      }
+      this->setLane(m_wideNodes[wideIndex], lane, m_nodes[child].bounds, childRef);
+      m_nodeLanes[child] = wideIndex * 4 + lane;
+    }
+  }
+}
+
+void Bvh::refitLanes() {
+  for (uint32_t node: m_refitNodes) {
+    uint32_t lane = node < m_nodeLanes.size() ? m_nodeLanes[node] : NONE;
+    if (lane != NONE) {
+      WideNode& wideNode = m_wideNodes[lane / 4];
+      this->setLane(wideNode, lane % 4, m_nodes[node].bounds, wideNode.children[lane % 4]);
+    }
+  }
+}
+
+// Lane masks of the children touching the query, and of those entirely
+// inside it, whose items are all taken without further tests
+
+struct BoxTest {
+  Aabb box;
+
+  template <typename Node>
+  int operator()(const Node& bounds, int& inside) const;
+};
+
+struct SphereTest {
+  BoundingSphere sphere;
+
+  template <typename Node>
+  int operator()(const Node& bounds, int& inside) const;
+};
+
+struct FrustumTest {
+  const Frustum& frustum;
+
+  template <typename Node>
+  int operator()(const Node& bounds, int& inside) const;
+};
+
+template <typename Node>
+int BoxTest::operator()(const Node& bounds, int& inside) const {
+#ifdef BVH_SSE
+  __m128 minX = _mm_load_ps(bounds.minX);
+  __m128 minY = _mm_load_ps(bounds.minY);
+  __m128 minZ = _mm_load_ps(bounds.minZ);
+  __m128 maxX = _mm_load_ps(bounds.maxX);
+  __m128 maxY = _mm_load_ps(bounds.maxY);
+  __m128 maxZ = _mm_load_ps(bounds.maxZ);
+  __m128 boxMinX = _mm_set1_ps(box.min.x);
+  __m128 boxMinY = _mm_set1_ps(box.min.y);
+  __m128 boxMinZ = _mm_set1_ps(box.min.z);
+  __m128 boxMaxX = _mm_set1_ps(box.max.x);
+  __m128 boxMaxY = _mm_set1_ps(box.max.y);
+  __m128 boxMaxZ = _mm_set1_ps(box.max.z);
+
+  __m128 overlap = _mm_and_ps(
+    _mm_and_ps(
+      _mm_and_ps(_mm_cmple_ps(minX, boxMaxX), _mm_cmpge_ps(maxX, boxMinX)),
+      _mm_and_ps(_mm_cmple_ps(minY, boxMaxY), _mm_cmpge_ps(maxY, boxMinY))
+    ),
+    _mm_and_ps(_mm_cmple_ps(minZ, boxMaxZ), _mm_cmpge_ps(maxZ, boxMinZ))
+  );
+  __m128 contained = _mm_and_ps(
+    _mm_and_ps(
+      _mm_and_ps(_mm_cmpge_ps(minX, boxMinX), _mm_cmple_ps(maxX, boxMaxX)),
+      _mm_and_ps(_mm_cmpge_ps(minY, boxMinY), _mm_cmple_ps(maxY, boxMaxY))
+    ),
+    _mm_and_ps(_mm_cmpge_ps(minZ, boxMinZ), _mm_cmple_ps(maxZ, boxMaxZ))
+  );
+  inside = _mm_movemask_ps(contained);
+  return _mm_movemask_ps(overlap);
+#else
+  int hits = 0;
+  inside = 0;
+  for (int lane = 0; lane < 4; ++lane) {
+    bool overlap = (
+      bounds.minX[lane] <= box.max.x && bounds.maxX[lane] >= box.min.x
+      && bounds.minY[lane] <= box.max.y && bounds.maxY[lane] >= box.min.y
+      && bounds.minZ[lane] <= box.max.z && bounds.maxZ[lane] >= box.min.z
+    );
+    bool contained = (
+      bounds.minX[lane] >= box.min.x && bounds.maxX[lane] <= box.max.x
+      && bounds.minY[lane] >= box.min.y && bounds.maxY[lane] <= box.max.y
+      && bounds.minZ[lane] >= box.min.z && bounds.maxZ[lane] <= box.max.z
+    );
+    hits |= overlap << lane;
+    inside |= contained << lane;
+  }
+  return hits;
+#endif
+}
+
+template <typename Node>
+int SphereTest::operator()(const Node& bounds, int& inside) const {
+  // Hit when the closest point of the box is within the radius, inside
+  // when the furthest one is
+#ifdef BVH_SSE
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  __m128 closest = _mm_setzero_ps();
+  __m128 furthest = _mm_setzero_ps();
+  const float* mins[3] = { bounds.minX, bounds.minY, bounds.minZ };
+  const float* maxs[3] = { bounds.maxX, bounds.maxY, bounds.maxZ };
+  for (int axis = 0; axis < 3; ++axis) {
+    __m128 center = _mm_set1_ps(sphere.center[axis]);
+    __m128 toMin = _mm_sub_ps(_mm_load_ps(mins[axis]), center);
+    __m128 toMax = _mm_sub_ps(center, _mm_load_ps(maxs[axis]));
+    __m128 distance = _mm_max_ps(_mm_max_ps(toMin, toMax), _mm_setzero_ps());
+    __m128 furthestAxis = _mm_max_ps(_mm_andnot_ps(signMask, toMin), _mm_andnot_ps(signMask, toMax));
+    closest = _mm_add_ps(closest, _mm_mul_ps(distance, distance));
+    furthest = _mm_add_ps(furthest, _mm_mul_ps(furthestAxis, furthestAxis));
+  }
+  __m128 radius2 = _mm_set1_ps(sphere.radius * sphere.radius);
+  inside = _mm_movemask_ps(_mm_cmple_ps(furthest, radius2));
+  return _mm_movemask_ps(_mm_cmple_ps(closest, radius2));
+#else
+  int hits = 0;
+  inside = 0;
+  float radius2 = sphere.radius * sphere.radius;
+  for (int lane = 0; lane < 4; ++lane) {
+    glm::vec3 min(bounds.minX[lane], bounds.minY[lane], bounds.minZ[lane]);
+    glm::vec3 max(bounds.maxX[lane], bounds.maxY[lane], bounds.maxZ[lane]);
+    glm::vec3 toMin = min - sphere.center;
+    glm::vec3 toMax = sphere.center - max;
+    glm::vec3 distance = glm::max(glm::max(toMin, toMax), glm::vec3(0));
+    glm::vec3 furthestAxis = glm::max(glm::abs(toMin), glm::abs(toMax));
+    hits |= (glm::dot(distance, distance) <= radius2) << lane;
+    inside |= (glm::dot(furthestAxis, furthestAxis) <= radius2) << lane;
+  }
+  return hits;
+#endif
+}
+
+template <typename Node>
+int FrustumTest::operator()(const Node& bounds, int& inside) const {
+  // Outside when the corner furthest along a plane's normal is behind
+  // it, inside when the nearest corner is in front of every plane
+#ifdef BVH_SSE
+  int outsideMask = 0;
+  int insideMask = 0xF;
+  for (int i = 0; i < Frustum::PLANE_COUNT; ++i) {
+    bool px = frustum.nx[i] >= 0;
+    bool py = frustum.ny[i] >= 0;
+    bool pz = frustum.nz[i] >= 0;
+    __m128 nx = _mm_set1_ps(frustum.nx[i]);
+    __m128 ny = _mm_set1_ps(frustum.ny[i]);
+    __m128 nz = _mm_set1_ps(frustum.nz[i]);
+    __m128 d = _mm_set1_ps(frustum.d[i]);
+
+    __m128 furthest = _mm_add_ps(
+      _mm_add_ps(
+        _mm_mul_ps(nx, _mm_load_ps(px ? bounds.maxX : bounds.minX)),
+        _mm_mul_ps(ny, _mm_load_ps(py ? bounds.maxY : bounds.minY))
+      ),
+      _mm_add_ps(_mm_mul_ps(nz, _mm_load_ps(pz ? bounds.maxZ : bounds.minZ)), d)
+    );
+    __m128 nearest = _mm_add_ps(
+      _mm_add_ps(
+        _mm_mul_ps(nx, _mm_load_ps(px ? bounds.minX : bounds.maxX)),
+        _mm_mul_ps(ny, _mm_load_ps(py ? bounds.minY : bounds.maxY))
+      ),
+      _mm_add_ps(_mm_mul_ps(nz, _mm_load_ps(pz ? bounds.minZ : bounds.maxZ)), d)
+    );
+    outsideMask |= _mm_movemask_ps(_mm_cmplt_ps(furthest, _mm_setzero_ps()));
+    insideMask &= _mm_movemask_ps(_mm_cmpge_ps(nearest, _mm_setzero_ps()));
+  }
+  inside = insideMask & ~outsideMask;
+  return ~outsideMask & 0xF;
+#else
+  int hits = 0;
+  inside = 0;
+  for (int lane = 0; lane < 4; ++lane) {
+    bool outside = false;
+    bool contained = true;
+    for (int i = 0; i < Frustum::PLANE_COUNT; ++i) {
+      glm::vec3 normal(frustum.nx[i], frustum.ny[i], frustum.nz[i]);
+      glm::vec3 min(bounds.minX[lane], bounds.minY[lane], bounds.minZ[lane]);
+      glm::vec3 max(bounds.maxX[lane], bounds.maxY[lane], bounds.maxZ[lane]);
+      glm::vec3 furthest;
+      glm::vec3 nearest;
+      for (int axis = 0; axis < 3; ++axis) {
+        furthest[axis] = normal[axis] >= 0 ? max[axis] : min[axis];
+        nearest[axis] = normal[axis] >= 0 ? min[axis] : max[axis];
+      }
+      outside |= glm::dot(normal, furthest) + frustum.d[i] < 0;
+      contained &= glm::dot(normal, nearest) + frustum.d[i] >= 0;
+    }
+    hits |= !outside << lane;
+    inside |= (contained && !outside) << lane;
+  }
+  return hits;
+#endif
+}
+
+template <typename Test>
+void Bvh::query(const Test& test, std::vector<uint32_t>& items) const {
+  items.insert(items.end(), m_unboundedItems.begin(), m_unboundedItems.end());
+  if (m_wideNodes.empty()) {
+    return;
+  }
+
+  thread_local std::vector<uint32_t> stack;
+  stack.clear();
+  stack.push_back(0);
+  while (!stack.empty()) {
+    const WideNode& node = m_wideNodes[stack.back()];
+    stack.pop_back();
+
+    int inside;
+    int hits = test(node, inside);
+    for (int lane = 0; lane < 4; ++lane) {
+      uint32_t child = node.children[lane];
+      if (!(hits & (1 << lane)) || child == NONE) {
+        continue;
+      }
+      if (child & LEAF) {
+        items.push_back(child & ~LEAF);
+      }
+      else if (inside & (1 << lane)) {
+        this->collect(child, items);
+      }
+      else {
+        stack.push_back(child);
+      }
+    }
+  }
+}
+
+void Bvh::collect(uint32_t wideNode, std::vector<uint32_t>& items) const {
+  thread_local std::vector<uint32_t> stack;
+  stack.clear();
+  stack.push_back(wideNode);
+  while (!stack.empty()) {
+    const WideNode& node = m_wideNodes[stack.back()];
+    stack.pop_back();
+    for (uint32_t child: node.children) {
+      if (child == NONE) {
+        continue;
+      }
+      if (child & LEAF) {
+        items.push_back(child & ~LEAF);
+      }
+      else {
+        stack.push_back(child);
+      }
+    }
+  }
+}
+
+void Bvh::queryFrustum(const Frustum& frustum, std::vector<uint32_t>& items) const {
+  this->query(FrustumTest { frustum }, items);
+}
+
+void Bvh::queryBox(const Aabb& box, std::vector<uint32_t>& items) const {
+  this->query(BoxTest { box }, items);
+}
+
+void Bvh::querySphere(const BoundingSphere& sphere, std::vector<uint32_t>& items) const {
+  this->query(SphereTest { sphere }, items);
+}
+
+// Lane mask of the children the ray enters before closest, and where
+template <typename Node>
+static int _intersectLanes(
+  const Node& bounds, const glm::vec3& origin, const glm::vec3& inverseDirection,
+  float closest, float entries[4]
+) {
+#ifdef BVH_SSE
+  __m128 entry = _mm_setzero_ps();
+  __m128 exit = _mm_set1_ps(closest);
+  const float* mins[3] = { bounds.minX, bounds.minY, bounds.minZ };
+  const float* maxs[3] = { bounds.maxX, bounds.maxY, bounds.maxZ };
+  for (int axis = 0; axis < 3; ++axis) {
+    __m128 start = _mm_set1_ps(origin[axis]);
+    __m128 scale = _mm_set1_ps(inverseDirection[axis]);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(mins[axis]), start), scale);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxs[axis]), start), scale);
+    entry = _mm_max_ps(entry, _mm_min_ps(t0, t1));
+    exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+  }
+  _mm_storeu_ps(entries, entry);
+  return _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+#else
+  int hits = 0;
+  for (int lane = 0; lane < 4; ++lane) {
+    glm::vec3 min(bounds.minX[lane], bounds.minY[lane], bounds.minZ[lane]);
+    glm::vec3 max(bounds.maxX[lane], bounds.maxY[lane], bounds.maxZ[lane]);
+    glm::vec3 t0 = (min - origin) * inverseDirection;
+    glm::vec3 t1 = (max - origin) * inverseDirection;
+    float entry = 0;
+    float exit = closest;
+    for (int axis = 0; axis < 3; ++axis) {
+      entry = std::max(entry, std::min(t0[axis], t1[axis]));
+      exit = std::min(exit, std::max(t0[axis], t1[axis]));
+    }
+    entries[lane] = entry;
+    hits |= (entry <= exit) << lane;
+  }
+  return hits;
+#endif
+}
+
+float Bvh::castRay(const Ray& ray, const RayItemTest& testItem) const {
+  float closest = ray.maxDistance;
+  for (uint32_t item: m_unboundedItems) {
+    closest = std::min(closest, testItem(item, closest));
+  }
+  if (m_wideNodes.empty()) {
+    return closest < ray.maxDistance ? closest : INFINITY;
+  }
+
+  // Children wait with the distance the ray enters them at
+  struct StackEntry {
+    uint32_t child;
+    float entry;
+  };
+  thread_local std::vector<StackEntry> stack;
+  stack.clear();
+  stack.push_back(StackEntry { 0, 0 });
+  glm::vec3 inverseDirection = glm::vec3(1) / ray.direction;
+  while (!stack.empty()) {
+    StackEntry top = stack.back();
+    stack.pop_back();
+    if (top.entry > closest) {
+      continue;
+    }
+    if (top.child & LEAF) {
+      closest = std::min(closest, testItem(top.child & ~LEAF, closest));
+      continue;
+    }
+
+    const WideNode& node = m_wideNodes[top.child];
+    alignas(16) float entries[4];
+    int hits = _intersectLanes(node, ray.origin, inverseDirection, closest, entries);
+
+    // The farthest are pushed first, so the nearest comes out next
+    int lanes[4];
+    int laneCount = 0;
+    for (int lane = 0; lane < 4; ++lane) {
+      if ((hits & (1 << lane)) && node.children[lane] != NONE) {
+        int i = laneCount++;
+        for (; i > 0 && entries[lanes[i - 1]] < entries[lane]; --i) {
+          lanes[i] = lanes[i - 1];
+        }
+        lanes[i] = lane;
+      }
+    }
+    for (int i = 0; i < laneCount; ++i) {
+      stack.push_back(StackEntry { node.children[lanes[i]], entries[lanes[i]] });
+    }
+  }
+  return closest < ray.maxDistance ? closest : INFINITY;
+}
+
+// Chunks of queries fill their own item lists, joined in query order
+template <typename Query, typename Run>
+static void _queryBatch(
+  const std::vector<Query>& queries, BvhQueryResults& results,
+  ThreadPool* threadPool, const Run& run
+) {
+  uint32_t queryCount = queries.size();
+  uint32_t chunkCount = (queryCount + QUERY_GRAIN - 1) / QUERY_GRAIN;
+  std::vector<std::vector<uint32_t>> chunkItems(chunkCount);
+  results.offsets.assign(queryCount + 1, 0);
+
+  parallelFor(threadPool, chunkCount, [&](uint32_t chunk, uint32_t) {
+    uint32_t begin = chunk * QUERY_GRAIN;
+    uint32_t end = std::min(begin + QUERY_GRAIN, queryCount);
+    for (uint32_t i = begin; i < end; ++i) {
+      size_t before = chunkItems[chunk].size();
+      run(queries[i], chunkItems[chunk]);
+      results.offsets[i + 1] = chunkItems[chunk].size() - before;
+    }
+  });
+
+  for (uint32_t i = 0; i < queryCount; ++i) {
+    results.offsets[i + 1] += results.offsets[i];
+  }
+  results.items.clear();
+  results.items.reserve(results.offsets.back());
+  for (const std::vector<uint32_t>& items: chunkItems) {
+    results.items.insert(results.items.end(), items.begin(), items.end());
+  }
+}
+
+void Bvh::queryFrustums(
+  const std::vector<Frustum>& frustums, BvhQueryResults& results,
+  ThreadPool* threadPool
+) const {
+  _queryBatch(frustums, results, threadPool, [&](const Frustum& frustum, std::vector<uint32_t>& items) {
+    this->queryFrustum(frustum, items);
+  });
+}
+
+void Bvh::queryBoxes(
+  const std::vector<Aabb>& boxes, BvhQueryResults& results,
+  ThreadPool* threadPool
+) const {
+  _queryBatch(boxes, results, threadPool, [&](const Aabb& box, std::vector<uint32_t>& items) {
+    this->queryBox(box, items);
+  });
+}
+
+void Bvh::querySpheres(
+  const std::vector<BoundingSphere>& spheres, BvhQueryResults& results,
+  ThreadPool* threadPool
+) const {
+  _queryBatch(spheres, results, threadPool, [&](const BoundingSphere& sphere, std::vector<uint32_t>& items) {
+    this->querySphere(sphere, items);
+  });
+}
+
+const BvhStats& Bvh::getStats() const {
+  return m_stats;
+}
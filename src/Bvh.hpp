@@ -0,0 +1,160 @@
+
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/vec3.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "Bounds.hpp"
+#include "Culling.hpp"
+#include "ThreadPool.hpp"
+
+struct BoundingSphere {
+  glm::vec3 center;
+  float radius;
+};
+
+// Items of a batch of queries: those of query i are items[offsets[i]] up
+// to items[offsets[i + 1]]
+struct BvhQueryResults {
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> items;
+};
+
+struct BvhStats {
+  uint32_t itemCount = 0;
+  uint32_t nodeCount = 0;
+  uint32_t wideNodeCount = 0;
+  // Of the last update()
+  uint32_t refitNodes = 0;
+  uint32_t rotations = 0;
+  bool rebuilt = false;
+  bool flattened = false;
+};
+
+// Bounding volume hierarchy over the bounds of items, numbered by the
+// caller. Items live in the leaves of a binary tree, built top-down with
+// the surface area heuristic, then kept up to date: moved items refit
+// their ancestors, which are rotated on the way up when that shrinks
+// them, and new items are inserted where they grow the tree the least.
+// Queries run on a flattened copy of the tree whose nodes hold up to
+// four children, tested at once with SIMD.
+// Items with infinite bounds are kept aside and returned by every query,
+// items with empty bounds by none.
+class Bvh {
+public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  // Inserts the item, or moves it. Nothing changes until update().
+  void set(uint32_t item, const Aabb& bounds);
+  void remove(uint32_t item);
+  // Gives an item's place to another number, which must not be in use
+  void renameItem(uint32_t item, uint32_t newItem);
+  bool contains(uint32_t item) const;
+
+  // Applies the changes, rebuilding the whole tree when most items are
+  // new, then refreshes the nodes the queries use
+  void update();
+
+  // Queries append the items they find, as of the last update()
+  void queryFrustum(const Frustum& frustum, std::vector<uint32_t>& items) const;
+  void queryBox(const Aabb& box, std::vector<uint32_t>& items) const;
+  void querySphere(const BoundingSphere& sphere, std::vector<uint32_t>& items) const;
+
+  // Many queries at once, spread over the pool
+  void queryFrustums(
+    const std::vector<Frustum>& frustums, BvhQueryResults& results,
+    ThreadPool* threadPool = nullptr
+  ) const;
+  void queryBoxes(
+    const std::vector<Aabb>& boxes, BvhQueryResults& results,
+    ThreadPool* threadPool = nullptr
+  ) const;
+  void querySpheres(
+    const std::vector<BoundingSphere>& spheres, BvhQueryResults& results,
+    ThreadPool* threadPool = nullptr
+  ) const;
+
+  // Distance of the item's closest hit nearer than maxDistance, or
+  // INFINITY
+  using RayItemTest = std::function<float(uint32_t item, float maxDistance)>;
+  // Tests the items whose bounds the ray crosses, nearest bounds first,
+  // skipping those entered past the closest hit so far. Returns the
+  // distance of the closest hit, or INFINITY.
+  float castRay(const Ray& ray, const RayItemTest& testItem) const;
+
+  const BvhStats& getStats() const;
+
+private:
+  struct Node {
+    Aabb bounds;
+    uint32_t parent;
+    // NONE for leaves
+    uint32_t children[2];
+    uint32_t item;
+  };
+
+  // Structure of arrays over the four children. Children are wide node
+  // indices, or items with LEAF set; unused lanes have empty bounds.
+  struct alignas(16) WideNode {
+    float minX[4];
+    float minY[4];
+    float minZ[4];
+    float maxX[4];
+    float maxY[4];
+    float maxZ[4];
+    uint32_t children[4];
+  };
+  static constexpr uint32_t LEAF = 1u << 31;
+
+  // Places of the items, besides node indices
+  static constexpr uint32_t UNBOUNDED = NONE - 1;
+  static constexpr uint32_t EMPTY = NONE - 2;
+
+  uint32_t allocateNode();
+  void freeNode(uint32_t node);
+  bool isLeaf(uint32_t node) const;
+
+  void build();
+  void insertLeaf(uint32_t leaf);
+  void removeLeaf(uint32_t leaf);
+  void unplace(uint32_t item);
+  // Recomputes the bounds of node and its ancestors, rotating them
+  void refit(uint32_t node);
+  bool rotate(uint32_t node);
+
+  void flatten();
+  void setLane(WideNode& wideNode, int lane, const Aabb& bounds, uint32_t child);
+  void refitLanes();
+
+  template <typename Test>
+  void query(const Test& test, std::vector<uint32_t>& items) const;
+  void collect(uint32_t wideNode, std::vector<uint32_t>& items) const;
+
+  std::vector<Node> m_nodes;
+  std::vector<uint32_t> m_freeNodes;
+  uint32_t m_root = NONE;
+
+  // By item: the leaf node, UNBOUNDED, EMPTY or NONE
+  std::vector<uint32_t> m_itemPlaces;
+  std::vector<Aabb> m_itemBounds;
+  std::vector<uint32_t> m_unboundedItems;
+  // Set since the last update
+  std::vector<uint32_t> m_changedItems;
+  std::vector<uint8_t> m_itemChanged;
+  uint32_t m_itemCount = 0;
+
+  std::vector<WideNode> m_wideNodes;
+  // Lane of each binary node that is a wide node child, or NONE
+  std::vector<uint32_t> m_nodeLanes;
+  // Nodes whose bounds changed, without changing the tree's shape
+  std::vector<uint32_t> m_refitNodes;
+  bool m_shapeChanged = false;
+
+  BvhStats m_stats;
+};
+
+#endif // !BVH_H
@@ -0,0 +1,79 @@
+
+#include <glm/glm.hpp>
+
+#include "Culling.hpp"
+#include "Simd.hpp"
+
+Frustum Frustum::fromMatrix(const glm::mat4& viewProjection) {
+  // Gribb & Hartmann: planes are sums and differences of the matrix rows
+  glm::vec4 rows[4];
+  for (int i = 0; i < 4; ++i) {
+    rows[i] = glm::vec4(
+      viewProjection[0][i], viewProjection[1][i],
+      viewProjection[2][i], viewProjection[3][i]
+    );
+  }
+
+  glm::vec4 planes[PLANE_COUNT] = {
+    rows[3] + rows[0], rows[3] - rows[0],
+    rows[3] + rows[1], rows[3] - rows[1],
+    rows[3] + rows[2], rows[3] - rows[2]
+  };
+
+  Frustum frustum;
+  for (int i = 0; i < 8; ++i) {
+    // Padding planes accept everything
+    glm::vec4 plane = i < PLANE_COUNT
+      ? planes[i] / glm::length(glm::vec3(planes[i]))
+      : glm::vec4(0, 0, 0, 1);
+    frustum.nx[i] = plane.x;
+    frustum.ny[i] = plane.y;
+    frustum.nz[i] = plane.z;
+    frustum.d[i] = plane.w;
+  }
+  return frustum;
+}
+
+bool Frustum::isVisible(const Aabb& box) const {
+  if (box.isEmpty()) {
+    return false;
+  }
+  if (box.isInfinite()) {
+    return true;
+  }
+
+  glm::vec3 center = box.getCenter();
+  glm::vec3 extents = box.getExtents();
+
+  // The box is outside a plane when its center is further behind it than
+  // the box's projected radius on the plane normal
+  const simd::Float cx = simd::set1(center.x);
+  const simd::Float cy = simd::set1(center.y);
+  const simd::Float cz = simd::set1(center.z);
+  const simd::Float ex = simd::set1(extents.x);
+  const simd::Float ey = simd::set1(extents.y);
+  const simd::Float ez = simd::set1(extents.z);
+  const simd::Float zero = simd::set1(0);
+
+  int outside = 0;
+  for (int i = 0; i < 8; i += simd::WIDTH) {
+    simd::Float px = simd::load(this->nx + i);
+    simd::Float py = simd::load(this->ny + i);
+    simd::Float pz = simd::load(this->nz + i);
+    simd::Float pd = simd::load(this->d + i);
+
+    simd::Float distance = simd::add(
+      simd::add(simd::mul(px, cx), simd::mul(py, cy)),
+      simd::add(simd::mul(pz, cz), pd)
+    );
+    simd::Float radius = simd::add(
+      simd::add(
+        simd::mul(simd::abs(px), ex),
+        simd::mul(simd::abs(py), ey)
+      ),
+      simd::mul(simd::abs(pz), ez)
+    );
+    outside |= simd::mask(simd::lessThan(simd::add(distance, radius), zero));
+  }
+  return outside == 0;
+}
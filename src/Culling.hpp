@@ -0,0 +1,26 @@
+
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+
+#include "Bounds.hpp"
+
+// Planes are stored as structure of arrays, padded to 8 so that whole
+// SIMD registers cover all of them
+struct Frustum {
+  static constexpr int PLANE_COUNT = 6;
+
+  alignas(16) float nx[8];
+  alignas(16) float ny[8];
+  alignas(16) float nz[8];
+  alignas(16) float d[8];
+
+  // Planes point inwards, in the space viewProjection transforms from
+  static Frustum fromMatrix(const glm::mat4& viewProjection);
+
+  bool isVisible(const Aabb& box) const;
+};
+
+#endif // !CULLING_H
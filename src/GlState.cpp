@@ -0,0 +1,212 @@
+
+#include <algorithm>
+
+#include "GlState.hpp"
+
+GlState& GlState::get() {
+  static GlState state;
+  return state;
+}
+
+GlState::GlState() {
+  this->invalidate();
+}
+
+bool GlState::update(GLuint& current, GLuint value) {
+  if (current == value) {
+    m_stats.elidedCalls++;
+    return false;
+  }
+  current = value;
+  m_stats.issuedCalls++;
+  return true;
+}
+
+GLuint& GlState::genericBinding(GLenum target) {
+  for (auto& binding: m_buffers) {
+    if (binding.first == target) {
+      return binding.second;
+    }
+  }
+  m_buffers.emplace_back(target, UNKNOWN);
+  return m_buffers.back().second;
+}
+
+void GlState::activeTexture(GLuint unit) {
+  if (this->update(m_activeUnit, unit)) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+  }
+}
+
+void GlState::useProgram(GLuint programId) {
+  if (this->update(m_programId, programId)) {
+    glUseProgram(programId);
+  }
+}
+
+void GlState::bindVertexArray(GLuint vaoId) {
+  if (this->update(m_vaoId, vaoId)) {
+    glBindVertexArray(vaoId);
+  }
+}
+
+void GlState::bindBuffer(GLenum target, GLuint bufferId) {
+  GLuint* current;
+  GLuint unknown = UNKNOWN;
+  if (target != GL_ELEMENT_ARRAY_BUFFER) {
+    current = &this->genericBinding(target);
+  }
+  else if (m_vaoId != UNKNOWN) {
+    current = &m_elementBuffers.emplace(m_vaoId, UNKNOWN).first->second;
+  }
+  else {
+    current = &unknown;
+  }
+  if (this->update(*current, bufferId)) {
+    glBindBuffer(target, bufferId);
+  }
+}
+
+void GlState::bindBufferRange(
+  GLenum target, GLuint index, GLuint bufferId,
+  GLintptr offset, GLsizeiptr size
+) {
+  IndexedBinding* bindings = nullptr;
+  if (target == GL_UNIFORM_BUFFER) {
+    bindings = m_uniformBuffers;
+  }
+  else if (target == GL_SHADER_STORAGE_BUFFER) {
+    bindings = m_storageBuffers;
+  }
+
+  IndexedBinding binding { bufferId, offset, size };
+  if (bindings != nullptr && index < INDEXED_BINDING_COUNT) {
+    IndexedBinding& current = bindings[index];
+    if (
+      current.bufferId == bufferId && current.offset == offset
+      && current.size == size
+    ) {
+      m_stats.elidedCalls++;
+      return;
+    }
+    current = binding;
+  }
+  m_stats.issuedCalls++;
+  glBindBufferRange(target, index, bufferId, offset, size);
+  this->genericBinding(target) = bufferId;
+}
+
+void GlState::bindTexture(GLuint unit, GLenum target, GLuint textureId) {
+  GLuint* current = nullptr;
+  if (unit < TEXTURE_UNIT_COUNT && target == GL_TEXTURE_2D) {
+    current = &m_textures2d[unit];
+  }
+  else if (unit < TEXTURE_UNIT_COUNT && target == GL_TEXTURE_2D_ARRAY) {
+    current = &m_textureArrays[unit];
+  }
+
+  if (current != nullptr && *current == textureId) {
+    m_stats.elidedCalls++;
+    return;
+  }
+  this->activeTexture(unit);
+  if (current != nullptr) {
+    *current = textureId;
+  }
+  m_stats.issuedCalls++;
+  glBindTexture(target, textureId);
+}
+
+void GlState::bindSampler(GLuint unit, GLuint samplerId) {
+  GLuint unknown = UNKNOWN;
+  GLuint& current = unit < TEXTURE_UNIT_COUNT ? m_samplers[unit] : unknown;
+  if (this->update(current, samplerId)) {
+    glBindSampler(unit, samplerId);
+  }
+}
+
+void GlState::setEnabled(GLenum capability, bool enabled) {
+  auto it = std::find_if(
+    m_capabilities.begin(), m_capabilities.end(),
+    [&](const std::pair<GLenum, GLuint>& entry) { return entry.first == capability; }
+  );
+  if (it == m_capabilities.end()) {
+    m_capabilities.emplace_back(capability, UNKNOWN);
+    it = m_capabilities.end() - 1;
+  }
+  if (this->update(it->second, enabled ? 1 : 0)) {
+    if (enabled) {
+      glEnable(capability);
+    }
+    else {
+      glDisable(capability);
+    }
+  }
+}
+
+void GlState::deleteBuffer(GLuint bufferId) {
+  glDeleteBuffers(1, &bufferId);
+  // Dropped from the bindings of the context, and from the current
+  // vertex array only
+  for (auto& binding: m_buffers) {
+    if (binding.second == bufferId) {
+      binding.second = 0;
+    }
+  }
+  for (IndexedBinding* bindings: { m_uniformBuffers, m_storageBuffers }) {
+    for (uint32_t i = 0; i < INDEXED_BINDING_COUNT; ++i) {
+      if (bindings[i].bufferId == bufferId) {
+        bindings[i] = IndexedBinding { 0, 0, 0 };
+      }
+    }
+  }
+  for (auto& elementBuffer: m_elementBuffers) {
+    if (elementBuffer.second == bufferId) {
+      elementBuffer.second = elementBuffer.first == m_vaoId ? 0 : UNKNOWN;
+    }
+  }
+}
+
+void GlState::deleteTexture(GLuint textureId) {
+  glDeleteTextures(1, &textureId);
+  for (uint32_t unit = 0; unit < TEXTURE_UNIT_COUNT; ++unit) {
+    for (GLuint* textures: { m_textures2d, m_textureArrays }) {
+      if (textures[unit] == textureId) {
+        textures[unit] = 0;
+      }
+    }
+  }
+}
+
+void GlState::deleteVertexArray(GLuint vaoId) {
+  glDeleteVertexArrays(1, &vaoId);
+  m_elementBuffers.erase(vaoId);
+  if (m_vaoId == vaoId) {
+    m_vaoId = 0;
+  }
+}
+
+void GlState::invalidate() {
+  m_programId = UNKNOWN;
+  m_vaoId = UNKNOWN;
+  m_activeUnit = UNKNOWN;
+  m_elementBuffers.clear();
+  m_buffers.clear();
+  for (uint32_t i = 0; i < INDEXED_BINDING_COUNT; ++i) {
+    m_uniformBuffers[i] = IndexedBinding { UNKNOWN, -1, -1 };
+    m_storageBuffers[i] = IndexedBinding { UNKNOWN, -1, -1 };
+  }
+  std::fill(m_textures2d, m_textures2d + TEXTURE_UNIT_COUNT, UNKNOWN);
+  std::fill(m_textureArrays, m_textureArrays + TEXTURE_UNIT_COUNT, UNKNOWN);
+  std::fill(m_samplers, m_samplers + TEXTURE_UNIT_COUNT, UNKNOWN);
+  m_capabilities.clear();
+}
+
+void GlState::endFrame() {
+  m_frameStats = m_stats;
+  m_stats = GlStateStats {};
+}
+
+const GlStateStats& GlState::getFrameStats() const {
+  return m_frameStats;
+}
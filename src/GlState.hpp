@@ -0,0 +1,101 @@
+
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Of the calls that went through the cache
+struct GlStateStats {
+  // Reached the driver
+  uint32_t issuedCalls = 0;
+  // Skipped, the state already matched
+  uint32_t elidedCalls = 0;
+};
+
+// Mirrors the bindings and capabilities of the GL context, to skip the
+// calls that would not change them. Only what goes through it is
+// tracked: code changing the same state directly must call invalidate()
+// afterwards, and objects must be deleted through it, since GL reuses
+// the names of deleted objects. Starts invalidated. Not thread safe, use
+// on the thread owning the GL context.
+class GlState {
+public:
+  // Tracked units and indexed bindings, higher ones are passed through
+  static constexpr uint32_t TEXTURE_UNIT_COUNT = 16;
+  static constexpr uint32_t INDEXED_BINDING_COUNT = 16;
+
+  static GlState& get();
+
+  GlState(const GlState&) = delete;
+  GlState& operator=(const GlState&) = delete;
+
+  void useProgram(GLuint programId);
+  void bindVertexArray(GLuint vaoId);
+  // The element array binding is tracked per vertex array, as GL does
+  void bindBuffer(GLenum target, GLuint bufferId);
+  // Also binds the target's generic binding point, as GL does
+  void bindBufferRange(
+    GLenum target, GLuint index, GLuint bufferId,
+    GLintptr offset, GLsizeiptr size
+  );
+  // Selects the unit only when the binding changes. Targets other than
+  // 2D textures and arrays are passed through.
+  void bindTexture(GLuint unit, GLenum target, GLuint textureId);
+  void bindSampler(GLuint unit, GLuint samplerId);
+  void setEnabled(GLenum capability, bool enabled);
+
+  // Delete the objects, and forget the bindings GL drops with them
+  void deleteBuffer(GLuint bufferId);
+  void deleteTexture(GLuint textureId);
+  void deleteVertexArray(GLuint vaoId);
+
+  // Forgets everything, the next calls are all issued
+  void invalidate();
+
+  // Call once per frame, after its last GL call
+  void endFrame();
+  // Of the last ended frame
+  const GlStateStats& getFrameStats() const;
+
+private:
+  GlState();
+
+  // Marks a binding the cache knows nothing about
+  static constexpr GLuint UNKNOWN = ~0u;
+
+  struct IndexedBinding {
+    GLuint bufferId;
+    GLintptr offset;
+    GLsizeiptr size;
+  };
+
+  // Returns whether the call is needed, counting it either way
+  bool update(GLuint& current, GLuint value);
+  GLuint& genericBinding(GLenum target);
+  void activeTexture(GLuint unit);
+
+  GLuint m_programId;
+  GLuint m_vaoId;
+  GLuint m_activeUnit;
+  // Of the vertex arrays bound so far
+  std::unordered_map<GLuint, GLuint> m_elementBuffers;
+  // Few targets are ever bound, searched linearly
+  std::vector<std::pair<GLenum, GLuint>> m_buffers;
+  IndexedBinding m_uniformBuffers[INDEXED_BINDING_COUNT];
+  IndexedBinding m_storageBuffers[INDEXED_BINDING_COUNT];
+  GLuint m_textures2d[TEXTURE_UNIT_COUNT];
+  GLuint m_textureArrays[TEXTURE_UNIT_COUNT];
+  GLuint m_samplers[TEXTURE_UNIT_COUNT];
+  // Enabled, disabled or UNKNOWN
+  std::vector<std::pair<GLenum, GLuint>> m_capabilities;
+
+  GlStateStats m_stats;
+  GlStateStats m_frameStats;
+};
+
+#endif // !GL_STATE_H
@@ -0,0 +1,339 @@
+
+#include <cassert>
+#include <algorithm>
+
+#include "GpuAllocator.hpp"
+#include "GlState.hpp"
+
+static inline GLintptr _alignUp(GLintptr value, GLsizeiptr alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+bool GpuAllocation::isValid() const {
+  return (this->bufferId != 0);
+}
+
+float GpuPoolStats::utilization() const {
+  return this->capacity != 0
+    ? (float)this->usedBytes / this->capacity
+    : 0;
+}
+
+float GpuPoolStats::fragmentation() const {
+  return this->freeBytes != 0
+    ? 1 - (float)this->largestFreeRange / this->freeBytes
+    : 0;
+}
+
+
+GpuBufferPool::GpuBufferPool(
+  GLenum target, GLsizeiptr blockSize, GLsizeiptr alignment
+) :
+  m_target(target),
+  m_blockSize(blockSize),
+  m_alignment(alignment)
+{
+  assert(alignment > 0);
+}
+
+GpuBufferPool::~GpuBufferPool() {
+  for (Block& block: m_blocks) {
+    GlState::get().deleteBuffer(block.bufferId);
+  }
+}
+
+uint32_t GpuBufferPool::createBlock(GLsizeiptr minSize) {
+  Block block;
+  block.size = std::max(minSize, m_blockSize);
+  block.freeRanges.push_back({ 0, block.size });
+
+  // Errors left by earlier calls would be taken for a failure here
+  while (glGetError() != GL_NO_ERROR) {}
+
+  // Buffer objects are untyped, so create and fill them through the copy
+  // target instead of disturbing the current VAO's element array binding.
+  glGenBuffers(1, &block.bufferId);
+  GlState::get().bindBuffer(GL_COPY_WRITE_BUFFER, block.bufferId);
+  if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+    glBufferStorage(
+      GL_COPY_WRITE_BUFFER, block.size, nullptr, GL_DYNAMIC_STORAGE_BIT
+    );
+  }
+  else {
+    glBufferData(GL_COPY_WRITE_BUFFER, block.size, nullptr, GL_STATIC_DRAW);
+  }
+  // Typically GL_OUT_OF_MEMORY, the buffer then has no storage
+  if (glGetError() != GL_NO_ERROR) {
+    GlState::get().deleteBuffer(block.bufferId);
+    return NONE;
+  }
+
+  m_blocks.push_back(std::move(block));
+  return m_blocks.size() - 1;
+}
+
+bool GpuBufferPool::allocateFromBlock(
+  uint32_t blockIndex, GLsizeiptr size, GLsizeiptr alignment,
+  GpuAllocation& allocation
+) {
+  Block& block = m_blocks[blockIndex];
+  auto& ranges = block.freeRanges;
+
+  // First fit
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    FreeRange range = ranges[i];
+    GLintptr offset = _alignUp(range.offset, alignment);
+    GLintptr rangeEnd = range.offset + range.size;
+    if (offset + size > rangeEnd) {
+      continue;
+    }
+
+    // Split into (possibly empty) head and tail ranges
+    ranges.erase(ranges.begin() + i);
+    if (offset + size < rangeEnd) {
+      ranges.insert(ranges.begin() + i, { offset + size, rangeEnd - offset - size });
+    }
+    if (range.offset < offset) {
+      ranges.insert(ranges.begin() + i, { range.offset, offset - range.offset });
+    }
+
+    block.usedBytes += size;
+    block.allocationCount++;
+
+    allocation = GpuAllocation {
+      block.bufferId, offset, size, blockIndex
+    };
+    return true;
+  }
+  return false;
+}
+
+GpuAllocation GpuBufferPool::allocate(
+  GLsizeiptr size, const void* data, GLsizeiptr alignment
+) {
+  alignment = std::max(alignment, m_alignment);
+  size = std::max<GLsizeiptr>(size, 1);
+
+  GpuAllocation allocation;
+  bool found = false;
+  for (uint32_t i = 0; i < m_blocks.size() && !found; ++i) {
+    found = allocateFromBlock(i, size, alignment, allocation);
+  }
+  if (!found) {
+    uint32_t blockIndex = createBlock(size);
+    if (blockIndex == NONE) {
+      return GpuAllocation {};
+    }
+    found = allocateFromBlock(blockIndex, size, alignment, allocation);
+  }
+  assert(found);
+
+  if (data) {
+    GlState::get().bindBuffer(GL_COPY_WRITE_BUFFER, allocation.bufferId);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, allocation.offset, size, data);
+  }
+
+  return allocation;
+}
+
+void GpuBufferPool::free(const GpuAllocation& allocation) {
+  if (!allocation.isValid()) {
+    return;
+  }
+  assert(allocation.blockIndex < m_blocks.size());
+  Block& block = m_blocks[allocation.blockIndex];
+  assert(block.bufferId == allocation.bufferId);
+  auto& ranges = block.freeRanges;
+
+  auto it = std::lower_bound(
+    ranges.begin(), ranges.end(), allocation.offset,
+    [](const FreeRange& range, GLintptr offset) {
+      return range.offset < offset;
+    }
+  );
+  it = ranges.insert(it, { allocation.offset, allocation.size });
+
+  // Coalesce with neighbours
+  auto next = it + 1;
+  if (next != ranges.end() && it->offset + it->size == next->offset) {
+    it->size += next->size;
+    ranges.erase(next);
+  }
+  if (it != ranges.begin()) {
+    auto prev = it - 1;
+    if (prev->offset + prev->size == it->offset) {
+      prev->size += it->size;
+      ranges.erase(it);
+    }
+  }
+
+  block.usedBytes -= allocation.size;
+  block.allocationCount--;
+}
+
+GLenum GpuBufferPool::getTarget() const {
+  return m_target;
+}
+
+GpuPoolStats GpuBufferPool::getStats() const {
+  GpuPoolStats stats;
+  stats.blockCount = m_blocks.size();
+  for (const Block& block: m_blocks) {
+    stats.allocationCount += block.allocationCount;
+    stats.capacity += block.size;
+    stats.usedBytes += block.usedBytes;
+    stats.freeRangeCount += block.freeRanges.size();
+    for (const FreeRange& range: block.freeRanges) {
+      stats.freeBytes += range.size;
+      stats.largestFreeRange = std::max(stats.largestFreeRange, range.size);
+    }
+  }
+  return stats;
+}
+
+
+GpuBufferAllocator::GpuBufferAllocator(GLsizeiptr blockSize) :
+  // 16 bytes covers every vertex attribute type, indices only need
+  // their own size
+  m_vertexPool(GL_ARRAY_BUFFER, blockSize, 16),
+  m_indexPool(GL_ELEMENT_ARRAY_BUFFER, blockSize, 4)
+{}
+
+GpuBufferPool& GpuBufferAllocator::getPool(GLenum target) {
+  assert(target == GL_ARRAY_BUFFER || target == GL_ELEMENT_ARRAY_BUFFER);
+  return target == GL_ELEMENT_ARRAY_BUFFER ? m_indexPool : m_vertexPool;
+}
+
+const GpuBufferPool& GpuBufferAllocator::getPool(GLenum target) const {
+  assert(target == GL_ARRAY_BUFFER || target == GL_ELEMENT_ARRAY_BUFFER);
+  return target == GL_ELEMENT_ARRAY_BUFFER ? m_indexPool : m_vertexPool;
+}
+
+
+bool GpuRingAllocation::isValid() const {
+  return (this->data != nullptr);
+}
+
+GpuRingBuffer::GpuRingBuffer(GLsizeiptr frameSize) :
+  m_frameSize(_alignUp(frameSize, ALIGNMENT))
+{
+  assert(frameSize > 0);
+}
+
+GpuRingBuffer::~GpuRingBuffer() {
+  this->destroy();
+}
+
+void GpuRingBuffer::create() {
+  GLint uniformAlignment = 0;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+  assert(uniformAlignment > 0 && ALIGNMENT % uniformAlignment == 0);
+
+  GLsizeiptr size = m_frameSize * FRAME_COUNT;
+  glGenBuffers(1, &m_bufferId);
+  GlState::get().bindBuffer(GL_COPY_WRITE_BUFFER, m_bufferId);
+  m_stats.persistent = (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+  if (m_stats.persistent) {
+    // Coherent writes are seen by the commands issued after them, no
+    // explicit flush or barrier is needed
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+    m_mapping = static_cast<uint8_t*>(
+      glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags)
+    );
+    assert(m_mapping);
+  }
+  else {
+    glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    m_staging.resize(size);
+    m_mapping = m_staging.data();
+  }
+  m_stats.frameSize = m_frameSize;
+}
+
+void GpuRingBuffer::destroy() {
+  for (GLsync& fence: m_fences) {
+    if (fence) {
+      glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+      glDeleteSync(fence);
+      fence = nullptr;
+    }
+  }
+  if (m_bufferId != 0) {
+    if (m_stats.persistent) {
+      GlState::get().bindBuffer(GL_COPY_WRITE_BUFFER, m_bufferId);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+    GlState::get().deleteBuffer(m_bufferId);
+    m_bufferId = 0;
+  }
+  m_mapping = nullptr;
+  m_staging.clear();
+}
+
+void GpuRingBuffer::beginFrame() {
+  if (m_stats.failedAllocations > 0) {
+    this->destroy();
+    while (m_frameSize < m_stats.requestedBytes) {
+      m_frameSize *= 2;
+    }
+  }
+  if (m_bufferId == 0) {
+    this->create();
+  }
+
+  GLsync& fence = m_fences[m_frameIndex];
+  if (fence) {
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+      m_stats.stalledFrames++;
+      glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+  }
+
+  m_head = 0;
+  m_failedAllocations = 0;
+  m_flushedBytes = 0;
+}
+
+GpuRingAllocation GpuRingBuffer::allocate(GLsizeiptr size) {
+  assert(m_mapping);
+  GLsizeiptr offset = m_head.fetch_add(_alignUp(size, ALIGNMENT));
+  if (offset + size > m_frameSize) {
+    m_failedAllocations++;
+    return GpuRingAllocation {};
+  }
+  GLintptr bufferOffset = m_frameIndex * m_frameSize + offset;
+  return GpuRingAllocation { bufferOffset, size, m_mapping + bufferOffset };
+}
+
+void GpuRingBuffer::flush() {
+  if (m_stats.persistent) {
+    return;
+  }
+  GLsizeiptr usedBytes = std::min<GLsizeiptr>(m_head, m_frameSize);
+  if (usedBytes > m_flushedBytes) {
+    GLintptr offset = m_frameIndex * m_frameSize + m_flushedBytes;
+    GlState::get().bindBuffer(GL_COPY_WRITE_BUFFER, m_bufferId);
+    glBufferSubData(
+      GL_COPY_WRITE_BUFFER, offset, usedBytes - m_flushedBytes, m_mapping + offset
+    );
+    m_flushedBytes = usedBytes;
+  }
+}
+
+void GpuRingBuffer::endFrame() {
+  m_stats.requestedBytes = m_head;
+  m_stats.failedAllocations = m_failedAllocations;
+  m_fences[m_frameIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_frameIndex = (m_frameIndex + 1) % FRAME_COUNT;
+}
+
+GLuint GpuRingBuffer::getBufferId() const {
+  return m_bufferId;
+}
+
+GpuRingStats GpuRingBuffer::getStats() const {
+  return m_stats;
+}
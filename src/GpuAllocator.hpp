@@ -0,0 +1,177 @@
+
+#ifndef GPU_ALLOCATOR_H
+#define GPU_ALLOCATOR_H
+
+#include <GL/glew.h>
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct GpuAllocation {
+  GLuint bufferId = 0;
+  GLintptr offset = 0;
+  GLsizeiptr size = 0;
+  uint32_t blockIndex = 0;
+
+  bool isValid() const;
+};
+
+struct GpuPoolStats {
+  size_t blockCount = 0;
+  size_t allocationCount = 0;
+  GLsizeiptr capacity = 0;
+  GLsizeiptr usedBytes = 0;
+  GLsizeiptr freeBytes = 0;
+  GLsizeiptr largestFreeRange = 0;
+  size_t freeRangeCount = 0;
+
+  // Share of the allocated blocks actually holding data
+  float utilization() const;
+  // 0 when all free space is one contiguous range, close to 1 when it is
+  // scattered in small holes
+  float fragmentation() const;
+};
+
+// Sub-allocates ranges from large immutable buffer objects.
+// Blocks are only created on the first allocation, so a pool can be
+// constructed without a GL context.
+class GpuBufferPool {
+public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  GpuBufferPool(GLenum target, GLsizeiptr blockSize, GLsizeiptr alignment);
+  GpuBufferPool(const GpuBufferPool&) = delete;
+  GpuBufferPool(GpuBufferPool&&) = delete;
+  ~GpuBufferPool();
+
+  // Returns an invalid allocation when no block has room and a new one
+  // cannot be created
+  GpuAllocation allocate(
+    GLsizeiptr size, const void* data = nullptr, GLsizeiptr alignment = 0
+  );
+  void free(const GpuAllocation& allocation);
+
+  GLenum getTarget() const;
+  GpuPoolStats getStats() const;
+
+private:
+  struct FreeRange {
+    GLintptr offset;
+    GLsizeiptr size;
+  };
+
+  struct Block {
+    GLuint bufferId = 0;
+    GLsizeiptr size = 0;
+    GLsizeiptr usedBytes = 0;
+    size_t allocationCount = 0;
+    // sorted by offset, never adjacent
+    std::vector<FreeRange> freeRanges = {};
+  };
+
+  // NONE when the buffer could not be allocated
+  uint32_t createBlock(GLsizeiptr minSize);
+  bool allocateFromBlock(
+    uint32_t blockIndex, GLsizeiptr size, GLsizeiptr alignment,
+    GpuAllocation& allocation
+  );
+
+  GLenum m_target;
+  GLsizeiptr m_blockSize;
+  GLsizeiptr m_alignment;
+  std::vector<Block> m_blocks;
+};
+
+// Separate pools for vertex and index data, so each block only ever
+// backs a single kind of binding.
+class GpuBufferAllocator {
+public:
+  static constexpr GLsizeiptr DEFAULT_BLOCK_SIZE = 32 * 1024 * 1024;
+
+  explicit GpuBufferAllocator(GLsizeiptr blockSize = DEFAULT_BLOCK_SIZE);
+  GpuBufferAllocator(const GpuBufferAllocator&) = delete;
+  GpuBufferAllocator(GpuBufferAllocator&&) = delete;
+
+  // target is GL_ARRAY_BUFFER or GL_ELEMENT_ARRAY_BUFFER
+  GpuBufferPool& getPool(GLenum target);
+  const GpuBufferPool& getPool(GLenum target) const;
+
+private:
+  GpuBufferPool m_vertexPool;
+  GpuBufferPool m_indexPool;
+};
+
+struct GpuRingAllocation {
+  GLintptr offset = 0;
+  GLsizeiptr size = 0;
+  // Write only, reading back from a mapping is slow
+  uint8_t* data = nullptr;
+
+  bool isValid() const;
+};
+
+struct GpuRingStats {
+  GLsizeiptr frameSize = 0;
+  // Asked for by the last frame, including failed allocations
+  GLsizeiptr requestedBytes = 0;
+  uint32_t failedAllocations = 0;
+  // Frames that waited for the GPU to release their region
+  uint32_t stalledFrames = 0;
+  bool persistent = false;
+};
+
+// Data written once per frame and read by its draws, such as transforms
+// and joint palettes. The buffer holds a region per frame in flight,
+// released by a fence, and stays mapped: allocating is a lock-free bump
+// in the current region, so worker threads write straight into it.
+// The buffer is only created by the first frame, so a ring can be
+// constructed without a GL context.
+class GpuRingBuffer {
+public:
+  static constexpr uint32_t FRAME_COUNT = 3;
+  // Covers GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT on current hardware, so
+  // offsets can be laid out without a context
+  static constexpr GLsizeiptr ALIGNMENT = 256;
+
+  explicit GpuRingBuffer(GLsizeiptr frameSize);
+  GpuRingBuffer(const GpuRingBuffer&) = delete;
+  GpuRingBuffer(GpuRingBuffer&&) = delete;
+  ~GpuRingBuffer();
+
+  // Waits for the GPU to be done with the region of FRAME_COUNT frames
+  // ago, after growing the buffer if the last frame ran out of room
+  void beginFrame();
+  // Thread safe. Fails, without blocking, once the region is full.
+  GpuRingAllocation allocate(GLsizeiptr size);
+  // Makes the writes so far visible to the draws. Only copies anything
+  // without persistent mapping support.
+  void flush();
+  // Fences the region once the frame's draws are issued
+  void endFrame();
+
+  GLuint getBufferId() const;
+  GpuRingStats getStats() const;
+
+private:
+  void create();
+  void destroy();
+
+  GLsizeiptr m_frameSize;
+  GLuint m_bufferId = 0;
+  uint8_t* m_mapping = nullptr;
+  // Stands in for the mapping without persistent mapping support
+  std::vector<uint8_t> m_staging;
+  GLsizeiptr m_flushedBytes = 0;
+
+  std::array<GLsync, FRAME_COUNT> m_fences = {};
+  uint32_t m_frameIndex = 0;
+  std::atomic<GLsizeiptr> m_head{0};
+  std::atomic<uint32_t> m_failedAllocations{0};
+
+  GpuRingStats m_stats;
+};
+
+#endif // !GPU_ALLOCATOR_H
@@ -0,0 +1,167 @@
+
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#ifdef HAS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#include <stb/stb_image_write.h>
+
+#include "Headless.hpp"
+
+#ifdef HAS_EGL
+
+static EGLDisplay _getDisplay() {
+  // Surfaceless needs neither X, Wayland nor a DRM device
+  auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+    eglGetProcAddress("eglGetPlatformDisplayEXT")
+  );
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (
+    getPlatformDisplay && extensions
+    && strstr(extensions, "EGL_MESA_platform_surfaceless")
+  ) {
+    EGLDisplay display = getPlatformDisplay(
+      EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr
+    );
+    if (display != EGL_NO_DISPLAY) {
+      return display;
+    }
+  }
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+HeadlessContext::HeadlessContext(int majorVersion, int minorVersion) {
+  m_display = _getDisplay();
+  if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, nullptr, nullptr)) {
+    throw std::runtime_error("Error initializing EGL");
+  }
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    eglTerminate(m_display);
+    throw std::runtime_error("EGL has no desktop OpenGL support");
+  }
+
+  // Rendering only goes to framebuffer objects, so any surface type will
+  // do; the default would require window support
+  const EGLint configAttributes[] = {
+    EGL_SURFACE_TYPE, 0,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint configCount = 0;
+  if (
+    !eglChooseConfig(m_display, configAttributes, &config, 1, &configCount)
+    || configCount == 0
+  ) {
+    eglTerminate(m_display);
+    throw std::runtime_error("Error choosing an EGL config");
+  }
+
+  const EGLint contextAttributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, majorVersion,
+    EGL_CONTEXT_MINOR_VERSION, minorVersion,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  m_context = eglCreateContext(
+    m_display, config, EGL_NO_CONTEXT, contextAttributes
+  );
+  if (
+    m_context == EGL_NO_CONTEXT
+    || !eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_context)
+  ) {
+    if (m_context != EGL_NO_CONTEXT) {
+      eglDestroyContext(m_display, m_context);
+    }
+    eglTerminate(m_display);
+    throw std::runtime_error("Error creating a surfaceless EGL context");
+  }
+}
+
+HeadlessContext::~HeadlessContext() {
+  eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(m_display, m_context);
+  eglTerminate(m_display);
+}
+
+#else
+
+HeadlessContext::HeadlessContext(int, int) {
+  throw std::runtime_error("Built without EGL, headless mode is unavailable");
+}
+
+HeadlessContext::~HeadlessContext() {}
+
+#endif // HAS_EGL
+
+OffscreenTarget::OffscreenTarget(int width, int height) :
+  m_width(width),
+  m_height(height)
+{
+  glGenRenderbuffers(1, &m_colorId);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_colorId);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+  glGenRenderbuffers(1, &m_depthId);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_depthId);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &m_fboId);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fboId);
+  glFramebufferRenderbuffer(
+    GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_colorId
+  );
+  glFramebufferRenderbuffer(
+    GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depthId
+  );
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    glDeleteFramebuffers(1, &m_fboId);
+    glDeleteRenderbuffers(1, &m_colorId);
+    glDeleteRenderbuffers(1, &m_depthId);
+    throw std::runtime_error("Offscreen framebuffer is incomplete");
+  }
+}
+
+OffscreenTarget::~OffscreenTarget() {
+  glDeleteFramebuffers(1, &m_fboId);
+  glDeleteRenderbuffers(1, &m_colorId);
+  glDeleteRenderbuffers(1, &m_depthId);
+}
+
+void OffscreenTarget::bind() const {
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fboId);
+  glViewport(0, 0, m_width, m_height);
+}
+
+std::vector<uint8_t> OffscreenTarget::readPixels() const {
+  std::vector<uint8_t> pixels(4 * m_width * m_height);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fboId);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+  // GL rows start at the bottom
+  size_t rowSize = 4 * m_width;
+  std::vector<uint8_t> row(rowSize);
+  for (int y = 0; y < m_height / 2; ++y) {
+    uint8_t* top = pixels.data() + y * rowSize;
+    uint8_t* bottom = pixels.data() + (m_height - 1 - y) * rowSize;
+    std::copy(top, top + rowSize, row.begin());
+    std::copy(bottom, bottom + rowSize, top);
+    std::copy(row.begin(), row.end(), bottom);
+  }
+  return pixels;
+}
+
+bool OffscreenTarget::writePng(const std::string& path) const {
+  std::vector<uint8_t> pixels = this->readPixels();
+  return stbi_write_png(
+    path.c_str(), m_width, m_height, 4, pixels.data(), 4 * m_width
+  ) != 0;
+}
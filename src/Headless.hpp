@@ -0,0 +1,56 @@
+
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <GL/glew.h>
+#ifdef HAS_EGL
+#include <EGL/egl.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// OpenGL core context without any window or display server, through
+// EGL's surfaceless platform (Mesa, including llvmpipe) or the default
+// display. Current on the creating thread until destroyed.
+// Throws when built without EGL.
+class HeadlessContext {
+public:
+  HeadlessContext(int majorVersion = 4, int minorVersion = 3);
+  HeadlessContext(const HeadlessContext&) = delete;
+  HeadlessContext(HeadlessContext&&) = delete;
+  ~HeadlessContext();
+
+private:
+#ifdef HAS_EGL
+  EGLDisplay m_display = EGL_NO_DISPLAY;
+  EGLContext m_context = EGL_NO_CONTEXT;
+#endif
+};
+
+// Framebuffer with color and depth renderbuffers, standing in for the
+// default framebuffer when there is no window
+class OffscreenTarget {
+public:
+  OffscreenTarget(int width, int height);
+  OffscreenTarget(const OffscreenTarget&) = delete;
+  OffscreenTarget(OffscreenTarget&&) = delete;
+  ~OffscreenTarget();
+
+  void bind() const;
+
+  // RGBA8, top row first
+  std::vector<uint8_t> readPixels() const;
+  // Returns false if the file could not be written
+  bool writePng(const std::string& path) const;
+
+private:
+  int m_width;
+  int m_height;
+  GLuint m_fboId = 0;
+  GLuint m_colorId = 0;
+  GLuint m_depthId = 0;
+};
+
+#endif // !HEADLESS_H
@@ -0,0 +1,176 @@
+
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#ifdef HAS_ZSTD
+#include <zstd.h>
+#endif
+
+#include "Ktx2.hpp"
+
+static const uint8_t KTX2_IDENTIFIER[12] = {
+  0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+// Identifier, header and index, then the level index
+static constexpr size_t LEVEL_INDEX_OFFSET = 80;
+static constexpr size_t LEVEL_INDEX_ENTRY_SIZE = 24;
+
+enum class Supercompression: uint32_t {
+  None = 0,
+  BasisLZ = 1,
+  Zstandard = 2,
+  Zlib = 3
+};
+
+struct Ktx2Format {
+  uint32_t vkFormat;
+  GLenum internalFormat;
+  // Bytes per 4x4 block, or per pixel when not compressed
+  uint32_t blockBytes;
+  bool compressed;
+};
+
+// sRGB formats are uploaded as their linear counterparts: PNG and JPEG
+// images are not decoded to linear either, and the framebuffer is not sRGB
+static const Ktx2Format KTX2_FORMATS[] = {
+  { 37, GL_RGBA8, 4, false },
+  { 43, GL_RGBA8, 4, false },
+  { 131, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, 8, true },
+  { 132, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, 8, true },
+  { 133, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 8, true },
+  { 134, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 8, true },
+  { 137, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 16, true },
+  { 138, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 16, true },
+  { 139, GL_COMPRESSED_RED_RGTC1, 8, true },
+  { 141, GL_COMPRESSED_RG_RGTC2, 16, true },
+  { 145, GL_COMPRESSED_RGBA_BPTC_UNORM, 16, true },
+  { 146, GL_COMPRESSED_RGBA_BPTC_UNORM, 16, true },
+};
+
+template <typename T>
+static T _read(const uint8_t* data, size_t offset) {
+  T value;
+  memcpy(&value, data + offset, sizeof(T));
+  return value;
+}
+
+bool isKtx2(const uint8_t* data, size_t size) {
+  return (
+    size >= sizeof(KTX2_IDENTIFIER)
+    && memcmp(data, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) == 0
+  );
+}
+
+void loadKtx2(const uint8_t* data, size_t size, TextureData& texture) {
+  if (!isKtx2(data, size) || size < LEVEL_INDEX_OFFSET) {
+    throw std::runtime_error("Invalid KTX2 file");
+  }
+
+  uint32_t vkFormat = _read<uint32_t>(data, 12);
+  uint32_t width = _read<uint32_t>(data, 20);
+  uint32_t height = _read<uint32_t>(data, 24);
+  uint32_t depth = _read<uint32_t>(data, 28);
+  uint32_t layerCount = _read<uint32_t>(data, 32);
+  uint32_t faceCount = _read<uint32_t>(data, 36);
+  // 0 asks for the mips to be generated, the file then holds the base
+  // level only
+  uint32_t fileLevelCount = _read<uint32_t>(data, 40);
+  uint32_t levelCount = std::max(fileLevelCount, 1u);
+  auto supercompression = (Supercompression)_read<uint32_t>(data, 44);
+
+  if (depth > 1 || layerCount > 1 || faceCount != 1 || width == 0 || height == 0) {
+    throw std::runtime_error("Only 2D KTX2 textures are supported");
+  }
+  const Ktx2Format* format = std::find_if(
+    std::begin(KTX2_FORMATS), std::end(KTX2_FORMATS),
+    [&](const Ktx2Format& candidate) { return candidate.vkFormat == vkFormat; }
+  );
+  if (format == std::end(KTX2_FORMATS)) {
+    throw std::runtime_error(
+      "Unsupported KTX2 format " + std::to_string(vkFormat)
+    );
+  }
+  if (fileLevelCount == 0 && format->compressed) {
+    throw std::runtime_error("Compressed KTX2 textures need their mip levels");
+  }
+  if (
+    supercompression != Supercompression::None
+    && supercompression != Supercompression::Zstandard
+  ) {
+    throw std::runtime_error("Unsupported KTX2 supercompression");
+  }
+#ifndef HAS_ZSTD
+  if (supercompression == Supercompression::Zstandard) {
+    throw std::runtime_error("KTX2 zstd supercompression needs a build with zstd");
+  }
+#endif
+  if (size < LEVEL_INDEX_OFFSET + levelCount * LEVEL_INDEX_ENTRY_SIZE) {
+    throw std::runtime_error("Invalid KTX2 level index");
+  }
+
+  texture.width = width;
+  texture.height = height;
+  texture.internalFormat = format->internalFormat;
+  texture.compressed = format->compressed;
+  texture.levels.resize(levelCount);
+
+  // Levels are stored as GL expects them, only their sizes are checked
+  size_t totalBytes = 0;
+  for (uint32_t level = 0; level < levelCount; ++level) {
+    uint32_t levelWidth = std::max(width >> level, 1u);
+    uint32_t levelHeight = std::max(height >> level, 1u);
+    size_t byteLength = format->compressed
+      ? (size_t)((levelWidth + 3) / 4) * ((levelHeight + 3) / 4) * format->blockBytes
+      : (size_t)levelWidth * levelHeight * format->blockBytes;
+    texture.levels[level] = TextureLevel { (uint32_t)totalBytes, (uint32_t)byteLength };
+    totalBytes += byteLength;
+  }
+  texture.data.resize(totalBytes);
+
+  for (uint32_t level = 0; level < levelCount; ++level) {
+    size_t entry = LEVEL_INDEX_OFFSET + level * LEVEL_INDEX_ENTRY_SIZE;
+    uint64_t byteOffset = _read<uint64_t>(data, entry);
+    uint64_t byteLength = _read<uint64_t>(data, entry + 8);
+    uint64_t uncompressedLength = _read<uint64_t>(data, entry + 16);
+    const TextureLevel& textureLevel = texture.levels[level];
+
+    if (
+      byteOffset > size || byteLength > size - byteOffset
+      || uncompressedLength != textureLevel.byteLength
+    ) {
+      throw std::runtime_error(
+        "Invalid KTX2 level " + std::to_string(level)
+      );
+    }
+
+    uint8_t* destination = texture.data.data() + textureLevel.byteOffset;
+    if (supercompression == Supercompression::None) {
+      if (byteLength != textureLevel.byteLength) {
+        throw std::runtime_error(
+          "Invalid KTX2 level " + std::to_string(level)
+        );
+      }
+      memcpy(destination, data + byteOffset, byteLength);
+    }
+#ifdef HAS_ZSTD
+    else {
+      size_t decodedLength = ZSTD_decompress(
+        destination, textureLevel.byteLength, data + byteOffset, byteLength
+      );
+      if (ZSTD_isError(decodedLength) || decodedLength != textureLevel.byteLength) {
+        throw std::runtime_error(
+          "Invalid zstd data in KTX2 level " + std::to_string(level)
+        );
+      }
+    }
+#endif
+  }
+
+  // Then generated like those of PNG and JPEG images
+  if (fileLevelCount == 0) {
+    texture.levels.clear();
+  }
+}
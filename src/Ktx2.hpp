@@ -0,0 +1,20 @@
+
+#ifndef KTX2_H
+#define KTX2_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Primitives.hpp"
+
+// Whether the data starts with the KTX2 file identifier
+bool isKtx2(const uint8_t* data, size_t size);
+
+// Reads the mip levels of a KTX2 2D texture into texture, for upload
+// without decoding. Supports RGBA8 and BC1, BC3, BC4, BC5 and BC7
+// formats, without supercompression or with zstd (when built with it).
+// RGBA8 files without levels get their mips generated like other images.
+// Throws std::runtime_error for anything else.
+void loadKtx2(const uint8_t* data, size_t size, TextureData& texture);
+
+#endif // !KTX2_H
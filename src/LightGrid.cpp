@@ -0,0 +1,229 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "LightGrid.hpp"
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+// Cosine of the outer cone of point lights, below any direction's
+static constexpr float POINT_OUTER_COS = -2;
+
+LightGrid::LightGrid(uint32_t tilesX, uint32_t tilesY, uint32_t slices)
+  : m_tilesX(std::max(1u, tilesX)), m_tilesY(std::max(1u, tilesY)),
+    m_slices(std::max(1u, slices))
+{
+}
+
+void LightGrid::setViewportSize(float width, float height) {
+  m_viewportSize = glm::vec2(width, height);
+}
+
+void LightGrid::buildClusters(const glm::mat4& projection) {
+  m_projection = projection;
+  float nearDepth = projection[3][2] / (projection[2][2] - 1);
+  float farDepth = projection[3][2] / (projection[2][2] + 1);
+  float logRatio = std::log(farDepth / nearDepth);
+  uint32_t sliceCount = m_slices.size();
+  m_depthScale = sliceCount / logRatio;
+  m_depthBias = -(float)sliceCount * std::log(nearDepth) / logRatio;
+
+  // Tile corners, on the plane at a unit depth
+  glm::mat4 inverseProjection = glm::inverse(projection);
+  std::vector<glm::vec3> corners;
+  for (uint32_t y = 0; y <= m_tilesY; ++y) {
+    for (uint32_t x = 0; x <= m_tilesX; ++x) {
+      glm::vec4 corner = inverseProjection * glm::vec4(
+        2.0f * x / m_tilesX - 1, 2.0f * y / m_tilesY - 1, -1, 1
+      );
+      corners.push_back(glm::vec3(corner) / corner.w / nearDepth);
+    }
+  }
+
+  for (uint32_t s = 0; s < sliceCount; ++s) {
+    Slice& slice = m_slices[s];
+    slice.nearDepth = nearDepth * std::pow(farDepth / nearDepth, (float)s / sliceCount);
+    slice.farDepth = nearDepth * std::pow(farDepth / nearDepth, (float)(s + 1) / sliceCount);
+    slice.clusterMins.resize(m_tilesX * m_tilesY);
+    slice.clusterMaxs.resize(m_tilesX * m_tilesY);
+    for (uint32_t y = 0; y < m_tilesY; ++y) {
+      for (uint32_t x = 0; x < m_tilesX; ++x) {
+        glm::vec3 min = glm::vec3(INFINITY);
+        glm::vec3 max = glm::vec3(-INFINITY);
+        for (uint32_t corner: { 0u, 1u, m_tilesX + 1, m_tilesX + 2 }) {
+          for (float depth: { slice.nearDepth, slice.farDepth }) {
+            glm::vec3 point = corners[y * (m_tilesX + 1) + x + corner] * depth;
+            min = glm::min(min, point);
+            max = glm::max(max, point);
+          }
+        }
+        slice.clusterMins[y * m_tilesX + x] = min;
+        slice.clusterMaxs[y * m_tilesX + x] = max;
+      }
+    }
+  }
+}
+
+void LightGrid::update(
+  const std::vector<Light>& lights,
+  const glm::mat4& view, const glm::mat4& projection,
+  ThreadPool* threadPool
+) {
+  auto start = std::chrono::steady_clock::now();
+  if (projection != m_projection) {
+    this->buildClusters(projection);
+  }
+
+  // Padding lanes have a negative range, which no slice overlaps
+  size_t paddedCount = simd::roundUp(lights.size());
+  m_lightX.assign(paddedCount, 0);
+  m_lightY.assign(paddedCount, 0);
+  m_lightZ.assign(paddedCount, 0);
+  m_lightRanges.assign(paddedCount, -INFINITY);
+  m_gpuLights.resize(lights.size());
+  glm::mat3 viewRotation(view);
+  for (size_t i = 0; i < lights.size(); ++i) {
+    const Light& light = lights[i];
+    glm::vec3 position = glm::vec3(view * glm::vec4(light.position, 1));
+    m_lightX[i] = position.x;
+    m_lightY[i] = position.y;
+    m_lightZ[i] = position.z;
+    m_lightRanges[i] = light.range;
+
+    float outerCos = light.outerConeAngle < 3.14159265f
+      ? std::cos(light.outerConeAngle)
+      : POINT_OUTER_COS;
+    // Distinct edges for the shader's smoothstep
+    float innerCos = std::max(std::cos(light.innerConeAngle), outerCos + 1e-4f);
+    m_gpuLights[i] = GpuLight {
+      glm::vec4(position, std::isinf(light.range) ? 0 : 1 / (light.range * light.range)),
+      glm::vec4(light.color, outerCos),
+      glm::vec4(glm::normalize(viewRotation * light.direction), innerCos)
+    };
+  }
+
+  parallelFor(threadPool, m_slices.size(), [&](uint32_t slice, uint32_t) {
+    this->assignSlice(m_slices[slice]);
+  });
+
+  // Slices joined in order, z being the slowest axis of the clusters
+  uint32_t tileCount = m_tilesX * m_tilesY;
+  m_clusters.resize(2 * tileCount * m_slices.size());
+  m_lightIndices.clear();
+  m_stats = LightGridStats {};
+  for (size_t s = 0; s < m_slices.size(); ++s) {
+    const Slice& slice = m_slices[s];
+    uint32_t offset = m_lightIndices.size();
+    for (uint32_t tile = 0; tile < tileCount; ++tile) {
+      uint32_t cluster = s * tileCount + tile;
+      m_clusters[2 * cluster] = offset;
+      m_clusters[2 * cluster + 1] = slice.clusterCounts[tile];
+      offset += slice.clusterCounts[tile];
+      m_stats.maxClusterLights = std::max(m_stats.maxClusterLights, slice.clusterCounts[tile]);
+    }
+    m_lightIndices.insert(m_lightIndices.end(), slice.lightIndices.begin(), slice.lightIndices.end());
+  }
+
+  m_stats.lightCount = lights.size();
+  m_stats.clusterCount = tileCount * m_slices.size();
+  m_stats.lightIndexCount = m_lightIndices.size();
+  m_stats.assignMs = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+}
+
+void LightGrid::assignSlice(Slice& slice) {
+  // Lights whose depth range overlaps the slice's, in their own arrays,
+  // padded with lanes no cluster is close enough to
+  thread_local std::vector<uint32_t> threadCandidates;
+  thread_local std::vector<float> threadCandidateData[4];
+  std::vector<uint32_t>& candidates = threadCandidates;
+  std::vector<float>* candidateData = threadCandidateData;
+  candidates.clear();
+
+  const simd::Float nearDepth = simd::set1(slice.nearDepth);
+  const simd::Float farDepth = simd::set1(slice.farDepth);
+  for (size_t i = 0; i < m_lightZ.size(); i += simd::WIDTH) {
+    simd::Float depth = simd::sub(simd::set1(0), simd::load(m_lightZ.data() + i));
+    simd::Float range = simd::load(m_lightRanges.data() + i);
+    simd::Float outside = simd::bitOr(
+      simd::lessThan(farDepth, simd::sub(depth, range)),
+      simd::lessThan(simd::add(depth, range), nearDepth)
+    );
+    int inside = ~simd::mask(outside) & ((1 << simd::WIDTH) - 1);
+    for (; inside != 0; inside &= inside - 1) {
+      uint32_t light = i + simd::firstLane(inside);
+      if (m_lightRanges[light] >= 0) {
+        candidates.push_back(light);
+      }
+    }
+  }
+
+  size_t paddedCount = simd::roundUp(candidates.size());
+  for (int component = 0; component < 4; ++component) {
+    candidateData[component].assign(paddedCount, component == 3 ? -1.0f : 0.0f);
+  }
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    uint32_t light = candidates[i];
+    candidateData[0][i] = m_lightX[light];
+    candidateData[1][i] = m_lightY[light];
+    candidateData[2][i] = m_lightZ[light];
+    candidateData[3][i] = m_lightRanges[light] * m_lightRanges[light];
+  }
+
+  // Squared distance from the center of each light to the cluster's box
+  slice.lightIndices.clear();
+  slice.clusterCounts.assign(slice.clusterMins.size(), 0);
+  const simd::Float zero = simd::set1(0);
+  for (size_t cluster = 0; cluster < slice.clusterMins.size(); ++cluster) {
+    const glm::vec3& min = slice.clusterMins[cluster];
+    const glm::vec3& max = slice.clusterMaxs[cluster];
+    simd::Float mins[3] = { simd::set1(min.x), simd::set1(min.y), simd::set1(min.z) };
+    simd::Float maxs[3] = { simd::set1(max.x), simd::set1(max.y), simd::set1(max.z) };
+    for (size_t i = 0; i < paddedCount; i += simd::WIDTH) {
+      simd::Float distanceSquared = zero;
+      for (int axis = 0; axis < 3; ++axis) {
+        simd::Float center = simd::load(candidateData[axis].data() + i);
+        simd::Float distance = simd::max(
+          simd::max(simd::sub(mins[axis], center), simd::sub(center, maxs[axis])), zero
+        );
+        distanceSquared = simd::add(distanceSquared, simd::mul(distance, distance));
+      }
+      simd::Float rangeSquared = simd::load(candidateData[3].data() + i);
+      int touching = simd::mask(simd::lessThan(distanceSquared, rangeSquared));
+      for (; touching != 0; touching &= touching - 1) {
+        slice.lightIndices.push_back(candidates[i + simd::firstLane(touching)]);
+        slice.clusterCounts[cluster]++;
+      }
+    }
+  }
+}
+
+glm::uvec4 LightGrid::getClusterCounts() const {
+  return glm::uvec4(m_tilesX, m_tilesY, m_slices.size(), 0);
+}
+
+glm::vec4 LightGrid::getClusterParameters() const {
+  return glm::vec4(
+    m_tilesX / m_viewportSize.x, m_tilesY / m_viewportSize.y,
+    m_depthScale, m_depthBias
+  );
+}
+
+const std::vector<LightGrid::GpuLight>& LightGrid::getLights() const {
+  return m_gpuLights;
+}
+
+const std::vector<uint32_t>& LightGrid::getClusters() const {
+  return m_clusters;
+}
+
+const std::vector<uint32_t>& LightGrid::getLightIndices() const {
+  return m_lightIndices;
+}
+
+const LightGridStats& LightGrid::getStats() const {
+  return m_stats;
+}
@@ -0,0 +1,121 @@
+
+#ifndef LIGHT_GRID_H
+#define LIGHT_GRID_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+
+class ThreadPool;
+
+// Point light, or spot light when its outer cone is under a half turn.
+// World space.
+struct Light {
+  glm::vec3 position = glm::vec3(0);
+  // No effect beyond it, INFINITY for no falloff at all
+  float range = INFINITY;
+  glm::vec3 color = glm::vec3(1);
+  glm::vec3 direction = glm::vec3(0, 0, -1);
+  // Half angles in radians, full intensity inside the inner cone
+  float innerConeAngle = 3.14159265f;
+  float outerConeAngle = 3.14159265f;
+};
+
+struct LightGridStats {
+  uint32_t lightCount = 0;
+  uint32_t clusterCount = 0;
+  // Entries of the light index list, a light per cluster it touches
+  uint32_t lightIndexCount = 0;
+  uint32_t maxClusterLights = 0;
+  double assignMs = 0;
+};
+
+// Splits the view frustum into tiles of the screen, and each tile into
+// slices of exponentially growing depth, then lists the lights whose
+// bounding sphere touches each of these clusters. Slices are assigned on
+// the pool, each testing its lights against its clusters' boxes a SIMD
+// register of lights at a time. The results are laid out as the shaders
+// read them: camera space lights, an offset and count per cluster, and
+// the light indices the counts refer to.
+class LightGrid {
+public:
+  // std430 layout of the Lights buffer, see phong.frag
+  struct GpuLight {
+    // w is 1 / range^2, 0 without falloff
+    glm::vec4 positionInverseRangeSquared;
+    // w is the cosine of the outer cone
+    glm::vec4 colorOuterCos;
+    // w is the cosine of the inner cone
+    glm::vec4 directionInnerCos;
+  };
+
+  explicit LightGrid(uint32_t tilesX = 16, uint32_t tilesY = 9, uint32_t slices = 24);
+  LightGrid(const LightGrid&) = delete;
+  LightGrid& operator=(const LightGrid&) = delete;
+
+  // In pixels, to find the tile of a fragment
+  void setViewportSize(float width, float height);
+
+  // Assigns the lights to the clusters of the view. The projection must
+  // be a perspective one.
+  void update(
+    const std::vector<Light>& lights,
+    const glm::mat4& view, const glm::mat4& projection,
+    ThreadPool* threadPool = nullptr
+  );
+
+  // Tiles, tiles and slices, in x, y and z
+  glm::uvec4 getClusterCounts() const;
+  // xy scale gl_FragCoord to tiles, zw scale and bias the log of the
+  // camera space depth to slices
+  glm::vec4 getClusterParameters() const;
+
+  const std::vector<GpuLight>& getLights() const;
+  // Offset in the light indices and count of each cluster, x fastest
+  const std::vector<uint32_t>& getClusters() const;
+  const std::vector<uint32_t>& getLightIndices() const;
+  const LightGridStats& getStats() const;
+
+private:
+  // Of a slice, rebuilt with the clusters' boxes
+  struct Slice {
+    float nearDepth;
+    float farDepth;
+    // Camera space boxes of the slice's clusters
+    std::vector<glm::vec3> clusterMins;
+    std::vector<glm::vec3> clusterMaxs;
+    // Of the last update, in the slice's own order
+    std::vector<uint32_t> lightIndices;
+    std::vector<uint32_t> clusterCounts;
+  };
+
+  void buildClusters(const glm::mat4& projection);
+  void assignSlice(Slice& slice);
+
+  uint32_t m_tilesX;
+  uint32_t m_tilesY;
+  glm::vec2 m_viewportSize = glm::vec2(800, 800);
+  // Projection the clusters were built for
+  glm::mat4 m_projection = glm::mat4(0);
+  float m_depthScale = 0;
+  float m_depthBias = 0;
+  std::vector<Slice> m_slices;
+
+  // Camera space lights, as structure of arrays padded to the SIMD
+  // width
+  std::vector<float> m_lightX;
+  std::vector<float> m_lightY;
+  std::vector<float> m_lightZ;
+  std::vector<float> m_lightRanges;
+
+  std::vector<GpuLight> m_gpuLights;
+  std::vector<uint32_t> m_clusters;
+  std::vector<uint32_t> m_lightIndices;
+  LightGridStats m_stats;
+};
+
+#endif // !LIGHT_GRID_H
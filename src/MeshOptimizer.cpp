@@ -0,0 +1,422 @@
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+#include "MeshOptimizer.hpp"
+
+// Clusters may cost this much more cache misses than the whole mesh
+static const float OVERDRAW_THRESHOLD = 1.05f;
+
+static double _ratio(size_t numerator, size_t denominator) {
+  return denominator != 0 ? (double)numerator / denominator : 0;
+}
+
+double MeshOptimizationReport::acmrBefore() const {
+  return _ratio(cacheMissesBefore, triangleCount);
+}
+
+double MeshOptimizationReport::acmrAfter() const {
+  return _ratio(cacheMissesAfter, triangleCount);
+}
+
+double MeshOptimizationReport::atvrBefore() const {
+  return _ratio(cacheMissesBefore, vertexCount);
+}
+
+double MeshOptimizationReport::atvrAfter() const {
+  return _ratio(cacheMissesAfter, vertexCount);
+}
+
+void MeshOptimizationReport::add(const MeshOptimizationReport& other) {
+  primitiveCount += other.primitiveCount;
+  skippedPrimitives += other.skippedPrimitives;
+  triangleCount += other.triangleCount;
+  vertexCount += other.vertexCount;
+  cacheMissesBefore += other.cacheMissesBefore;
+  cacheMissesAfter += other.cacheMissesAfter;
+  indexBytesBefore += other.indexBytesBefore;
+  indexBytesAfter += other.indexBytesAfter;
+}
+
+// A vertex is in the FIFO cache while fewer than cacheSize misses
+// happened since it was loaded
+struct VertexCache {
+  uint32_t size;
+  uint32_t time;
+  std::vector<uint32_t> loadTimes;
+
+  VertexCache(uint32_t vertexCount, uint32_t cacheSize) :
+    size(cacheSize),
+    time(cacheSize),
+    loadTimes(vertexCount, 0)
+  {}
+
+  // Returns true on a miss
+  bool access(uint32_t vertex) {
+    if (time - loadTimes[vertex] < size) {
+      return false;
+    }
+    loadTimes[vertex] = time++;
+    return true;
+  }
+
+  void flush() {
+    time += size;
+  }
+};
+
+size_t simulateVertexCache(
+  const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize
+) {
+  VertexCache cache(vertexCount, cacheSize);
+  size_t misses = 0;
+  for (uint32_t index: indices) {
+    misses += cache.access(index);
+  }
+  return misses;
+}
+
+static std::vector<uint32_t> _readIndices(const Accessor& indices) {
+  std::vector<uint32_t> result(indices.count);
+  for (uint32_t i = 0; i < indices.count; ++i) {
+    result[i] = indices.getIndex(i);
+  }
+  return result;
+}
+
+static uint32_t _countUsedVertices(
+  const std::vector<uint32_t>& indices, uint32_t vertexCount
+) {
+  std::vector<bool> used(vertexCount, false);
+  uint32_t count = 0;
+  for (uint32_t index: indices) {
+    count += !used[index];
+    used[index] = true;
+  }
+  return count;
+}
+
+// Sander et al., Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw: emits the triangles around a fanning vertex, then moves to
+// the neighbor which will still be in the cache after its own fan
+static std::vector<uint32_t> _tipsify(
+  const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize
+) {
+  size_t triangleCount = indices.size() / 3;
+
+  // Triangles around each vertex, as ranges of one array
+  std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+  for (uint32_t index: indices) {
+    adjacencyOffsets[index + 1] += 1;
+  }
+  for (uint32_t v = 0; v < vertexCount; ++v) {
+    adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+  }
+  std::vector<uint32_t> adjacency(indices.size());
+  std::vector<uint32_t> liveTriangles(vertexCount);
+  for (uint32_t v = 0; v < vertexCount; ++v) {
+    liveTriangles[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+  }
+  std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+  for (size_t i = 0; i < indices.size(); ++i) {
+    adjacency[fill[indices[i]]++] = i / 3;
+  }
+
+  std::vector<uint32_t> cacheTimes(vertexCount, 0);
+  uint32_t time = cacheSize + 1;
+  std::vector<bool> emitted(triangleCount, false);
+  std::vector<uint32_t> deadEnds;
+  std::vector<uint32_t> candidates;
+  uint32_t cursor = 0;
+
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+
+  int64_t fanning = 0;
+  while (fanning >= 0) {
+    candidates.clear();
+    for (
+      uint32_t i = adjacencyOffsets[fanning]; i < adjacencyOffsets[fanning + 1]; ++i
+    ) {
+      uint32_t triangle = adjacency[i];
+      if (emitted[triangle]) {
+        continue;
+      }
+      for (int c = 0; c < 3; ++c) {
+        uint32_t v = indices[3 * triangle + c];
+        result.push_back(v);
+        deadEnds.push_back(v);
+        candidates.push_back(v);
+        liveTriangles[v] -= 1;
+        if (time - cacheTimes[v] > cacheSize) {
+          cacheTimes[v] = time++;
+        }
+      }
+      emitted[triangle] = true;
+    }
+
+    // Prefer the oldest candidate still cached once its fan is emitted
+    fanning = -1;
+    int64_t bestPriority = -1;
+    for (uint32_t v: candidates) {
+      if (liveTriangles[v] == 0) {
+        continue;
+      }
+      int64_t priority = 0;
+      if (time - cacheTimes[v] + 2 * liveTriangles[v] <= cacheSize) {
+        priority = time - cacheTimes[v];
+      }
+      if (priority > bestPriority) {
+        bestPriority = priority;
+        fanning = v;
+      }
+    }
+
+    // Dead end, go back to a recent vertex, or to the next unfinished one
+    while (fanning == -1 && !deadEnds.empty()) {
+      uint32_t v = deadEnds.back();
+      deadEnds.pop_back();
+      if (liveTriangles[v] > 0) {
+        fanning = v;
+      }
+    }
+    while (fanning == -1 && cursor < vertexCount) {
+      if (liveTriangles[cursor] > 0) {
+        fanning = cursor;
+      }
+      ++cursor;
+    }
+  }
+
+  assert(result.size() == indices.size());
+  return result;
+}
+
+struct TriangleCluster {
+  size_t begin;
+  size_t end;
+  float sortKey;
+};
+
+// Splits the cache ordered triangles in clusters which, even drawn from a
+// cold cache, stay within OVERDRAW_THRESHOLD of the mesh ACMR. Drawing
+// clusters facing away from the center first hides more of the others.
+static std::vector<uint32_t> _orderClusters(
+  const std::vector<uint32_t>& indices, const Accessor& positions,
+  uint32_t cacheSize
+) {
+  size_t triangleCount = indices.size() / 3;
+  float targetAcmr = OVERDRAW_THRESHOLD * _ratio(
+    simulateVertexCache(indices, positions.count, cacheSize), triangleCount
+  );
+
+  // Where Tipsify hit a dead end every vertex misses; starting a cluster
+  // there is free
+  VertexCache orderedCache(positions.count, cacheSize);
+  VertexCache clusterCache(positions.count, cacheSize);
+  std::vector<TriangleCluster> clusters;
+  size_t clusterBegin = 0;
+  size_t clusterMisses = 0;
+  for (size_t t = 0; t < triangleCount; ++t) {
+    uint32_t misses = 0;
+    uint32_t clusterTriangleMisses = 0;
+    for (int c = 0; c < 3; ++c) {
+      misses += orderedCache.access(indices[3 * t + c]);
+      clusterTriangleMisses += clusterCache.access(indices[3 * t + c]);
+    }
+    if (misses == 3 && t > clusterBegin) {
+      clusters.push_back({ clusterBegin, t, 0 });
+      clusterBegin = t;
+      clusterMisses = 3;
+      clusterCache.flush();
+      for (int c = 0; c < 3; ++c) {
+        clusterCache.access(indices[3 * t + c]);
+      }
+      continue;
+    }
+    clusterMisses += clusterTriangleMisses;
+    if (clusterMisses <= targetAcmr * (t + 1 - clusterBegin)) {
+      clusters.push_back({ clusterBegin, t + 1, 0 });
+      clusterBegin = t + 1;
+      clusterMisses = 0;
+      clusterCache.flush();
+    }
+  }
+  if (clusterBegin < triangleCount) {
+    clusters.push_back({ clusterBegin, triangleCount, 0 });
+  }
+
+  // Area weighted centroids and normals
+  auto getPosition = [&](uint32_t index) {
+    return glm::vec3(
+      positions.getComponent(index, 0),
+      positions.getComponent(index, 1),
+      positions.getComponent(index, 2)
+    );
+  };
+  std::vector<glm::vec3> centroids(clusters.size(), glm::vec3(0));
+  std::vector<glm::vec3> normals(clusters.size(), glm::vec3(0));
+  glm::vec3 meshCentroid(0);
+  float meshArea = 0;
+  for (size_t i = 0; i < clusters.size(); ++i) {
+    float clusterArea = 0;
+    for (size_t t = clusters[i].begin; t < clusters[i].end; ++t) {
+      glm::vec3 a = getPosition(indices[3 * t]);
+      glm::vec3 b = getPosition(indices[3 * t + 1]);
+      glm::vec3 c = getPosition(indices[3 * t + 2]);
+      glm::vec3 normal = glm::cross(b - a, c - a);
+      float area = glm::length(normal);
+      centroids[i] += (a + b + c) * (area / 3);
+      normals[i] += normal;
+      clusterArea += area;
+    }
+    meshCentroid += centroids[i];
+    meshArea += clusterArea;
+    if (clusterArea > 0) {
+      centroids[i] /= clusterArea;
+    }
+  }
+  if (meshArea > 0) {
+    meshCentroid /= meshArea;
+  }
+  for (size_t i = 0; i < clusters.size(); ++i) {
+    float normalLength = glm::length(normals[i]);
+    clusters[i].sortKey = normalLength > 0
+      ? glm::dot(centroids[i] - meshCentroid, normals[i] / normalLength)
+      : 0;
+  }
+
+  std::stable_sort(
+    clusters.begin(), clusters.end(),
+    [](const TriangleCluster& a, const TriangleCluster& b) {
+      return a.sortKey > b.sortKey;
+    }
+  );
+
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+  for (const TriangleCluster& cluster: clusters) {
+    result.insert(
+      result.end(),
+      indices.begin() + 3 * cluster.begin, indices.begin() + 3 * cluster.end
+    );
+  }
+  return result;
+}
+
+// Copies the attribute in the new vertex order
+static std::unique_ptr<OwnedAccessor> _remapAttribute(
+  const Accessor& attribute, const std::vector<uint32_t>& remap,
+  uint32_t vertexCount
+) {
+  // Attributes stay 4-byte aligned, as glTF requires
+  uint32_t elementSize = attribute.getElementSize();
+  auto remapped = std::make_unique<OwnedAccessor>(
+    vertexCount, attribute.type, attribute.componentType, attribute.normalized,
+    (elementSize + 3) / 4 * 4, BufferView::TargetType::ArrayBuffer
+  );
+  remapped->accessor.min = attribute.min;
+  remapped->accessor.max = attribute.max;
+
+  for (uint32_t v = 0; v < attribute.count; ++v) {
+    if (remap[v] != UINT32_MAX) {
+      std::memcpy(
+        remapped->getElement(remap[v]), attribute.getElementData(v), elementSize
+      );
+    }
+  }
+  return remapped;
+}
+
+MeshOptimizationReport optimizeMeshPrimitives(
+  const std::vector<MeshPrimitive*>& meshPrimitives,
+  std::vector<std::unique_ptr<OwnedAccessor>>& storage
+) {
+  MeshOptimizationReport report;
+  if (meshPrimitives.empty()) {
+    return report;
+  }
+  const MeshPrimitive::Attributes attributes = meshPrimitives[0]->attributes;
+  auto positionsIt = attributes.find("POSITION");
+  if (positionsIt == attributes.end()) {
+    report.skippedPrimitives = meshPrimitives.size();
+    return report;
+  }
+  const Accessor& positions = *positionsIt->second;
+  uint32_t vertexCount = positions.count;
+  const uint32_t cacheSize = MeshOptimizationReport::CACHE_SIZE;
+
+  // Vertices can only be moved if every primitive using them is indexed
+  bool remapVertices = true;
+  std::vector<std::vector<uint32_t>> primitiveIndices(meshPrimitives.size());
+  for (size_t i = 0; i < meshPrimitives.size(); ++i) {
+    MeshPrimitive& meshPrimitive = *meshPrimitives[i];
+    assert(meshPrimitive.vaoId == 0);
+    // Reordering would break them
+    assert(meshPrimitive.lods.empty() && meshPrimitive.meshlets.empty());
+    assert(meshPrimitive.attributes == attributes);
+    if (!meshPrimitive.indices) {
+      remapVertices = false;
+      report.skippedPrimitives += 1;
+      continue;
+    }
+
+    std::vector<uint32_t>& indices = primitiveIndices[i];
+    indices = _readIndices(*meshPrimitive.indices);
+    report.indexBytesBefore += meshPrimitive.indices->getByteLength();
+    if (meshPrimitive.mode != MeshPrimitive::Mode::Triangles) {
+      report.skippedPrimitives += 1;
+      continue;
+    }
+
+    report.primitiveCount += 1;
+    report.triangleCount += indices.size() / 3;
+    report.vertexCount += _countUsedVertices(indices, vertexCount);
+    report.cacheMissesBefore += simulateVertexCache(indices, vertexCount, cacheSize);
+
+    indices = _tipsify(indices, vertexCount, cacheSize);
+    indices = _orderClusters(indices, positions, cacheSize);
+  }
+
+  // Vertices in the order the triangles first use them
+  uint32_t remappedCount = vertexCount;
+  if (remapVertices) {
+    std::vector<uint32_t> remap(vertexCount, UINT32_MAX);
+    remappedCount = 0;
+    for (std::vector<uint32_t>& indices: primitiveIndices) {
+      for (uint32_t& index: indices) {
+        if (remap[index] == UINT32_MAX) {
+          remap[index] = remappedCount++;
+        }
+        index = remap[index];
+      }
+    }
+
+    MeshPrimitive::Attributes remappedAttributes;
+    for (const auto& attribute: attributes) {
+      storage.push_back(_remapAttribute(*attribute.second, remap, remappedCount));
+      remappedAttributes[attribute.first] = &storage.back()->accessor;
+    }
+    for (MeshPrimitive* meshPrimitive: meshPrimitives) {
+      meshPrimitive->attributes = remappedAttributes;
+    }
+  }
+
+  for (size_t i = 0; i < meshPrimitives.size(); ++i) {
+    MeshPrimitive& meshPrimitive = *meshPrimitives[i];
+    if (!meshPrimitive.indices) {
+      continue;
+    }
+    const std::vector<uint32_t>& indices = primitiveIndices[i];
+    storage.push_back(createIndexAccessor(indices, remappedCount));
+    meshPrimitive.indices = &storage.back()->accessor;
+    report.indexBytesAfter += meshPrimitive.indices->getByteLength();
+    if (meshPrimitive.mode == MeshPrimitive::Mode::Triangles) {
+      report.cacheMissesAfter += simulateVertexCache(indices, remappedCount, cacheSize);
+    }
+  }
+
+  return report;
+}
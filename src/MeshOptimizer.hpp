@@ -0,0 +1,53 @@
+
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <memory>
+#include <vector>
+
+#include "Primitives.hpp"
+
+struct MeshOptimizationReport {
+  // FIFO post-transform cache simulated for the ratios
+  static constexpr uint32_t CACHE_SIZE = 16;
+
+  size_t primitiveCount = 0;
+  // Not indexed triangle lists, left as is
+  size_t skippedPrimitives = 0;
+  size_t triangleCount = 0;
+  size_t vertexCount = 0;
+  size_t cacheMissesBefore = 0;
+  size_t cacheMissesAfter = 0;
+  size_t indexBytesBefore = 0;
+  size_t indexBytesAfter = 0;
+
+  // Average cache miss ratio, transformed vertices per triangle
+  double acmrBefore() const;
+  double acmrAfter() const;
+  // Average transform to vertex ratio, 1 is optimal
+  double atvrBefore() const;
+  double atvrAfter() const;
+
+  void add(const MeshOptimizationReport& other);
+};
+
+// Transformed vertices when drawing indices in order, with a FIFO cache
+size_t simulateVertexCache(
+  const std::vector<uint32_t>& indices, uint32_t vertexCount,
+  uint32_t cacheSize = MeshOptimizationReport::CACHE_SIZE
+);
+
+// Reorders the triangles of each primitive for the post-transform cache
+// (Tipsify), then their clusters so outer surfaces are drawn first, to
+// reduce overdraw. The vertices are then stored in the order the indices
+// first reference them, dropping unused ones, and indices are narrowed
+// to 16 bits when they fit.
+// The primitives must share the same attributes, which are replaced by
+// copies appended to storage. Must run before they are loaded to the GPU,
+// and before LODs or meshlets are built.
+MeshOptimizationReport optimizeMeshPrimitives(
+  const std::vector<MeshPrimitive*>& meshPrimitives,
+  std::vector<std::unique_ptr<OwnedAccessor>>& storage
+);
+
+#endif // !MESH_OPTIMIZER_H
@@ -0,0 +1,217 @@
+
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "Meshlets.hpp"
+#include "Primitives.hpp"
+#include "Culling.hpp"
+#include "Simd.hpp"
+
+// Cones wider than this cannot be culled from anywhere useful
+static constexpr float MIN_CONE_DOT = 0.1f;
+
+static void _addMeshlet(
+  Meshlets& meshlets, const std::vector<glm::vec3>& positions,
+  const std::vector<uint32_t>& indices, uint32_t indexOffset, uint32_t indexCount
+) {
+  Aabb box;
+  glm::vec3 normalSum(0);
+  for (uint32_t i = indexOffset; i < indexOffset + indexCount; i += 3) {
+    const glm::vec3& p0 = positions[indices[i]];
+    const glm::vec3& p1 = positions[indices[i + 1]];
+    const glm::vec3& p2 = positions[indices[i + 2]];
+    box.expand(p0);
+    box.expand(p1);
+    box.expand(p2);
+
+    glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    float length = glm::length(normal);
+    if (length > 0) {
+      normalSum += normal / length;
+    }
+  }
+
+  glm::vec3 center = box.getCenter();
+  float radius = 0;
+  for (uint32_t i = indexOffset; i < indexOffset + indexCount; ++i) {
+    radius = std::max(radius, glm::length(positions[indices[i]] - center));
+  }
+
+  // Degenerate triangles have no facing, they do not widen the cone
+  float normalLength = glm::length(normalSum);
+  glm::vec3 axis = normalLength > 0 ? normalSum / normalLength : glm::vec3(0);
+  float minDot = normalLength > 0 ? 1 : -1;
+  for (uint32_t i = indexOffset; normalLength > 0 && i < indexOffset + indexCount; i += 3) {
+    const glm::vec3& p0 = positions[indices[i]];
+    glm::vec3 normal = glm::cross(
+      positions[indices[i + 1]] - p0, positions[indices[i + 2]] - p0
+    );
+    float length = glm::length(normal);
+    if (length > 0) {
+      minDot = std::min(minDot, glm::dot(axis, normal) / length);
+    }
+  }
+
+  meshlets.indexOffsets.push_back(indexOffset);
+  meshlets.indexCounts.push_back(indexCount);
+  meshlets.centerX.push_back(center.x);
+  meshlets.centerY.push_back(center.y);
+  meshlets.centerZ.push_back(center.z);
+  meshlets.radius.push_back(radius);
+  meshlets.axisX.push_back(axis.x);
+  meshlets.axisY.push_back(axis.y);
+  meshlets.axisZ.push_back(axis.z);
+  meshlets.cutoff.push_back(
+    minDot > MIN_CONE_DOT ? std::sqrt(1 - minDot * minDot) : 1
+  );
+}
+
+Meshlets buildMeshlets(const MeshPrimitive& meshPrimitive) {
+  Meshlets meshlets;
+  if (
+    !meshPrimitive.indices
+    || meshPrimitive.mode != MeshPrimitive::Mode::Triangles
+  ) {
+    return meshlets;
+  }
+
+  // Bounds are in object space, also when quantized
+  const Accessor& positionAccessor = *meshPrimitive.attributes.at("POSITION");
+  std::vector<glm::vec3> positions(positionAccessor.count);
+  for (uint32_t v = 0; v < positionAccessor.count; ++v) {
+    glm::vec3 position(
+      positionAccessor.getComponent(v, 0),
+      positionAccessor.getComponent(v, 1),
+      positionAccessor.getComponent(v, 2)
+    );
+    positions[v] = (
+      position * meshPrimitive.positionScale + meshPrimitive.positionOffset
+    );
+  }
+
+  const Accessor& indexAccessor = *meshPrimitive.indices;
+  std::vector<uint32_t> indices(indexAccessor.count);
+  for (uint32_t i = 0; i < indexAccessor.count; ++i) {
+    indices[i] = indexAccessor.getIndex(i);
+  }
+
+  // Meshlet that last used each vertex, to count the unique ones
+  std::vector<uint32_t> vertexMeshlet(positions.size(), UINT32_MAX);
+  uint32_t meshletStart = 0;
+  uint32_t meshletVertices = 0;
+  for (uint32_t i = 0; i + 2 < indices.size(); i += 3) {
+    uint32_t meshletIndex = meshlets.size();
+    uint32_t newVertices = 0;
+    for (uint32_t k = 0; k < 3; ++k) {
+      // A vertex repeated in the triangle is only new once
+      uint32_t v = indices[i + k];
+      bool seen = (
+        vertexMeshlet[v] == meshletIndex
+        || (k > 0 && v == indices[i]) || (k > 1 && v == indices[i + 1])
+      );
+      newVertices += !seen;
+    }
+
+    if (
+      (i - meshletStart) / 3 == Meshlets::MAX_TRIANGLES
+      || meshletVertices + newVertices > Meshlets::MAX_VERTICES
+    ) {
+      _addMeshlet(meshlets, positions, indices, meshletStart, i - meshletStart);
+      meshletIndex++;
+      meshletStart = i;
+      meshletVertices = 0;
+    }
+
+    for (uint32_t k = 0; k < 3; ++k) {
+      if (vertexMeshlet[indices[i + k]] != meshletIndex) {
+        vertexMeshlet[indices[i + k]] = meshletIndex;
+        meshletVertices++;
+      }
+    }
+  }
+  uint32_t triangleEnd = indices.size() / 3 * 3;
+  if (triangleEnd > meshletStart) {
+    _addMeshlet(meshlets, positions, indices, meshletStart, triangleEnd - meshletStart);
+  }
+
+  // Padding lanes are tested, their results ignored
+  size_t paddedCount = simd::roundUp(meshlets.size());
+  for (std::vector<float>* stream: {
+    &meshlets.centerX, &meshlets.centerY, &meshlets.centerZ, &meshlets.radius,
+    &meshlets.axisX, &meshlets.axisY, &meshlets.axisZ
+  }) {
+    stream->resize(paddedCount, 0);
+  }
+  meshlets.cutoff.resize(paddedCount, 1);
+  return meshlets;
+}
+
+uint32_t cullMeshlets(
+  const Meshlets& meshlets,
+  const Frustum& frustum, const glm::vec3& cameraPosition, bool cullBackfaces,
+  std::vector<uint8_t>& visible
+) {
+  uint32_t count = meshlets.size();
+  visible.resize(count);
+
+  const simd::Float zero = simd::set1(0);
+  const simd::Float cameraX = simd::set1(cameraPosition.x);
+  const simd::Float cameraY = simd::set1(cameraPosition.y);
+  const simd::Float cameraZ = simd::set1(cameraPosition.z);
+
+  uint32_t culledCount = 0;
+  for (uint32_t i = 0; i < count; i += simd::WIDTH) {
+    simd::Float x = simd::load(meshlets.centerX.data() + i);
+    simd::Float y = simd::load(meshlets.centerY.data() + i);
+    simd::Float z = simd::load(meshlets.centerZ.data() + i);
+    simd::Float radius = simd::load(meshlets.radius.data() + i);
+
+    // Spheres entirely behind a plane
+    simd::Float culled = zero;
+    for (int p = 0; p < Frustum::PLANE_COUNT; ++p) {
+      simd::Float distance = simd::add(
+        simd::add(
+          simd::mul(simd::set1(frustum.nx[p]), x),
+          simd::mul(simd::set1(frustum.ny[p]), y)
+        ),
+        simd::add(
+          simd::mul(simd::set1(frustum.nz[p]), z),
+          simd::set1(frustum.d[p])
+        )
+      );
+      culled = simd::bitOr(
+        culled, simd::lessThan(simd::add(distance, radius), zero)
+      );
+    }
+
+    // The camera is behind every triangle when it sees the sphere within
+    // the cone of directions opposite to all their normals
+    if (cullBackfaces) {
+      simd::Float dx = simd::sub(x, cameraX);
+      simd::Float dy = simd::sub(y, cameraY);
+      simd::Float dz = simd::sub(z, cameraZ);
+      simd::Float distance = simd::sqrt(simd::add(
+        simd::add(simd::mul(dx, dx), simd::mul(dy, dy)), simd::mul(dz, dz)
+      ));
+      simd::Float alignment = simd::add(
+        simd::add(
+          simd::mul(dx, simd::load(meshlets.axisX.data() + i)),
+          simd::mul(dy, simd::load(meshlets.axisY.data() + i))
+        ),
+        simd::mul(dz, simd::load(meshlets.axisZ.data() + i))
+      );
+      simd::Float threshold = simd::add(
+        simd::mul(simd::load(meshlets.cutoff.data() + i), distance), radius
+      );
+      culled = simd::bitOr(culled, simd::lessThan(threshold, alignment));
+    }
+
+    int culledMask = simd::mask(culled);
+    for (uint32_t lane = 0; lane < (uint32_t)simd::WIDTH && i + lane < count; ++lane) {
+      bool isCulled = (culledMask >> lane) & 1;
+      visible[i + lane] = !isCulled;
+      culledCount += isCulled;
+    }
+  }
+  return culledCount;
+}
@@ -0,0 +1,59 @@
+
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include <cstdint>
+#include <vector>
+#include <glm/vec3.hpp>
+
+struct MeshPrimitive;
+struct Frustum;
+
+// Runs of consecutive triangles of a primitive's indices, with the bounds
+// needed to cull them. Stored as structure of arrays, padded to the SIMD
+// width, so whole groups are tested at once.
+struct Meshlets {
+  static constexpr uint32_t MAX_VERTICES = 64;
+  static constexpr uint32_t MAX_TRIANGLES = 124;
+
+  // Range of each meshlet in MeshPrimitive::indices, in indices
+  std::vector<uint32_t> indexOffsets;
+  std::vector<uint32_t> indexCounts;
+
+  // Object space bounding spheres
+  std::vector<float> centerX;
+  std::vector<float> centerY;
+  std::vector<float> centerZ;
+  std::vector<float> radius;
+
+  // Normal cones, the sine of the angle between the axis and the most
+  // deviating normal; 1 when the triangles can never all face away
+  std::vector<float> axisX;
+  std::vector<float> axisY;
+  std::vector<float> axisZ;
+  std::vector<float> cutoff;
+
+  uint32_t size() const {
+    return indexOffsets.size();
+  }
+  bool empty() const {
+    return indexOffsets.empty();
+  }
+};
+
+// Splits the indexed triangle list in meshlets, in the order of its
+// triangles, so meshlets are as coherent as that order is; run it after
+// the mesh optimizer. Other primitives get none.
+Meshlets buildMeshlets(const MeshPrimitive& meshPrimitive);
+
+// Flags the meshlets outside the frustum, or whose triangles all face
+// away from the camera when backfaces are culled, as not visible. The
+// frustum and camera are in the object space of the primitive; the cone
+// test only holds without non-uniform scale. Returns the number culled.
+uint32_t cullMeshlets(
+  const Meshlets& meshlets,
+  const Frustum& frustum, const glm::vec3& cameraPosition, bool cullBackfaces,
+  std::vector<uint8_t>& visible
+);
+
+#endif // !MESHLETS_H
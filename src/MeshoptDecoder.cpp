@@ -0,0 +1,481 @@
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "MeshoptDecoder.hpp"
+
+// Bitstreams as specified by EXT_meshopt_compression: version 0 of the
+// attribute codec, versions 0 and 1 of the index codecs
+
+static constexpr uint8_t ATTRIBUTES_HEADER = 0xa0;
+static constexpr uint8_t TRIANGLES_HEADER = 0xe0;
+static constexpr uint8_t INDICES_HEADER = 0xd0;
+
+static constexpr uint32_t BYTE_GROUP_SIZE = 16;
+static constexpr uint32_t VERTEX_BLOCK_SIZE_BYTES = 8192;
+static constexpr uint32_t VERTEX_BLOCK_MAX_SIZE = 256;
+// Holds the first vertex, padded so the decoder may read past the data
+static constexpr uint32_t TAIL_MIN_SIZE = 32;
+
+std::optional<MeshoptCompression> MeshoptCompression::fromJson(
+  const nlohmann::json& extensionsAndExtras
+) {
+  auto extensions = extensionsAndExtras.find("extensions");
+  if (extensions == extensionsAndExtras.end()) {
+    return std::nullopt;
+  }
+  auto extension = extensions->find("EXT_meshopt_compression");
+  if (extension == extensions->end()) {
+    return std::nullopt;
+  }
+
+  MeshoptCompression compression;
+  compression.buffer = extension->value("buffer", 0u);
+  compression.byteOffset = extension->value("byteOffset", 0u);
+  compression.byteLength = extension->value("byteLength", 0u);
+  compression.byteStride = extension->value("byteStride", 0u);
+  compression.count = extension->value("count", 0u);
+
+  std::string mode = extension->value("mode", "");
+  if (mode == "ATTRIBUTES") {
+    compression.mode = Mode::Attributes;
+  }
+  else if (mode == "TRIANGLES") {
+    compression.mode = Mode::Triangles;
+  }
+  else if (mode == "INDICES") {
+    compression.mode = Mode::Indices;
+  }
+  else {
+    return std::nullopt;
+  }
+
+  std::string filter = extension->value("filter", "NONE");
+  if (filter == "NONE") {
+    compression.filter = Filter::None;
+  }
+  else if (filter == "OCTAHEDRAL") {
+    compression.filter = Filter::Octahedral;
+  }
+  else if (filter == "QUATERNION") {
+    compression.filter = Filter::Quaternion;
+  }
+  else if (filter == "EXPONENTIAL") {
+    compression.filter = Filter::Exponential;
+  }
+  else {
+    return std::nullopt;
+  }
+  return compression;
+}
+
+// Groups of 16 bytes stored with 0, 2, 4 or 8 bits each, the largest
+// value of 2 and 4 bits meaning the byte follows the packed ones
+static const uint8_t* _decodeBytes(
+  const uint8_t* data, const uint8_t* end, uint8_t* buffer, uint32_t size
+) {
+  size_t headerSize = (size / BYTE_GROUP_SIZE + 3) / 4;
+  if ((size_t)(end - data) < headerSize) {
+    return nullptr;
+  }
+  const uint8_t* header = data;
+  data += headerSize;
+
+  for (uint32_t group = 0; group < size / BYTE_GROUP_SIZE; ++group) {
+    uint32_t bitsLog2 = (header[group / 4] >> (group % 4 * 2)) & 3;
+    uint8_t* output = buffer + group * BYTE_GROUP_SIZE;
+
+    if (bitsLog2 == 0) {
+      memset(output, 0, BYTE_GROUP_SIZE);
+      continue;
+    }
+    if (bitsLog2 == 3) {
+      if ((size_t)(end - data) < BYTE_GROUP_SIZE) {
+        return nullptr;
+      }
+      memcpy(output, data, BYTE_GROUP_SIZE);
+      data += BYTE_GROUP_SIZE;
+      continue;
+    }
+
+    uint32_t bits = 1 << bitsLog2;
+    uint32_t packedSize = BYTE_GROUP_SIZE * bits / 8;
+    if ((size_t)(end - data) < packedSize) {
+      return nullptr;
+    }
+    uint8_t escape = (1 << bits) - 1;
+    const uint8_t* extra = data + packedSize;
+    // Most significant bits first
+    for (uint32_t i = 0; i < BYTE_GROUP_SIZE; ++i) {
+      uint32_t bitOffset = i * bits;
+      uint8_t value = (data[bitOffset / 8] >> (8 - bits - bitOffset % 8)) & escape;
+      if (value == escape) {
+        if (extra == end) {
+          return nullptr;
+        }
+        value = *extra++;
+      }
+      output[i] = value;
+    }
+    data = extra;
+  }
+  return data;
+}
+
+// Each byte of a vertex is stored as a column of zigzag deltas to the
+// same byte of the previous vertex
+static bool _decodeAttributes(
+  const uint8_t* data, size_t size, uint32_t count, uint32_t stride,
+  uint8_t* destination
+) {
+  if (stride == 0 || stride > 256 || stride % 4 != 0) {
+    return false;
+  }
+  size_t tailSize = std::max(stride, TAIL_MIN_SIZE);
+  if (size < 1 + tailSize || data[0] != ATTRIBUTES_HEADER) {
+    return false;
+  }
+  const uint8_t* end = data + size;
+  data++;
+
+  uint8_t lastVertex[256];
+  memcpy(lastVertex, end - stride, stride);
+
+  uint32_t blockSize = std::min(
+    (VERTEX_BLOCK_SIZE_BYTES / stride) & ~(BYTE_GROUP_SIZE - 1),
+    VERTEX_BLOCK_MAX_SIZE
+  );
+  uint8_t deltas[VERTEX_BLOCK_MAX_SIZE];
+  for (uint32_t first = 0; first < count; first += blockSize) {
+    uint32_t blockCount = std::min(blockSize, count - first);
+    uint32_t alignedCount = (blockCount + BYTE_GROUP_SIZE - 1) & ~(BYTE_GROUP_SIZE - 1);
+
+    for (uint32_t k = 0; k < stride; ++k) {
+      data = _decodeBytes(data, end, deltas, alignedCount);
+      if (!data) {
+        return false;
+      }
+
+      uint8_t value = lastVertex[k];
+      for (uint32_t i = 0; i < blockCount; ++i) {
+        uint8_t delta = deltas[i];
+        value += (delta >> 1) ^ -(delta & 1);
+        destination[(first + i) * stride + k] = value;
+      }
+      lastVertex[k] = value;
+    }
+  }
+  return (size_t)(end - data) == tailSize;
+}
+
+static uint32_t _decodeVByte(const uint8_t*& data) {
+  uint32_t lead = *data++;
+  if (lead < 128) {
+    return lead;
+  }
+
+  uint32_t result = lead & 127;
+  uint32_t shift = 7;
+  for (int i = 0; i < 4; ++i) {
+    uint32_t group = *data++;
+    result |= (group & 127) << shift;
+    shift += 7;
+    if (group < 128) {
+      break;
+    }
+  }
+  return result;
+}
+
+// Zigzag delta to the previous free index
+static uint32_t _decodeIndex(const uint8_t*& data, uint32_t last) {
+  uint32_t v = _decodeVByte(data);
+  return last + ((v >> 1) ^ -(v & 1));
+}
+
+static void _writeIndex(uint8_t* destination, uint32_t i, uint32_t indexSize, uint32_t index) {
+  if (indexSize == 2) {
+    uint16_t value = index;
+    memcpy(destination + 2 * i, &value, 2);
+  }
+  else {
+    memcpy(destination + 4 * i, &index, 4);
+  }
+}
+
+struct IndexFifos {
+  uint32_t edges[16][2];
+  uint32_t vertices[16];
+  uint32_t edgeOffset = 0;
+  uint32_t vertexOffset = 0;
+
+  IndexFifos() {
+    memset(edges, -1, sizeof(edges));
+    memset(vertices, -1, sizeof(vertices));
+  }
+
+  void pushEdge(uint32_t a, uint32_t b) {
+    edges[edgeOffset][0] = a;
+    edges[edgeOffset][1] = b;
+    edgeOffset = (edgeOffset + 1) & 15;
+  }
+  void pushVertex(uint32_t v, bool advance = true) {
+    vertices[vertexOffset] = v;
+    vertexOffset = (vertexOffset + advance) & 15;
+  }
+};
+
+// Triangles reuse edges and vertices of recent ones through two FIFOs,
+// new vertices are mostly the next unseen index
+static bool _decodeTriangles(
+  const uint8_t* buffer, size_t size, uint32_t count, uint32_t indexSize,
+  uint8_t* destination
+) {
+  // Header, a code per triangle and the 16 byte auxiliary code table
+  if (count % 3 != 0 || size < 1 + count / 3 + 16) {
+    return false;
+  }
+  if ((buffer[0] & 0xf0) != TRIANGLES_HEADER || (buffer[0] & 0x0f) > 1) {
+    return false;
+  }
+  uint32_t maxReusedVertex = (buffer[0] & 0x0f) >= 1 ? 13 : 15;
+
+  IndexFifos fifos;
+  uint32_t next = 0;
+  uint32_t last = 0;
+
+  const uint8_t* code = buffer + 1;
+  const uint8_t* data = code + count / 3;
+  // A triangle reads at most 16 bytes, the table keeps them in bounds
+  const uint8_t* dataEnd = buffer + size - 16;
+  const uint8_t* codeTable = dataEnd;
+
+  for (uint32_t i = 0; i < count; i += 3) {
+    if (data > dataEnd) {
+      return false;
+    }
+    uint8_t triangleCode = *code++;
+
+    if (triangleCode < 0xf0) {
+      // Edge from the FIFO, third vertex new, from the FIFO, or free
+      const uint32_t* edge = fifos.edges[(fifos.edgeOffset - 1 - (triangleCode >> 4)) & 15];
+      uint32_t a = edge[0];
+      uint32_t b = edge[1];
+      uint32_t vertexCode = triangleCode & 15;
+      uint32_t c;
+      bool advance = true;
+      if (vertexCode == 0) {
+        c = next++;
+      }
+      else if (vertexCode < maxReusedVertex) {
+        c = fifos.vertices[(fifos.vertexOffset - 1 - vertexCode) & 15];
+        advance = false;
+      }
+      else {
+        // 13 and 14 are the previous free index -1 and +1
+        last = c = vertexCode != 15
+          ? last + (vertexCode == 13 ? -1 : 1)
+          : _decodeIndex(data, last);
+      }
+      _writeIndex(destination, i, indexSize, a);
+      _writeIndex(destination, i + 1, indexSize, b);
+      _writeIndex(destination, i + 2, indexSize, c);
+      fifos.pushVertex(c, advance);
+      fifos.pushEdge(c, b);
+      fifos.pushEdge(a, c);
+      continue;
+    }
+
+    // No shared edge: first vertex new or free, the others coded in a
+    // table entry or a byte of their own
+    uint32_t codeA;
+    uint32_t codeB;
+    uint32_t codeC;
+    if (triangleCode < 0xfe) {
+      uint8_t auxCode = codeTable[triangleCode & 15];
+      codeA = 0;
+      codeB = auxCode >> 4;
+      codeC = auxCode & 15;
+    }
+    else {
+      uint8_t auxCode = *data++;
+      // A zero byte restarts the new indices
+      if (auxCode == 0) {
+        next = 0;
+      }
+      codeA = triangleCode == 0xfe ? 0 : 15;
+      codeB = auxCode >> 4;
+      codeC = auxCode & 15;
+    }
+
+    // New indices are taken before free ones are decoded
+    uint32_t a = codeA == 0 ? next++ : 0;
+    uint32_t b = codeB == 0 ? next++ : fifos.vertices[(fifos.vertexOffset - codeB) & 15];
+    uint32_t c = codeC == 0 ? next++ : fifos.vertices[(fifos.vertexOffset - codeC) & 15];
+    if (codeA == 15) {
+      last = a = _decodeIndex(data, last);
+    }
+    if (codeB == 15) {
+      last = b = _decodeIndex(data, last);
+    }
+    if (codeC == 15) {
+      last = c = _decodeIndex(data, last);
+    }
+    _writeIndex(destination, i, indexSize, a);
+    _writeIndex(destination, i + 1, indexSize, b);
+    _writeIndex(destination, i + 2, indexSize, c);
+    fifos.pushVertex(a);
+    fifos.pushVertex(b, codeB == 0 || codeB == 15);
+    fifos.pushVertex(c, codeC == 0 || codeC == 15);
+    fifos.pushEdge(b, a);
+    fifos.pushEdge(c, b);
+    fifos.pushEdge(a, c);
+  }
+  return data == dataEnd;
+}
+
+// Zigzag deltas to either of the two previous indices
+static bool _decodeIndices(
+  const uint8_t* buffer, size_t size, uint32_t count, uint32_t indexSize,
+  uint8_t* destination
+) {
+  // Header, a byte per index at least and a 4 byte tail
+  if (size < 1 + (size_t)count + 4) {
+    return false;
+  }
+  if ((buffer[0] & 0xf0) != INDICES_HEADER || (buffer[0] & 0x0f) > 1) {
+    return false;
+  }
+
+  const uint8_t* data = buffer + 1;
+  const uint8_t* dataEnd = buffer + size - 4;
+  uint32_t last[2] = { 0, 0 };
+  for (uint32_t i = 0; i < count; ++i) {
+    if (data >= dataEnd) {
+      return false;
+    }
+    uint32_t v = _decodeVByte(data);
+    uint32_t baseline = v & 1;
+    v >>= 1;
+    last[baseline] += (v >> 1) ^ -(v & 1);
+    _writeIndex(destination, i, indexSize, last[baseline]);
+  }
+  return data == dataEnd;
+}
+
+template <typename T>
+static T _roundTo(float value) {
+  return (T)(value + (value >= 0 ? 0.5f : -0.5f));
+}
+
+// Normals and tangents: x, y in octahedral form, z holding one
+template <typename T>
+static void _octahedralFilter(uint8_t* data, uint32_t count) {
+  const float maxValue = (1 << (sizeof(T) * 8 - 1)) - 1;
+  for (uint32_t i = 0; i < count; ++i) {
+    T components[4];
+    memcpy(components, data + i * sizeof(components), sizeof(components));
+    float x = components[0];
+    float y = components[1];
+    float z = components[2] - std::abs(x) - std::abs(y);
+    float fold = std::min(z, 0.0f);
+    x += x >= 0 ? fold : -fold;
+    y += y >= 0 ? fold : -fold;
+
+    float scale = maxValue / std::sqrt(x * x + y * y + z * z);
+    components[0] = _roundTo<T>(x * scale);
+    components[1] = _roundTo<T>(y * scale);
+    components[2] = _roundTo<T>(z * scale);
+    memcpy(data + i * sizeof(components), components, sizeof(components));
+  }
+}
+
+// Three smallest components, the fourth holding the index of the largest
+// and the scale
+static void _quaternionFilter(uint8_t* data, uint32_t count) {
+  const float range = 1 / std::sqrt(2.0f);
+  for (uint32_t i = 0; i < count; ++i) {
+    int16_t components[4];
+    memcpy(components, data + i * sizeof(components), sizeof(components));
+    float scale = range / (components[3] | 3);
+    float x = components[0] * scale;
+    float y = components[1] * scale;
+    float z = components[2] * scale;
+    float w = std::sqrt(std::max(1 - x * x - y * y - z * z, 0.0f));
+
+    uint32_t largest = components[3] & 3;
+    components[(largest + 1) & 3] = _roundTo<int16_t>(x * 32767);
+    components[(largest + 2) & 3] = _roundTo<int16_t>(y * 32767);
+    components[(largest + 3) & 3] = _roundTo<int16_t>(z * 32767);
+    components[largest] = _roundTo<int16_t>(w * 32767);
+    memcpy(data + i * sizeof(components), components, sizeof(components));
+  }
+}
+
+// 8 bits of exponent and 24 of mantissa, both signed, to floats
+static void _exponentialFilter(uint8_t* data, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    int32_t encoded;
+    memcpy(&encoded, data + 4 * i, 4);
+    int32_t exponent = encoded >> 24;
+    int32_t mantissa = (int32_t)((uint32_t)encoded << 8) >> 8;
+    float value = std::ldexp((float)mantissa, exponent);
+    memcpy(data + 4 * i, &value, 4);
+  }
+}
+
+bool decodeMeshopt(
+  const MeshoptCompression& compression,
+  const uint8_t* source, std::vector<uint8_t>& destination
+) {
+  uint32_t stride = compression.byteStride;
+  uint32_t count = compression.count;
+  destination.resize((size_t)count * stride);
+
+  switch (compression.mode) {
+    case MeshoptCompression::Mode::Attributes: {
+      if (!_decodeAttributes(source, compression.byteLength, count, stride, destination.data())) {
+        return false;
+      }
+      break;
+    }
+    case MeshoptCompression::Mode::Triangles: {
+      return (stride == 2 || stride == 4) && compression.filter == MeshoptCompression::Filter::None
+        && _decodeTriangles(source, compression.byteLength, count, stride, destination.data());
+    }
+    case MeshoptCompression::Mode::Indices: {
+      return (stride == 2 || stride == 4) && compression.filter == MeshoptCompression::Filter::None
+        && _decodeIndices(source, compression.byteLength, count, stride, destination.data());
+    }
+  }
+
+  switch (compression.filter) {
+    case MeshoptCompression::Filter::None: {
+      return true;
+    }
+    case MeshoptCompression::Filter::Octahedral: {
+      if (stride == 4) {
+        _octahedralFilter<int8_t>(destination.data(), count);
+        return true;
+      }
+      if (stride == 8) {
+        _octahedralFilter<int16_t>(destination.data(), count);
+        return true;
+      }
+      return false;
+    }
+    case MeshoptCompression::Filter::Quaternion: {
+      if (stride != 8) {
+        return false;
+      }
+      _quaternionFilter(destination.data(), count);
+      return true;
+    }
+    case MeshoptCompression::Filter::Exponential: {
+      _exponentialFilter(destination.data(), count * stride / 4);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,39 @@
+
+#ifndef MESHOPT_DECODER_H
+#define MESHOPT_DECODER_H
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+// EXT_meshopt_compression properties of a buffer view. The view itself
+// describes the decoded data, which is count * byteStride bytes long.
+struct MeshoptCompression {
+  enum class Mode { Attributes, Triangles, Indices };
+  enum class Filter { None, Octahedral, Quaternion, Exponential };
+
+  // Where the compressed data is
+  uint32_t buffer = 0;
+  uint32_t byteOffset = 0;
+  uint32_t byteLength = 0;
+
+  uint32_t byteStride = 0;
+  uint32_t count = 0;
+  Mode mode = Mode::Attributes;
+  Filter filter = Filter::None;
+
+  // From the extensionsAndExtras of a buffer view, empty without the
+  // extension or when it is malformed
+  static std::optional<MeshoptCompression> fromJson(const nlohmann::json& extensionsAndExtras);
+};
+
+// Decodes the bitstream and applies the filter into destination, which
+// is resized to count * byteStride. Returns false on malformed data.
+// Thread safe.
+bool decodeMeshopt(
+  const MeshoptCompression& compression,
+  const uint8_t* source, std::vector<uint8_t>& destination
+);
+
+#endif // !MESHOPT_DECODER_H
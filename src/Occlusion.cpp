@@ -0,0 +1,417 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "Occlusion.hpp"
+#include "Primitives.hpp"
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+// Occluder triangles per unit of work of the setup
+static constexpr uint32_t TRIANGLE_GRAIN = 1024;
+// Boxes per unit of work of a test
+static constexpr uint32_t BOX_GRAIN = 256;
+// Texels a tested rectangle may span on each axis of its level
+static constexpr int MAX_TEST_SPAN = 4;
+
+static_assert(OcclusionBuffer::TILE_WIDTH % simd::WIDTH == 0, "Tiles are whole registers");
+
+OccluderMesh buildOccluderMesh(
+  const MeshPrimitive& meshPrimitive, float maxError
+) {
+  OccluderMesh occluderMesh;
+  auto positionIt = meshPrimitive.attributes.find("POSITION");
+  if (
+    positionIt == meshPrimitive.attributes.end()
+    || meshPrimitive.mode != MeshPrimitive::Mode::Triangles
+  ) {
+    return occluderMesh;
+  }
+
+  uint32_t lod = 0;
+  while (lod < meshPrimitive.lods.size() && meshPrimitive.lods[lod].error <= maxError) {
+    lod++;
+  }
+  const Accessor& positions = *positionIt->second;
+  const Accessor* indices = meshPrimitive.getLodIndices(lod);
+  uint32_t vertexCount = (indices ? indices->count : positions.count) / 3 * 3;
+  occluderMesh.vertices.resize(vertexCount);
+  for (uint32_t i = 0; i < vertexCount; ++i) {
+    uint32_t vertex = indices ? indices->getIndex(i) : i;
+    glm::vec3 position(
+      positions.getComponent(vertex, 0),
+      positions.getComponent(vertex, 1),
+      positions.getComponent(vertex, 2)
+    );
+    occluderMesh.vertices[i] = (
+      position * meshPrimitive.positionScale + meshPrimitive.positionOffset
+    );
+  }
+  return occluderMesh;
+}
+
+OcclusionBuffer::OcclusionBuffer(uint32_t width, uint32_t height) {
+  m_tilesX = std::max(1u, (width + TILE_WIDTH - 1) / TILE_WIDTH);
+  m_tilesY = std::max(1u, (height + TILE_HEIGHT - 1) / TILE_HEIGHT);
+  m_width = m_tilesX * TILE_WIDTH;
+  m_height = m_tilesY * TILE_HEIGHT;
+
+  uint32_t levelWidth = m_width;
+  uint32_t levelHeight = m_height;
+  while (true) {
+    m_levels.emplace_back(levelWidth * levelHeight, 1.0f);
+    m_levelWidths.push_back(levelWidth);
+    m_levelHeights.push_back(levelHeight);
+    if (levelWidth == 1 && levelHeight == 1) {
+      break;
+    }
+    levelWidth = (levelWidth + 1) / 2;
+    levelHeight = (levelHeight + 1) / 2;
+  }
+}
+
+uint32_t OcclusionBuffer::getWidth() const {
+  return m_width;
+}
+
+uint32_t OcclusionBuffer::getHeight() const {
+  return m_height;
+}
+
+void OcclusionBuffer::begin(const glm::mat4& viewProjection) {
+  m_viewProjection = viewProjection;
+  m_occluders.clear();
+  m_stats = OcclusionStats {};
+}
+
+void OcclusionBuffer::addOccluder(const OccluderMesh& mesh, const glm::mat4& model) {
+  if (mesh.empty()) {
+    return;
+  }
+  m_occluders.push_back(Occluder { &mesh, m_viewProjection * model });
+  m_stats.occluderCount++;
+  m_stats.occluderTriangles += mesh.vertices.size() / 3;
+}
+
+void OcclusionBuffer::rasterize(ThreadPool* threadPool) {
+  auto start = std::chrono::steady_clock::now();
+
+  uint32_t threadCount = threadPool ? threadPool->getThreadCount() : 1;
+  m_threadBins.resize(std::max<size_t>(m_threadBins.size(), threadCount));
+  for (ThreadBins& bins: m_threadBins) {
+    bins.triangles.clear();
+    bins.tiles.resize(m_tilesX * m_tilesY);
+    for (std::vector<uint32_t>& tile: bins.tiles) {
+      tile.clear();
+    }
+  }
+
+  // Large occluders are split, so their setup spreads over the threads
+  struct SetupJob {
+    uint32_t occluder;
+    uint32_t begin;
+    uint32_t end;
+  };
+  thread_local std::vector<SetupJob> threadJobs;
+  std::vector<SetupJob>& jobs = threadJobs;
+  jobs.clear();
+  for (uint32_t i = 0; i < m_occluders.size(); ++i) {
+    uint32_t triangleCount = m_occluders[i].mesh->vertices.size() / 3;
+    for (uint32_t begin = 0; begin < triangleCount; begin += TRIANGLE_GRAIN) {
+      jobs.push_back(SetupJob { i, begin, std::min(begin + TRIANGLE_GRAIN, triangleCount) });
+    }
+  }
+  parallelFor(threadPool, jobs.size(), [&](uint32_t job, uint32_t thread) {
+    this->setupTriangles(m_occluders[jobs[job].occluder], jobs[job].begin, jobs[job].end, m_threadBins[thread]);
+  });
+  for (const ThreadBins& bins: m_threadBins) {
+    m_stats.rasterizedTriangles += bins.triangles.size();
+  }
+
+  parallelFor(threadPool, m_tilesX * m_tilesY, [&](uint32_t tile, uint32_t) {
+    this->rasterizeTile(tile);
+  });
+  this->buildPyramid();
+
+  m_stats.rasterizeMs += std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+}
+
+void OcclusionBuffer::setupTriangles(
+  const Occluder& occluder, uint32_t begin, uint32_t end, ThreadBins& bins
+) const {
+  // Clip space vertices of the range, projected a register at a time
+  thread_local std::vector<float> threadClip[4];
+  std::vector<float>* clip = threadClip;
+  const std::vector<glm::vec3>& vertices = occluder.mesh->vertices;
+  uint32_t vertexBegin = 3 * begin;
+  uint32_t vertexCount = 3 * (end - begin);
+  for (int row = 0; row < 4; ++row) {
+    clip[row].resize(simd::roundUp(vertexCount));
+  }
+  for (uint32_t v = 0; v < vertexCount; ++v) {
+    clip[0][v] = vertices[vertexBegin + v].x;
+    clip[1][v] = vertices[vertexBegin + v].y;
+    clip[2][v] = vertices[vertexBegin + v].z;
+  }
+  const glm::mat4& m = occluder.modelViewProjection;
+  for (uint32_t v = 0; v < vertexCount; v += simd::WIDTH) {
+    simd::Float x = simd::load(clip[0].data() + v);
+    simd::Float y = simd::load(clip[1].data() + v);
+    simd::Float z = simd::load(clip[2].data() + v);
+    simd::Float rows[4];
+    for (int row = 0; row < 4; ++row) {
+      rows[row] = simd::add(
+        simd::add(simd::mul(simd::set1(m[0][row]), x), simd::mul(simd::set1(m[1][row]), y)),
+        simd::add(simd::mul(simd::set1(m[2][row]), z), simd::set1(m[3][row]))
+      );
+    }
+    for (int row = 0; row < 4; ++row) {
+      simd::store(clip[row].data() + v, rows[row]);
+    }
+  }
+
+  for (uint32_t t = 0; t < end - begin; ++t) {
+    float x[3];
+    float y[3];
+    float z[3];
+    bool clipped = false;
+    for (int k = 0; k < 3; ++k) {
+      uint32_t v = 3 * t + k;
+      float w = clip[3][v];
+      // Behind the near plane, the projection no longer holds
+      if (w <= 0 || clip[2][v] < -w) {
+        clipped = true;
+        break;
+      }
+      float inverseW = 1 / w;
+      x[k] = (clip[0][v] * inverseW * 0.5f + 0.5f) * m_width;
+      y[k] = (clip[1][v] * inverseW * 0.5f + 0.5f) * m_height;
+      z[k] = clip[2][v] * inverseW * 0.5f + 0.5f;
+    }
+    if (clipped) {
+      continue;
+    }
+
+    // Pixels whose center is in the bounding rectangle
+    ScreenTriangle triangle;
+    triangle.minX = std::max(0, (int)std::ceil(std::min({ x[0], x[1], x[2] }) - 0.5f));
+    triangle.minY = std::max(0, (int)std::ceil(std::min({ y[0], y[1], y[2] }) - 0.5f));
+    triangle.maxX = std::min((int)m_width - 1, (int)std::floor(std::max({ x[0], x[1], x[2] }) - 0.5f));
+    triangle.maxY = std::min((int)m_height - 1, (int)std::floor(std::max({ y[0], y[1], y[2] }) - 0.5f));
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (
+      triangle.minX > triangle.maxX || triangle.minY > triangle.maxY
+      || area == 0 || std::min({ z[0], z[1], z[2] }) > 1
+    ) {
+      continue;
+    }
+
+    // Both windings are occluders, edges are flipped to be positive
+    // inside either way
+    float sign = area > 0 ? 1.0f : -1.0f;
+    for (int k = 0; k < 3; ++k) {
+      int next = (k + 1) % 3;
+      float dx = x[next] - x[k];
+      float dy = y[next] - y[k];
+      triangle.edgeA[k] = -dy * sign;
+      triangle.edgeB[k] = dx * sign;
+      triangle.edgeC[k] = (dy * x[k] - dx * y[k]) * sign;
+    }
+    triangle.depthA = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+    triangle.depthB = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+    triangle.depthC = z[0] - triangle.depthA * x[0] - triangle.depthB * y[0];
+
+    uint32_t index = bins.triangles.size();
+    bins.triangles.push_back(triangle);
+    for (int tileY = triangle.minY / (int)TILE_HEIGHT; tileY <= triangle.maxY / (int)TILE_HEIGHT; ++tileY) {
+      for (int tileX = triangle.minX / (int)TILE_WIDTH; tileX <= triangle.maxX / (int)TILE_WIDTH; ++tileX) {
+        bins.tiles[tileY * m_tilesX + tileX].push_back(index);
+      }
+    }
+  }
+}
+
+void OcclusionBuffer::rasterizeTile(uint32_t tile) {
+  int tileX = tile % m_tilesX * TILE_WIDTH;
+  int tileY = tile / m_tilesX * TILE_HEIGHT;
+  float* depth = m_levels[0].data();
+  for (int y = tileY; y < tileY + (int)TILE_HEIGHT; ++y) {
+    std::fill_n(depth + y * m_width + tileX, TILE_WIDTH, 1.0f);
+  }
+
+  // Pixel centers of the lanes, from the first pixel of the register
+  const simd::Float laneCenters = simd::add(simd::lanes(), simd::set1(0.5f));
+  const simd::Float zero = simd::set1(0);
+  for (const ThreadBins& bins: m_threadBins) {
+    for (uint32_t index: bins.tiles[tile]) {
+      const ScreenTriangle& triangle = bins.triangles[index];
+      int minX = std::max(triangle.minX, tileX) / simd::WIDTH * simd::WIDTH;
+      int maxX = std::min(triangle.maxX, tileX + (int)TILE_WIDTH - 1);
+      int minY = std::max(triangle.minY, tileY);
+      int maxY = std::min(triangle.maxY, tileY + (int)TILE_HEIGHT - 1);
+
+      simd::Float laneEdges[3];
+      for (int k = 0; k < 3; ++k) {
+        laneEdges[k] = simd::mul(simd::set1(triangle.edgeA[k]), laneCenters);
+      }
+      simd::Float laneDepths = simd::mul(simd::set1(triangle.depthA), laneCenters);
+
+      for (int y = minY; y <= maxY; ++y) {
+        float centerY = y + 0.5f;
+        float* row = depth + y * m_width;
+        for (int x = minX; x <= maxX; x += simd::WIDTH) {
+          simd::Float edges[3];
+          for (int k = 0; k < 3; ++k) {
+            edges[k] = simd::add(
+              simd::set1(triangle.edgeA[k] * x + triangle.edgeB[k] * centerY + triangle.edgeC[k]),
+              laneEdges[k]
+            );
+          }
+          simd::Float outside = simd::lessThan(
+            simd::min(simd::min(edges[0], edges[1]), edges[2]), zero
+          );
+          simd::Float triangleDepth = simd::add(
+            simd::set1(triangle.depthA * x + triangle.depthB * centerY + triangle.depthC),
+            laneDepths
+          );
+          simd::Float current = simd::load(row + x);
+          simd::store(
+            row + x,
+            simd::min(current, simd::select(outside, current, triangleDepth))
+          );
+        }
+      }
+    }
+  }
+}
+
+void OcclusionBuffer::buildPyramid() {
+  for (size_t level = 1; level < m_levels.size(); ++level) {
+    const std::vector<float>& source = m_levels[level - 1];
+    uint32_t sourceWidth = m_levelWidths[level - 1];
+    uint32_t sourceHeight = m_levelHeights[level - 1];
+    std::vector<float>& target = m_levels[level];
+    for (uint32_t y = 0; y < m_levelHeights[level]; ++y) {
+      const float* row0 = source.data() + 2 * y * sourceWidth;
+      const float* row1 = source.data() + std::min(2 * y + 1, sourceHeight - 1) * sourceWidth;
+      for (uint32_t x = 0; x < m_levelWidths[level]; ++x) {
+        uint32_t x1 = std::min(2 * x + 1, sourceWidth - 1);
+        target[y * m_levelWidths[level] + x] = std::max(
+          std::max(row0[2 * x], row0[x1]), std::max(row1[2 * x], row1[x1])
+        );
+      }
+    }
+  }
+}
+
+bool OcclusionBuffer::isOccluded(const Aabb& box) const {
+  if (box.isEmpty() || box.isInfinite()) {
+    return false;
+  }
+
+  // The corners, projected a register at a time
+  alignas(32) float cornerX[8];
+  alignas(32) float cornerY[8];
+  alignas(32) float cornerZ[8];
+  alignas(32) float cornerW[8];
+  for (int i = 0; i < 8; ++i) {
+    cornerX[i] = i & 1 ? box.max.x : box.min.x;
+    cornerY[i] = i & 2 ? box.max.y : box.min.y;
+    cornerZ[i] = i & 4 ? box.max.z : box.min.z;
+  }
+  const glm::mat4& m = m_viewProjection;
+  for (int i = 0; i < 8; i += simd::WIDTH) {
+    simd::Float x = simd::load(cornerX + i);
+    simd::Float y = simd::load(cornerY + i);
+    simd::Float z = simd::load(cornerZ + i);
+    simd::Float clip[4];
+    for (int row = 0; row < 4; ++row) {
+      clip[row] = simd::add(
+        simd::add(simd::mul(simd::set1(m[0][row]), x), simd::mul(simd::set1(m[1][row]), y)),
+        simd::add(simd::mul(simd::set1(m[2][row]), z), simd::set1(m[3][row]))
+      );
+    }
+    simd::store(cornerX + i, clip[0]);
+    simd::store(cornerY + i, clip[1]);
+    simd::store(cornerZ + i, clip[2]);
+    simd::store(cornerW + i, clip[3]);
+  }
+
+  float minX = INFINITY;
+  float minY = INFINITY;
+  float maxX = -INFINITY;
+  float maxY = -INFINITY;
+  float minDepth = INFINITY;
+  for (int i = 0; i < 8; ++i) {
+    // Reaching the near plane, the box may cover the whole screen
+    if (cornerW[i] <= 0 || cornerZ[i] < -cornerW[i]) {
+      return false;
+    }
+    float inverseW = 1 / cornerW[i];
+    float x = (cornerX[i] * inverseW * 0.5f + 0.5f) * m_width;
+    float y = (cornerY[i] * inverseW * 0.5f + 0.5f) * m_height;
+    minX = std::min(minX, x);
+    maxX = std::max(maxX, x);
+    minY = std::min(minY, y);
+    maxY = std::max(maxY, y);
+    minDepth = std::min(minDepth, cornerZ[i] * inverseW * 0.5f + 0.5f);
+  }
+  // Off screen boxes are left to the frustum
+  if (maxX < 0 || maxY < 0 || minX >= m_width || minY >= m_height) {
+    return false;
+  }
+
+  // Every pixel the rectangle touches
+  int x0 = std::max(0, (int)minX);
+  int y0 = std::max(0, (int)minY);
+  int x1 = std::min((int)m_width - 1, (int)maxX);
+  int y1 = std::min((int)m_height - 1, (int)maxY);
+  uint32_t level = 0;
+  while ((x1 >> level) - (x0 >> level) >= MAX_TEST_SPAN || (y1 >> level) - (y0 >> level) >= MAX_TEST_SPAN) {
+    level++;
+  }
+  const std::vector<float>& depth = m_levels[level];
+  uint32_t levelWidth = m_levelWidths[level];
+  for (int y = y0 >> level; y <= y1 >> level; ++y) {
+    for (int x = x0 >> level; x <= x1 >> level; ++x) {
+      if (depth[y * levelWidth + x] >= minDepth) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void OcclusionBuffer::test(
+  const std::vector<Aabb>& boxes, std::vector<uint8_t>& occluded,
+  ThreadPool* threadPool
+) {
+  auto start = std::chrono::steady_clock::now();
+
+  occluded.resize(boxes.size());
+  uint32_t chunkCount = (boxes.size() + BOX_GRAIN - 1) / BOX_GRAIN;
+  parallelFor(chunkCount > 1 ? threadPool : nullptr, chunkCount, [&](uint32_t chunk, uint32_t) {
+    uint32_t end = std::min<uint32_t>((chunk + 1) * BOX_GRAIN, boxes.size());
+    for (uint32_t i = chunk * BOX_GRAIN; i < end; ++i) {
+      occluded[i] = this->isOccluded(boxes[i]);
+    }
+  });
+
+  m_stats.testedBoxes += boxes.size();
+  m_stats.occludedBoxes += std::count(occluded.begin(), occluded.end(), 1);
+  m_stats.testMs += std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+}
+
+const std::vector<float>& OcclusionBuffer::getDepth() const {
+  return m_levels[0];
+}
+
+const OcclusionStats& OcclusionBuffer::getStats() const {
+  return m_stats;
+}
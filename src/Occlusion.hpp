@@ -0,0 +1,139 @@
+
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <cstdint>
+#include <vector>
+#include <glm/vec3.hpp>
+#include <glm/mat4x4.hpp>
+
+#include "Bounds.hpp"
+
+struct MeshPrimitive;
+class ThreadPool;
+
+// Object space triangles of a primitive, decoded once to be rasterized
+// as an occluder every frame
+struct OccluderMesh {
+  // Three per triangle
+  std::vector<glm::vec3> vertices;
+
+  bool empty() const {
+    return vertices.empty();
+  }
+};
+
+// Triangles of the coarsest level of detail whose error is at most
+// maxError, in object space units. Primitives other than triangle lists
+// get an empty mesh.
+OccluderMesh buildOccluderMesh(
+  const MeshPrimitive& meshPrimitive, float maxError = 0
+);
+
+// Of the last frame of an OcclusionBuffer
+struct OcclusionStats {
+  uint32_t occluderCount = 0;
+  uint32_t occluderTriangles = 0;
+  // Left once near, off screen and degenerate triangles are dropped
+  uint32_t rasterizedTriangles = 0;
+  uint32_t testedBoxes = 0;
+  uint32_t occludedBoxes = 0;
+  double rasterizeMs = 0;
+  double testMs = 0;
+};
+
+// Low resolution depth buffer the occluders of a frame are rasterized
+// into, on the CPU, to reject the boxes they hide before drawing them.
+// Triangles are binned to screen tiles, then every tile is rasterized by
+// one thread, a SIMD register of pixels at a time. Boxes are tested
+// against a max depth pyramid, on the few texels of the level their
+// screen rectangle covers. Occluders crossing the near plane are
+// dropped, and pixels are only covered through their center, so that
+// nothing visible gets hidden beyond that sampling.
+class OcclusionBuffer {
+public:
+  // The width of a tile is a multiple of any SIMD width
+  static constexpr uint32_t TILE_WIDTH = 32;
+  static constexpr uint32_t TILE_HEIGHT = 16;
+
+  // Rounded up to whole tiles
+  explicit OcclusionBuffer(uint32_t width = 320, uint32_t height = 192);
+  OcclusionBuffer(const OcclusionBuffer&) = delete;
+  OcclusionBuffer& operator=(const OcclusionBuffer&) = delete;
+
+  uint32_t getWidth() const;
+  uint32_t getHeight() const;
+
+  // Clears the buffer and the occluders for a new frame
+  void begin(const glm::mat4& viewProjection);
+  // The mesh must live until rasterize() returns
+  void addOccluder(const OccluderMesh& mesh, const glm::mat4& model);
+  // Bins the occluders' triangles over the pool, rasterizes the tiles,
+  // then builds the depth pyramid
+  void rasterize(ThreadPool* threadPool = nullptr);
+
+  // Once rasterized, whether the world space box is behind the occluders
+  bool isOccluded(const Aabb& box) const;
+  // Sets occluded[i] to 1 for the hidden boxes, 0 for the others
+  void test(
+    const std::vector<Aabb>& boxes, std::vector<uint8_t>& occluded,
+    ThreadPool* threadPool = nullptr
+  );
+
+  // 0 to 1 from the near to the far plane, 1 where nothing was drawn,
+  // rows from the bottom of the screen
+  const std::vector<float>& getDepth() const;
+  const OcclusionStats& getStats() const;
+
+private:
+  // Edge functions, positive inside, and depth plane, in pixels
+  struct ScreenTriangle {
+    float edgeA[3];
+    float edgeB[3];
+    float edgeC[3];
+    float depthA;
+    float depthB;
+    float depthC;
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+  };
+
+  struct Occluder {
+    const OccluderMesh* mesh;
+    glm::mat4 modelViewProjection;
+  };
+
+  // Of one thread, the triangles it set up and their tiles
+  struct ThreadBins {
+    std::vector<ScreenTriangle> triangles;
+    // By tile, indices in triangles
+    std::vector<std::vector<uint32_t>> tiles;
+  };
+
+  void setupTriangles(
+    const Occluder& occluder, uint32_t begin, uint32_t end, ThreadBins& bins
+  ) const;
+  void rasterizeTile(uint32_t tile);
+  void buildPyramid();
+
+  uint32_t m_width;
+  uint32_t m_height;
+  uint32_t m_tilesX;
+  uint32_t m_tilesY;
+  glm::mat4 m_viewProjection = glm::mat4(1);
+
+  std::vector<Occluder> m_occluders;
+  std::vector<ThreadBins> m_threadBins;
+
+  // Level 0 is the depth buffer, each next level keeps the farthest of
+  // 2x2 texels
+  std::vector<std::vector<float>> m_levels;
+  std::vector<uint32_t> m_levelWidths;
+  std::vector<uint32_t> m_levelHeights;
+
+  OcclusionStats m_stats;
+};
+
+#endif // !OCCLUSION_H
@@ -1,6 +1,11 @@
 
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <glm/glm.hpp>
 #include "Primitives.hpp"
+#include "GlState.hpp"
 
 // TODO - Integrate to gltf lib
 static inline uint32_t _getComponentCount(Accessor::Type accessorType) {
@@ -51,6 +56,134 @@ static inline uint32_t _getComponentSize(Accessor::ComponentType componentType)
   assert(false);
 }
 
+static inline float _normalizeComponent(
+  float value, Accessor::ComponentType componentType
+) {
+  switch (componentType) {
+    case Accessor::ComponentType::Byte: {
+      return std::max(value / 127.0, -1.0);
+    }
+    case Accessor::ComponentType::UnsignedByte: {
+      return value / 255.0;
+    }
+    case Accessor::ComponentType::Short: {
+      return std::max(value / 32767.0, -1.0);
+    }
+    case Accessor::ComponentType::UnsignedShort: {
+      return value / 65535.0;
+    }
+    case Accessor::ComponentType::UnsignedInt: {
+      return value / 4294967295.0;
+    }
+    default: {
+      return value;
+    }
+  }
+}
+
+void MeshPrimitive::computeBounds() {
+  this->bounds = {};
+
+  auto it = this->attributes.find("POSITION");
+  if (it == this->attributes.end()) {
+    return;
+  }
+  const Accessor& positions = *it->second;
+  assert(positions.type == Accessor::Type::Vec3);
+
+  // min and max are mandatory for POSITION, but cheap to recover
+  if (positions.min.size() == 3 && positions.max.size() == 3) {
+    for (int i = 0; i < 3; ++i) {
+      float min = positions.min[i];
+      float max = positions.max[i];
+      // They hold the values as stored, before normalization
+      if (positions.normalized) {
+        min = _normalizeComponent(min, positions.componentType);
+        max = _normalizeComponent(max, positions.componentType);
+      }
+      this->bounds.min[i] = min;
+      this->bounds.max[i] = max;
+    }
+  }
+  else {
+    for (uint32_t i = 0; i < positions.count; ++i) {
+      this->bounds.expand(glm::vec3(
+        positions.getComponent(i, 0),
+        positions.getComponent(i, 1),
+        positions.getComponent(i, 2)
+      ));
+    }
+  }
+}
+
+void MeshPrimitive::computeTexcoordDensity() {
+  auto positionIt = this->attributes.find("POSITION");
+  auto texcoordIt = this->attributes.find("TEXCOORD_0");
+  if (
+    positionIt == this->attributes.end() || texcoordIt == this->attributes.end()
+    || this->mode != Mode::Triangles
+  ) {
+    return;
+  }
+  const Accessor& positions = *positionIt->second;
+  const Accessor& texcoords = *texcoordIt->second;
+
+  uint32_t indexCount = this->indices ? this->indices->count : positions.count;
+  double positionArea = 0;
+  double texcoordArea = 0;
+  for (uint32_t i = 0; i + 2 < indexCount; i += 3) {
+    glm::vec3 p[3];
+    glm::vec2 t[3];
+    for (uint32_t k = 0; k < 3; ++k) {
+      uint32_t v = this->indices ? this->indices->getIndex(i + k) : i + k;
+      p[k] = glm::vec3(
+        positions.getComponent(v, 0),
+        positions.getComponent(v, 1),
+        positions.getComponent(v, 2)
+      ) * this->positionScale;
+      t[k] = glm::vec2(texcoords.getComponent(v, 0), texcoords.getComponent(v, 1));
+    }
+    positionArea += glm::length(glm::cross(p[1] - p[0], p[2] - p[0]));
+    glm::vec2 u = t[1] - t[0];
+    glm::vec2 w = t[2] - t[0];
+    texcoordArea += std::abs(u.x * w.y - u.y * w.x);
+  }
+  this->texcoordDensity = positionArea > 0
+    ? (float)std::sqrt(texcoordArea / positionArea)
+    : 0;
+}
+
+uint32_t MeshPrimitive::getLodCount() const {
+  return this->lods.size() + 1;
+}
+
+const Accessor* MeshPrimitive::getLodIndices(uint32_t lod) const {
+  return lod == 0 ? this->indices : this->lods[lod - 1].indices;
+}
+
+float MeshPrimitive::getLodError(uint32_t lod) const {
+  return lod == 0 ? 0 : this->lods[lod - 1].error;
+}
+
+uint32_t MeshPrimitive::getTriangleCount(uint32_t lod) const {
+  const Accessor* indices = this->getLodIndices(lod);
+  uint32_t count = indices
+    ? indices->count
+    : this->attributes.at("POSITION")->count;
+  switch (this->mode) {
+    case Mode::Triangles: {
+      return count / 3;
+    }
+    case Mode::TriangleStrip:
+    case Mode::TriangleFan: {
+      return count >= 3 ? count - 2 : 0;
+    }
+    default: {
+      return 0;
+    }
+  }
+}
+
 bool MeshPrimitive::isLoaded() const {
   for (const auto& attribute: this->attributes) {
     const Accessor* accessor = attribute.second;
@@ -62,7 +195,9 @@ bool MeshPrimitive::isLoaded() const {
   return (this->vaoId != 0);
 }
 
-void MeshPrimitive::loadToGpu(const AttributeMap& attributeMap, bool reload) {
+void MeshPrimitive::loadToGpu(
+  const AttributeMap& attributeMap, GpuBufferAllocator* allocator, bool reload
+) {
   if (this->vaoId == 0) {
     glGenVertexArrays(1, &this->vaoId);
     // TODO - error handling
@@ -74,11 +209,26 @@ void MeshPrimitive::loadToGpu(const AttributeMap& attributeMap, bool reload) {
   // TODO - reload bufferViews
 
   for (const auto& attribute: this->attributes) {
-    const Accessor* accessor = attribute.second;
-    accessor->bufferView->loadToGpu(false);
+    BufferView* bufferView = attribute.second->bufferView;
+    if (allocator) {
+      bufferView->loadToGpu(*allocator, false);
+    }
+    else {
+      bufferView->loadToGpu(false);
+    }
+  }
+  for (uint32_t lod = 0; this->indices && lod < this->getLodCount(); ++lod) {
+    BufferView* bufferView = this->getLodIndices(lod)->bufferView;
+    if (allocator) {
+      bufferView->loadToGpu(*allocator, reload);
+    }
+    else {
+      bufferView->loadToGpu(reload);
+    }
   }
 
-  glBindVertexArray(this->vaoId);
+  GlState& glState = GlState::get();
+  glState.bindVertexArray(this->vaoId);
 
   for (const auto& attribute: this->attributes) {
     const std::string& name = attribute.first;
@@ -89,7 +239,7 @@ void MeshPrimitive::loadToGpu(const AttributeMap& attributeMap, bool reload) {
       GLuint attributeIndex = it->second;
       int componentCount = _getComponentCount(accessor->type);
 
-      glBindBuffer(GL_ARRAY_BUFFER, accessor->bufferView->vboId);
+      glState.bindBuffer(GL_ARRAY_BUFFER, accessor->bufferView->vboId);
       glEnableVertexAttribArray(attributeIndex);
       glVertexAttribPointer(
         attributeIndex,
@@ -97,13 +247,16 @@ void MeshPrimitive::loadToGpu(const AttributeMap& attributeMap, bool reload) {
         (GLenum)accessor->componentType,
         accessor->normalized,
         accessor->bufferView->byteStride,
-        reinterpret_cast<GLvoid*>(accessor->byteOffset)
+        reinterpret_cast<GLvoid*>(
+          accessor->bufferView->getGpuOffset(accessor->byteOffset)
+        )
       );
     }
   }
 
+  // Recorded in the VAO
   if (this->indices) {
-    this->indices->bufferView->loadToGpu(reload);
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->indices->bufferView->vboId);
   }
 }
 
@@ -133,13 +286,38 @@ void Material::loadToGpu(bool reload) {
 
 
 bool TextureData::isLoaded() const {
-  return (this->texId != 0);
+  return (this->texId != 0 || this->arrayTexId != 0);
+}
+
+// Generates a texture with the sampler's parameters, bound to unit 0
+static GLuint _createTexture(const TextureData& texture) {
+  GLuint texId = 0;
+  glGenTextures(1, &texId);
+  GlState::get().bindTexture(0, GL_TEXTURE_2D, texId);
+
+  if (texture.sampler.magFilter != fx::gltf::Sampler::MagFilter::None) {
+    glTexParameteri(
+      GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (GLint)texture.sampler.magFilter
+    );
+  }
+  if (texture.sampler.minFilter != fx::gltf::Sampler::MinFilter::None) {
+    glTexParameteri(
+      GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (GLint)texture.sampler.minFilter
+    );
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (GLint)texture.sampler.wrapS);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (GLint)texture.sampler.wrapT);
+  return texId;
 }
 
 void TextureData::loadToGpu(bool reload) {
+  // Packed textures are uploaded with their array
+  if (this->arrayTexId != 0) {
+    return;
+  }
   if (this->isLoaded()) {
     if (reload) {
-      glDeleteTextures(1, &this->texId);
+      GlState::get().deleteTexture(this->texId);
       this->texId = 0;
     }
     else {
@@ -147,23 +325,12 @@ void TextureData::loadToGpu(bool reload) {
     }
   }
 
-  glActiveTexture(GL_TEXTURE0);
-  glGenTextures(1, &this->texId);
-  glBindTexture(GL_TEXTURE_2D, this->texId);
-
-  if (this->sampler.magFilter != fx::gltf::Sampler::MagFilter::None) {
-    glTexParameteri(
-      GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (GLint)this->sampler.magFilter
-    );
-  }
-  if (this->sampler.minFilter != fx::gltf::Sampler::MinFilter::None) {
-    glTexParameteri(
-      GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (GLint)this->sampler.minFilter
-    );
+  if (!this->levels.empty()) {
+    this->setResidentLevel(this->residentLevel);
+    return;
   }
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (GLint)this->sampler.wrapS);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (GLint)this->sampler.wrapT);
 
+  this->texId = _createTexture(*this);
   glTexImage2D(
     GL_TEXTURE_2D, 0, GL_RGBA, this->width, this->height,
     0,
@@ -172,8 +339,117 @@ void TextureData::loadToGpu(bool reload) {
   glGenerateMipmap(GL_TEXTURE_2D);
 }
 
+void TextureData::buildMipChain() {
+  if (!this->levels.empty() || this->width <= 0 || this->height <= 0) {
+    return;
+  }
+  assert(!this->compressed);
+  assert(this->data.size() == (size_t)this->width * this->height * 4);
+
+  uint32_t levelCount = 1;
+  while ((std::max(this->width, this->height) >> levelCount) > 0) {
+    levelCount++;
+  }
+  size_t totalBytes = 0;
+  this->levels.resize(levelCount);
+  for (uint32_t level = 0; level < levelCount; ++level) {
+    size_t byteLength = (
+      (size_t)std::max(this->width >> level, 1)
+      * std::max(this->height >> level, 1) * 4
+    );
+    this->levels[level] = TextureLevel { (uint32_t)totalBytes, (uint32_t)byteLength };
+    totalBytes += byteLength;
+  }
+  this->data.resize(totalBytes);
+
+  // Odd sizes clamp, so the last row and column are counted twice
+  for (uint32_t level = 1; level < levelCount; ++level) {
+    int sourceWidth = std::max(this->width >> (level - 1), 1);
+    int sourceHeight = std::max(this->height >> (level - 1), 1);
+    int levelWidth = std::max(this->width >> level, 1);
+    int levelHeight = std::max(this->height >> level, 1);
+    const uint8_t* source = this->data.data() + this->levels[level - 1].byteOffset;
+    uint8_t* destination = this->data.data() + this->levels[level].byteOffset;
+    for (int y = 0; y < levelHeight; ++y) {
+      int y0 = std::min(2 * y, sourceHeight - 1);
+      int y1 = std::min(2 * y + 1, sourceHeight - 1);
+      for (int x = 0; x < levelWidth; ++x) {
+        int x0 = std::min(2 * x, sourceWidth - 1);
+        int x1 = std::min(2 * x + 1, sourceWidth - 1);
+        for (int c = 0; c < 4; ++c) {
+          uint32_t sum = (
+            source[(y0 * sourceWidth + x0) * 4 + c]
+            + source[(y0 * sourceWidth + x1) * 4 + c]
+            + source[(y1 * sourceWidth + x0) * 4 + c]
+            + source[(y1 * sourceWidth + x1) * 4 + c]
+          );
+          destination[(y * levelWidth + x) * 4 + c] = (uint8_t)((sum + 2) / 4);
+        }
+      }
+    }
+  }
+}
+
+size_t TextureData::getLevelBytes(uint32_t firstLevel) const {
+  size_t bytes = 0;
+  for (size_t level = firstLevel; level < this->levels.size(); ++level) {
+    bytes += this->levels[level].byteLength;
+  }
+  return bytes;
+}
+
+void TextureData::setResidentLevel(uint32_t level) {
+  assert(level < this->levels.size());
+  assert(this->arrayTexId == 0);
+  if (this->isLoaded() && level == this->residentLevel) {
+    return;
+  }
+  GLuint previousTexId = this->texId;
+  uint32_t previousLevel = this->residentLevel;
+
+  // Immutable storage cannot shrink or grow, the texture is replaced.
+  // Sampling coordinates are normalized, draws do not see the change.
+  this->texId = _createTexture(*this);
+  glTexStorage2D(
+    GL_TEXTURE_2D, this->levels.size() - level, this->internalFormat,
+    std::max(this->width >> level, 1), std::max(this->height >> level, 1)
+  );
+  for (uint32_t source = level; source < this->levels.size(); ++source) {
+    const TextureLevel& textureLevel = this->levels[source];
+    GLint destination = source - level;
+    GLsizei levelWidth = std::max(this->width >> source, 1);
+    GLsizei levelHeight = std::max(this->height >> source, 1);
+    if (previousTexId != 0 && source >= previousLevel) {
+      glCopyImageSubData(
+        previousTexId, GL_TEXTURE_2D, source - previousLevel, 0, 0, 0,
+        this->texId, GL_TEXTURE_2D, destination, 0, 0, 0,
+        levelWidth, levelHeight, 1
+      );
+      continue;
+    }
+    const uint8_t* levelData = this->data.data() + textureLevel.byteOffset;
+    if (this->compressed) {
+      glCompressedTexSubImage2D(
+        GL_TEXTURE_2D, destination, 0, 0, levelWidth, levelHeight,
+        this->internalFormat, textureLevel.byteLength, levelData
+      );
+    }
+    else {
+      glTexSubImage2D(
+        GL_TEXTURE_2D, destination, 0, 0, levelWidth, levelHeight,
+        GL_RGBA, GL_UNSIGNED_BYTE, levelData
+      );
+    }
+  }
+
+  if (previousTexId != 0) {
+    GlState::get().deleteTexture(previousTexId);
+  }
+  this->residentLevel = level;
+}
+
 
-inline uint32_t Accessor::getStride() const {
+uint32_t Accessor::getStride() const {
   uint32_t stride = this->bufferView->byteStride;
   return stride != 0
     ? stride
@@ -181,6 +457,20 @@ inline uint32_t Accessor::getStride() const {
   ;
 }
 
+uint32_t Accessor::getComponentCount() const {
+  return _getComponentCount(this->type);
+}
+
+uint32_t Accessor::getElementSize() const {
+  return _getComponentCount(this->type) * _getComponentSize(this->componentType);
+}
+
+uint32_t Accessor::getByteLength() const {
+  return this->count != 0
+    ? (this->count - 1) * this->getStride() + this->getElementSize()
+    : 0;
+}
+
 float Accessor::getComponent(uint32_t element, uint32_t component) const {
   assert(component < _getComponentCount(this->type));
 
@@ -197,23 +487,23 @@ float Accessor::getComponent(uint32_t element, uint32_t component) const {
     }
     case ComponentType::Byte: {
       float f = *(int8_t*)compData;
-      return this->normalized ? std::max(f / 127.0, -1.0) : f;
+      return this->normalized ? _normalizeComponent(f, this->componentType) : f;
     }
     case ComponentType::UnsignedByte: {
       float f = *(uint8_t*)compData;
-      return this->normalized ? f / 255.0 : f;
+      return this->normalized ? _normalizeComponent(f, this->componentType) : f;
     }
     case ComponentType::Short: {
       float f = *(int16_t*)compData;
-      return this->normalized ? std::max(f / 32767.0, -1.0) : f;
+      return this->normalized ? _normalizeComponent(f, this->componentType) : f;
     }
     case ComponentType::UnsignedShort: {
       float f = *(uint16_t*)compData;
-      return this->normalized ? f / 65535.0 : f;
+      return this->normalized ? _normalizeComponent(f, this->componentType) : f;
     }
     case ComponentType::UnsignedInt: {
-      float f = *(uint16_t*)compData;
-      return this->normalized ? f / 4294967295.0 : f;
+      float f = *(uint32_t*)compData;
+      return this->normalized ? _normalizeComponent(f, this->componentType) : f;
     }
     case ComponentType::Float: {
       return *(float*)compData;
@@ -223,11 +513,71 @@ float Accessor::getComponent(uint32_t element, uint32_t component) const {
 }
 
 
+uint32_t Accessor::getIndex(uint32_t element) const {
+  const uint8_t* data = this->getElementData(element);
+  switch (this->componentType) {
+    case ComponentType::UnsignedByte: {
+      return *data;
+    }
+    case ComponentType::UnsignedShort: {
+      uint16_t index;
+      std::memcpy(&index, data, sizeof(index));
+      return index;
+    }
+    case ComponentType::UnsignedInt: {
+      uint32_t index;
+      std::memcpy(&index, data, sizeof(index));
+      return index;
+    }
+    default: {
+      break;
+    }
+  }
+  assert(false);
+  return 0;
+}
+
+const uint8_t* Accessor::getElementData(uint32_t element) const {
+  return (
+    this->bufferView->buffer->data.data()
+    + this->bufferView->byteOffset + this->byteOffset
+    + element * this->getStride()
+  );
+}
+
+
+void BufferView::addReference(const Accessor& accessor) {
+  // Rounding down keeps every accessor 4-byte aligned relative to the
+  // start of the upload
+  uint32_t begin = accessor.byteOffset / 4 * 4;
+  uint32_t end = accessor.byteOffset + accessor.getByteLength();
+  assert(end <= this->byteLength);
+
+  if (this->usedByteLength != 0) {
+    end = std::max(end, this->usedByteOffset + this->usedByteLength);
+    begin = std::min(begin, this->usedByteOffset);
+  }
+  this->usedByteOffset = begin;
+  this->usedByteLength = end - begin;
+}
+
+GLenum BufferView::getGlTarget() const {
+  return this->target == TargetType::ElementArrayBuffer
+    ? GL_ELEMENT_ARRAY_BUFFER
+    : GL_ARRAY_BUFFER;
+}
+
+GLintptr BufferView::getGpuOffset(uint32_t viewOffset) const {
+  GLintptr base = this->allocation.isValid() ? this->allocation.offset : 0;
+  return base + (GLintptr)viewOffset - this->usedByteOffset;
+}
+
 bool BufferView::isLoaded() const {
   return (this->vboId != 0);
 }
 
 void BufferView::loadToGpu(bool reload) {
+  assert(!this->allocation.isValid());
   if (this->vboId == 0) {
     glGenBuffers(1, &this->vboId);
     // TODO - error handling
@@ -236,28 +586,93 @@ void BufferView::loadToGpu(bool reload) {
     return;
   }
 
-  glBindVertexArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, this->vboId);
+  // Views nobody registered a reference to are uploaded whole
+  if (this->usedByteLength == 0) {
+    this->usedByteOffset = 0;
+    this->usedByteLength = this->byteLength;
+  }
+
+  GlState::get().bindBuffer(GL_COPY_WRITE_BUFFER, this->vboId);
 
   assert(this->byteOffset + this->byteLength <= this->buffer->data.size());
   glBufferData(
-    GL_ARRAY_BUFFER,
-    this->byteLength,
-    this->buffer->data.data() + this->byteOffset,
+    GL_COPY_WRITE_BUFFER,
+    this->usedByteLength,
+    this->buffer->data.data() + this->byteOffset + this->usedByteOffset,
     GL_STATIC_DRAW
   );
 }
 
-BufferView* createBufferView(const std::vector<float>& bufferData) {
-  // TODO - handle endianness
+void BufferView::loadToGpu(GpuBufferAllocator& allocator, bool reload) {
+  // Views that did not fit in the pool keep their own buffer
+  if (this->isLoaded() && !this->allocation.isValid()) {
+    this->loadToGpu(reload);
+    return;
+  }
+
+  GpuBufferPool& pool = allocator.getPool(this->getGlTarget());
+  if (this->allocation.isValid()) {
+    if (!reload) {
+      return;
+    }
+    pool.free(this->allocation);
+    this->allocation = {};
+    this->vboId = 0;
+  }
+
+  if (this->usedByteLength == 0) {
+    this->usedByteOffset = 0;
+    this->usedByteLength = this->byteLength;
+  }
 
-  const uint8_t* rawPtr = reinterpret_cast<const uint8_t*>(bufferData.data());
-  std::vector<uint8_t> rawData(
-    rawPtr, rawPtr + bufferData.size() * sizeof(float)
+  assert(this->byteOffset + this->byteLength <= this->buffer->data.size());
+  this->allocation = pool.allocate(
+    this->usedByteLength,
+    this->buffer->data.data() + this->byteOffset + this->usedByteOffset
   );
+  this->vboId = this->allocation.bufferId;
+  // Out of room for another block, the view alone may still fit
+  if (!this->allocation.isValid()) {
+    this->loadToGpu(false);
+  }
+}
 
-  return new BufferView {
-    new BufferData { rawData },
-    0, (uint32_t)rawData.size(), 0
+OwnedAccessor::OwnedAccessor(
+  uint32_t count, Accessor::Type type, Accessor::ComponentType componentType,
+  bool normalized, uint32_t byteStride, BufferView::TargetType target
+) {
+  this->bufferView = { &this->buffer, 0, 0, byteStride, target };
+  this->accessor = {
+    &this->bufferView, 0, count, type, componentType, normalized
   };
+  this->bufferView.byteLength = this->accessor.getByteLength();
+  this->buffer.data.resize(this->bufferView.byteLength);
+  this->bufferView.addReference(this->accessor);
+}
+
+uint8_t* OwnedAccessor::getElement(uint32_t element) {
+  return this->buffer.data.data() + element * this->accessor.getStride();
+}
+
+std::unique_ptr<OwnedAccessor> createIndexAccessor(
+  const std::vector<uint32_t>& indices, uint32_t vertexCount
+) {
+  bool narrow = (vertexCount <= 65536);
+  auto result = std::make_unique<OwnedAccessor>(
+    indices.size(), Accessor::Type::Scalar,
+    narrow
+      ? Accessor::ComponentType::UnsignedShort
+      : Accessor::ComponentType::UnsignedInt,
+    false, 0, BufferView::TargetType::ElementArrayBuffer
+  );
+  for (size_t i = 0; i < indices.size(); ++i) {
+    if (narrow) {
+      uint16_t index = indices[i];
+      std::memcpy(result->getElement(i), &index, sizeof(index));
+    }
+    else {
+      std::memcpy(result->getElement(i), &indices[i], sizeof(uint32_t));
+    }
+  }
+  return result;
 }
@@ -4,15 +4,26 @@
 
 #include <GL/glew.h>
 #include <fx/gltf.h>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 
 #include <vector>
 #include <array>
+#include <memory>
+
+#include "GpuAllocator.hpp"
+#include "Bounds.hpp"
+#include "Meshlets.hpp"
+#include "TriangleBvh.hpp"
+#include "Occlusion.hpp"
 
 struct Mesh;
 struct MeshPrimitive;
+struct MeshLod;
 struct Material;
 struct TextureData;
+struct TextureLevel;
 struct Accessor;
 struct BufferView;
 struct BufferData;
@@ -20,6 +31,20 @@ struct BufferData;
 struct Mesh {
   std::vector<MeshPrimitive> primitives{};
   std::vector<float> weights{};
+
+  // Union of the primitive bounds
+  Aabb bounds = {};
+
+  // Largest simplification error of the primitives at each LOD, in
+  // object space units; empty without LODs
+  std::vector<float> lodErrors{};
+};
+
+// Simplified version of a primitive, drawn with the same vertices
+struct MeshLod {
+  const Accessor* indices = nullptr;
+  // Object space units
+  float error = 0;
 };
 
 struct MeshPrimitive {
@@ -30,13 +55,50 @@ struct MeshPrimitive {
   Mode mode = Mode::Triangles;
   Attributes attributes = {};
   Accessor* indices = nullptr;
+  // Coarser levels of detail, by increasing error
+  std::vector<MeshLod> lods = {};
+  // Splits indices, the full level, for culling; empty when not built
+  Meshlets meshlets = {};
+  // Over the triangles of the full level, for ray casts; empty when not
+  // built
+  TriangleBvh triangleBvh = {};
+  // Triangles rasterized when its instance is an occluder; empty when
+  // not built
+  OccluderMesh occluderMesh = {};
 
   // std::vector<Attributes> morphTargets{};
 
+  // Object space bounds of POSITION, before skinning
+  Aabb bounds = {};
+
+  // Object space position of a stored POSITION, applied in the vertex
+  // shader; not the identity once quantized
+  glm::vec3 positionScale = glm::vec3(1);
+  glm::vec3 positionOffset = glm::vec3(0);
+
+  // TEXCOORD_0 units per object space unit, from the total area of the
+  // triangles in both spaces; 0 without texture coordinates
+  float texcoordDensity = 0;
+
   GLuint vaoId = 0;
 
+  void computeBounds();
+  void computeTexcoordDensity();
+
+  // Levels of detail including the full one, which is level 0
+  uint32_t getLodCount() const;
+  const Accessor* getLodIndices(uint32_t lod) const;
+  float getLodError(uint32_t lod) const;
+  // Triangles drawn at the given level
+  uint32_t getTriangleCount(uint32_t lod = 0) const;
+
   bool isLoaded() const;
-  void loadToGpu(const AttributeMap& attributeMap, bool reload = false);
+  // Without an allocator, each buffer view gets its own buffer object
+  void loadToGpu(
+    const AttributeMap& attributeMap,
+    GpuBufferAllocator* allocator = nullptr,
+    bool reload = false
+  );
 };
 
 struct Material {
@@ -45,10 +107,24 @@ struct Material {
 
   TextureData* normalMap = nullptr;
 
+  // Backfaces are culled otherwise
+  bool doubleSided = false;
+
+  // KHR_texture_transform of the base color texture, applied to every
+  // texture; dequantizes integer TEXCOORD_0 (KHR_mesh_quantization)
+  glm::vec2 texcoordScale = glm::vec2(1);
+  glm::vec2 texcoordOffset = glm::vec2(0);
+
   bool isLoaded() const;
   void loadToGpu(bool reload = false);
 };
 
+// Part of TextureData::data holding a mip level
+struct TextureLevel {
+  uint32_t byteOffset = 0;
+  uint32_t byteLength = 0;
+};
+
 struct TextureData {
   std::vector<uint8_t> data = {};
   int width = 0;
@@ -58,8 +134,36 @@ struct TextureData {
 
   GLuint texId = 0;
 
+  // Pre-built mip chain, base level first, uploaded as is. Empty for
+  // RGBA8 images, whose mips are generated.
+  std::vector<TextureLevel> levels = {};
+  // Sized format of the levels
+  GLenum internalFormat = GL_RGBA8;
+  bool compressed = false;
+
+  // Finest level on the GPU, where its storage starts. Only streamed
+  // textures leave out their finer levels.
+  uint32_t residentLevel = 0;
+
+  // Array texture and layer holding the texture instead of texId, 0 when
+  // not packed, see TextureArrays
+  GLuint arrayTexId = 0;
+  uint32_t arrayLayer = 0;
+  // Resident handle of the array, 0 without bindless textures
+  GLuint64 arrayHandle = 0;
+
   bool isLoaded() const;
   void loadToGpu(bool reload = false);
+
+  // Box filters the levels of an RGBA8 image without any
+  void buildMipChain();
+  // Bytes of the levels from the given one to the coarsest, 0 without
+  // levels
+  size_t getLevelBytes(uint32_t firstLevel) const;
+  // Reallocates the storage to start at level, copying the levels that
+  // were already resident on the GPU and uploading the others. Needs
+  // levels, and a texture of its own.
+  void setResidentLevel(uint32_t level);
 };
 
 struct Accessor {
@@ -80,7 +184,14 @@ struct Accessor {
   // Sparse sparse{};
 
   uint32_t getStride() const;
+  uint32_t getComponentCount() const;
+  uint32_t getElementSize() const;
+  // Bytes spanned in the buffer view, starting at byteOffset
+  uint32_t getByteLength() const;
   float getComponent(uint32_t element, uint32_t component = 0) const;
+  // Exact value of an unsigned integer scalar, such as indices
+  uint32_t getIndex(uint32_t element) const;
+  const uint8_t* getElementData(uint32_t element) const;
 
   std::vector<float> max = {};
   std::vector<float> min = {};
@@ -94,19 +205,50 @@ struct BufferView {
   uint32_t byteLength = 0;
   uint32_t byteStride = 0;
 
-  // unused
   TargetType target = TargetType::None;
 
+  // Part of the view referenced by accessors; only this range is uploaded
+  uint32_t usedByteOffset = 0;
+  uint32_t usedByteLength = 0;
+
   GLuint vboId = 0;
+  GpuAllocation allocation = {};
+
+  void addReference(const Accessor& accessor);
+  GLenum getGlTarget() const;
+  // Offset in vboId of the given offset in the view
+  GLintptr getGpuOffset(uint32_t viewOffset) const;
 
   bool isLoaded() const;
   void loadToGpu(bool reload = false);
+  void loadToGpu(GpuBufferAllocator& allocator, bool reload = false);
 };
 
 struct BufferData {
   std::vector<uint8_t> data = {};
 };
 
-BufferView* createBufferView(const std::vector<float>& bufferData);
+// Accessor over a buffer of its own, for data generated after loading.
+// Not copyable, the accessor points into it.
+struct OwnedAccessor {
+  BufferData buffer;
+  BufferView bufferView;
+  Accessor accessor;
+
+  // A byteStride of 0 packs the elements
+  OwnedAccessor(
+    uint32_t count, Accessor::Type type, Accessor::ComponentType componentType,
+    bool normalized, uint32_t byteStride, BufferView::TargetType target
+  );
+  OwnedAccessor(const OwnedAccessor&) = delete;
+  OwnedAccessor& operator=(const OwnedAccessor&) = delete;
+
+  uint8_t* getElement(uint32_t element);
+};
+
+// Narrowed to 16 bits when vertexCount allows
+std::unique_ptr<OwnedAccessor> createIndexAccessor(
+  const std::vector<uint32_t>& indices, uint32_t vertexCount
+);
 
 #endif // !PRIMITIVES_H
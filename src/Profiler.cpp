@@ -0,0 +1,209 @@
+
+#include <cassert>
+#include <algorithm>
+#include <fstream>
+#include <nlohmann/json.hpp>
+
+#include "Profiler.hpp"
+
+std::atomic<bool> Profiler::s_enabled{false};
+
+// Trace process ids, so CPU threads and the GPU get separate groups
+static constexpr int CPU_PID = 0;
+static constexpr int GPU_PID = 1;
+
+Profiler& Profiler::get() {
+  static Profiler profiler;
+  return profiler;
+}
+
+Profiler::Profiler() :
+  m_startTime(std::chrono::steady_clock::now())
+{}
+
+void Profiler::setEnabled(bool enabled) {
+  s_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void Profiler::setCapturing(bool capturing) {
+  m_capturing = capturing;
+}
+
+bool Profiler::isCapturing() const {
+  return m_capturing;
+}
+
+double Profiler::now() const {
+  return std::chrono::duration<double, std::micro>(
+    std::chrono::steady_clock::now() - m_startTime
+  ).count();
+}
+
+Profiler::ThreadEvents& Profiler::getThreadEvents() {
+  // Each thread registers once, then appends without locking
+  thread_local ThreadEvents* threadEvents = nullptr;
+  if (!threadEvents) {
+    std::lock_guard<std::mutex> lock(m_threadsMutex);
+    m_threads.push_back(std::make_unique<ThreadEvents>());
+    threadEvents = m_threads.back().get();
+    threadEvents->threadId = m_threads.size() - 1;
+  }
+  return *threadEvents;
+}
+
+void Profiler::addCpuEvent(const char* name, double start, double end) {
+  ThreadEvents& threadEvents = this->getThreadEvents();
+  threadEvents.events.push_back({
+    name, threadEvents.threadId, false, start, end - start
+  });
+}
+
+void Profiler::beginGpuZone(const char* name) {
+  assert(!m_gpuZoneOpen);
+  GpuFrame& frame = m_gpuFrames[m_frameIndex % GPU_FRAME_COUNT];
+  if (frame.usedCount == frame.queries.size()) {
+    GpuQuery query = {};
+    glGenQueries(1, &query.queryId);
+    frame.queries.push_back(query);
+  }
+  GpuQuery& query = frame.queries[frame.usedCount++];
+  query.name = name;
+  query.cpuStart = this->now();
+  glBeginQuery(GL_TIME_ELAPSED, query.queryId);
+  m_gpuZoneOpen = true;
+}
+
+void Profiler::endGpuZone() {
+  assert(m_gpuZoneOpen);
+  glEndQuery(GL_TIME_ELAPSED);
+  m_gpuZoneOpen = false;
+}
+
+void Profiler::readGpuFrame(GpuFrame& frame, std::vector<ProfileEvent>& events) {
+  // The GPU has no shared clock with the CPU here, so its zones are laid
+  // out back to back from the CPU time they were issued at
+  double gpuTime = 0;
+  for (uint32_t i = 0; i < frame.usedCount; ++i) {
+    const GpuQuery& query = frame.queries[i];
+    GLint available = 0;
+    glGetQueryObjectiv(query.queryId, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      // Never stall: a late result is dropped
+      m_droppedGpuQueries++;
+      continue;
+    }
+    GLuint64 elapsedNs = 0;
+    glGetQueryObjectui64v(query.queryId, GL_QUERY_RESULT, &elapsedNs);
+
+    double start = std::max(gpuTime, query.cpuStart);
+    double duration = elapsedNs / 1000.0;
+    events.push_back({ query.name, 0, true, start, duration });
+    gpuTime = start + duration;
+  }
+  frame.usedCount = 0;
+}
+
+void Profiler::endFrame() {
+  assert(!m_gpuZoneOpen);
+  if (!isEnabled()) {
+    return;
+  }
+
+  std::vector<ProfileEvent> events;
+  {
+    std::lock_guard<std::mutex> lock(m_threadsMutex);
+    for (auto& threadEvents: m_threads) {
+      events.insert(
+        events.end(), threadEvents->events.begin(), threadEvents->events.end()
+      );
+      threadEvents->events.clear();
+    }
+  }
+
+  // The queries issued last frame, whose slot is reused next frame
+  m_frameIndex++;
+  this->readGpuFrame(m_gpuFrames[m_frameIndex % GPU_FRAME_COUNT], events);
+
+  if (events.empty() && m_history.empty()) {
+    return;
+  }
+
+  std::map<std::pair<std::string, bool>, double> frameTotals;
+  for (const ProfileEvent& event: events) {
+    frameTotals[{ event.name, event.isGpu }] += event.duration;
+  }
+  for (auto& it: frameTotals) {
+    m_history[it.first];
+  }
+  for (auto& it: m_history) {
+    auto total = frameTotals.find(it.first);
+    it.second.push_back(total != frameTotals.end() ? total->second : 0);
+    if (it.second.size() > HISTORY_SIZE) {
+      it.second.pop_front();
+    }
+  }
+
+  if (m_capturing) {
+    m_trace.insert(m_trace.end(), events.begin(), events.end());
+  }
+}
+
+std::vector<ProfileStageSummary> Profiler::getSummary() const {
+  std::vector<ProfileStageSummary> summary;
+  for (const auto& it: m_history) {
+    const auto& history = it.second;
+    double sum = 0;
+    double max = 0;
+    for (double total: history) {
+      sum += total;
+      max = std::max(max, total);
+    }
+    summary.push_back({
+      it.first.first, it.first.second,
+      sum / history.size() / 1000, max / 1000
+    });
+  }
+  return summary;
+}
+
+uint32_t Profiler::getDroppedGpuQueries() const {
+  return m_droppedGpuQueries;
+}
+
+bool Profiler::writeTrace(const std::string& path) const {
+  using nlohmann::json;
+
+  json traceEvents = json::array();
+  traceEvents.push_back({
+    { "name", "process_name" }, { "ph", "M" }, { "pid", CPU_PID },
+    { "args", { { "name", "CPU" } } }
+  });
+  traceEvents.push_back({
+    { "name", "process_name" }, { "ph", "M" }, { "pid", GPU_PID },
+    { "args", { { "name", "GPU" } } }
+  });
+  for (uint32_t i = 0; i < m_threads.size(); ++i) {
+    traceEvents.push_back({
+      { "name", "thread_name" }, { "ph", "M" }, { "pid", CPU_PID }, { "tid", i },
+      { "args", { { "name", "Thread " + std::to_string(i) } } }
+    });
+  }
+
+  for (const ProfileEvent& event: m_trace) {
+    traceEvents.push_back({
+      { "name", event.name },
+      { "ph", "X" },
+      { "pid", event.isGpu ? GPU_PID : CPU_PID },
+      { "tid", event.threadId },
+      { "ts", event.start },
+      { "dur", event.duration }
+    });
+  }
+
+  std::ofstream file(path);
+  if (!file) {
+    return false;
+  }
+  file << json { { "traceEvents", traceEvents }, { "displayTimeUnit", "ms" } };
+  return file.good();
+}
@@ -0,0 +1,159 @@
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <GL/glew.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct ProfileEvent {
+  // Zone names must be string literals, they are never copied
+  const char* name;
+  uint32_t threadId;
+  bool isGpu;
+  // Microseconds since the profiler was created
+  double start;
+  double duration;
+};
+
+struct ProfileStageSummary {
+  std::string name;
+  bool isGpu;
+  // Per frame, over the last Profiler::HISTORY_SIZE frames
+  double averageMs;
+  double maxMs;
+};
+
+// Collects CPU zones from any thread and GPU zones from the GL thread.
+// Everything compiles in, a disabled profiler costs one relaxed atomic
+// load per zone.
+class Profiler {
+public:
+  static constexpr uint32_t HISTORY_SIZE = 120;
+  // GPU results are read one frame late, so the queries of two frames
+  // are alive at once and reading them never waits for the GPU
+  static constexpr uint32_t GPU_FRAME_COUNT = 2;
+
+  static Profiler& get();
+
+  static bool isEnabled() {
+    return s_enabled.load(std::memory_order_relaxed);
+  }
+  void setEnabled(bool enabled);
+
+  // While capturing, every event is kept for writeTrace()
+  void setCapturing(bool capturing);
+  bool isCapturing() const;
+
+  // Call once per frame on the GL thread. Collects the events of every
+  // thread, so no other thread may be inside a zone.
+  void endFrame();
+
+  // Chrome / Perfetto trace event JSON, returns false if the file could
+  // not be written
+  bool writeTrace(const std::string& path) const;
+  std::vector<ProfileStageSummary> getSummary() const;
+  // GPU results that were not ready a frame later
+  uint32_t getDroppedGpuQueries() const;
+
+  double now() const;
+  void addCpuEvent(const char* name, double start, double end);
+  void beginGpuZone(const char* name);
+  void endGpuZone();
+
+private:
+  struct ThreadEvents {
+    uint32_t threadId;
+    std::vector<ProfileEvent> events;
+  };
+
+  struct GpuQuery {
+    GLuint queryId;
+    const char* name;
+    double cpuStart;
+  };
+
+  struct GpuFrame {
+    std::vector<GpuQuery> queries;
+    uint32_t usedCount = 0;
+  };
+
+  Profiler();
+  Profiler(const Profiler&) = delete;
+  Profiler(Profiler&&) = delete;
+  ~Profiler() = default;
+
+  ThreadEvents& getThreadEvents();
+  void readGpuFrame(GpuFrame& frame, std::vector<ProfileEvent>& events);
+
+  static std::atomic<bool> s_enabled;
+
+  std::chrono::steady_clock::time_point m_startTime;
+
+  std::mutex m_threadsMutex;
+  std::vector<std::unique_ptr<ThreadEvents>> m_threads;
+
+  GpuFrame m_gpuFrames[GPU_FRAME_COUNT];
+  uint64_t m_frameIndex = 0;
+  bool m_gpuZoneOpen = false;
+  uint32_t m_droppedGpuQueries = 0;
+
+  bool m_capturing = false;
+  std::vector<ProfileEvent> m_trace;
+
+  // Per frame totals of each stage, keyed by name and GPU flag
+  std::map<std::pair<std::string, bool>, std::deque<double>> m_history;
+};
+
+// Times the enclosing scope on the calling thread
+class ProfileZone {
+public:
+  explicit ProfileZone(const char* name) {
+    if (Profiler::isEnabled()) {
+      m_name = name;
+      m_start = Profiler::get().now();
+    }
+  }
+  ~ProfileZone() {
+    if (m_name) {
+      Profiler::get().addCpuEvent(m_name, m_start, Profiler::get().now());
+    }
+  }
+  ProfileZone(const ProfileZone&) = delete;
+
+private:
+  const char* m_name = nullptr;
+  double m_start = 0;
+};
+
+// Times the GL commands issued in the enclosing scope. GPU zones can not
+// be nested, since only one GL_TIME_ELAPSED query may be active.
+class GpuProfileZone {
+public:
+  explicit GpuProfileZone(const char* name) {
+    if (Profiler::isEnabled()) {
+      m_active = true;
+      Profiler::get().beginGpuZone(name);
+    }
+  }
+  ~GpuProfileZone() {
+    if (m_active) {
+      Profiler::get().endGpuZone();
+    }
+  }
+  GpuProfileZone(const GpuProfileZone&) = delete;
+
+private:
+  bool m_active = false;
+};
+
+#endif // !PROFILER_H
@@ -0,0 +1,254 @@
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+#include "Quantization.hpp"
+
+void QuantizationReport::add(const QuantizationReport& other) {
+  attributeCount += other.attributeCount;
+  originalBytes += other.originalBytes;
+  quantizedBytes += other.quantizedBytes;
+  maxPositionError = std::max(maxPositionError, other.maxPositionError);
+  maxNormalError = std::max(maxNormalError, other.maxNormalError);
+  maxTexcoordError = std::max(maxTexcoordError, other.maxTexcoordError);
+  maxWeightError = std::max(maxWeightError, other.maxWeightError);
+}
+
+static glm::vec3 _getVec3(const Accessor& accessor, uint32_t element) {
+  return glm::vec3(
+    accessor.getComponent(element, 0),
+    accessor.getComponent(element, 1),
+    accessor.getComponent(element, 2)
+  );
+}
+
+// Same rounding as the GL conversion back to float
+static uint16_t _toUnorm16(float value) {
+  return (uint16_t)std::lround(std::clamp(value, 0.f, 1.f) * 65535);
+}
+
+static int16_t _toSnorm16(float value) {
+  return (int16_t)std::lround(std::clamp(value, -1.f, 1.f) * 32767);
+}
+
+static float _fromSnorm16(int16_t value) {
+  return std::max(value / 32767.f, -1.f);
+}
+
+// Projects the unit sphere on an octahedron, then unfolds the lower half
+// over the corners of the upper one. Decoded in phong.vert.
+static glm::vec2 _octahedralEncode(glm::vec3 normal) {
+  normal /= std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+  glm::vec2 encoded(normal.x, normal.y);
+  if (normal.z < 0) {
+    encoded = glm::vec2(
+      (1 - std::abs(normal.y)) * (normal.x >= 0 ? 1 : -1),
+      (1 - std::abs(normal.x)) * (normal.y >= 0 ? 1 : -1)
+    );
+  }
+  return encoded;
+}
+
+static glm::vec3 _octahedralDecode(glm::vec2 encoded) {
+  glm::vec3 normal(
+    encoded.x, encoded.y, 1 - std::abs(encoded.x) - std::abs(encoded.y)
+  );
+  float fold = std::max(-normal.z, 0.f);
+  normal.x += normal.x >= 0 ? -fold : fold;
+  normal.y += normal.y >= 0 ? -fold : fold;
+  return glm::normalize(normal);
+}
+
+// Attributes stay 4-byte aligned, as glTF requires
+static std::unique_ptr<QuantizedAttribute> _createAttribute(
+  const Accessor& original, Accessor::Type type,
+  Accessor::ComponentType componentType, uint32_t byteStride
+) {
+  return std::make_unique<QuantizedAttribute>(
+    original.count, type, componentType, true, byteStride,
+    BufferView::TargetType::ArrayBuffer
+  );
+}
+
+template <typename T>
+static void _write(QuantizedAttribute& attribute, uint32_t element, uint32_t component, T value) {
+  std::memcpy(attribute.getElement(element) + component * sizeof(T), &value, sizeof(T));
+}
+
+static std::unique_ptr<QuantizedAttribute> _quantizePositions(
+  const Accessor& positions, const Aabb& bounds, QuantizationReport& report
+) {
+  auto attribute = _createAttribute(
+    positions, Accessor::Type::Vec3, Accessor::ComponentType::UnsignedShort, 8
+  );
+  glm::vec3 extent = bounds.max - bounds.min;
+  attribute->positionScale = extent;
+  attribute->positionOffset = bounds.min;
+  attribute->accessor.min = { 0, 0, 0 };
+  attribute->accessor.max = { 65535, 65535, 65535 };
+
+  for (uint32_t i = 0; i < positions.count; ++i) {
+    glm::vec3 position = _getVec3(positions, i);
+    for (int c = 0; c < 3; ++c) {
+      float normalized = extent[c] > 0
+        ? (position[c] - bounds.min[c]) / extent[c]
+        : 0;
+      uint16_t value = _toUnorm16(normalized);
+      _write(*attribute, i, c, value);
+
+      float decoded = value / 65535.f * extent[c] + bounds.min[c];
+      report.maxPositionError = std::max(
+        report.maxPositionError, std::abs(decoded - position[c])
+      );
+    }
+  }
+  return attribute;
+}
+
+static std::unique_ptr<QuantizedAttribute> _quantizeNormals(
+  const Accessor& normals, QuantizationReport& report
+) {
+  auto attribute = _createAttribute(
+    normals, Accessor::Type::Vec2, Accessor::ComponentType::Short, 4
+  );
+
+  for (uint32_t i = 0; i < normals.count; ++i) {
+    glm::vec3 normal = _getVec3(normals, i);
+    if (glm::dot(normal, normal) == 0) {
+      normal = glm::vec3(0, 0, 1);
+    }
+    normal = glm::normalize(normal);
+
+    glm::vec2 encoded = _octahedralEncode(normal);
+    int16_t x = _toSnorm16(encoded.x);
+    int16_t y = _toSnorm16(encoded.y);
+    _write(*attribute, i, 0, x);
+    _write(*attribute, i, 1, y);
+
+    glm::vec3 decoded = _octahedralDecode(
+      glm::vec2(_fromSnorm16(x), _fromSnorm16(y))
+    );
+    float angle = glm::degrees(
+      std::acos(std::clamp(glm::dot(decoded, normal), -1.f, 1.f))
+    );
+    report.maxNormalError = std::max(report.maxNormalError, angle);
+  }
+  return attribute;
+}
+
+// Texture coordinates outside of [0, 1], used for wrapping, cannot be
+// normalized and are kept as floats
+static std::unique_ptr<QuantizedAttribute> _quantizeTexcoords(
+  const Accessor& texcoords, QuantizationReport& report
+) {
+  for (uint32_t i = 0; i < texcoords.count; ++i) {
+    for (int c = 0; c < 2; ++c) {
+      float value = texcoords.getComponent(i, c);
+      if (value < 0 || value > 1) {
+        return nullptr;
+      }
+    }
+  }
+
+  auto attribute = _createAttribute(
+    texcoords, Accessor::Type::Vec2, Accessor::ComponentType::UnsignedShort, 4
+  );
+  for (uint32_t i = 0; i < texcoords.count; ++i) {
+    for (int c = 0; c < 2; ++c) {
+      float original = texcoords.getComponent(i, c);
+      uint16_t value = _toUnorm16(original);
+      _write(*attribute, i, c, value);
+      report.maxTexcoordError = std::max(
+        report.maxTexcoordError, std::abs(value / 65535.f - original)
+      );
+    }
+  }
+  return attribute;
+}
+
+// Rounding errors go to the largest weight, so they still sum to one
+static std::unique_ptr<QuantizedAttribute> _quantizeWeights(
+  const Accessor& weights, QuantizationReport& report
+) {
+  auto attribute = _createAttribute(
+    weights, Accessor::Type::Vec4, Accessor::ComponentType::UnsignedByte, 4
+  );
+  for (uint32_t i = 0; i < weights.count; ++i) {
+    float original[4];
+    int values[4];
+    int sum = 0;
+    int largest = 0;
+    for (int c = 0; c < 4; ++c) {
+      original[c] = weights.getComponent(i, c);
+      values[c] = (int)std::lround(std::clamp(original[c], 0.f, 1.f) * 255);
+      sum += values[c];
+      if (original[c] > original[largest]) {
+        largest = c;
+      }
+    }
+    values[largest] = std::clamp(values[largest] + 255 - sum, 0, 255);
+
+    for (int c = 0; c < 4; ++c) {
+      _write(*attribute, i, c, (uint8_t)values[c]);
+      report.maxWeightError = std::max(
+        report.maxWeightError, std::abs(values[c] / 255.f - original[c])
+      );
+    }
+  }
+  return attribute;
+}
+
+QuantizationReport quantizeMesh(Mesh& mesh, QuantizedAttributes& quantized) {
+  QuantizationReport report;
+
+  for (MeshPrimitive& meshPrimitive: mesh.primitives) {
+    assert(meshPrimitive.vaoId == 0);
+
+    for (auto& attribute: meshPrimitive.attributes) {
+      const std::string& name = attribute.first;
+      const Accessor* original = attribute.second;
+      if (original->componentType != Accessor::ComponentType::Float) {
+        continue;
+      }
+
+      auto it = quantized.find(original);
+      if (it == quantized.end()) {
+        std::unique_ptr<QuantizedAttribute> encoded;
+        if (name == "POSITION") {
+          encoded = _quantizePositions(*original, mesh.bounds, report);
+        }
+        else if (name == "NORMAL") {
+          encoded = _quantizeNormals(*original, report);
+        }
+        else if (name == "TEXCOORD_0") {
+          encoded = _quantizeTexcoords(*original, report);
+        }
+        else if (name == "WEIGHTS_0") {
+          encoded = _quantizeWeights(*original, report);
+        }
+
+        if (encoded) {
+          report.attributeCount += 1;
+          report.originalBytes += original->count * original->getElementSize();
+          report.quantizedBytes += encoded->bufferView.byteLength;
+        }
+        // Unsupported attributes are remembered too, to skip them next time
+        it = quantized.emplace(original, std::move(encoded)).first;
+      }
+      if (!it->second) {
+        continue;
+      }
+
+      attribute.second = &it->second->accessor;
+      if (name == "POSITION") {
+        meshPrimitive.positionScale = it->second->positionScale;
+        meshPrimitive.positionOffset = it->second->positionOffset;
+      }
+    }
+  }
+
+  return report;
+}
@@ -0,0 +1,53 @@
+
+#ifndef QUANTIZATION_H
+#define QUANTIZATION_H
+
+#include <memory>
+#include <unordered_map>
+#include <glm/vec3.hpp>
+
+#include "Primitives.hpp"
+
+struct QuantizationReport {
+  size_t attributeCount = 0;
+  size_t originalBytes = 0;
+  size_t quantizedBytes = 0;
+
+  // Largest difference between an original and a decoded value
+  // Object space units
+  float maxPositionError = 0;
+  // Degrees
+  float maxNormalError = 0;
+  float maxTexcoordError = 0;
+  float maxWeightError = 0;
+
+  size_t savedBytes() const {
+    return originalBytes - quantizedBytes;
+  }
+  void add(const QuantizationReport& other);
+};
+
+// Re-encoded copy of an attribute
+struct QuantizedAttribute: OwnedAccessor {
+  using OwnedAccessor::OwnedAccessor;
+
+  // Decoding of POSITION, see MeshPrimitive::positionScale
+  glm::vec3 positionScale = glm::vec3(1);
+  glm::vec3 positionOffset = glm::vec3(0);
+};
+
+// Original accessor to its quantized copy, so shared attributes are
+// only encoded once
+using QuantizedAttributes = std::unordered_map<
+  const Accessor*, std::unique_ptr<QuantizedAttribute>
+>;
+
+// Points the float attributes of the mesh primitives to compact copies:
+// - POSITION, unsigned 16 bits normalized to the mesh bounds
+// - NORMAL, octahedral encoding in two signed 16 bits
+// - TEXCOORD_0, unsigned 16 bits, when in [0, 1]
+// - WEIGHTS_0, unsigned 8 bits
+// Must run before the mesh is loaded to the GPU. Bounds are left as is.
+QuantizationReport quantizeMesh(Mesh& mesh, QuantizedAttributes& quantized);
+
+#endif // !QUANTIZATION_H
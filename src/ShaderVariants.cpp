@@ -0,0 +1,132 @@
+
+#include <cassert>
+#include <vector>
+
+#include "ShaderVariants.hpp"
+
+static const char* FEATURE_NAMES[ShaderVariants::FEATURE_COUNT] = {
+  "HAS_SKINNING",
+  "HAS_NORMAL_MAP",
+  "HAS_BASE_COLOR_TEXTURE",
+  "USE_INSTANCING",
+  "HAS_OCTAHEDRAL_NORMALS",
+  "USE_TEXTURE_ARRAYS",
+  "USE_BINDLESS_TEXTURES"
+};
+
+ShaderVariants::ShaderVariants(
+  const std::string& vertexPath, const std::string& fragmentPath
+) :
+  m_vertexPath(vertexPath),
+  m_fragmentPath(fragmentPath)
+{}
+
+void ShaderVariants::compile(uint32_t featureMask, uint32_t fixedFeatures) {
+  if (GLEW_KHR_parallel_shader_compile) {
+    // Let the driver pick the number of threads
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+  }
+  else if (GLEW_ARB_parallel_shader_compile) {
+    glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+  }
+
+  // Status queries wait for the compilation, so they only happen once
+  // every variant has been submitted
+  std::vector<ShaderProgram*> started;
+  featureMask &= ~fixedFeatures;
+  for (uint32_t subset = 0; subset < VARIANT_COUNT; ++subset) {
+    if ((subset & ~featureMask) != 0) {
+      continue;
+    }
+    uint32_t features = subset | fixedFeatures;
+    if (!(features & TEXTURE_FEATURES)) {
+      features &= ~TEXTURE_ACCESS_FEATURES;
+    }
+    if (!isValid(features) || m_variants[features]) {
+      continue;
+    }
+    m_variants[features] = std::make_unique<ShaderProgram>();
+    m_variants[features]->startInitFromFiles(
+      m_vertexPath, m_fragmentPath, getDefines(features)
+    );
+    started.push_back(m_variants[features].get());
+  }
+  for (ShaderProgram* program: started) {
+    program->finishInit();
+  }
+}
+
+ShaderProgram& ShaderVariants::get(uint32_t features) {
+  assert(features < VARIANT_COUNT && isValid(features));
+  if (!m_variants[features]) {
+    m_variants[features] = std::make_unique<ShaderProgram>();
+    m_variants[features]->initFromFiles(
+      m_vertexPath, m_fragmentPath, getDefines(features)
+    );
+  }
+  return *m_variants[features];
+}
+
+uint32_t ShaderVariants::selectFeatures(
+  const MeshPrimitive& meshPrimitive, const Material& material,
+  const Material& defaultMaterial, bool skinned
+) {
+  const auto& attributes = meshPrimitive.attributes;
+  bool hasTexcoords = attributes.count("TEXCOORD_0") > 0;
+
+  uint32_t features = 0;
+  if (
+    skinned
+    && attributes.count("JOINTS_0") > 0 && attributes.count("WEIGHTS_0") > 0
+  ) {
+    features |= HAS_SKINNING;
+  }
+  if (
+    material.normalMap != defaultMaterial.normalMap
+    && hasTexcoords && attributes.count("TANGENT") > 0
+  ) {
+    features |= HAS_NORMAL_MAP;
+  }
+  if (material.baseColorTexture != defaultMaterial.baseColorTexture && hasTexcoords) {
+    features |= HAS_BASE_COLOR_TEXTURE;
+  }
+
+  const TextureData* sampled[] = {
+    (features & HAS_BASE_COLOR_TEXTURE) ? material.baseColorTexture : nullptr,
+    (features & HAS_NORMAL_MAP) ? material.normalMap : nullptr
+  };
+  bool packed = (features & TEXTURE_FEATURES) != 0;
+  bool bindless = packed;
+  for (const TextureData* texture: sampled) {
+    if (texture) {
+      packed = packed && texture->arrayTexId != 0;
+      bindless = bindless && texture->arrayHandle != 0;
+    }
+  }
+  if (packed) {
+    features |= USE_TEXTURE_ARRAYS | (bindless ? USE_BINDLESS_TEXTURES : 0);
+  }
+
+  auto normals = attributes.find("NORMAL");
+  if (normals != attributes.end() && normals->second->type == Accessor::Type::Vec2) {
+    features |= HAS_OCTAHEDRAL_NORMALS;
+  }
+  return features;
+}
+
+bool ShaderVariants::isValid(uint32_t features) {
+  if ((features & USE_BINDLESS_TEXTURES) && !(features & USE_TEXTURE_ARRAYS)) {
+    return false;
+  }
+  return !(features & USE_TEXTURE_ARRAYS) || (features & TEXTURE_FEATURES);
+}
+
+std::string ShaderVariants::getDefines(uint32_t features) {
+  std::string defines;
+  for (uint32_t i = 0; i < FEATURE_COUNT; ++i) {
+    if (features & (1 << i)) {
+      defines += std::string("#define ") + FEATURE_NAMES[i] + "\n";
+    }
+  }
+  return defines;
+}
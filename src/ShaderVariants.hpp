@@ -0,0 +1,67 @@
+
+#ifndef SHADER_VARIANTS_H
+#define SHADER_VARIANTS_H
+
+#include <array>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+#include "ShaderProgram.hpp"
+#include "Primitives.hpp"
+
+// Programs built from one pair of shader files, with a variant for each
+// combination of feature defines.
+class ShaderVariants {
+public:
+  // Feature bits, each one enables a #define of the same name
+  static constexpr uint32_t HAS_SKINNING = 1 << 0;
+  static constexpr uint32_t HAS_NORMAL_MAP = 1 << 1;
+  static constexpr uint32_t HAS_BASE_COLOR_TEXTURE = 1 << 2;
+  static constexpr uint32_t USE_INSTANCING = 1 << 3;
+  // NORMAL holds two components, see quantizeMesh
+  static constexpr uint32_t HAS_OCTAHEDRAL_NORMALS = 1 << 4;
+  // Textures are layers of arrays, see TextureArrays
+  static constexpr uint32_t USE_TEXTURE_ARRAYS = 1 << 5;
+  // The arrays are referenced by handle, needs ARB_bindless_texture
+  static constexpr uint32_t USE_BINDLESS_TEXTURES = 1 << 6;
+  static constexpr uint32_t FEATURE_COUNT = 7;
+  static constexpr uint32_t VARIANT_COUNT = 1 << FEATURE_COUNT;
+
+  static constexpr uint32_t TEXTURE_FEATURES = HAS_NORMAL_MAP | HAS_BASE_COLOR_TEXTURE;
+  // How the textures are sampled, meaningless without any
+  static constexpr uint32_t TEXTURE_ACCESS_FEATURES = USE_TEXTURE_ARRAYS | USE_BINDLESS_TEXTURES;
+
+  ShaderVariants(const std::string& vertexPath, const std::string& fragmentPath);
+  ShaderVariants(const ShaderVariants&) = delete;
+  ShaderVariants(ShaderVariants&&) = delete;
+
+  // Builds every valid variant combining the features of featureMask,
+  // each with fixedFeatures, which hold for the whole run. The texture
+  // access features only apply to variants sampling textures. Lets the
+  // driver compile them in parallel when it can.
+  void compile(uint32_t featureMask, uint32_t fixedFeatures = 0);
+
+  // Compiles the variant on first use if compile() did not cover it. The
+  // features must be valid.
+  ShaderProgram& get(uint32_t features);
+
+  // The cheapest variant able to draw the primitive with the material.
+  // defaultMaterial tells apart the placeholder textures, which need no
+  // sampling. Arrays are only sampled when every sampled texture is
+  // packed.
+  static uint32_t selectFeatures(
+    const MeshPrimitive& meshPrimitive, const Material& material,
+    const Material& defaultMaterial, bool skinned
+  );
+  static std::string getDefines(uint32_t features);
+  // Bindless textures need arrays, which need a sampled texture
+  static bool isValid(uint32_t features);
+
+private:
+  std::string m_vertexPath;
+  std::string m_fragmentPath;
+  std::array<std::unique_ptr<ShaderProgram>, VARIANT_COUNT> m_variants;
+};
+
+#endif // !SHADER_VARIANTS_H
@@ -0,0 +1,114 @@
+
+#ifndef SIMD_H
+#define SIMD_H
+
+// Thin wrapper over the widest float vectors the build targets, so that
+// structure of arrays kernels are written once.
+// AVX is only used when the ENABLE_AVX2 build option is set.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include <cmath>
+#include <cstddef>
+
+namespace simd {
+
+#if defined(__AVX__)
+
+constexpr int WIDTH = 8;
+using Float = __m256;
+
+inline Float load(const float* ptr) { return _mm256_loadu_ps(ptr); }
+inline void store(float* ptr, Float value) { _mm256_storeu_ps(ptr, value); }
+inline Float set1(float value) { return _mm256_set1_ps(value); }
+inline Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+inline Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+inline Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+inline Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+inline Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+inline Float abs(Float a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+inline Float sqrt(Float a) { return _mm256_sqrt_ps(a); }
+inline Float lessThan(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline Float bitOr(Float a, Float b) { return _mm256_or_ps(a, b); }
+inline Float bitAnd(Float a, Float b) { return _mm256_and_ps(a, b); }
+inline int mask(Float a) { return _mm256_movemask_ps(a); }
+// a where the mask is set, b elsewhere
+inline Float select(Float mask, Float a, Float b) { return _mm256_blendv_ps(b, a, mask); }
+// 0, 1, 2, ... in the lanes
+inline Float lanes() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+constexpr int WIDTH = 4;
+using Float = __m128;
+
+inline Float load(const float* ptr) { return _mm_loadu_ps(ptr); }
+inline void store(float* ptr, Float value) { _mm_storeu_ps(ptr, value); }
+inline Float set1(float value) { return _mm_set1_ps(value); }
+inline Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+inline Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+inline Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+inline Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+inline Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+inline Float abs(Float a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline Float sqrt(Float a) { return _mm_sqrt_ps(a); }
+inline Float lessThan(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+inline Float bitOr(Float a, Float b) { return _mm_or_ps(a, b); }
+inline Float bitAnd(Float a, Float b) { return _mm_and_ps(a, b); }
+inline int mask(Float a) { return _mm_movemask_ps(a); }
+inline Float select(Float mask, Float a, Float b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+inline Float lanes() { return _mm_setr_ps(0, 1, 2, 3); }
+
+#else
+
+constexpr int WIDTH = 1;
+// Comparisons yield 0 or 1 instead of a lane mask
+using Float = float;
+
+inline Float load(const float* ptr) { return *ptr; }
+inline void store(float* ptr, Float value) { *ptr = value; }
+inline Float set1(float value) { return value; }
+inline Float add(Float a, Float b) { return a + b; }
+inline Float sub(Float a, Float b) { return a - b; }
+inline Float mul(Float a, Float b) { return a * b; }
+inline Float min(Float a, Float b) { return a < b ? a : b; }
+inline Float max(Float a, Float b) { return a > b ? a : b; }
+inline Float abs(Float a) { return a < 0 ? -a : a; }
+inline Float sqrt(Float a) { return std::sqrt(a); }
+inline Float lessThan(Float a, Float b) { return a < b ? 1 : 0; }
+inline Float bitOr(Float a, Float b) { return (a != 0 || b != 0) ? 1 : 0; }
+inline Float bitAnd(Float a, Float b) { return (a != 0 && b != 0) ? 1 : 0; }
+inline int mask(Float a) { return a != 0 ? 1 : 0; }
+inline Float select(Float mask, Float a, Float b) { return mask != 0 ? a : b; }
+inline Float lanes() { return 0; }
+
+#endif
+
+inline size_t roundUp(size_t count) {
+  return (count + WIDTH - 1) / WIDTH * WIDTH;
+}
+
+// Lowest lane set in a non-zero mask
+inline int firstLane(int mask) {
+#if defined(_MSC_VER)
+  unsigned long lane;
+  _BitScanForward(&lane, (unsigned long)mask);
+  return (int)lane;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+} // namespace simd
+
+#endif // !SIMD_H
@@ -0,0 +1,434 @@
+
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+#include "Simplifier.hpp"
+
+// Sum of squared distances to planes, weighted by the triangle areas
+struct Quadric {
+  // Symmetric 3x3 matrix
+  double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+  double b0 = 0, b1 = 0, b2 = 0;
+  double c = 0;
+  double weight = 0;
+
+  void addPlane(const glm::vec3& normal, float distance, float planeWeight) {
+    a00 += planeWeight * normal.x * normal.x;
+    a01 += planeWeight * normal.x * normal.y;
+    a02 += planeWeight * normal.x * normal.z;
+    a11 += planeWeight * normal.y * normal.y;
+    a12 += planeWeight * normal.y * normal.z;
+    a22 += planeWeight * normal.z * normal.z;
+    b0 += planeWeight * normal.x * distance;
+    b1 += planeWeight * normal.y * distance;
+    b2 += planeWeight * normal.z * distance;
+    c += planeWeight * distance * distance;
+    weight += planeWeight;
+  }
+
+  void add(const Quadric& other) {
+    a00 += other.a00;
+    a01 += other.a01;
+    a02 += other.a02;
+    a11 += other.a11;
+    a12 += other.a12;
+    a22 += other.a22;
+    b0 += other.b0;
+    b1 += other.b1;
+    b2 += other.b2;
+    c += other.c;
+    weight += other.weight;
+  }
+
+  // Weighted mean of the squared distances
+  double getError(const glm::vec3& point) const {
+    double x = point.x;
+    double y = point.y;
+    double z = point.z;
+    double error = (
+      a00 * x * x + a11 * y * y + a22 * z * z
+      + 2 * (a01 * x * y + a02 * x * z + a12 * y * z)
+      + 2 * (b0 * x + b1 * y + b2 * z)
+      + c
+    );
+    return weight > 0 ? std::max(error, 0.0) / weight : 0;
+  }
+};
+
+struct Collapse {
+  uint32_t from;
+  uint32_t to;
+  double error;
+};
+
+// Vertices sharing a position are welded: collapses and quadrics work on
+// the first of them, the representative, and triangles keep their own
+// vertex, or wedge, so their attributes stay intact
+struct SimplifierState {
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> representatives;
+  // Circular lists of the vertices sharing a position
+  std::vector<uint32_t> nextWedges;
+  // Compared to pick the wedge of a collapse target
+  std::vector<float> wedgeAttributes;
+  uint32_t wedgeAttributeCount = 0;
+  // Joint with the largest weight, 0 when not skinned
+  std::vector<uint32_t> dominantJoints;
+  std::vector<bool> locked;
+
+  std::vector<uint32_t> corners;
+  std::vector<bool> removed;
+  uint32_t liveTriangles = 0;
+  // Triangles of each representative, removed ones included
+  std::vector<std::vector<uint32_t>> adjacency;
+  std::vector<Quadric> quadrics;
+
+  // Vertices changed by a collapse of the current pass
+  std::vector<uint32_t> touched;
+  uint32_t pass = 0;
+  double maxError = 0;
+
+  uint32_t getRepresentative(size_t corner) const {
+    return this->representatives[this->corners[corner]];
+  }
+};
+
+static void _readAttributes(const MeshPrimitive& meshPrimitive, SimplifierState& state) {
+  const Accessor& positions = *meshPrimitive.attributes.at("POSITION");
+  uint32_t vertexCount = positions.count;
+
+  // Errors are measured in object space, also when quantized
+  state.positions.resize(vertexCount);
+  for (uint32_t v = 0; v < vertexCount; ++v) {
+    glm::vec3 position(
+      positions.getComponent(v, 0),
+      positions.getComponent(v, 1),
+      positions.getComponent(v, 2)
+    );
+    state.positions[v] = (
+      position * meshPrimitive.positionScale + meshPrimitive.positionOffset
+    );
+  }
+
+  std::vector<const Accessor*> wedgeAccessors;
+  for (const char* name: { "TEXCOORD_0", "NORMAL" }) {
+    auto it = meshPrimitive.attributes.find(name);
+    if (it != meshPrimitive.attributes.end()) {
+      wedgeAccessors.push_back(it->second);
+      state.wedgeAttributeCount += it->second->getComponentCount();
+    }
+  }
+  state.wedgeAttributes.reserve(vertexCount * state.wedgeAttributeCount);
+  for (uint32_t v = 0; v < vertexCount; ++v) {
+    for (const Accessor* accessor: wedgeAccessors) {
+      for (uint32_t c = 0; c < accessor->getComponentCount(); ++c) {
+        state.wedgeAttributes.push_back(accessor->getComponent(v, c));
+      }
+    }
+  }
+
+  state.dominantJoints.assign(vertexCount, 0);
+  auto joints = meshPrimitive.attributes.find("JOINTS_0");
+  auto weights = meshPrimitive.attributes.find("WEIGHTS_0");
+  if (joints != meshPrimitive.attributes.end() && weights != meshPrimitive.attributes.end()) {
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+      uint32_t dominant = 0;
+      for (uint32_t c = 1; c < 4; ++c) {
+        if (weights->second->getComponent(v, c) > weights->second->getComponent(v, dominant)) {
+          dominant = c;
+        }
+      }
+      state.dominantJoints[v] = joints->second->getComponent(v, dominant);
+    }
+  }
+}
+
+// Vertices sharing a position with another one sit on a UV seam or a
+// hard edge, and are locked
+static void _weldVertices(SimplifierState& state) {
+  uint32_t vertexCount = state.positions.size();
+  std::vector<uint32_t> order(vertexCount);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    const glm::vec3& pa = state.positions[a];
+    const glm::vec3& pb = state.positions[b];
+    if (pa.x != pb.x) {
+      return pa.x < pb.x;
+    }
+    if (pa.y != pb.y) {
+      return pa.y < pb.y;
+    }
+    return pa.z < pb.z;
+  });
+
+  state.representatives.resize(vertexCount);
+  state.nextWedges.resize(vertexCount);
+  state.locked.assign(vertexCount, false);
+  for (uint32_t begin = 0; begin < vertexCount;) {
+    uint32_t end = begin + 1;
+    while (end < vertexCount && state.positions[order[end]] == state.positions[order[begin]]) {
+      ++end;
+    }
+    uint32_t representative = order[begin];
+    for (uint32_t i = begin; i < end; ++i) {
+      state.representatives[order[i]] = representative;
+      state.nextWedges[order[i]] = order[i + 1 < end ? i + 1 : begin];
+    }
+    state.locked[representative] = (end - begin > 1);
+    begin = end;
+  }
+}
+
+static void _buildTopology(SimplifierState& state, const std::vector<uint32_t>& indices) {
+  uint32_t vertexCount = state.positions.size();
+  size_t triangleCount = indices.size() / 3;
+  state.corners = indices;
+  state.removed.assign(triangleCount, false);
+  state.adjacency.assign(vertexCount, {});
+  state.quadrics.assign(vertexCount, {});
+  state.touched.assign(vertexCount, 0);
+  state.liveTriangles = 0;
+
+  std::vector<uint64_t> edges;
+  edges.reserve(indices.size());
+  for (size_t t = 0; t < triangleCount; ++t) {
+    uint32_t r[3];
+    for (int c = 0; c < 3; ++c) {
+      r[c] = state.getRepresentative(3 * t + c);
+    }
+    if (r[0] == r[1] || r[1] == r[2] || r[0] == r[2]) {
+      state.removed[t] = true;
+      continue;
+    }
+    state.liveTriangles++;
+
+    const glm::vec3& p0 = state.positions[r[0]];
+    glm::vec3 normal = glm::cross(state.positions[r[1]] - p0, state.positions[r[2]] - p0);
+    float length = glm::length(normal);
+    if (length > 0) {
+      normal /= length;
+      for (int c = 0; c < 3; ++c) {
+        state.quadrics[r[c]].addPlane(normal, -glm::dot(normal, p0), length / 2);
+      }
+    }
+    for (int c = 0; c < 3; ++c) {
+      state.adjacency[r[c]].push_back(t);
+
+      uint32_t a = std::min(r[c], r[(c + 1) % 3]);
+      uint32_t b = std::max(r[c], r[(c + 1) % 3]);
+      edges.push_back((uint64_t)a << 32 | b);
+    }
+  }
+
+  // Borders and non-manifold edges keep their vertices
+  std::sort(edges.begin(), edges.end());
+  for (size_t begin = 0; begin < edges.size();) {
+    size_t end = begin + 1;
+    while (end < edges.size() && edges[end] == edges[begin]) {
+      ++end;
+    }
+    if (end - begin != 2) {
+      state.locked[edges[begin] >> 32] = true;
+      state.locked[edges[begin] & 0xFFFFFFFF] = true;
+    }
+    begin = end;
+  }
+}
+
+// Among the wedges of the target, the one with the closest attributes,
+// on the same side of any seam as the collapsed vertex
+static uint32_t _pickWedge(const SimplifierState& state, uint32_t to, uint32_t vertex) {
+  uint32_t best = to;
+  float bestDistance = INFINITY;
+  uint32_t count = state.wedgeAttributeCount;
+  uint32_t wedge = to;
+  do {
+    float distance = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      float delta = state.wedgeAttributes[wedge * count + i] - state.wedgeAttributes[vertex * count + i];
+      distance += delta * delta;
+    }
+    if (distance < bestDistance) {
+      bestDistance = distance;
+      best = wedge;
+    }
+    wedge = state.nextWedges[wedge];
+  } while (wedge != to);
+  return best;
+}
+
+// True if moving from onto to turns any remaining triangle over
+static bool _flipsTriangles(const SimplifierState& state, uint32_t from, uint32_t to) {
+  for (uint32_t t: state.adjacency[from]) {
+    if (state.removed[t]) {
+      continue;
+    }
+    glm::vec3 before[3];
+    glm::vec3 after[3];
+    bool degenerate = false;
+    for (int c = 0; c < 3; ++c) {
+      uint32_t r = state.getRepresentative(3 * t + c);
+      degenerate |= (r == to);
+      before[c] = state.positions[r];
+      after[c] = state.positions[r == from ? to : r];
+    }
+    if (degenerate) {
+      continue;
+    }
+    glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+    glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+    if (glm::dot(normalBefore, normalAfter) <= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void _collapse(SimplifierState& state, const Collapse& collapse) {
+  for (uint32_t t: state.adjacency[collapse.from]) {
+    if (state.removed[t]) {
+      continue;
+    }
+    // Later collapses of this pass must not see these triangles change
+    bool degenerate = false;
+    for (int c = 0; c < 3; ++c) {
+      uint32_t r = state.getRepresentative(3 * t + c);
+      state.touched[r] = state.pass;
+      degenerate |= (r == collapse.to);
+    }
+    if (degenerate) {
+      state.removed[t] = true;
+      state.liveTriangles--;
+      continue;
+    }
+    for (int c = 0; c < 3; ++c) {
+      uint32_t& vertex = state.corners[3 * t + c];
+      if (state.representatives[vertex] == collapse.from) {
+        vertex = _pickWedge(state, collapse.to, vertex);
+      }
+    }
+    state.adjacency[collapse.to].push_back(t);
+  }
+  state.adjacency[collapse.from] = {};
+  state.quadrics[collapse.to].add(state.quadrics[collapse.from]);
+  state.maxError = std::max(state.maxError, collapse.error);
+}
+
+// Collapses the cheapest edges, each vertex at most once, until
+// targetTriangles remain. Returns false when no edge can collapse.
+static bool _collapsePass(SimplifierState& state, uint32_t targetTriangles) {
+  std::vector<uint64_t> edges;
+  for (size_t t = 0; t < state.removed.size(); ++t) {
+    if (state.removed[t]) {
+      continue;
+    }
+    for (int c = 0; c < 3; ++c) {
+      uint32_t a = state.getRepresentative(3 * t + c);
+      uint32_t b = state.getRepresentative(3 * t + (c + 1) % 3);
+      edges.push_back((uint64_t)std::min(a, b) << 32 | std::max(a, b));
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+  std::vector<Collapse> collapses;
+  for (uint64_t edge: edges) {
+    uint32_t a = edge >> 32;
+    uint32_t b = edge & 0xFFFFFFFF;
+    Collapse best = { 0, 0, INFINITY };
+    for (auto [from, to]: { std::make_pair(a, b), std::make_pair(b, a) }) {
+      if (state.locked[from] || state.dominantJoints[from] != state.dominantJoints[to]) {
+        continue;
+      }
+      Quadric quadric = state.quadrics[from];
+      quadric.add(state.quadrics[to]);
+      double error = quadric.getError(state.positions[to]);
+      if (error < best.error) {
+        best = { from, to, error };
+      }
+    }
+    if (best.error != INFINITY) {
+      collapses.push_back(best);
+    }
+  }
+  std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) {
+    return a.error < b.error;
+  });
+
+  state.pass++;
+  bool collapsed = false;
+  for (const Collapse& collapse: collapses) {
+    if (state.liveTriangles <= targetTriangles) {
+      break;
+    }
+    if (
+      state.touched[collapse.from] == state.pass
+      || state.touched[collapse.to] == state.pass
+      || _flipsTriangles(state, collapse.from, collapse.to)
+    ) {
+      continue;
+    }
+    _collapse(state, collapse);
+    collapsed = true;
+  }
+  return collapsed;
+}
+
+uint32_t generateLods(
+  MeshPrimitive& meshPrimitive,
+  std::vector<std::unique_ptr<OwnedAccessor>>& storage,
+  const SimplifierSettings& settings
+) {
+  if (
+    !meshPrimitive.indices
+    || meshPrimitive.mode != MeshPrimitive::Mode::Triangles
+    || meshPrimitive.attributes.count("POSITION") == 0
+  ) {
+    return 0;
+  }
+
+  std::vector<uint32_t> indices(meshPrimitive.indices->count);
+  for (uint32_t i = 0; i < indices.size(); ++i) {
+    indices[i] = meshPrimitive.indices->getIndex(i);
+  }
+
+  SimplifierState state;
+  _readAttributes(meshPrimitive, state);
+  _weldVertices(state);
+  _buildTopology(state, indices);
+  uint32_t vertexCount = state.positions.size();
+
+  meshPrimitive.lods.clear();
+  uint32_t previousTriangles = state.liveTriangles;
+  for (uint32_t level = 0; level < settings.maxLods; ++level) {
+    uint32_t targetTriangles = previousTriangles * settings.reduction;
+    while (
+      state.liveTriangles > targetTriangles
+      && _collapsePass(state, targetTriangles)
+    ) {}
+
+    if (state.liveTriangles > previousTriangles * (1 - settings.minReduction)) {
+      break;
+    }
+
+    std::vector<uint32_t> lodIndices;
+    lodIndices.reserve(3 * state.liveTriangles);
+    for (size_t t = 0; t < state.removed.size(); ++t) {
+      if (!state.removed[t]) {
+        lodIndices.insert(
+          lodIndices.end(),
+          state.corners.begin() + 3 * t, state.corners.begin() + 3 * t + 3
+        );
+      }
+    }
+    storage.push_back(createIndexAccessor(lodIndices, vertexCount));
+    meshPrimitive.lods.push_back({
+      &storage.back()->accessor, (float)std::sqrt(state.maxError)
+    });
+    previousTriangles = state.liveTriangles;
+  }
+
+  return meshPrimitive.lods.size();
+}
@@ -0,0 +1,32 @@
+
+#ifndef SIMPLIFIER_H
+#define SIMPLIFIER_H
+
+#include <memory>
+#include <vector>
+
+#include "Primitives.hpp"
+
+struct SimplifierSettings {
+  // Coarser levels built per primitive, at most
+  uint32_t maxLods = 4;
+  // Triangles kept by each level relative to the previous one
+  float reduction = 0.5f;
+  // A level removing less than this fraction of the previous one's
+  // triangles ends the chain
+  float minReduction = 0.1f;
+};
+
+// Builds a chain of LOD index buffers over the primitive's own vertices,
+// through quadric error metric edge collapses. Vertices on borders, UV
+// seams or hard edges never move, and collapses between vertices driven
+// by different joints are rejected.
+// Only indexed triangle lists are simplified. The index buffers are
+// appended to storage. Returns the number of levels added.
+uint32_t generateLods(
+  MeshPrimitive& meshPrimitive,
+  std::vector<std::unique_ptr<OwnedAccessor>>& storage,
+  const SimplifierSettings& settings = {}
+);
+
+#endif // !SIMPLIFIER_H
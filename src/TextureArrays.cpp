@@ -0,0 +1,129 @@
+
+#include <algorithm>
+#include <tuple>
+
+#include "TextureArrays.hpp"
+#include "GlState.hpp"
+#include "ThreadPool.hpp"
+
+// Textures sharing all of these can be layers of the same array
+static auto _getKind(const TextureData& texture) {
+  return std::make_tuple(
+    texture.width, texture.height, texture.levels.size(), texture.internalFormat,
+    texture.sampler.magFilter, texture.sampler.minFilter,
+    texture.sampler.wrapS, texture.sampler.wrapT
+  );
+}
+
+TextureArrays::~TextureArrays() {
+  for (const Array& array: m_arrays) {
+    if (array.handle != 0) {
+      glMakeTextureHandleNonResidentARB(array.handle);
+    }
+    GlState::get().deleteTexture(array.texId);
+  }
+}
+
+void TextureArrays::addTextures(
+  const std::vector<TextureData*>& textures, bool bindless,
+  ThreadPool* threadPool
+) {
+  std::vector<TextureData*> added;
+  for (TextureData* texture: textures) {
+    if (!texture->isLoaded() && texture->width > 0 && texture->height > 0) {
+      added.push_back(texture);
+    }
+  }
+  std::sort(added.begin(), added.end());
+  added.erase(std::unique(added.begin(), added.end()), added.end());
+
+  parallelFor(threadPool, added.size(), [&](uint32_t i, uint32_t) {
+    added[i]->buildMipChain();
+  });
+
+  std::stable_sort(
+    added.begin(), added.end(),
+    [](const TextureData* a, const TextureData* b) {
+      return _getKind(*a) < _getKind(*b);
+    }
+  );
+  GLint maxLayers = 0;
+  glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+  bool useHandles = bindless && GLEW_ARB_bindless_texture;
+
+  // Runs of the same kind, split at the layer limit
+  for (size_t begin = 0, end = 0; begin < added.size(); begin = end) {
+    end = begin + 1;
+    while (
+      end < added.size() && end - begin < (size_t)maxLayers
+      && _getKind(*added[end]) == _getKind(*added[begin])
+    ) {
+      end++;
+    }
+
+    const TextureData& first = *added[begin];
+    Array array { 0, 0 };
+    glGenTextures(1, &array.texId);
+    GlState::get().bindTexture(0, GL_TEXTURE_2D_ARRAY, array.texId);
+    if (first.sampler.magFilter != fx::gltf::Sampler::MagFilter::None) {
+      glTexParameteri(
+        GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, (GLint)first.sampler.magFilter
+      );
+    }
+    if (first.sampler.minFilter != fx::gltf::Sampler::MinFilter::None) {
+      glTexParameteri(
+        GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, (GLint)first.sampler.minFilter
+      );
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, (GLint)first.sampler.wrapS);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, (GLint)first.sampler.wrapT);
+    glTexStorage3D(
+      GL_TEXTURE_2D_ARRAY, first.levels.size(), first.internalFormat,
+      first.width, first.height, end - begin
+    );
+
+    for (size_t i = begin; i < end; ++i) {
+      TextureData& texture = *added[i];
+      GLint layer = i - begin;
+      for (uint32_t level = 0; level < texture.levels.size(); ++level) {
+        const TextureLevel& textureLevel = texture.levels[level];
+        GLsizei levelWidth = std::max(texture.width >> level, 1);
+        GLsizei levelHeight = std::max(texture.height >> level, 1);
+        const uint8_t* levelData = texture.data.data() + textureLevel.byteOffset;
+        if (texture.compressed) {
+          glCompressedTexSubImage3D(
+            GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelWidth, levelHeight, 1,
+            texture.internalFormat, textureLevel.byteLength, levelData
+          );
+        }
+        else {
+          glTexSubImage3D(
+            GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelWidth, levelHeight, 1,
+            GL_RGBA, GL_UNSIGNED_BYTE, levelData
+          );
+        }
+      }
+      texture.arrayTexId = array.texId;
+      texture.arrayLayer = layer;
+      m_stats.bytes += texture.getLevelBytes(0);
+    }
+
+    // The array is immutable from here on
+    if (useHandles) {
+      array.handle = glGetTextureHandleARB(array.texId);
+      glMakeTextureHandleResidentARB(array.handle);
+      for (size_t i = begin; i < end; ++i) {
+        added[i]->arrayHandle = array.handle;
+      }
+    }
+    m_arrays.push_back(array);
+    m_stats.arrayCount++;
+  }
+
+  m_stats.textureCount += added.size();
+  m_stats.bindless = m_stats.bindless || (useHandles && !added.empty());
+}
+
+const TextureArrayStats& TextureArrays::getStats() const {
+  return m_stats;
+}
@@ -0,0 +1,60 @@
+
+#ifndef TEXTURE_ARRAYS_H
+#define TEXTURE_ARRAYS_H
+
+#include <GL/glew.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Primitives.hpp"
+
+class ThreadPool;
+
+struct TextureArrayStats {
+  uint32_t textureCount = 0;
+  uint32_t arrayCount = 0;
+  size_t bytes = 0;
+  // Arrays referenced by handle instead of bound
+  bool bindless = false;
+};
+
+// Packs textures of the same size, level count, format and sampler into
+// the layers of shared 2D array textures. Draws of different materials
+// then sample the same bound arrays, picking their layer from the
+// DrawData block, so that changing materials no longer changes texture
+// bindings. With ARB_bindless_texture, the arrays are also made resident
+// and draws reference them by handle, without binding anything.
+// Packed textures have no texture of their own, and cannot be streamed.
+class TextureArrays {
+public:
+  TextureArrays() = default;
+  TextureArrays(const TextureArrays&) = delete;
+  TextureArrays(TextureArrays&&) = delete;
+  ~TextureArrays();
+
+  // Builds the missing mip chains on the pool, then uploads the textures
+  // into new arrays, each grouping the textures of one kind. Textures
+  // already on the GPU are left alone. Bindless handles are only made
+  // when the driver supports them. Must run on the thread owning the GL
+  // context, before gpuLoadAll.
+  void addTextures(
+    const std::vector<TextureData*>& textures, bool bindless = false,
+    ThreadPool* threadPool = nullptr
+  );
+
+  const TextureArrayStats& getStats() const;
+
+private:
+  struct Array {
+    GLuint texId;
+    GLuint64 handle;
+  };
+
+  std::vector<Array> m_arrays;
+
+  TextureArrayStats m_stats;
+};
+
+#endif // !TEXTURE_ARRAYS_H
@@ -0,0 +1,200 @@
+
+#include <algorithm>
+#include <cassert>
+
+#include "TextureStreamer.hpp"
+#include "ThreadPool.hpp"
+#include "Profiler.hpp"
+
+TextureStreamer::TextureStreamer(size_t budgetBytes, size_t uploadBytesPerFrame)
+  : m_uploadBytesPerFrame(uploadBytesPerFrame)
+{
+  m_stats.budgetBytes = budgetBytes;
+}
+
+void TextureStreamer::setViewportHeight(float viewportHeight) {
+  m_viewportHeight = viewportHeight;
+}
+
+float TextureStreamer::getViewportHeight() const {
+  return m_viewportHeight;
+}
+
+void TextureStreamer::addTextures(
+  const std::vector<TextureData*>& textures, ThreadPool* threadPool
+) {
+  std::vector<TextureData*> added;
+  for (TextureData* texture: textures) {
+    if (
+      texture->isLoaded() || texture->width <= 0 || texture->height <= 0
+      || m_entryIndices.count(texture) > 0
+    ) {
+      continue;
+    }
+    m_entryIndices[texture] = m_entries.size() + added.size();
+    added.push_back(texture);
+  }
+
+  parallelFor(threadPool, added.size(), [&](uint32_t i, uint32_t) {
+    added[i]->buildMipChain();
+  });
+
+  for (TextureData* texture: added) {
+    uint32_t coarseLevel = 0;
+    while (
+      coarseLevel + 1 < texture->levels.size()
+      && std::max(texture->width >> coarseLevel, texture->height >> coarseLevel)
+        > MIN_RESIDENT_SIZE
+    ) {
+      coarseLevel++;
+    }
+    texture->residentLevel = coarseLevel;
+    texture->loadToGpu();
+
+    m_entries.push_back(Entry { texture, coarseLevel, coarseLevel, 0 });
+    m_stats.textureCount++;
+    m_stats.fullBytes += texture->getLevelBytes(0);
+    m_stats.residentBytes += texture->getLevelBytes(coarseLevel);
+  }
+}
+
+void TextureStreamer::request(const std::vector<TextureRequest>& requests) {
+  for (const TextureRequest& textureRequest: requests) {
+    auto it = m_entryIndices.find(textureRequest.texture);
+    if (it == m_entryIndices.end()) {
+      continue;
+    }
+    Entry& entry = m_entries[it->second];
+
+    // Rounded down, so magnification is never needed
+    uint32_t level = textureRequest.level > 0
+      ? (uint32_t)std::min(textureRequest.level, (float)entry.coarseLevel)
+      : 0;
+    if (entry.lastRequestFrame != m_frame) {
+      entry.requestedLevel = level;
+      entry.lastRequestFrame = m_frame;
+    }
+    else {
+      entry.requestedLevel = std::min(entry.requestedLevel, level);
+    }
+  }
+}
+
+void TextureStreamer::update() {
+  ProfileZone zone("stream textures");
+
+  m_stats.requestedTextures = 0;
+  m_stats.misses = 0;
+  m_stats.uploadedLevels = 0;
+  m_stats.uploadedBytes = 0;
+  m_stats.evictedLevels = 0;
+
+  std::vector<uint32_t> missing;
+  for (uint32_t i = 0; i < m_entries.size(); ++i) {
+    const Entry& entry = m_entries[i];
+    if (entry.lastRequestFrame != m_frame) {
+      continue;
+    }
+    m_stats.requestedTextures++;
+    if (entry.texture->residentLevel > entry.requestedLevel) {
+      missing.push_back(i);
+    }
+  }
+  m_stats.misses = missing.size();
+
+  // The most blurred first
+  std::sort(missing.begin(), missing.end(), [&](uint32_t a, uint32_t b) {
+    const Entry& entryA = m_entries[a];
+    const Entry& entryB = m_entries[b];
+    return (
+      entryA.texture->residentLevel - entryA.requestedLevel
+      > entryB.texture->residentLevel - entryB.requestedLevel
+    );
+  });
+
+  size_t uploadLeft = m_uploadBytesPerFrame;
+  for (uint32_t i: missing) {
+    Entry& entry = m_entries[i];
+    const TextureData& texture = *entry.texture;
+    size_t residentBytes = texture.getLevelBytes(texture.residentLevel);
+
+    // Past the frame's allowance, levels come in one at a time over the
+    // next frames, and the first one of a frame is always let through
+    uint32_t level = entry.requestedLevel;
+    while (
+      level + 1 < texture.residentLevel
+      && texture.getLevelBytes(level) - residentBytes > uploadLeft
+    ) {
+      level++;
+    }
+    size_t bytes = texture.getLevelBytes(level) - residentBytes;
+    if (bytes > uploadLeft && m_stats.uploadedLevels > 0) {
+      break;
+    }
+
+    if (m_stats.residentBytes + bytes > m_stats.budgetBytes) {
+      this->evict(m_stats.residentBytes + bytes - m_stats.budgetBytes);
+    }
+    while (
+      level < texture.residentLevel
+      && m_stats.residentBytes + texture.getLevelBytes(level) - residentBytes
+        > m_stats.budgetBytes
+    ) {
+      level++;
+    }
+    if (level == texture.residentLevel) {
+      continue;
+    }
+
+    bytes = texture.getLevelBytes(level) - residentBytes;
+    m_stats.uploadedLevels += texture.residentLevel - level;
+    m_stats.uploadedBytes += bytes;
+    uploadLeft -= std::min(bytes, uploadLeft);
+    this->setResidentLevel(entry, level);
+  }
+
+  m_frame++;
+}
+
+const TextureStreamingStats& TextureStreamer::getStats() const {
+  return m_stats;
+}
+
+uint32_t TextureStreamer::getKeptLevel(const Entry& entry) const {
+  return entry.lastRequestFrame == m_frame ? entry.requestedLevel : entry.coarseLevel;
+}
+
+void TextureStreamer::evict(size_t bytes) {
+  std::vector<uint32_t> candidates;
+  for (uint32_t i = 0; i < m_entries.size(); ++i) {
+    if (m_entries[i].texture->residentLevel < this->getKeptLevel(m_entries[i])) {
+      candidates.push_back(i);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b) {
+    return m_entries[a].lastRequestFrame < m_entries[b].lastRequestFrame;
+  });
+
+  size_t freedBytes = 0;
+  for (uint32_t i: candidates) {
+    if (freedBytes >= bytes) {
+      break;
+    }
+    Entry& entry = m_entries[i];
+    uint32_t level = this->getKeptLevel(entry);
+    const TextureData& texture = *entry.texture;
+    freedBytes += (
+      texture.getLevelBytes(texture.residentLevel) - texture.getLevelBytes(level)
+    );
+    m_stats.evictedLevels += level - texture.residentLevel;
+    this->setResidentLevel(entry, level);
+  }
+}
+
+void TextureStreamer::setResidentLevel(Entry& entry, uint32_t level) {
+  TextureData& texture = *entry.texture;
+  assert(level <= entry.coarseLevel);
+  m_stats.residentBytes -= texture.getLevelBytes(texture.residentLevel);
+  texture.setResidentLevel(level);
+  m_stats.residentBytes += texture.getLevelBytes(level);
+}
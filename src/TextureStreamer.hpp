@@ -0,0 +1,101 @@
+
+#ifndef TEXTURE_STREAMER_H
+#define TEXTURE_STREAMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "Primitives.hpp"
+
+class ThreadPool;
+
+// Mip level a draw samples a texture at, fractional and possibly out of
+// the texture's range
+struct TextureRequest {
+  const TextureData* texture = nullptr;
+  float level = 0;
+};
+
+struct TextureStreamingStats {
+  size_t budgetBytes = 0;
+  size_t residentBytes = 0;
+  // With every level resident
+  size_t fullBytes = 0;
+  uint32_t textureCount = 0;
+
+  // Of the last update: textures drawn, and of those, drawn with a
+  // coarser level than they needed
+  uint32_t requestedTextures = 0;
+  uint32_t misses = 0;
+  uint32_t uploadedLevels = 0;
+  size_t uploadedBytes = 0;
+  uint32_t evictedLevels = 0;
+};
+
+// Keeps the levels of the textures that draws need on the GPU, within a
+// memory budget. Textures start with only their coarse levels, finer
+// ones are uploaded from the CPU copy once requested, and dropped again
+// from the least recently requested textures when the budget is short.
+class TextureStreamer {
+public:
+  // Levels up to this size are loaded up front and never dropped
+  static constexpr int MIN_RESIDENT_SIZE = 64;
+
+  explicit TextureStreamer(
+    size_t budgetBytes, size_t uploadBytesPerFrame = 16 << 20
+  );
+  TextureStreamer(const TextureStreamer&) = delete;
+  TextureStreamer(TextureStreamer&&) = delete;
+
+  // Height of the viewport in pixels, to convert projected sizes
+  void setViewportHeight(float viewportHeight);
+  float getViewportHeight() const;
+
+  // Builds the missing mip chains on the pool, then loads the coarse
+  // levels. Textures already on the GPU are left alone. Must run on the
+  // thread owning the GL context.
+  void addTextures(
+    const std::vector<TextureData*>& textures, ThreadPool* threadPool = nullptr
+  );
+
+  // Collects the requests of this frame, such as those of the draw lists
+  void request(const std::vector<TextureRequest>& requests);
+
+  // Uploads the requested levels and drops unused ones to fit the budget,
+  // then starts a new frame. Must run on the thread owning the GL
+  // context, before the draws are submitted.
+  void update();
+
+  const TextureStreamingStats& getStats() const;
+
+private:
+  struct Entry {
+    TextureData* texture;
+    // Resident from the start
+    uint32_t coarseLevel;
+    // Finest level requested this frame
+    uint32_t requestedLevel;
+    uint64_t lastRequestFrame;
+  };
+
+  // The level an entry can be dropped to
+  uint32_t getKeptLevel(const Entry& entry) const;
+  // Frees at least bytes, or as much as possible, from the least
+  // recently requested entries
+  void evict(size_t bytes);
+  void setResidentLevel(Entry& entry, uint32_t level);
+
+  std::vector<Entry> m_entries;
+  std::unordered_map<const TextureData*, uint32_t> m_entryIndices;
+
+  size_t m_uploadBytesPerFrame;
+  float m_viewportHeight = 800;
+  // Starts at 1, so no entry is requested before any request
+  uint64_t m_frame = 1;
+
+  TextureStreamingStats m_stats;
+};
+
+#endif // !TEXTURE_STREAMER_H
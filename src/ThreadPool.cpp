@@ -0,0 +1,106 @@
+
+#include <cassert>
+#include <algorithm>
+
+#include "ThreadPool.hpp"
+#include "Profiler.hpp"
+
+ThreadPool::ThreadPool(uint32_t threadCount) {
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (uint32_t i = 1; i < threadCount; ++i) {
+    m_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_wakeCondition.notify_all();
+  for (std::thread& worker: m_workers) {
+    worker.join();
+  }
+}
+
+uint32_t ThreadPool::getThreadCount() const {
+  return m_workers.size() + 1;
+}
+
+void ThreadPool::runJobs(uint32_t threadIndex) {
+  ProfileZone zone("parallelFor");
+  for (;;) {
+    uint32_t index = m_nextIndex.fetch_add(1, std::memory_order_relaxed);
+    if (index >= m_jobCount) {
+      return;
+    }
+    (*m_job)(index, threadIndex);
+  }
+}
+
+void ThreadPool::workerLoop(uint32_t threadIndex) {
+  uint64_t seenGeneration = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeCondition.wait(lock, [&]() {
+        return m_stopping || m_generation != seenGeneration;
+      });
+      if (m_stopping) {
+        return;
+      }
+      seenGeneration = m_generation;
+    }
+
+    this->runJobs(threadIndex);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_busyWorkers--;
+    }
+    m_doneCondition.notify_one();
+  }
+}
+
+void ThreadPool::parallelFor(uint32_t count, const Job& job) {
+  assert(!m_job);
+  if (count == 0) {
+    return;
+  }
+  if (count == 1 || m_workers.empty()) {
+    for (uint32_t i = 0; i < count; ++i) {
+      job(i, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_job = &job;
+    m_jobCount = count;
+    m_nextIndex.store(0, std::memory_order_relaxed);
+    m_busyWorkers = m_workers.size();
+    m_generation++;
+  }
+  m_wakeCondition.notify_all();
+
+  this->runJobs(0);
+
+  // Workers still reference the job until they report back
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_doneCondition.wait(lock, [&]() { return m_busyWorkers == 0; });
+  m_job = nullptr;
+}
+
+void parallelFor(ThreadPool* pool, uint32_t count, const ThreadPool::Job& job) {
+  if (pool) {
+    pool->parallelFor(count, job);
+  }
+  else {
+    for (uint32_t i = 0; i < count; ++i) {
+      job(i, 0);
+    }
+  }
+}
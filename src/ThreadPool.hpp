@@ -0,0 +1,55 @@
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running data-parallel loops.
+// The thread calling parallelFor() takes part in the work, so a pool of
+// N threads only spawns N - 1 workers.
+class ThreadPool {
+public:
+  using Job = std::function<void(uint32_t index, uint32_t threadIndex)>;
+
+  // 0 means one thread per hardware thread
+  explicit ThreadPool(uint32_t threadCount = 0);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool(ThreadPool&&) = delete;
+  ~ThreadPool();
+
+  uint32_t getThreadCount() const;
+
+  // Calls job for every index in [0, count) and returns once all calls
+  // are done. threadIndex is in [0, getThreadCount()), and is stable for
+  // the duration of a call, to index per-thread scratch data.
+  // Must not be called from inside a job.
+  void parallelFor(uint32_t count, const Job& job);
+
+private:
+  void workerLoop(uint32_t threadIndex);
+  void runJobs(uint32_t threadIndex);
+
+  std::vector<std::thread> m_workers;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wakeCondition;
+  std::condition_variable m_doneCondition;
+  uint64_t m_generation = 0;
+  uint32_t m_busyWorkers = 0;
+  bool m_stopping = false;
+
+  const Job* m_job = nullptr;
+  uint32_t m_jobCount = 0;
+  std::atomic<uint32_t> m_nextIndex{0};
+};
+
+// Runs serially on the calling thread when pool is null
+void parallelFor(ThreadPool* pool, uint32_t count, const ThreadPool::Job& job);
+
+#endif // !THREAD_POOL_H
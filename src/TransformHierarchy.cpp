@@ -0,0 +1,409 @@
+
+#include <cassert>
+#include <array>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "TransformHierarchy.hpp"
+#include "Simd.hpp"
+
+static const std::array<float, 16> IDENTITY_MATRIX = {
+  1, 0, 0, 0,
+  0, 1, 0, 0,
+  0, 0, 1, 0,
+  0, 0, 0, 1
+};
+
+// Streams of the local matrix kernel scratch buffer
+enum {
+  TX, TY, TZ,
+  QX, QY, QZ, QW,
+  SX, SY, SZ,
+  // Output, the three scaled rotation columns
+  M00, M01, M02,
+  M10, M11, M12,
+  M20, M21, M22,
+  STREAM_COUNT
+};
+
+TransformHierarchy::TransformHierarchy(
+  const AssetManager& assets, size_t assetId, uint32_t sceneIndex
+) {
+  const fx::gltf::Document& document = *assets.getAsset(assetId);
+
+  m_slots.assign(document.nodes.size(), NONE);
+  if (sceneIndex < document.scenes.size()) {
+    for (uint32_t rootNode: document.scenes[sceneIndex].nodes) {
+      addNode(assets, assetId, rootNode, NONE);
+    }
+  }
+
+  uint32_t count = this->size();
+  m_localDirty.assign(count, 0);
+  m_worldDirty.assign(count, 0);
+  m_boundsDirty.assign(count, 0);
+  m_world.resize(count);
+  m_worldNormal.resize(count);
+  m_worldBounds.resize(count);
+  m_subtreeBounds.resize(count);
+
+  for (uint32_t slot = 0; slot < count; ++slot) {
+    if (!m_hasMatrix[slot]) {
+      m_localDirty[slot] = 1;
+      m_dirtySlots.push_back(slot);
+    }
+  }
+
+  // Descend until subtrees are small enough
+  for (uint32_t slot = 0; slot < count;) {
+    uint32_t subtreeEnd = m_subtreeEnds[slot];
+    if (subtreeEnd - slot <= TASK_GRAIN) {
+      m_tasks.push_back({ slot, subtreeEnd, true });
+      slot = subtreeEnd;
+    }
+    else {
+      m_tasks.push_back({ slot, slot + 1, false });
+      slot++;
+    }
+  }
+}
+
+void TransformHierarchy::addNode(
+  const AssetManager& assets, size_t assetId,
+  uint32_t nodeIndex, uint32_t parentSlot
+) {
+  const fx::gltf::Node& node = assets.getAsset(assetId)->nodes[nodeIndex];
+  uint32_t slot = this->size();
+
+  assert(m_slots[nodeIndex] == NONE);
+  m_slots[nodeIndex] = slot;
+  m_nodeIndices.push_back(nodeIndex);
+  m_parents.push_back(parentSlot);
+  m_subtreeEnds.push_back(slot + 1);
+
+  for (int i = 0; i < 3; ++i) {
+    m_translations[i].push_back(node.translation[i]);
+    m_scales[i].push_back(node.scale[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    m_rotations[i].push_back(node.rotation[i]);
+  }
+
+  // A node has either a matrix or TRS properties, never both
+  bool hasMatrix = node.matrix != IDENTITY_MATRIX;
+  m_hasMatrix.push_back(hasMatrix);
+  m_local.push_back(
+    hasMatrix ? glm::make_mat4(node.matrix.data()) : glm::mat4(1)
+  );
+
+  Aabb bounds = {};
+  uint32_t primitiveCount = 0;
+  if (node.mesh != -1) {
+    const Mesh& mesh = *assets.getMesh(assetId, node.mesh);
+    bounds = node.skin != -1 ? Aabb::infinite() : mesh.bounds;
+    primitiveCount = mesh.primitives.size();
+  }
+  m_localBounds.push_back(bounds);
+  m_subtreePrimitiveCounts.push_back(primitiveCount);
+
+  for (int32_t childIndex: node.children) {
+    addNode(assets, assetId, childIndex, slot);
+    m_subtreePrimitiveCounts[slot] += m_subtreePrimitiveCounts[m_slots[childIndex]];
+  }
+  m_subtreeEnds[slot] = this->size();
+}
+
+uint32_t TransformHierarchy::size() const {
+  return m_nodeIndices.size();
+}
+
+uint32_t TransformHierarchy::getSlot(uint32_t nodeIndex) const {
+  return m_slots[nodeIndex];
+}
+
+uint32_t TransformHierarchy::getNodeIndex(uint32_t slot) const {
+  return m_nodeIndices[slot];
+}
+
+uint32_t TransformHierarchy::getParent(uint32_t slot) const {
+  return m_parents[slot];
+}
+
+uint32_t TransformHierarchy::getSubtreeEnd(uint32_t slot) const {
+  return m_subtreeEnds[slot];
+}
+
+uint32_t TransformHierarchy::getSubtreePrimitiveCount(uint32_t slot) const {
+  return m_subtreePrimitiveCounts[slot];
+}
+
+const std::vector<TransformHierarchy::Task>& TransformHierarchy::getTasks() const {
+  return m_tasks;
+}
+
+void TransformHierarchy::setRootTransform(const glm::mat4& transform) {
+  if (transform != m_rootTransform) {
+    m_rootTransform = transform;
+    m_rootDirty = true;
+  }
+}
+
+template <int N, typename T>
+static bool _setComponents(
+  std::vector<float> (&streams)[N], uint32_t slot, const T& value
+) {
+  bool changed = false;
+  for (int i = 0; i < N; ++i) {
+    changed |= (streams[i][slot] != value[i]);
+    streams[i][slot] = value[i];
+  }
+  return changed;
+}
+
+void TransformHierarchy::markDirty(uint32_t slot) {
+  assert(!m_hasMatrix[slot]);
+  if (!m_localDirty[slot]) {
+    m_localDirty[slot] = 1;
+    m_dirtySlots.push_back(slot);
+  }
+}
+
+void TransformHierarchy::setTranslation(
+  uint32_t slot, const glm::vec3& translation
+) {
+  if (_setComponents(m_translations, slot, translation)) {
+    this->markDirty(slot);
+  }
+}
+
+void TransformHierarchy::setRotation(uint32_t slot, const glm::quat& rotation) {
+  if (_setComponents(m_rotations, slot, rotation)) {
+    this->markDirty(slot);
+  }
+}
+
+void TransformHierarchy::setScale(uint32_t slot, const glm::vec3& scale) {
+  if (_setComponents(m_scales, slot, scale)) {
+    this->markDirty(slot);
+  }
+}
+
+void TransformHierarchy::composeLocalMatrices(uint32_t begin, uint32_t end) {
+  const uint32_t* dirtySlots = m_dirtySlots.data() + begin;
+  size_t count = end - begin;
+
+  // Gather the dirty nodes into contiguous streams, padded to the SIMD
+  // width so that the kernel needs no scalar tail
+  size_t stride = simd::roundUp(count);
+  thread_local std::vector<float> scratch;
+  scratch.assign(stride * STREAM_COUNT, 0.0f);
+  float* streams[STREAM_COUNT];
+  for (int i = 0; i < STREAM_COUNT; ++i) {
+    streams[i] = scratch.data() + i * stride;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t slot = dirtySlots[i];
+    for (int j = 0; j < 3; ++j) {
+      streams[TX + j][i] = m_translations[j][slot];
+      streams[SX + j][i] = m_scales[j][slot];
+    }
+    for (int j = 0; j < 4; ++j) {
+      streams[QX + j][i] = m_rotations[j][slot];
+    }
+  }
+
+  // Same expansion as glm::mat3_cast, with each column then scaled
+  const simd::Float one = simd::set1(1);
+  for (size_t i = 0; i < stride; i += simd::WIDTH) {
+    simd::Float qx = simd::load(streams[QX] + i);
+    simd::Float qy = simd::load(streams[QY] + i);
+    simd::Float qz = simd::load(streams[QZ] + i);
+    simd::Float qw = simd::load(streams[QW] + i);
+
+    simd::Float qx2 = simd::add(qx, qx);
+    simd::Float qy2 = simd::add(qy, qy);
+    simd::Float qz2 = simd::add(qz, qz);
+
+    simd::Float xx = simd::mul(qx, qx2);
+    simd::Float yy = simd::mul(qy, qy2);
+    simd::Float zz = simd::mul(qz, qz2);
+    simd::Float xy = simd::mul(qx, qy2);
+    simd::Float xz = simd::mul(qx, qz2);
+    simd::Float yz = simd::mul(qy, qz2);
+    simd::Float wx = simd::mul(qw, qx2);
+    simd::Float wy = simd::mul(qw, qy2);
+    simd::Float wz = simd::mul(qw, qz2);
+
+    simd::Float sx = simd::load(streams[SX] + i);
+    simd::Float sy = simd::load(streams[SY] + i);
+    simd::Float sz = simd::load(streams[SZ] + i);
+
+    simd::store(streams[M00] + i, simd::mul(simd::sub(one, simd::add(yy, zz)), sx));
+    simd::store(streams[M01] + i, simd::mul(simd::add(xy, wz), sx));
+    simd::store(streams[M02] + i, simd::mul(simd::sub(xz, wy), sx));
+
+    simd::store(streams[M10] + i, simd::mul(simd::sub(xy, wz), sy));
+    simd::store(streams[M11] + i, simd::mul(simd::sub(one, simd::add(xx, zz)), sy));
+    simd::store(streams[M12] + i, simd::mul(simd::add(yz, wx), sy));
+
+    simd::store(streams[M20] + i, simd::mul(simd::add(xz, wy), sz));
+    simd::store(streams[M21] + i, simd::mul(simd::sub(yz, wx), sz));
+    simd::store(streams[M22] + i, simd::mul(simd::sub(one, simd::add(xx, yy)), sz));
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    glm::mat4& local = m_local[dirtySlots[i]];
+    for (int column = 0; column < 3; ++column) {
+      for (int row = 0; row < 3; ++row) {
+        local[column][row] = streams[M00 + column * 3 + row][i];
+      }
+      local[column][3] = 0;
+    }
+    local[3] = glm::vec4(streams[TX][i], streams[TY][i], streams[TZ][i], 1);
+  }
+}
+
+uint32_t TransformHierarchy::updateWorld(uint32_t begin, uint32_t end) {
+  // Parents come first, so their world matrix is always up to date by the
+  // time their children are reached
+  uint32_t updatedCount = 0;
+  for (uint32_t slot = begin; slot < end; ++slot) {
+    uint32_t parent = m_parents[slot];
+    bool dirty = m_localDirty[slot]
+      || (parent != NONE ? m_worldDirty[parent] : m_rootDirty);
+    m_worldDirty[slot] = dirty;
+    if (!dirty) {
+      continue;
+    }
+
+    m_world[slot] = this->getParentWorld(slot) * m_local[slot];
+    m_worldNormal[slot] = glm::transpose(glm::inverse(glm::mat3(m_world[slot])));
+    m_worldBounds[slot] = m_localBounds[slot].transformed(m_world[slot]);
+    updatedCount++;
+  }
+  return updatedCount;
+}
+
+void TransformHierarchy::updateSubtreeBounds(uint32_t begin, uint32_t end) {
+  // Children come after their parent, so walking backwards completes
+  // every subtree before it is merged into its parent's
+  for (uint32_t slot = end; slot-- > begin;) {
+    m_subtreeBounds[slot].expand(m_worldBounds[slot]);
+    if (slot != begin) {
+      m_subtreeBounds[m_parents[slot]].expand(m_subtreeBounds[slot]);
+    }
+  }
+}
+
+uint32_t TransformHierarchy::update(ThreadPool* threadPool) {
+  static constexpr uint32_t LOCAL_MATRIX_BATCH = 1024;
+  uint32_t dirtyCount = m_dirtySlots.size();
+  parallelFor(
+    threadPool, (dirtyCount + LOCAL_MATRIX_BATCH - 1) / LOCAL_MATRIX_BATCH,
+    [&](uint32_t batch, uint32_t) {
+      uint32_t begin = batch * LOCAL_MATRIX_BATCH;
+      this->composeLocalMatrices(
+        begin, std::min(begin + LOCAL_MATRIX_BATCH, dirtyCount)
+      );
+    }
+  );
+
+  // Lone nodes have no parent inside a subtree task, so they go first
+  uint32_t updatedCount = 0;
+  for (const Task& task: m_tasks) {
+    if (!task.isSubtree) {
+      uint32_t taskUpdatedCount = this->updateWorld(task.begin, task.end);
+      m_boundsDirty[task.begin] = taskUpdatedCount > 0;
+      updatedCount += taskUpdatedCount;
+    }
+  }
+  std::atomic<uint32_t> subtreeUpdatedCount(0);
+  parallelFor(threadPool, m_tasks.size(), [&](uint32_t taskIndex, uint32_t) {
+    const Task& task = m_tasks[taskIndex];
+    if (task.isSubtree) {
+      uint32_t taskUpdatedCount = this->updateWorld(task.begin, task.end);
+      m_boundsDirty[task.begin] = taskUpdatedCount > 0;
+      subtreeUpdatedCount += taskUpdatedCount;
+    }
+  });
+  updatedCount += subtreeUpdatedCount;
+
+  for (uint32_t slot: m_dirtySlots) {
+    m_localDirty[slot] = 0;
+  }
+  m_dirtySlots.clear();
+  m_rootDirty = false;
+
+  if (updatedCount > 0) {
+    // Only the tasks with updated slots, and the lone nodes above them,
+    // are merged again; the other tasks keep their bounds
+    for (size_t i = m_tasks.size(); i-- > 0;) {
+      uint32_t slot = m_tasks[i].begin;
+      if (!m_boundsDirty[slot]) {
+        continue;
+      }
+      if (!m_tasks[i].isSubtree) {
+        m_subtreeBounds[slot] = Aabb {};
+      }
+      if (m_parents[slot] != NONE) {
+        m_boundsDirty[m_parents[slot]] = 1;
+      }
+    }
+    parallelFor(threadPool, m_tasks.size(), [&](uint32_t taskIndex, uint32_t) {
+      const Task& task = m_tasks[taskIndex];
+      if (task.isSubtree && m_boundsDirty[task.begin]) {
+        std::fill(
+          m_subtreeBounds.begin() + task.begin,
+          m_subtreeBounds.begin() + task.end, Aabb {}
+        );
+        this->updateSubtreeBounds(task.begin, task.end);
+      }
+    });
+    // Then merge the tasks' roots upwards through the lone nodes
+    for (size_t i = m_tasks.size(); i-- > 0;) {
+      uint32_t slot = m_tasks[i].begin;
+      uint32_t parent = m_parents[slot];
+      if (!m_tasks[i].isSubtree && m_boundsDirty[slot]) {
+        m_subtreeBounds[slot].expand(m_worldBounds[slot]);
+      }
+      if (parent != NONE && m_boundsDirty[parent]) {
+        m_subtreeBounds[parent].expand(m_subtreeBounds[slot]);
+      }
+      // Its children's tasks all come after it, so the flag is done
+      m_boundsDirty[slot] = 0;
+    }
+  }
+
+  return updatedCount;
+}
+
+const glm::mat4& TransformHierarchy::getRootTransform() const {
+  return m_rootTransform;
+}
+
+const glm::mat4& TransformHierarchy::getLocal(uint32_t slot) const {
+  return m_local[slot];
+}
+
+const glm::mat4& TransformHierarchy::getWorld(uint32_t slot) const {
+  return m_world[slot];
+}
+
+const glm::mat3& TransformHierarchy::getWorldNormal(uint32_t slot) const {
+  return m_worldNormal[slot];
+}
+
+const glm::mat4& TransformHierarchy::getParentWorld(uint32_t slot) const {
+  uint32_t parent = m_parents[slot];
+  return parent != NONE ? m_world[parent] : m_rootTransform;
+}
+
+const Aabb& TransformHierarchy::getWorldBounds(uint32_t slot) const {
+  return m_worldBounds[slot];
+}
+
+const Aabb& TransformHierarchy::getSubtreeBounds(uint32_t slot) const {
+  return m_subtreeBounds[slot];
+}
@@ -0,0 +1,115 @@
+
+#ifndef TRANSFORM_HIERARCHY_H
+#define TRANSFORM_HIERARCHY_H
+
+#include <glm/vec3.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "AssetManager.hpp"
+#include "Bounds.hpp"
+#include "ThreadPool.hpp"
+
+// Scene nodes flattened in depth-first order: parents always come before
+// their children, and a node's descendants are the slots right after it,
+// up to getSubtreeEnd().
+// Local and world matrices are cached, and only nodes whose transform
+// changed, or whose ancestors' did, are recomputed by update().
+class TransformHierarchy {
+public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+  // Subtrees up to this size are processed as a single task
+  static constexpr uint32_t TASK_GRAIN = 256;
+
+  // Slots split into independent units of work, in slot order.
+  // Subtree tasks cover a whole subtree; the others are lone nodes with
+  // too many descendants, and must be processed before any subtree task.
+  struct Task {
+    uint32_t begin;
+    uint32_t end;
+    bool isSubtree;
+  };
+
+  TransformHierarchy() = default;
+  TransformHierarchy(
+    const AssetManager& assets, size_t assetId, uint32_t sceneIndex = 0
+  );
+
+  uint32_t size() const;
+
+  uint32_t getSlot(uint32_t nodeIndex) const;
+  uint32_t getNodeIndex(uint32_t slot) const;
+  uint32_t getParent(uint32_t slot) const;
+  uint32_t getSubtreeEnd(uint32_t slot) const;
+  uint32_t getSubtreePrimitiveCount(uint32_t slot) const;
+  const std::vector<Task>& getTasks() const;
+
+  // Setters only mark the node dirty, nothing is computed until update()
+  void setRootTransform(const glm::mat4& transform);
+  void setTranslation(uint32_t slot, const glm::vec3& translation);
+  void setRotation(uint32_t slot, const glm::quat& rotation);
+  void setScale(uint32_t slot, const glm::vec3& scale);
+
+  // Returns the number of world matrices recomputed
+  uint32_t update(ThreadPool* threadPool = nullptr);
+
+  const glm::mat4& getRootTransform() const;
+  const glm::mat4& getLocal(uint32_t slot) const;
+  const glm::mat4& getWorld(uint32_t slot) const;
+  // Inverse transpose of the world matrix, for normals
+  const glm::mat3& getWorldNormal(uint32_t slot) const;
+  // World transform of the parent, or the root transform
+  const glm::mat4& getParentWorld(uint32_t slot) const;
+
+  const Aabb& getWorldBounds(uint32_t slot) const;
+  const Aabb& getSubtreeBounds(uint32_t slot) const;
+
+private:
+  void addNode(
+    const AssetManager& assets, size_t assetId,
+    uint32_t nodeIndex, uint32_t parentSlot
+  );
+  void markDirty(uint32_t slot);
+  void composeLocalMatrices(uint32_t begin, uint32_t end);
+  uint32_t updateWorld(uint32_t begin, uint32_t end);
+  void updateSubtreeBounds(uint32_t begin, uint32_t end);
+
+  glm::mat4 m_rootTransform = glm::mat4(1);
+  bool m_rootDirty = true;
+
+  std::vector<uint32_t> m_slots;
+  std::vector<uint32_t> m_nodeIndices;
+  std::vector<uint32_t> m_parents;
+  std::vector<uint32_t> m_subtreeEnds;
+  std::vector<uint32_t> m_subtreePrimitiveCounts;
+  std::vector<Task> m_tasks;
+
+  // TRS, as structure of arrays for the batched local matrix kernel
+  std::vector<float> m_translations[3];
+  std::vector<float> m_rotations[4];
+  std::vector<float> m_scales[3];
+  // Nodes given as a matrix in the file keep it as their local matrix
+  std::vector<bool> m_hasMatrix;
+
+  std::vector<uint8_t> m_localDirty;
+  std::vector<uint8_t> m_worldDirty;
+  std::vector<uint32_t> m_dirtySlots;
+  // Set on task roots and lone nodes whose subtree bounds must be merged
+  // again
+  std::vector<uint8_t> m_boundsDirty;
+
+  std::vector<glm::mat4> m_local;
+  std::vector<glm::mat4> m_world;
+  std::vector<glm::mat3> m_worldNormal;
+
+  // Object space, infinite for skinned meshes
+  std::vector<Aabb> m_localBounds;
+  std::vector<Aabb> m_worldBounds;
+  std::vector<Aabb> m_subtreeBounds;
+};
+
+#endif // !TRANSFORM_HIERARCHY_H
@@ -0,0 +1,530 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <glm/glm.hpp>
+
+#include "TriangleBvh.hpp"
+#include "Primitives.hpp"
+#include "ThreadPool.hpp"
+
+static constexpr int BIN_COUNT = 16;
+// Ranges this large are binned over the pool, in chunks of the grain
+static constexpr uint32_t PARALLEL_RANGE = 1 << 16;
+static constexpr uint32_t TRIANGLE_GRAIN = 1 << 14;
+// Of a node visit, in triangle tests
+static constexpr float TRAVERSAL_COST = 1;
+// Bounds the traversal stack
+static constexpr uint32_t MAX_DEPTH = 64;
+
+// Tag and version at the start of every cache file, bump the version if
+// the layout changes
+static constexpr uint32_t CACHE_MAGIC = 0x48564254; // "TBVH"
+static constexpr uint32_t CACHE_VERSION = 1;
+
+void TriangleBvhReport::add(const TriangleBvhReport& other) {
+  primitiveCount += other.primitiveCount;
+  triangleCount += other.triangleCount;
+  nodeCount += other.nodeCount;
+  cachedCount += other.cachedCount;
+}
+
+static float _area(const Aabb& box) {
+  if (box.isEmpty()) {
+    return 0;
+  }
+  glm::vec3 size = box.max - box.min;
+  return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+// By triangle, and the triangles of the ranges being split
+struct BuildData {
+  std::vector<Aabb> bounds;
+  std::vector<glm::vec3> centers;
+  std::vector<uint32_t> order;
+};
+
+struct Bins {
+  Aabb bounds[BIN_COUNT];
+  uint32_t counts[BIN_COUNT];
+};
+
+struct BuildTask {
+  uint32_t begin;
+  uint32_t end;
+  uint32_t node;
+  uint32_t depth;
+};
+
+// Runs job on the positions of order in [begin, end), in chunks of the
+// grain when the range is large enough for the pool
+template <typename Job>
+static uint32_t _forEachChunk(
+  ThreadPool* threadPool, uint32_t begin, uint32_t end, const Job& job
+) {
+  uint32_t count = end - begin;
+  uint32_t chunkCount = threadPool && count >= PARALLEL_RANGE
+    ? (count + TRIANGLE_GRAIN - 1) / TRIANGLE_GRAIN
+    : 1;
+  parallelFor(chunkCount > 1 ? threadPool : nullptr, chunkCount, [&](uint32_t chunk, uint32_t) {
+    uint32_t chunkBegin = begin + chunk * TRIANGLE_GRAIN;
+    job(chunk, chunkCount > 1 ? chunkBegin : begin, chunkCount > 1 ? std::min(chunkBegin + TRIANGLE_GRAIN, end) : end);
+  });
+  return chunkCount;
+}
+
+// Splits the range where the areas of both sides, weighted by their
+// triangle counts, are the smallest. Returns false when a leaf costs
+// less, otherwise partitions the range and gives the bounds of each side.
+static bool _split(
+  BuildData& data, const BuildTask& task, const Aabb& bounds,
+  uint32_t& middle, Aabb& leftBounds, Aabb& rightBounds,
+  ThreadPool* threadPool
+) {
+  uint32_t count = task.end - task.begin;
+  if (count == 1 || task.depth + 1 >= MAX_DEPTH) {
+    return false;
+  }
+
+  // Thread locals are referenced, so the pool's threads see this one's
+  thread_local std::vector<Aabb> threadCenterBounds;
+  std::vector<Aabb>& chunkCenterBounds = threadCenterBounds;
+  chunkCenterBounds.assign((count + TRIANGLE_GRAIN - 1) / TRIANGLE_GRAIN, Aabb {});
+  uint32_t chunkCount = _forEachChunk(threadPool, task.begin, task.end, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+    Aabb centerBounds;
+    for (uint32_t i = begin; i < end; ++i) {
+      centerBounds.expand(data.centers[data.order[i]]);
+    }
+    chunkCenterBounds[chunk] = centerBounds;
+  });
+  Aabb centerBounds;
+  for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+    centerBounds.expand(chunkCenterBounds[chunk]);
+  }
+
+  glm::vec3 extents = centerBounds.max - centerBounds.min;
+  int axis = extents.x > extents.y
+    ? (extents.x > extents.z ? 0 : 2)
+    : (extents.y > extents.z ? 1 : 2);
+  float axisMin = centerBounds.min[axis];
+  float binScale = extents[axis] > 0 ? BIN_COUNT / extents[axis] : 0;
+  auto binOf = [&](uint32_t triangle) {
+    int bin = (int)((data.centers[triangle][axis] - axisMin) * binScale);
+    return std::min(bin, BIN_COUNT - 1);
+  };
+
+  int bestSplit = 0;
+  float bestCost = INFINITY;
+  if (binScale > 0) {
+    thread_local std::vector<Bins> threadBins;
+    std::vector<Bins>& chunkBins = threadBins;
+    chunkBins.resize(std::max<size_t>(chunkBins.size(), chunkCount));
+    _forEachChunk(threadPool, task.begin, task.end, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+      Bins& bins = chunkBins[chunk];
+      bins = Bins {};
+      for (uint32_t i = begin; i < end; ++i) {
+        uint32_t triangle = data.order[i];
+        int bin = binOf(triangle);
+        bins.bounds[bin].expand(data.bounds[triangle]);
+        bins.counts[bin]++;
+      }
+    });
+    Bins bins = chunkBins[0];
+    for (uint32_t chunk = 1; chunk < chunkCount; ++chunk) {
+      for (int bin = 0; bin < BIN_COUNT; ++bin) {
+        bins.bounds[bin].expand(chunkBins[chunk].bounds[bin]);
+        bins.counts[bin] += chunkBins[chunk].counts[bin];
+      }
+    }
+
+    // Right sides swept from the end, then left sides from the start
+    float rightCosts[BIN_COUNT];
+    Aabb rightSides[BIN_COUNT];
+    Aabb side;
+    uint32_t sideCount = 0;
+    for (int bin = BIN_COUNT - 1; bin > 0; --bin) {
+      side.expand(bins.bounds[bin]);
+      sideCount += bins.counts[bin];
+      rightSides[bin] = side;
+      rightCosts[bin] = _area(side) * sideCount;
+    }
+    side = Aabb {};
+    sideCount = 0;
+    for (int bin = 0; bin + 1 < BIN_COUNT; ++bin) {
+      side.expand(bins.bounds[bin]);
+      sideCount += bins.counts[bin];
+      float cost = _area(side) * sideCount + rightCosts[bin + 1];
+      if (sideCount > 0 && sideCount < count && cost < bestCost) {
+        bestCost = cost;
+        bestSplit = bin + 1;
+        leftBounds = side;
+        rightBounds = rightSides[bin + 1];
+      }
+    }
+  }
+
+  float splitCost = TRAVERSAL_COST + bestCost / _area(bounds);
+  if (count <= TriangleBvh::MAX_LEAF_TRIANGLES && !(splitCost < count)) {
+    return false;
+  }
+
+  auto begin = data.order.begin() + task.begin;
+  auto end = data.order.begin() + task.end;
+  if (bestSplit > 0) {
+    middle = std::partition(begin, end, [&](uint32_t triangle) {
+      return binOf(triangle) < bestSplit;
+    }) - data.order.begin();
+    return true;
+  }
+
+  // Coincident centers: halves of the range
+  middle = task.begin + count / 2;
+  leftBounds = Aabb {};
+  rightBounds = Aabb {};
+  for (uint32_t i = task.begin; i < task.end; ++i) {
+    (i < middle ? leftBounds : rightBounds).expand(data.bounds[data.order[i]]);
+  }
+  return true;
+}
+
+static TriangleBvh::Node _makeNode(const Aabb& bounds) {
+  return TriangleBvh::Node { bounds.min, 0, bounds.max, 0 };
+}
+
+// Splits the task's range down to the leaves, numbering the nodes from
+// the task's own, which is nodes[firstNode]
+static void _buildNodes(
+  BuildData& data, const BuildTask& rootTask,
+  std::vector<TriangleBvh::Node>& nodes, uint32_t firstNode,
+  ThreadPool* threadPool, std::vector<BuildTask>* subtrees = nullptr
+) {
+  std::vector<BuildTask> tasks = { rootTask };
+  tasks.back().node = firstNode;
+  while (!tasks.empty()) {
+    BuildTask task = tasks.back();
+    tasks.pop_back();
+
+    // Left to the threads of the pool
+    if (subtrees && task.end - task.begin < PARALLEL_RANGE) {
+      subtrees->push_back(task);
+      continue;
+    }
+
+    TriangleBvh::Node& node = nodes[task.node];
+    uint32_t middle;
+    Aabb leftBounds;
+    Aabb rightBounds;
+    if (!_split(data, task, Aabb { node.min, node.max }, middle, leftBounds, rightBounds, threadPool)) {
+      node.first = task.begin;
+      node.triangleCount = task.end - task.begin;
+      continue;
+    }
+
+    uint32_t left = nodes.size();
+    nodes[task.node].first = left;
+    nodes.push_back(_makeNode(leftBounds));
+    nodes.push_back(_makeNode(rightBounds));
+    tasks.push_back(BuildTask { middle, task.end, left + 1, task.depth + 1 });
+    tasks.push_back(BuildTask { task.begin, middle, left, task.depth + 1 });
+  }
+}
+
+TriangleBvh buildTriangleBvh(
+  const MeshPrimitive& meshPrimitive, ThreadPool* threadPool
+) {
+  TriangleBvh triangleBvh;
+  auto positionIt = meshPrimitive.attributes.find("POSITION");
+  if (
+    positionIt == meshPrimitive.attributes.end()
+    || meshPrimitive.mode != MeshPrimitive::Mode::Triangles
+  ) {
+    return triangleBvh;
+  }
+
+  // Object space, also when quantized
+  const Accessor& positionAccessor = *positionIt->second;
+  std::vector<glm::vec3> positions(positionAccessor.count);
+  _forEachChunk(threadPool, 0, positions.size(), [&](uint32_t, uint32_t begin, uint32_t end) {
+    for (uint32_t v = begin; v < end; ++v) {
+      glm::vec3 position(
+        positionAccessor.getComponent(v, 0),
+        positionAccessor.getComponent(v, 1),
+        positionAccessor.getComponent(v, 2)
+      );
+      positions[v] = (
+        position * meshPrimitive.positionScale + meshPrimitive.positionOffset
+      );
+    }
+  });
+
+  const Accessor* indexAccessor = meshPrimitive.indices;
+  uint32_t triangleCount = (indexAccessor ? indexAccessor->count : positionAccessor.count) / 3;
+  if (triangleCount == 0) {
+    return triangleBvh;
+  }
+  std::vector<uint32_t> indices(triangleCount * 3);
+  _forEachChunk(threadPool, 0, indices.size(), [&](uint32_t, uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; ++i) {
+      indices[i] = indexAccessor ? indexAccessor->getIndex(i) : i;
+    }
+  });
+
+  BuildData data;
+  data.bounds.resize(triangleCount);
+  data.centers.resize(triangleCount);
+  data.order.resize(triangleCount);
+  std::iota(data.order.begin(), data.order.end(), 0);
+  std::vector<Aabb> chunkBounds;
+  chunkBounds.assign((triangleCount + TRIANGLE_GRAIN - 1) / TRIANGLE_GRAIN, Aabb {});
+  uint32_t chunkCount = _forEachChunk(threadPool, 0, triangleCount, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+    Aabb bounds;
+    for (uint32_t t = begin; t < end; ++t) {
+      Aabb& triangleBounds = data.bounds[t];
+      for (uint32_t k = 0; k < 3; ++k) {
+        triangleBounds.expand(positions[indices[t * 3 + k]]);
+      }
+      data.centers[t] = triangleBounds.getCenter();
+      bounds.expand(triangleBounds);
+    }
+    chunkBounds[chunk] = bounds;
+  });
+  Aabb bounds;
+  for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+    bounds.expand(chunkBounds[chunk]);
+  }
+
+  // The top of the tree is split with binning over the pool, the
+  // subtrees left are then built on a thread each, and appended
+  std::vector<TriangleBvh::Node>& nodes = triangleBvh.nodes;
+  nodes.push_back(_makeNode(bounds));
+  std::vector<BuildTask> subtrees;
+  BuildTask rootTask { 0, triangleCount, 0, 0 };
+  if (threadPool) {
+    _buildNodes(data, rootTask, nodes, 0, threadPool, &subtrees);
+  }
+  else {
+    subtrees.push_back(rootTask);
+  }
+
+  std::vector<std::vector<TriangleBvh::Node>> subtreeNodes(subtrees.size());
+  parallelFor(threadPool, subtrees.size(), [&](uint32_t i, uint32_t) {
+    subtreeNodes[i].push_back(nodes[subtrees[i].node]);
+    _buildNodes(data, subtrees[i], subtreeNodes[i], 0, nullptr);
+  });
+  for (uint32_t i = 0; i < subtrees.size(); ++i) {
+    // Their first node takes the place of the subtree's root
+    uint32_t offset = nodes.size() - 1;
+    for (TriangleBvh::Node& node: subtreeNodes[i]) {
+      if (node.triangleCount == 0) {
+        node.first += offset;
+      }
+    }
+    nodes[subtrees[i].node] = subtreeNodes[i][0];
+    nodes.insert(nodes.end(), subtreeNodes[i].begin() + 1, subtreeNodes[i].end());
+  }
+
+  triangleBvh.triangles.resize(triangleCount);
+  _forEachChunk(threadPool, 0, triangleCount, [&](uint32_t, uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; ++i) {
+      uint32_t t = data.order[i];
+      const glm::vec3& vertex = positions[indices[t * 3]];
+      triangleBvh.triangles[i] = TriangleBvh::Triangle {
+        vertex,
+        positions[indices[t * 3 + 1]] - vertex,
+        positions[indices[t * 3 + 2]] - vertex,
+        t
+      };
+    }
+  });
+  return triangleBvh;
+}
+
+// Distance where the ray enters the node, when it does before closest
+static bool _hitNode(
+  const TriangleBvh::Node& node, const glm::vec3& origin,
+  const glm::vec3& inverseDirection, float closest, float& entry
+) {
+  glm::vec3 t0 = (node.min - origin) * inverseDirection;
+  glm::vec3 t1 = (node.max - origin) * inverseDirection;
+  glm::vec3 entries = glm::min(t0, t1);
+  glm::vec3 exits = glm::max(t0, t1);
+  entry = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+  float exit = std::min(std::min(exits.x, exits.y), std::min(exits.z, closest));
+  return entry <= exit;
+}
+
+bool TriangleBvh::intersect(const Ray& ray, TriangleHit& hit) const {
+  float closest = std::min(ray.maxDistance, hit.distance);
+  glm::vec3 inverseDirection = glm::vec3(1) / ray.direction;
+  float entry;
+  if (this->nodes.empty() || !_hitNode(this->nodes[0], ray.origin, inverseDirection, closest, entry)) {
+    return false;
+  }
+
+  // Nearer child first, the other waits with its entry distance
+  struct StackEntry {
+    uint32_t node;
+    float entry;
+  };
+  StackEntry stack[MAX_DEPTH];
+  uint32_t stackSize = 0;
+  uint32_t nodeIndex = 0;
+  bool found = false;
+  while (true) {
+    const Node& node = this->nodes[nodeIndex];
+    if (node.triangleCount > 0) {
+      // Möller-Trumbore
+      for (uint32_t i = node.first; i < node.first + node.triangleCount; ++i) {
+        const Triangle& triangle = this->triangles[i];
+        glm::vec3 p = glm::cross(ray.direction, triangle.edge2);
+        float determinant = glm::dot(triangle.edge1, p);
+        if (determinant == 0) {
+          continue;
+        }
+        float inverseDeterminant = 1 / determinant;
+        glm::vec3 s = ray.origin - triangle.vertex;
+        float u = glm::dot(s, p) * inverseDeterminant;
+        if (u < 0 || u > 1) {
+          continue;
+        }
+        glm::vec3 q = glm::cross(s, triangle.edge1);
+        float v = glm::dot(ray.direction, q) * inverseDeterminant;
+        if (v < 0 || u + v > 1) {
+          continue;
+        }
+        float t = glm::dot(triangle.edge2, q) * inverseDeterminant;
+        if (t >= 0 && t < closest) {
+          closest = t;
+          hit = TriangleHit { triangle.index, glm::vec2(u, v), t };
+          found = true;
+        }
+      }
+    }
+    else {
+      float leftEntry;
+      float rightEntry;
+      bool hitLeft = _hitNode(this->nodes[node.first], ray.origin, inverseDirection, closest, leftEntry);
+      bool hitRight = _hitNode(this->nodes[node.first + 1], ray.origin, inverseDirection, closest, rightEntry);
+      if (hitLeft && hitRight) {
+        bool leftFirst = leftEntry <= rightEntry;
+        stack[stackSize++] = leftFirst
+          ? StackEntry { node.first + 1, rightEntry }
+          : StackEntry { node.first, leftEntry };
+        nodeIndex = leftFirst ? node.first : node.first + 1;
+        continue;
+      }
+      if (hitLeft || hitRight) {
+        nodeIndex = hitLeft ? node.first : node.first + 1;
+        continue;
+      }
+    }
+
+    // Nodes entered past the closest hit since they were pushed are skipped
+    while (stackSize > 0 && stack[stackSize - 1].entry > closest) {
+      stackSize--;
+    }
+    if (stackSize == 0) {
+      break;
+    }
+    nodeIndex = stack[--stackSize].node;
+  }
+  return found;
+}
+
+std::string getTriangleBvhCacheKey(const MeshPrimitive& meshPrimitive) {
+  // 64 bit FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  auto hashBytes = [&hash](const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  };
+
+  const Accessor& positionAccessor = *meshPrimitive.attributes.at("POSITION");
+  uint32_t header[] = {
+    CACHE_VERSION, positionAccessor.count,
+    (uint32_t)positionAccessor.componentType, positionAccessor.normalized,
+    meshPrimitive.indices ? meshPrimitive.indices->count : 0
+  };
+  hashBytes(header, sizeof(header));
+  for (uint32_t v = 0; v < positionAccessor.count; ++v) {
+    hashBytes(positionAccessor.getElementData(v), positionAccessor.getElementSize());
+  }
+  for (uint32_t i = 0; meshPrimitive.indices && i < meshPrimitive.indices->count; ++i) {
+    uint32_t index = meshPrimitive.indices->getIndex(i);
+    hashBytes(&index, sizeof(index));
+  }
+  hashBytes(&meshPrimitive.positionScale, sizeof(meshPrimitive.positionScale));
+  hashBytes(&meshPrimitive.positionOffset, sizeof(meshPrimitive.positionOffset));
+
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+  return key;
+}
+
+bool loadTriangleBvh(
+  const std::string& path, uint32_t triangleCount, TriangleBvh& triangleBvh
+) {
+  std::ifstream file(path, std::ios::binary);
+  uint32_t header[4];
+  if (
+    !file.read(reinterpret_cast<char*>(header), sizeof(header))
+    || header[0] != CACHE_MAGIC || header[1] != CACHE_VERSION
+    || header[2] == 0 || header[3] != triangleCount
+  ) {
+    return false;
+  }
+
+  TriangleBvh loaded;
+  loaded.nodes.resize(header[2]);
+  loaded.triangles.resize(triangleCount);
+  file.read(
+    reinterpret_cast<char*>(loaded.nodes.data()),
+    loaded.nodes.size() * sizeof(TriangleBvh::Node)
+  );
+  file.read(
+    reinterpret_cast<char*>(loaded.triangles.data()),
+    loaded.triangles.size() * sizeof(TriangleBvh::Triangle)
+  );
+  if (!file) {
+    return false;
+  }
+  triangleBvh = std::move(loaded);
+  return true;
+}
+
+void saveTriangleBvh(const std::string& path, const TriangleBvh& triangleBvh) {
+  std::error_code error;
+  std::filesystem::path parent = std::filesystem::path(path).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent, error);
+  }
+
+  // Written aside then renamed, so a reader never sees half a file
+  std::string tempPath = path + ".tmp";
+  {
+    std::ofstream file(tempPath, std::ios::binary);
+    uint32_t header[4] = {
+      CACHE_MAGIC, CACHE_VERSION,
+      (uint32_t)triangleBvh.nodes.size(), (uint32_t)triangleBvh.triangles.size()
+    };
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(
+      reinterpret_cast<const char*>(triangleBvh.nodes.data()),
+      triangleBvh.nodes.size() * sizeof(TriangleBvh::Node)
+    );
+    file.write(
+      reinterpret_cast<const char*>(triangleBvh.triangles.data()),
+      triangleBvh.triangles.size() * sizeof(TriangleBvh::Triangle)
+    );
+    if (!file) {
+      file.close();
+      std::filesystem::remove(tempPath, error);
+      return;
+    }
+  }
+  std::filesystem::rename(tempPath, path, error);
+}
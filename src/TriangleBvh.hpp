@@ -0,0 +1,88 @@
+
+#ifndef TRIANGLE_BVH_H
+#define TRIANGLE_BVH_H
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#include "Bounds.hpp"
+
+struct MeshPrimitive;
+class ThreadPool;
+
+struct TriangleHit {
+  // Triangle t of a primitive is made of its indices 3t to 3t + 2
+  uint32_t triangle = UINT32_MAX;
+  // Weights of the second and third vertices
+  glm::vec2 barycentrics = glm::vec2(0);
+  // Along the ray, see Ray
+  float distance = INFINITY;
+};
+
+struct TriangleBvhReport {
+  size_t primitiveCount = 0;
+  size_t triangleCount = 0;
+  size_t nodeCount = 0;
+  // Of the primitives, read from the cache instead of built
+  size_t cachedCount = 0;
+
+  void add(const TriangleBvhReport& other);
+};
+
+// Binary BVH over the triangles of a primitive, in object space. Nodes
+// are flattened depth first, with the two children of a node next to
+// each other. Triangles are copied in the order of the leaves, as a
+// vertex and two edges, so a leaf reads them contiguously.
+struct TriangleBvh {
+  static constexpr uint32_t MAX_LEAF_TRIANGLES = 8;
+
+  struct Node {
+    glm::vec3 min;
+    // First child for inner nodes, first triangle for leaves
+    uint32_t first;
+    glm::vec3 max;
+    // 0 for inner nodes
+    uint32_t triangleCount;
+  };
+
+  struct Triangle {
+    glm::vec3 vertex;
+    glm::vec3 edge1;
+    glm::vec3 edge2;
+    uint32_t index;
+  };
+
+  std::vector<Node> nodes;
+  std::vector<Triangle> triangles;
+
+  bool empty() const {
+    return nodes.empty();
+  }
+
+  // Closest triangle the ray hits, from either side, nearer than both
+  // ray.maxDistance and hit.distance; hit is only written then
+  bool intersect(const Ray& ray, TriangleHit& hit) const;
+};
+
+// Top-down with a binned surface area heuristic. Large ranges are binned
+// over the pool, then the subtrees left are built on a thread each.
+// Primitives other than triangle lists get an empty BVH.
+TriangleBvh buildTriangleBvh(
+  const MeshPrimitive& meshPrimitive, ThreadPool* threadPool = nullptr
+);
+
+// Hash of the positions and indices of the primitive, as they are once
+// cooked: optimized, quantized, with its position decoding
+std::string getTriangleBvhCacheKey(const MeshPrimitive& meshPrimitive);
+// Returns false on a missing file, or one of another version or size
+bool loadTriangleBvh(
+  const std::string& path, uint32_t triangleCount, TriangleBvh& triangleBvh
+);
+// Failures only cost a rebuild next time
+void saveTriangleBvh(const std::string& path, const TriangleBvh& triangleBvh);
+
+#endif // !TRIANGLE_BVH_H
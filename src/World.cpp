@@ -0,0 +1,326 @@
+
+#include <cassert>
+#include <glm/glm.hpp>
+
+#include "World.hpp"
+#include "Animation.hpp"
+#include "Profiler.hpp"
+
+bool InstanceId::operator==(const InstanceId& other) const {
+  return this->index == other.index && this->generation == other.generation;
+}
+
+bool InstanceId::operator!=(const InstanceId& other) const {
+  return !(*this == other);
+}
+
+// Moves the last element into the hole, the order is not kept
+template <typename T>
+static void _swapRemove(std::vector<T>& values, uint32_t index) {
+  values[index] = std::move(values.back());
+  values.pop_back();
+}
+
+// Runs job on each instance index, in chunks of World::INSTANCE_GRAIN
+template <typename Job>
+static void _forEachInstance(
+  ThreadPool* threadPool, uint32_t count, const Job& job
+) {
+  uint32_t chunkCount = (count + World::INSTANCE_GRAIN - 1) / World::INSTANCE_GRAIN;
+  parallelFor(threadPool, chunkCount, [&](uint32_t chunk, uint32_t) {
+    uint32_t begin = chunk * World::INSTANCE_GRAIN;
+    uint32_t end = std::min(begin + World::INSTANCE_GRAIN, count);
+    for (uint32_t i = begin; i < end; ++i) {
+      job(i);
+    }
+  });
+}
+
+World::World(const AssetManager& assets)
+  : m_assets(assets)
+{}
+
+void World::addAsset(size_t assetId) {
+  if (m_prototypeIndices.count(assetId) > 0) {
+    return;
+  }
+  m_prototypeIndices[assetId] = m_prototypes.size();
+  m_prototypes.push_back(Prototype { assetId, TransformHierarchy(m_assets, assetId), {} });
+  Prototype& prototype = m_prototypes.back();
+  prototype.restPose.update();
+  prototype.restBounds = getHierarchyBounds(prototype.restPose);
+}
+
+const Aabb& World::getRestBounds(size_t assetId) const {
+  return m_prototypes[m_prototypeIndices.at(assetId)].restBounds;
+}
+
+InstanceId World::add(size_t assetId, const glm::mat4& transform) {
+  this->addAsset(assetId);
+
+  InstanceId id;
+  if (!m_freeIds.empty()) {
+    id.index = m_freeIds.back();
+    m_freeIds.pop_back();
+  }
+  else {
+    id.index = m_denseIndices.size();
+    m_denseIndices.push_back(NONE);
+    m_generations.push_back(0);
+  }
+  id.generation = m_generations[id.index];
+  m_denseIndices[id.index] = this->size();
+
+  m_ids.push_back(id.index);
+  m_prototypeSlots.push_back(m_prototypeIndices[assetId]);
+  m_transforms.push_back(transform);
+  m_normalTransforms.push_back(glm::mat3(1));
+  m_flags.push_back(VISIBLE | MOVED);
+  m_bounds.push_back(Aabb {});
+  m_animations.push_back(NONE);
+  m_animationTimes.push_back(0);
+  m_animationSpeeds.push_back(0);
+  m_poseSlots.push_back(NONE);
+  m_lodLevels.emplace_back(m_prototypes[m_prototypeSlots.back()].restPose.size(), 0);
+  return id;
+}
+
+void World::remove(InstanceId id) {
+  assert(this->isValid(id));
+  uint32_t index = m_denseIndices[id.index];
+  this->releasePose(index);
+  if (m_bvh.contains(index)) {
+    m_bvh.remove(index);
+  }
+  uint32_t last = this->size() - 1;
+  if (index != last && m_bvh.contains(last)) {
+    m_bvh.renameItem(last, index);
+  }
+
+  // The last instance takes the place of the removed one
+  m_denseIndices[m_ids.back()] = index;
+  m_denseIndices[id.index] = NONE;
+  m_generations[id.index]++;
+  m_freeIds.push_back(id.index);
+
+  _swapRemove(m_ids, index);
+  _swapRemove(m_prototypeSlots, index);
+  _swapRemove(m_transforms, index);
+  _swapRemove(m_normalTransforms, index);
+  _swapRemove(m_flags, index);
+  _swapRemove(m_bounds, index);
+  _swapRemove(m_animations, index);
+  _swapRemove(m_animationTimes, index);
+  _swapRemove(m_animationSpeeds, index);
+  _swapRemove(m_poseSlots, index);
+  _swapRemove(m_lodLevels, index);
+}
+
+bool World::isValid(InstanceId id) const {
+  return (
+    id.index < m_denseIndices.size()
+    && m_generations[id.index] == id.generation
+    && m_denseIndices[id.index] != NONE
+  );
+}
+
+uint32_t World::size() const {
+  return m_ids.size();
+}
+
+uint32_t World::getIndex(InstanceId id) const {
+  assert(this->isValid(id));
+  return m_denseIndices[id.index];
+}
+
+InstanceId World::getId(uint32_t index) const {
+  uint32_t idIndex = m_ids[index];
+  return InstanceId { idIndex, m_generations[idIndex] };
+}
+
+void World::setTransform(InstanceId id, const glm::mat4& transform) {
+  uint32_t index = this->getIndex(id);
+  m_transforms[index] = transform;
+  m_flags[index] |= MOVED;
+}
+
+void World::setVisible(InstanceId id, bool visible) {
+  uint32_t index = this->getIndex(id);
+  m_flags[index] = visible ? (m_flags[index] | VISIBLE) : (m_flags[index] & ~VISIBLE);
+}
+
+void World::setOccluder(InstanceId id, bool occluder) {
+  uint32_t index = this->getIndex(id);
+  m_flags[index] = occluder ? (m_flags[index] | OCCLUDER) : (m_flags[index] & ~OCCLUDER);
+}
+
+void World::setAnimation(
+  InstanceId id, uint32_t animationIndex, float time, float speed
+) {
+  uint32_t index = this->getIndex(id);
+  m_animations[index] = animationIndex;
+  m_animationTimes[index] = time;
+  m_animationSpeeds[index] = speed;
+
+  if (animationIndex == NONE) {
+    this->releasePose(index);
+    m_flags[index] |= MOVED;
+    return;
+  }
+  assert(animationIndex < m_assets.getAsset(this->getAssetId(index))->animations.size());
+  if (m_poseSlots[index] == NONE) {
+    if (!m_freePoses.empty()) {
+      m_poseSlots[index] = m_freePoses.back();
+      m_freePoses.pop_back();
+    }
+    else {
+      m_poseSlots[index] = m_poses.size();
+      m_poses.emplace_back();
+    }
+    m_poses[m_poseSlots[index]] = m_prototypes[m_prototypeSlots[index]].restPose;
+  }
+}
+
+void World::animate(float deltaTime, ThreadPool* threadPool) {
+  ProfileZone zone("animate world");
+  _forEachInstance(threadPool, this->size(), [&](uint32_t i) {
+    if (m_animations[i] == NONE) {
+      return;
+    }
+    m_animationTimes[i] += deltaTime * m_animationSpeeds[i];
+
+    TransformHierarchy& pose = m_poses[m_poseSlots[i]];
+    animateHierarchy(
+      m_assets, this->getAssetId(i), m_animations[i], m_animationTimes[i], pose
+    );
+    pose.setRootTransform(m_transforms[i]);
+    pose.update();
+    m_bounds[i] = getHierarchyBounds(pose);
+    m_flags[i] |= MOVED;
+  });
+}
+
+void World::updateBounds(ThreadPool* threadPool) {
+  ProfileZone zone("update world bounds");
+  _forEachInstance(threadPool, this->size(), [&](uint32_t i) {
+    if (!(m_flags[i] & MOVED)) {
+      return;
+    }
+    m_normalTransforms[i] = glm::transpose(glm::inverse(glm::mat3(m_transforms[i])));
+    // Posed instances got theirs from their hierarchy
+    if (m_poseSlots[i] == NONE) {
+      m_bounds[i] = m_prototypes[m_prototypeSlots[i]].restBounds.transformed(m_transforms[i]);
+    }
+  });
+
+  for (uint32_t i = 0; i < this->size(); ++i) {
+    if (m_flags[i] & MOVED) {
+      m_bvh.set(i, m_bounds[i]);
+      m_flags[i] &= ~MOVED;
+    }
+  }
+  m_bvh.update();
+}
+
+size_t World::getAssetId(uint32_t index) const {
+  return m_prototypes[m_prototypeSlots[index]].assetId;
+}
+
+const glm::mat4& World::getTransform(uint32_t index) const {
+  return m_transforms[index];
+}
+
+const glm::mat3& World::getNormalTransform(uint32_t index) const {
+  return m_normalTransforms[index];
+}
+
+uint8_t World::getFlags(uint32_t index) const {
+  return m_flags[index];
+}
+
+const Aabb& World::getBounds(uint32_t index) const {
+  return m_bounds[index];
+}
+
+const TransformHierarchy& World::getHierarchy(uint32_t index) const {
+  uint32_t poseSlot = m_poseSlots[index];
+  return poseSlot != NONE
+    ? m_poses[poseSlot]
+    : m_prototypes[m_prototypeSlots[index]].restPose;
+}
+
+bool World::isPosed(uint32_t index) const {
+  return m_poseSlots[index] != NONE;
+}
+
+uint8_t* World::getLodLevels(uint32_t index) {
+  return m_lodLevels[index].data();
+}
+
+const Bvh& World::getBvh() const {
+  return m_bvh;
+}
+
+bool World::raycast(const Ray& ray, RaycastHit& hit) const {
+  RaycastHit closest;
+  float distance = m_bvh.castRay(ray, [&](uint32_t index, float maxDistance) {
+    return this->raycastInstance(index, ray, maxDistance, closest);
+  });
+  if (distance == INFINITY) {
+    return false;
+  }
+  hit = closest;
+  return true;
+}
+
+float World::raycastInstance(
+  uint32_t index, const Ray& ray, float maxDistance, RaycastHit& hit
+) const {
+  const fx::gltf::Document& document = *m_assets.getAsset(this->getAssetId(index));
+  const TransformHierarchy& hierarchy = this->getHierarchy(index);
+  bool posed = this->isPosed(index);
+  float closest = INFINITY;
+
+  for (uint32_t slot = 0; slot < hierarchy.size(); ++slot) {
+    const fx::gltf::Node& node = document.nodes[hierarchy.getNodeIndex(slot)];
+    if (node.mesh == -1 || node.skin != -1) {
+      continue;
+    }
+
+    // The primitives are tested in their object space
+    glm::mat4 model = posed
+      ? hierarchy.getWorld(slot)
+      : m_transforms[index] * hierarchy.getWorld(slot);
+    Ray localRay = ray.transformed(glm::inverse(model));
+    localRay.maxDistance = std::min(maxDistance, closest);
+
+    const Mesh& mesh = *m_assets.getMesh(this->getAssetId(index), node.mesh);
+    for (const MeshPrimitive& primitive: mesh.primitives) {
+      TriangleHit triangleHit;
+      if (primitive.triangleBvh.intersect(localRay, triangleHit)) {
+        closest = localRay.maxDistance = triangleHit.distance;
+        hit = RaycastHit {
+          this->getId(index), slot, &primitive,
+          triangleHit.triangle, triangleHit.barycentrics, triangleHit.distance
+        };
+      }
+    }
+  }
+  return closest;
+}
+
+Aabb World::getHierarchyBounds(const TransformHierarchy& hierarchy) {
+  // Scene roots follow each other's subtrees
+  Aabb bounds;
+  for (uint32_t slot = 0; slot < hierarchy.size(); slot = hierarchy.getSubtreeEnd(slot)) {
+    bounds.expand(hierarchy.getSubtreeBounds(slot));
+  }
+  return bounds;
+}
+
+void World::releasePose(uint32_t index) {
+  if (m_poseSlots[index] != NONE) {
+    m_freePoses.push_back(m_poseSlots[index]);
+    m_poseSlots[index] = NONE;
+  }
+}
@@ -0,0 +1,162 @@
+
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <glm/vec2.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "AssetManager.hpp"
+#include "Bounds.hpp"
+#include "Bvh.hpp"
+#include "TransformHierarchy.hpp"
+#include "ThreadPool.hpp"
+
+// Names an instance for as long as it lives. The index is reused once the
+// instance is removed, with a new generation.
+struct InstanceId {
+  uint32_t index = UINT32_MAX;
+  uint32_t generation = 0;
+
+  bool operator==(const InstanceId& other) const;
+  bool operator!=(const InstanceId& other) const;
+};
+
+// Closest triangle a ray hits in a world
+struct RaycastHit {
+  InstanceId instance;
+  // Of the instance's hierarchy, the node whose mesh was hit
+  uint32_t slot = UINT32_MAX;
+  const MeshPrimitive* primitive = nullptr;
+  // See TriangleHit
+  uint32_t triangle = UINT32_MAX;
+  glm::vec2 barycentrics = glm::vec2(0);
+  float distance = INFINITY;
+};
+
+// Placed instances of loaded assets. Components are stored as dense
+// arrays, in the same order, which removal keeps packed by moving the
+// last instance into the hole. Ids map to dense indices through a sparse
+// table, so adding and removing are O(1) and ids stay valid.
+// Static instances share their asset's rest pose, only animated ones get
+// a hierarchy of their own. A BVH over the instance bounds serves both
+// culling and gameplay queries.
+class World {
+public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+  // Instances per unit of work of the systems
+  static constexpr uint32_t INSTANCE_GRAIN = 1024;
+
+  // Instance flags
+  static constexpr uint8_t VISIBLE = 1 << 0;
+  // Transform or pose changed since the last updateBounds()
+  static constexpr uint8_t MOVED = 1 << 1;
+  // Its primitives' occluder meshes hide what is behind it
+  static constexpr uint8_t OCCLUDER = 1 << 2;
+
+  explicit World(const AssetManager& assets);
+  World(const World&) = delete;
+  World(World&&) = delete;
+
+  // Builds the rest pose of the asset, which add() does for its first
+  // instance. The asset must be loaded.
+  void addAsset(size_t assetId);
+  // Of the asset at the origin, addAsset() must have been called
+  const Aabb& getRestBounds(size_t assetId) const;
+
+  InstanceId add(size_t assetId, const glm::mat4& transform = glm::mat4(1));
+  void remove(InstanceId id);
+  bool isValid(InstanceId id) const;
+  uint32_t size() const;
+
+  // Dense index of a valid instance, which changes when others are removed
+  uint32_t getIndex(InstanceId id) const;
+  InstanceId getId(uint32_t index) const;
+
+  void setTransform(InstanceId id, const glm::mat4& transform);
+  void setVisible(InstanceId id, bool visible);
+  void setOccluder(InstanceId id, bool occluder);
+  // Plays the animation from time on, at speed. NONE goes back to the
+  // rest pose.
+  void setAnimation(
+    InstanceId id, uint32_t animationIndex, float time = 0, float speed = 1
+  );
+
+  // Per-frame systems, in this order. animate() advances the clocks and
+  // poses the animated instances, updateBounds() places the bounds of the
+  // static ones that moved and refits the BVH to all moved instances.
+  void animate(float deltaTime, ThreadPool* threadPool = nullptr);
+  void updateBounds(ThreadPool* threadPool = nullptr);
+
+  // Components, by dense index
+  size_t getAssetId(uint32_t index) const;
+  const glm::mat4& getTransform(uint32_t index) const;
+  // Inverse transpose of the transform, for normals
+  const glm::mat3& getNormalTransform(uint32_t index) const;
+  uint8_t getFlags(uint32_t index) const;
+  // World space, as of the last systems update
+  const Aabb& getBounds(uint32_t index) const;
+  // The instance's own hierarchy, with its transform as root transform,
+  // when it is animated; otherwise the rest pose of its asset, which the
+  // transform places in the world
+  const TransformHierarchy& getHierarchy(uint32_t index) const;
+  bool isPosed(uint32_t index) const;
+  // Current level of detail of each slot of the hierarchy, kept across
+  // frames by the extraction
+  uint8_t* getLodLevels(uint32_t index);
+
+  // Over dense indices, as of the last updateBounds()
+  const Bvh& getBvh() const;
+
+  // Finds the closest hit among the instances in the BVH, testing the
+  // triangles of the primitives whose triangle BVH was built. Skinned
+  // meshes are not hit. A normalized direction gives world distances.
+  bool raycast(const Ray& ray, RaycastHit& hit) const;
+
+private:
+  struct Prototype {
+    size_t assetId;
+    TransformHierarchy restPose;
+    Aabb restBounds;
+  };
+
+  static Aabb getHierarchyBounds(const TransformHierarchy& hierarchy);
+  void releasePose(uint32_t index);
+  float raycastInstance(
+    uint32_t index, const Ray& ray, float maxDistance, RaycastHit& hit
+  ) const;
+
+  const AssetManager& m_assets;
+  std::vector<Prototype> m_prototypes;
+  std::unordered_map<size_t, uint32_t> m_prototypeIndices;
+
+  // Sparse table, by id index
+  std::vector<uint32_t> m_denseIndices;
+  std::vector<uint32_t> m_generations;
+  std::vector<uint32_t> m_freeIds;
+
+  // Dense components
+  std::vector<uint32_t> m_ids;
+  std::vector<uint32_t> m_prototypeSlots;
+  std::vector<glm::mat4> m_transforms;
+  std::vector<glm::mat3> m_normalTransforms;
+  std::vector<uint8_t> m_flags;
+  std::vector<Aabb> m_bounds;
+  std::vector<uint32_t> m_animations;
+  std::vector<float> m_animationTimes;
+  std::vector<float> m_animationSpeeds;
+  // In m_poses, NONE for static instances
+  std::vector<uint32_t> m_poseSlots;
+  std::vector<std::vector<uint8_t>> m_lodLevels;
+
+  std::vector<TransformHierarchy> m_poses;
+  std::vector<uint32_t> m_freePoses;
+
+  Bvh m_bvh;
+};
+
+#endif // !WORLD_H
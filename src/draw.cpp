@@ -1,417 +1,1129 @@
 
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <optional>
+#include <utility>
 #include <cassert>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 
 #include "draw.hpp"
+#include "Animation.hpp"
+#include "Culling.hpp"
+#include "Profiler.hpp"
+#include "GlState.hpp"
 
-static void _drawMeshPrimitive(
-  ShaderProgram& shaderProgram,
-  const MeshPrimitive& meshPrimitive, const Material& material,
-  const std::vector<glm::mat4>* joints,
-  const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection
-) {
-  assert(meshPrimitive.isLoaded());
-  assert(material.isLoaded());
-  assert(meshPrimitive.attributes.count("POSITION") > 0);
+// Replaces skinned meshes with lines between their joints
+static constexpr bool DRAW_SKELETON = false;
 
-  glBindVertexArray(meshPrimitive.vaoId);
+// Uniform block binding points, see phong.vert
+static constexpr GLuint FRAME_DATA_BINDING = 0;
+static constexpr GLuint DRAW_DATA_BINDING = 1;
+static constexpr GLuint JOINT_PALETTE_BINDING = 2;
 
-  glUniformMatrix4fv(
-    shaderProgram.uniform("mvp"),
-    1, GL_FALSE,
-    glm::value_ptr(projection * view * model)
-  );
-  glUniformMatrix4fv(
-    shaderProgram.uniform("modelView"),
-    1, GL_FALSE,
-    glm::value_ptr(view * model)
-  );
-  glUniformMatrix3fv(
-    shaderProgram.uniform("normalMatrix"),
-    1, GL_FALSE,
-    glm::value_ptr(glm::mat3(glm::transpose(glm::inverse(view * model))))
+// Storage block binding points of the light lists, see phong.frag
+static constexpr GLuint LIGHTS_BINDING = 0;
+static constexpr GLuint LIGHT_CLUSTERS_BINDING = 1;
+static constexpr GLuint LIGHT_INDICES_BINDING = 2;
+
+// std140 layouts of the blocks, mat3 columns and vec3 take a vec4
+struct FrameDataBlock {
+  glm::mat4 view;
+  glm::mat4 projection;
+  glm::mat4 viewProjection;
+  glm::vec4 viewNormal[3];
+  glm::uvec4 clusterCounts;
+  glm::vec4 clusterParameters;
+};
+static_assert(sizeof(FrameDataBlock) == 272, "std140 layout");
+
+struct DrawDataBlock {
+  glm::mat4 model;
+  glm::vec4 normalMatrix[3];
+  glm::vec4 materialColor;
+  glm::vec2 texcoordScale;
+  glm::vec2 texcoordOffset;
+  glm::vec4 positionScale;
+  glm::vec4 positionOffset;
+  glm::uvec4 textureLayers;
+  glm::uvec4 textureHandles;
+};
+static_assert(sizeof(DrawDataBlock) == 208, "std140 layout");
+
+static constexpr GLsizeiptr JOINT_PALETTE_SIZE = DrawList::MAX_JOINTS * sizeof(glm::mat4);
+
+void DrawStats::add(const DrawStats& other) {
+  this->visiblePrimitives += other.visiblePrimitives;
+  this->culledPrimitives += other.culledPrimitives;
+  this->culledSubtrees += other.culledSubtrees;
+  this->updatedNodes += other.updatedNodes;
+  this->submittedTriangles += other.submittedTriangles;
+  this->culledMeshlets += other.culledMeshlets;
+  this->culledMeshletTriangles += other.culledMeshletTriangles;
+  this->culledInstances += other.culledInstances;
+  this->occludedInstances += other.occludedInstances;
+}
+
+void DrawList::clear() {
+  this->packets.clear();
+  this->rangeCounts.clear();
+  this->rangeOffsets.clear();
+  this->textureRequests.clear();
+  this->dynamicData.clear();
+  this->stats = DrawStats {};
+}
+
+// Shared by every primitive of a node. The view is applied by the
+// shaders, from the frame's block.
+struct NodeTransforms {
+  glm::mat4 model;
+  glm::mat3 normalMatrix;
+};
+
+// Room for dynamic data of the list's packets: in the ring buffer when
+// there is one, otherwise at the end of the list's own data. Null when
+// the ring buffer is full.
+static uint8_t* _allocateDynamic(
+  GpuRingBuffer* ringBuffer, DrawList& drawList, GLsizeiptr size,
+  GLintptr& offset
+) {
+  if (ringBuffer) {
+    GpuRingAllocation allocation = ringBuffer->allocate(size);
+    offset = allocation.offset;
+    return allocation.data;
+  }
+  std::vector<uint8_t>& data = drawList.dynamicData;
+  offset = (
+    (data.size() + GpuRingBuffer::ALIGNMENT - 1)
+    / GpuRingBuffer::ALIGNMENT * GpuRingBuffer::ALIGNMENT
   );
+  data.resize(offset + size);
+  return data.data() + offset;
+}
 
-  for (size_t i = 0; i < 16; ++i) {
-    if (joints && i < joints->size()) {
-      glUniformMatrix4fv(
-        shaderProgram.uniform("oc_jointMatrices[" + std::to_string(i) + "]"),
-        1, GL_FALSE,
-        glm::value_ptr((*joints)[i])
-      );
-    }
-    else {
-      glUniformMatrix4fv(
-        shaderProgram.uniform("oc_jointMatrices[" + std::to_string(i) + "]"),
-        1, GL_FALSE,
-        glm::value_ptr(glm::mat4(1))
-      );
+static glm::vec4 _std140(const glm::vec3& value) {
+  return glm::vec4(value, 0);
+}
+
+// Fills the packet's DrawData block. Returns false when the ring buffer
+// is full.
+static bool _writeDrawData(
+  GpuRingBuffer* ringBuffer, DrawList& drawList,
+  const NodeTransforms& transforms, DrawPacket& packet
+) {
+  uint8_t* destination = _allocateDynamic(
+    ringBuffer, drawList, sizeof(DrawDataBlock), packet.drawDataOffset
+  );
+  if (!destination) {
+    return false;
+  }
+  const Material& material = *packet.material;
+  // Skeleton lines are not quantized
+  const MeshPrimitive* meshPrimitive = packet.meshPrimitive;
+  // Zeros for textures that are not packed
+  uint32_t layers[2] = { 0, 0 };
+  GLuint64 handles[2] = { 0, 0 };
+  const TextureData* textures[2] = { material.baseColorTexture, material.normalMap };
+  for (int i = 0; i < 2; ++i) {
+    if (textures[i]) {
+      layers[i] = textures[i]->arrayLayer;
+      handles[i] = textures[i]->arrayHandle;
     }
   }
+  DrawDataBlock block {
+    transforms.model,
+    {
+      _std140(transforms.normalMatrix[0]),
+      _std140(transforms.normalMatrix[1]),
+      _std140(transforms.normalMatrix[2])
+    },
+    material.baseColorFactor,
+    material.texcoordScale,
+    material.texcoordOffset,
+    _std140(meshPrimitive ? meshPrimitive->positionScale : glm::vec3(1)),
+    _std140(meshPrimitive ? meshPrimitive->positionOffset : glm::vec3(0)),
+    glm::uvec4(layers[0], layers[1], 0, 0),
+    // Handles split into 32 bit halves, low first
+    glm::uvec4(
+      (uint32_t)handles[0], (uint32_t)(handles[0] >> 32),
+      (uint32_t)handles[1], (uint32_t)(handles[1] >> 32)
+    )
+  };
+  // Built aside and copied whole, mappings are write only
+  memcpy(destination, &block, sizeof(block));
+  return true;
+}
 
-  glm::vec4 gc_lightPos(1, 2, 3, 1);
+// Shared, read-only state of an extraction pass
+struct ExtractContext {
+  const AssetManager& assets;
+  glm::mat4 viewProjection;
+  Frustum frustum;
 
-  glUniform3fv(
-    shaderProgram.uniform("cc_lightPos"), 1,
-    glm::value_ptr(glm::vec3(view * gc_lightPos))
-  );
+  const LodSelection* lodSelection;
+  const TextureStreamer* textureStreamer;
+  // Written concurrently, each allocation by the task making it
+  GpuRingBuffer* ringBuffer;
+  glm::vec3 cameraPosition;
+  // Projected size of a unit length at a unit distance, in viewport
+  // heights
+  float projectionScale;
+};
 
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, material.baseColorTexture->texId);
-  glUniform1i(shaderProgram.uniform("textureId"), 0);
+// The asset instance an extraction task works on. Its hierarchy is either
+// placed in the world by its root transform, or a rest pose that model
+// places.
+struct ExtractInstance {
+  size_t assetId;
+  const TransformHierarchy& hierarchy;
+  // Null when the hierarchy is already placed
+  const glm::mat4* model;
+  const glm::mat3* normalModel;
+  // Current level of each slot, written by the task owning the slot
+  uint8_t* lodLevels;
+};
 
-  glActiveTexture(GL_TEXTURE1);
-  glBindTexture(GL_TEXTURE_2D, material.normalMap->texId);
-  glUniform1i(shaderProgram.uniform("normalMapId"), 1);
+static Aabb _placeBounds(const ExtractInstance& instance, const Aabb& bounds) {
+  return instance.model ? bounds.transformed(*instance.model) : bounds;
+}
 
-  glUniform4fv(
-    shaderProgram.uniform("c_materialColor"), 1,
-    glm::value_ptr(material.baseColorFactor)
+// Projected size of an object space unit, in viewport heights, at the
+// closest point of the node's bounding sphere
+static float _getProjectedScale(
+  const ExtractContext& context, const ExtractInstance& instance,
+  uint32_t slot, const Mesh& mesh, const glm::mat4& model
+) {
+  // Skinned bounds are infinite, the bind pose stands in for them
+  Aabb worldBounds = _placeBounds(instance, instance.hierarchy.getWorldBounds(slot));
+  Aabb bounds = worldBounds.isInfinite()
+    ? mesh.bounds.transformed(model)
+    : worldBounds;
+  float distance = std::max(
+    glm::length(bounds.getCenter() - context.cameraPosition)
+    - glm::length(bounds.getExtents()),
+    1e-4f
   );
+  float scale = std::max({
+    glm::length(glm::vec3(model[0])),
+    glm::length(glm::vec3(model[1])),
+    glm::length(glm::vec3(model[2]))
+  });
+  return scale * context.projectionScale / distance;
+}
 
-  if (meshPrimitive.indices) {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshPrimitive.indices->bufferView->vboId);
-    glDrawElements(
-      (GLenum)meshPrimitive.mode,
-      meshPrimitive.indices->count,
-      (GLenum)meshPrimitive.indices->componentType,
-      reinterpret_cast<GLvoid*>(meshPrimitive.indices->byteOffset)
-    );
-  }
-  else {
-    glDrawArrays(
-      (GLenum)meshPrimitive.mode,
-      0,
-      meshPrimitive.attributes.at("POSITION")->count
-    );
+static uint32_t _selectLod(
+  const ExtractContext& context, const ExtractInstance& instance,
+  uint32_t slot, const Mesh& mesh, float projectedScale
+) {
+  if (!context.lodSelection || mesh.lodErrors.size() < 2) {
+    return 0;
   }
+  const LodSelection& selection = *context.lodSelection;
+  float pixelsPerError = projectedScale * selection.viewportHeight;
 
-  glBindVertexArray(0);
+  // Without a current level, refine from the coarsest
+  uint32_t lodCount = mesh.lodErrors.size();
+  uint32_t lod = instance.lodLevels
+    ? std::min<uint32_t>(instance.lodLevels[slot], lodCount - 1)
+    : lodCount - 1;
+  while (lod > 0 && mesh.lodErrors[lod] * pixelsPerError > selection.errorThreshold) {
+    lod--;
+  }
+  while (
+    lod + 1 < lodCount
+    && mesh.lodErrors[lod + 1] * pixelsPerError
+      <= selection.errorThreshold * selection.hysteresis
+  ) {
+    lod++;
+  }
+  if (instance.lodLevels) {
+    instance.lodLevels[slot] = lod;
+  }
+  return lod;
 }
 
-void draw(
-  ShaderProgram& shaderProgram,
+// Leaves the index ranges of the visible meshlets in the draw list,
+// merging contiguous ones. Returns the number of culled triangles.
+static uint32_t _cullMeshlets(
+  const ExtractContext& context,
   const MeshPrimitive& meshPrimitive, const Material& material,
-  const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection
+  const NodeTransforms& transforms, DrawPacket& packet, DrawList& drawList
 ) {
-  shaderProgram.use();
-  _drawMeshPrimitive(
-    shaderProgram,
-    meshPrimitive, material,
-    nullptr,
-    model, view, projection
+  const Meshlets& meshlets = meshPrimitive.meshlets;
+
+  // Meshlet bounds are tested in object space
+  Frustum frustum = Frustum::fromMatrix(context.viewProjection * transforms.model);
+  glm::vec3 cameraPosition(
+    glm::inverse(transforms.model) * glm::vec4(context.cameraPosition, 1)
+  );
+  // Cones are not preserved by non-uniform scale
+  glm::vec3 scale(
+    glm::length(glm::vec3(transforms.model[0])),
+    glm::length(glm::vec3(transforms.model[1])),
+    glm::length(glm::vec3(transforms.model[2]))
   );
-  shaderProgram.disable();
+  float maxScale = std::max({ scale.x, scale.y, scale.z });
+  float minScale = std::min({ scale.x, scale.y, scale.z });
+  bool cullBackfaces = !material.doubleSided && maxScale - minScale <= 1e-3f * maxScale;
+
+  thread_local std::vector<uint8_t> visible;
+  uint32_t culledCount = cullMeshlets(
+    meshlets, frustum, cameraPosition, cullBackfaces, visible
+  );
+  drawList.stats.culledMeshlets += culledCount;
+  if (culledCount == 0) {
+    return 0;
+  }
+
+  const Accessor& indices = *meshPrimitive.indices;
+  uintptr_t baseOffset = indices.bufferView->getGpuOffset(indices.byteOffset);
+  uint32_t culledTriangles = 0;
+  packet.rangeOffset = drawList.rangeCounts.size();
+  for (uint32_t m = 0; m < meshlets.size(); ++m) {
+    if (!visible[m]) {
+      culledTriangles += meshlets.indexCounts[m] / 3;
+    }
+    else if (m > 0 && visible[m - 1]) {
+      drawList.rangeCounts.back() += meshlets.indexCounts[m];
+    }
+    else {
+      drawList.rangeCounts.push_back(meshlets.indexCounts[m]);
+      drawList.rangeOffsets.push_back(reinterpret_cast<const void*>(
+        baseOffset + meshlets.indexOffsets[m] * indices.getElementSize()
+      ));
+      packet.rangeCount++;
+    }
+  }
+  return culledTriangles;
 }
 
-static void _drawMesh(
-  ShaderProgram& shaderProgram,
-  const AssetManager& assets, size_t assetId, uint32_t meshIndex,
-  const std::vector<glm::mat4>* joints,
-  const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection
+// The level whose texels match the pixels covered by one object space
+// unit, from the average density of the texture coordinates
+static void _requestTextures(
+  const ExtractContext& context, const DrawPacket& packet,
+  float projectedScale, DrawList& drawList
 ) {
-  const fx::gltf::Document& document = *assets.getAsset(assetId);
-  const auto& mesh = *assets.getMesh(assetId, meshIndex);
-  const auto& meshObj = document.meshes[meshIndex];
+  const MeshPrimitive& meshPrimitive = *packet.meshPrimitive;
+  const Material& material = *packet.material;
+  float pixelsPerUnit = projectedScale * context.textureStreamer->getViewportHeight();
+  if (meshPrimitive.texcoordDensity <= 0 || pixelsPerUnit <= 0) {
+    return;
+  }
+  float texcoordsPerPixel = (
+    meshPrimitive.texcoordDensity
+    * std::sqrt(std::abs(material.texcoordScale.x * material.texcoordScale.y))
+    / pixelsPerUnit
+  );
 
-  TextureData defaultColorTexture = {
-    std::vector<uint8_t>(4, 255),
-    1, 1,
-    fx::gltf::Sampler {}
-  };
-  TextureData defaultNormalMap = {
-    { 0, 0, 255, 255 },
-    1, 1,
-    fx::gltf::Sampler {}
+  const TextureData* textures[] = {
+    (packet.shaderFeatures & ShaderVariants::HAS_BASE_COLOR_TEXTURE)
+      ? material.baseColorTexture : nullptr,
+    (packet.shaderFeatures & ShaderVariants::HAS_NORMAL_MAP)
+      ? material.normalMap : nullptr
   };
-  Material defaultMaterial {
-    glm::vec4(1),
-    &defaultColorTexture,
-    &defaultNormalMap
-  };
-  defaultMaterial.loadToGpu();
+  for (const TextureData* texture: textures) {
+    if (texture) {
+      float texelsPerPixel = texcoordsPerPixel * std::max(texture->width, texture->height);
+      drawList.textureRequests.push_back(
+        TextureRequest { texture, std::log2(std::max(texelsPerPixel, 1.f)) }
+      );
+    }
+  }
+}
+
+static void _extractMesh(
+  const ExtractContext& context, const ExtractInstance& instance,
+  uint32_t slot, uint32_t meshIndex,
+  const NodeTransforms& transforms, const DrawPacket& packetBase,
+  DrawList& drawList
+) {
+  const fx::gltf::Document& document = *context.assets.getAsset(instance.assetId);
+  const auto& mesh = *context.assets.getMesh(instance.assetId, meshIndex);
+  const auto& meshObj = document.meshes[meshIndex];
+  bool skinned = (packetBase.jointCount > 0);
+  float projectedScale = (context.lodSelection || context.textureStreamer)
+    ? _getProjectedScale(context, instance, slot, mesh, transforms.model)
+    : 0;
+  uint32_t lod = _selectLod(context, instance, slot, mesh, projectedScale);
+  // The subtree bounds the node passed are its mesh's alone on a leaf,
+  // where a lone primitive needs no test of its own
+  bool leaf = instance.hierarchy.getSubtreeEnd(slot) == slot + 1;
 
   for (size_t i = 0; i < mesh.primitives.size(); ++i) {
     const MeshPrimitive& meshPrimitive = mesh.primitives[i];
+
+    // Skinned vertices can move anywhere, only test static ones
+    if (
+      !skinned && (mesh.primitives.size() > 1 || !leaf)
+      && !context.frustum.isVisible(
+        meshPrimitive.bounds.transformed(transforms.model)
+      )
+    ) {
+      drawList.stats.culledPrimitives++;
+      continue;
+    }
+
     auto materialIndex = meshObj.primitives[i].material;
-    auto material = materialIndex != -1
-      ? *assets.getMaterial(assetId, materialIndex)
-      : defaultMaterial;
+    const Material& defaultMaterial = context.assets.getDefaultMaterial();
+    DrawPacket packet = packetBase;
+    packet.meshPrimitive = &meshPrimitive;
+    packet.material = materialIndex != -1
+      ? context.assets.getMaterial(instance.assetId, materialIndex)
+      : &defaultMaterial;
+    packet.shaderFeatures = ShaderVariants::selectFeatures(
+      meshPrimitive, *packet.material, defaultMaterial, skinned
+    );
+    packet.lod = std::min(lod, meshPrimitive.getLodCount() - 1);
+    uint32_t triangleCount = meshPrimitive.getTriangleCount(packet.lod);
 
-    _drawMeshPrimitive(
-      shaderProgram,
-      meshPrimitive, material,
+    // Meshlets split the full level, and skinning moves their triangles
+    if (packet.lod == 0 && !skinned && !meshPrimitive.meshlets.empty()) {
+      uint32_t culledTriangles = _cullMeshlets(
+        context, meshPrimitive, *packet.material, transforms, packet, drawList
+      );
+      drawList.stats.culledMeshletTriangles += culledTriangles;
+      triangleCount -= culledTriangles;
+      if (packet.rangeCount == 0 && culledTriangles > 0) {
+        drawList.stats.culledPrimitives++;
+        continue;
+      }
+    }
+
+    if (!_writeDrawData(context.ringBuffer, drawList, transforms, packet)) {
+      continue;
+    }
+    if (context.textureStreamer) {
+      _requestTextures(context, packet, projectedScale, drawList);
+    }
+
+    drawList.stats.visiblePrimitives++;
+    drawList.stats.submittedTriangles += triangleCount;
+    drawList.packets.push_back(packet);
+  }
+}
+
+static void _extractNode(
+  const ExtractContext& context, const ExtractInstance& instance,
+  uint32_t slot, DrawList& drawList
+) {
+  const fx::gltf::Document& document = *context.assets.getAsset(instance.assetId);
+  const TransformHierarchy& hierarchy = instance.hierarchy;
+  const fx::gltf::Node& node = document.nodes[hierarchy.getNodeIndex(slot)];
+
+  if (node.mesh == -1) {
+    return;
+  }
+
+  NodeTransforms transforms = instance.model
+    ? NodeTransforms {
+      *instance.model * hierarchy.getWorld(slot),
+      *instance.normalModel * hierarchy.getWorldNormal(slot)
+    }
+    : NodeTransforms { hierarchy.getWorld(slot), hierarchy.getWorldNormal(slot) };
+  DrawPacket packetBase;
+
+  if (node.skin != -1) {
+    const fx::gltf::Skin& skin = document.skins[node.skin];
+
+    thread_local std::vector<glm::mat4> joints;
+    thread_local std::vector<float> lineData;
+    getJointMatrices(
+      context.assets, instance.assetId,
+      skin, hierarchy,
       joints,
-      model, view, projection
+      DRAW_SKELETON ? &lineData : nullptr
+    );
+
+    // The shader only holds MAX_JOINTS matrices
+    uint32_t jointCount = std::min<size_t>(joints.size(), DrawList::MAX_JOINTS);
+    joints.resize(DrawList::MAX_JOINTS, glm::mat4(1));
+    uint8_t* palette = _allocateDynamic(
+      context.ringBuffer, drawList, JOINT_PALETTE_SIZE, packetBase.jointOffset
     );
+    if (!palette) {
+      return;
+    }
+    memcpy(palette, joints.data(), JOINT_PALETTE_SIZE);
+    packetBase.jointCount = jointCount;
+
+    if (DRAW_SKELETON) {
+      DrawPacket packet = packetBase;
+      packet.material = &context.assets.getDefaultMaterial();
+      GLsizeiptr lineBytes = lineData.size() * sizeof(float);
+      uint8_t* lines = _allocateDynamic(
+        context.ringBuffer, drawList, lineBytes, packet.lineOffset
+      );
+      if (!lines) {
+        return;
+      }
+      memcpy(lines, lineData.data(), lineBytes);
+      packet.lineCount = lineData.size() / 3;
+      // Lines are drawn as is, not skinned
+      packet.jointCount = 0;
+      if (_writeDrawData(context.ringBuffer, drawList, transforms, packet)) {
+        drawList.packets.push_back(packet);
+      }
+      return;
+    }
   }
+
+  _extractMesh(context, instance, slot, node.mesh, transforms, packetBase, drawList);
 }
 
-static glm::mat4 _getNextModel(
-  const glm::mat4& model, const fx::gltf::Node& node
+// Descendants directly follow their ancestor, so a culled subtree is
+// skipped by jumping to its end
+static void _extractRange(
+  const ExtractContext& context, const ExtractInstance& instance,
+  uint32_t begin, uint32_t end, DrawList& drawList
 ) {
-  return (
-    model *
-    glm::translate(glm::mat4(1), glm::make_vec3(node.translation.data())) *
-    glm::mat4_cast(glm::make_quat(node.rotation.data())) *
-    glm::scale(glm::mat4(1), glm::make_vec3(node.scale.data())) *
-    glm::make_mat4(node.matrix.data())
-  );
+  const TransformHierarchy& hierarchy = instance.hierarchy;
+  for (uint32_t slot = begin; slot < end;) {
+    if (!context.frustum.isVisible(_placeBounds(instance, hierarchy.getSubtreeBounds(slot)))) {
+      uint32_t primitiveCount = hierarchy.getSubtreePrimitiveCount(slot);
+      if (primitiveCount > 0) {
+        drawList.stats.culledPrimitives += primitiveCount;
+        drawList.stats.culledSubtrees++;
+      }
+      slot = hierarchy.getSubtreeEnd(slot);
+      continue;
+    }
+
+    _extractNode(context, instance, slot, drawList);
+    slot++;
+  }
+}
+
+static ExtractContext _makeExtractContext(
+  const AssetManager& assets,
+  const glm::mat4& view, const glm::mat4& projection,
+  const LodSelection* lodSelection,
+  const TextureStreamer* textureStreamer,
+  GpuRingBuffer* ringBuffer
+) {
+  return ExtractContext {
+    assets,
+    projection * view,
+    Frustum::fromMatrix(projection * view),
+    lodSelection,
+    textureStreamer,
+    ringBuffer,
+    glm::vec3(glm::inverse(view)[3]),
+    projection[1][1] / 2
+  };
 }
 
-static std::vector<fx::gltf::Node> _getAnimatedNodes(
+void extractDrawLists(
   const AssetManager& assets, size_t assetId,
-  uint32_t animIndex,
-  float animTime
+  TransformHierarchy& hierarchy,
+  const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection,
+  float elapsedTime,
+  std::vector<DrawList>& drawLists,
+  ThreadPool* threadPool,
+  DrawStats* stats,
+  LodSelection* lodSelection,
+  const TextureStreamer* textureStreamer,
+  GpuRingBuffer* ringBuffer
 ) {
+  ProfileZone zone("extract");
+
   const fx::gltf::Document& document = *assets.getAsset(assetId);
-  const fx::gltf::Animation& anim = document.animations[animIndex];
+  if (document.animations.size() > 0) {
+    ProfileZone animateZone("animate");
+    animateHierarchy(assets, assetId, 0, elapsedTime, hierarchy, threadPool);
+  }
+  hierarchy.setRootTransform(model);
+  uint32_t updatedNodes;
+  {
+    ProfileZone updateZone("update hierarchy");
+    updatedNodes = hierarchy.update(threadPool);
+  }
+
+  const ExtractContext context = _makeExtractContext(
+    assets, view, projection, lodSelection, textureStreamer, ringBuffer
+  );
+  if (lodSelection) {
+    lodSelection->levels.resize(hierarchy.size(), 0);
+  }
+  const ExtractInstance instance {
+    assetId, hierarchy, nullptr, nullptr,
+    lodSelection ? lodSelection->levels.data() : nullptr
+  };
+
+  const auto& tasks = hierarchy.getTasks();
+  drawLists.resize(tasks.size());
+  for (DrawList& drawList: drawLists) {
+    drawList.clear();
+  }
 
-  std::vector<fx::gltf::Node> newNodes = document.nodes;
+  // Lone nodes are the ancestors of the subtree tasks: cull them first,
+  // so the tasks below a culled one are dropped before going wide.
+  // Each task writes to its own list, which keeps the draw order.
+  ProfileZone cullZone("cull and build packets");
+  thread_local std::vector<uint32_t> threadVisibleTasks;
+  std::vector<uint32_t>& visibleTasks = threadVisibleTasks;
+  visibleTasks.clear();
+  uint32_t culledUntil = 0;
+  for (uint32_t i = 0; i < tasks.size(); ++i) {
+    const auto& task = tasks[i];
+    if (task.begin < culledUntil) {
+      continue;
+    }
+    if (
+      !task.isSubtree
+      && !context.frustum.isVisible(hierarchy.getSubtreeBounds(task.begin))
+    ) {
+      uint32_t primitiveCount = hierarchy.getSubtreePrimitiveCount(task.begin);
+      if (primitiveCount > 0) {
+        drawLists[i].stats.culledPrimitives += primitiveCount;
+        drawLists[i].stats.culledSubtrees++;
+      }
+      culledUntil = hierarchy.getSubtreeEnd(task.begin);
+      continue;
+    }
+    visibleTasks.push_back(i);
+  }
 
-  for (const auto& channel: anim.channels) {
-    fx::gltf::Node& node = newNodes[channel.target.node];
-    const auto& sampler = anim.samplers[channel.sampler];
+  parallelFor(threadPool, visibleTasks.size(), [&](uint32_t i, uint32_t) {
+    uint32_t taskIndex = visibleTasks[i];
+    const auto& task = tasks[taskIndex];
+    if (task.isSubtree) {
+      _extractRange(context, instance, task.begin, task.end, drawLists[taskIndex]);
+    }
+    else {
+      _extractNode(context, instance, task.begin, drawLists[taskIndex]);
+    }
+  });
 
-    const Accessor& times = *assets.getAccessor(assetId, sampler.input);
-    const Accessor& values = *assets.getAccessor(assetId, sampler.output);
+  if (stats) {
+    stats->updatedNodes += updatedNodes;
+    for (const DrawList& drawList: drawLists) {
+      stats->add(drawList.stats);
+    }
+  }
+}
 
-    assert(times.count == values.count);
-    assert(times.type == Accessor::Type::Scalar);
-    assert(times.componentType == Accessor::ComponentType::Float);
+// A task of an instance's hierarchy
+struct WorldExtractItem {
+  uint32_t instance;
+  uint32_t task;
+};
 
-    if (times.count == 0)
+// Rasterizes the occluders among the visible instances, then removes the
+// other instances they hide, keeping the order. Occluders are always
+// kept, so they never hide themselves. Returns how many were removed.
+static uint32_t _cullOccludedInstances(
+  const AssetManager& assets, const World& world,
+  const glm::mat4& viewProjection, OcclusionBuffer& occlusionBuffer,
+  std::vector<uint32_t>& visibleInstances, ThreadPool* threadPool
+) {
+  occlusionBuffer.begin(viewProjection);
+  for (uint32_t i: visibleInstances) {
+    if (!(world.getFlags(i) & World::OCCLUDER)) {
       continue;
+    }
+    size_t assetId = world.getAssetId(i);
+    const fx::gltf::Document& document = *assets.getAsset(assetId);
+    const TransformHierarchy& hierarchy = world.getHierarchy(i);
+    bool posed = world.isPosed(i);
+    for (uint32_t slot = 0; slot < hierarchy.size(); ++slot) {
+      const fx::gltf::Node& node = document.nodes[hierarchy.getNodeIndex(slot)];
+      if (node.mesh == -1 || node.skin != -1) {
+        continue;
+      }
+      glm::mat4 model = posed
+        ? hierarchy.getWorld(slot)
+        : world.getTransform(i) * hierarchy.getWorld(slot);
+      for (const MeshPrimitive& primitive: assets.getMesh(assetId, node.mesh)->primitives) {
+        occlusionBuffer.addOccluder(primitive.occluderMesh, model);
+      }
+    }
+  }
+  if (occlusionBuffer.getStats().occluderCount == 0) {
+    return 0;
+  }
+  occlusionBuffer.rasterize(threadPool);
+
+  thread_local std::vector<Aabb> threadBoxes;
+  thread_local std::vector<uint8_t> threadOccluded;
+  std::vector<Aabb>& boxes = threadBoxes;
+  std::vector<uint8_t>& occluded = threadOccluded;
+  boxes.clear();
+  for (uint32_t i: visibleInstances) {
+    if (!(world.getFlags(i) & World::OCCLUDER)) {
+      boxes.push_back(world.getBounds(i));
+    }
+  }
+  occlusionBuffer.test(boxes, occluded, threadPool);
+
+  uint32_t kept = 0;
+  uint32_t tested = 0;
+  for (uint32_t i: visibleInstances) {
+    if ((world.getFlags(i) & World::OCCLUDER) || !occluded[tested++]) {
+      visibleInstances[kept++] = i;
+    }
+  }
+  uint32_t occludedCount = visibleInstances.size() - kept;
+  visibleInstances.resize(kept);
+  return occludedCount;
+}
 
-    // Keyframes
-    uint32_t prevKf;
-    uint32_t nextKf = 0;
-    while (nextKf < times.count && times.getComponent(nextKf) < animTime) {
-      nextKf++;
-    }
-    prevKf = std::max<uint32_t>(1, nextKf) - 1;
-    nextKf = std::min<uint32_t>(nextKf, times.count - 1);
-
-    float prevTime = times.getComponent(prevKf);
-    float nextTime = times.getComponent(nextKf);
-    float transition = (nextKf != prevKf) ?
-      (animTime - prevTime) / (nextTime - prevTime)
-      : 0;
-
-    if (channel.target.path == "translation") {
-      for (size_t i = 0; i < 3; ++i) {
-        node.translation[i] = (
-          values.getComponent(prevTime, i) * (1 - transition)
-          + values.getComponent(nextTime, i) * transition
-        );
+void extractDrawLists(
+  const AssetManager& assets, World& world,
+  const glm::mat4& view, const glm::mat4& projection,
+  std::vector<DrawList>& drawLists,
+  ThreadPool* threadPool,
+  DrawStats* stats,
+  const LodSelection* lodSelection,
+  const TextureStreamer* textureStreamer,
+  GpuRingBuffer* ringBuffer,
+  OcclusionBuffer* occlusionBuffer
+) {
+  ProfileZone zone("extract world");
+
+  const ExtractContext context = _makeExtractContext(
+    assets, view, projection, lodSelection, textureStreamer, ringBuffer
+  );
+
+  // Back in dense order, which the components are laid out in
+  thread_local std::vector<uint32_t> threadVisibleInstances;
+  thread_local std::vector<uint8_t> threadInFrustum;
+  std::vector<uint32_t>& visibleInstances = threadVisibleInstances;
+  std::vector<uint8_t>& inFrustum = threadInFrustum;
+  {
+    ProfileZone cullZone("cull instances");
+    visibleInstances.clear();
+    world.getBvh().queryFrustum(context.frustum, visibleInstances);
+    inFrustum.assign(world.size(), 0);
+    for (uint32_t i: visibleInstances) {
+      inFrustum[i] = 1;
+    }
+    visibleInstances.clear();
+    for (uint32_t i = 0; i < world.size(); ++i) {
+      if (inFrustum[i] && (world.getFlags(i) & World::VISIBLE)) {
+        visibleInstances.push_back(i);
       }
     }
-    else if (channel.target.path == "rotation") {
-      for (size_t i = 0; i < 4; ++i) {
-        node.rotation[i] = (
-          values.getComponent(prevTime, i) * (1 - transition)
-          + values.getComponent(nextTime, i) * transition
-        );
+  }
+  uint32_t occludedInstances = 0;
+  if (occlusionBuffer) {
+    ProfileZone occlusionZone("occlusion");
+    occludedInstances = _cullOccludedInstances(
+      assets, world, context.viewProjection, *occlusionBuffer,
+      visibleInstances, threadPool
+    );
+  }
+
+  // Consecutive tasks are grouped up to a task's worth of nodes, and each
+  // group fills its own list, which keeps the draw order
+  thread_local std::vector<WorldExtractItem> threadItems;
+  thread_local std::vector<uint32_t> threadGroupEnds;
+  std::vector<WorldExtractItem>& items = threadItems;
+  std::vector<uint32_t>& groupEnds = threadGroupEnds;
+  items.clear();
+  groupEnds.clear();
+  uint32_t groupNodeCount = 0;
+  for (uint32_t i: visibleInstances) {
+    const auto& tasks = world.getHierarchy(i).getTasks();
+    for (uint32_t t = 0; t < tasks.size(); ++t) {
+      items.push_back(WorldExtractItem { i, t });
+      groupNodeCount += tasks[t].end - tasks[t].begin;
+      if (groupNodeCount >= TransformHierarchy::TASK_GRAIN) {
+        groupEnds.push_back(items.size());
+        groupNodeCount = 0;
       }
     }
-    else if (channel.target.path == "scale") {
-      for (size_t i = 0; i < 3; ++i) {
-        node.scale[i] = (
-          values.getComponent(prevTime, i) * (1 - transition)
-          + values.getComponent(nextTime, i) * transition
-        );
+  }
+  if (groupNodeCount > 0) {
+    groupEnds.push_back(items.size());
+  }
+
+  drawLists.resize(groupEnds.size());
+  for (DrawList& drawList: drawLists) {
+    drawList.clear();
+  }
+
+  ProfileZone buildZone("build packets");
+  parallelFor(threadPool, groupEnds.size(), [&](uint32_t group, uint32_t) {
+    DrawList& drawList = drawLists[group];
+    for (uint32_t item = group > 0 ? groupEnds[group - 1] : 0; item < groupEnds[group]; ++item) {
+      uint32_t index = items[item].instance;
+      bool posed = world.isPosed(index);
+      const ExtractInstance instance {
+        world.getAssetId(index), world.getHierarchy(index),
+        posed ? nullptr : &world.getTransform(index),
+        posed ? nullptr : &world.getNormalTransform(index),
+        world.getLodLevels(index)
+      };
+      const auto& task = instance.hierarchy.getTasks()[items[item].task];
+      if (task.isSubtree) {
+        _extractRange(context, instance, task.begin, task.end, drawList);
       }
+      else if (
+        context.frustum.isVisible(
+          _placeBounds(instance, instance.hierarchy.getSubtreeBounds(task.begin))
+        )
+      ) {
+        _extractNode(context, instance, task.begin, drawList);
+      }
+    }
+  });
+
+  if (stats) {
+    stats->culledInstances += world.size() - visibleInstances.size() - occludedInstances;
+    stats->occludedInstances += occludedInstances;
+    for (const DrawList& drawList: drawLists) {
+      stats->add(drawList.stats);
     }
   }
-  return std::move(newNodes);
 }
 
-void _setSkeletonData(
-  std::vector<glm::mat4>& skeletonData,
-  std::vector<float>* bufferData,
-  const glm::mat4& model,
-  const std::vector<fx::gltf::Node>& nodes,
-  const std::vector<uint32_t>& jointIndices,
-  uint32_t nodeIndex
-) {
-  glm::mat4 nodeModel = _getNextModel(model, nodes[nodeIndex]);
-
-  for (size_t i = 0; i < jointIndices.size(); ++i) {
-    if (jointIndices[i] == nodeIndex) {
-      skeletonData[i] = nodeModel;
-      if (bufferData)
-      {
-        glm::vec4 matPos = model * glm::vec4(0, 0, 0, 1);
-        (*bufferData)[i * 6 + 0] = matPos.x;
-        (*bufferData)[i * 6 + 1] = matPos.y;
-        (*bufferData)[i * 6 + 2] = matPos.z;
-
-        matPos = nodeModel * glm::vec4(0, 0, 0, 1);
-        (*bufferData)[i * 6 + 3] = matPos.x;
-        (*bufferData)[i * 6 + 4] = matPos.y;
-        (*bufferData)[i * 6 + 5] = matPos.z;
+// Texture units and block bindings of a program variant, set once per
+// submission. Samplers a variant does not use are -1, which GL ignores.
+struct SubmitUniforms {
+  GLint texture;
+  GLint normalMap;
+
+  explicit SubmitUniforms(const ShaderProgram& shaderProgram) {
+    GLuint programId = shaderProgram.getProgramId();
+    texture = glGetUniformLocation(programId, "textureId");
+    normalMap = glGetUniformLocation(programId, "normalMapId");
+
+    // Block bindings belong to the program, setting them again is cheap
+    const std::pair<const char*, GLuint> blocks[] = {
+      { "FrameData", FRAME_DATA_BINDING },
+      { "DrawData", DRAW_DATA_BINDING },
+      { "JointPalette", JOINT_PALETTE_BINDING }
+    };
+    for (const auto& block: blocks) {
+      GLuint blockIndex = glGetUniformBlockIndex(programId, block.first);
+      if (blockIndex != GL_INVALID_INDEX) {
+        glUniformBlockBinding(programId, blockIndex, block.second);
+      }
+    }
+    const std::pair<const char*, GLuint> storageBlocks[] = {
+      { "Lights", LIGHTS_BINDING },
+      { "LightClusters", LIGHT_CLUSTERS_BINDING },
+      { "LightIndices", LIGHT_INDICES_BINDING }
+    };
+    for (const auto& block: storageBlocks) {
+      GLuint blockIndex = glGetProgramResourceIndex(
+        programId, GL_SHADER_STORAGE_BLOCK, block.first
+      );
+      if (blockIndex != GL_INVALID_INDEX) {
+        glShaderStorageBlockBinding(programId, blockIndex, block.second);
       }
-      break;
     }
   }
+};
+
+// Redundant bindings are skipped by GlState
+struct SubmitState {
+  uint32_t shaderFeatures = UINT32_MAX;
+  GLuint ringBufferId = 0;
+  // Created for the first skeleton lines
+  GLuint lineVaoId = 0;
+  // Textures bound to units 0 and 1, to count the changes
+  GLuint textures[2] = { 0, 0 };
+  SubmitStats stats;
+};
 
-  for (uint32_t childIndex: nodes[nodeIndex].children) {
-    _setSkeletonData(
-      skeletonData,
-      bufferData,
-      nodeModel,
-      nodes,
-      jointIndices,
-      childIndex
+static void _drawMeshPrimitive(
+  const MeshPrimitive& meshPrimitive, uint32_t lod = 0,
+  const GLsizei* rangeCounts = nullptr, const void* const* rangeOffsets = nullptr,
+  uint32_t rangeCount = 0
+) {
+  GlState& glState = GlState::get();
+  glState.bindVertexArray(meshPrimitive.vaoId);
+
+  if (meshPrimitive.indices) {
+    const Accessor& indices = *meshPrimitive.getLodIndices(lod);
+    // Levels may live in other buffers than the one the VAO recorded,
+    // binding one changes the VAO state for the next draws too
+    if (!meshPrimitive.lods.empty()) {
+      glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.bufferView->vboId);
+    }
+    if (rangeCount > 0) {
+      glMultiDrawElements(
+        (GLenum)meshPrimitive.mode,
+        rangeCounts,
+        (GLenum)indices.componentType,
+        rangeOffsets,
+        rangeCount
+      );
+    }
+    else {
+      glDrawElements(
+        (GLenum)meshPrimitive.mode,
+        indices.count,
+        (GLenum)indices.componentType,
+        reinterpret_cast<GLvoid*>(
+          indices.bufferView->getGpuOffset(indices.byteOffset)
+        )
+      );
+    }
+  }
+  else {
+    glDrawArrays(
+      (GLenum)meshPrimitive.mode,
+      0,
+      meshPrimitive.attributes.at("POSITION")->count
     );
   }
 }
 
-std::vector<glm::mat4> _getSkeleton(
-  const std::vector<fx::gltf::Node>& nodes,
-  const std::vector<uint32_t>& jointIndices,
-  uint32_t skeletonNodeIndex,
-  std::vector<float>* bufferData
+// Lines are read straight from the ring buffer
+static void _drawSkeletonLines(
+  SubmitState& state, GLintptr lineOffset, uint32_t lineCount
 ) {
-  std::vector<glm::mat4> skeletonData(jointIndices.size(), glm::mat4(1));
-  if (bufferData)
-    *bufferData = std::vector<float>(3 * 2 * jointIndices.size(), 0);
-  _setSkeletonData(
-    skeletonData,
-    bufferData,
-    glm::mat4(1),
-    nodes,
-    jointIndices,
-    skeletonNodeIndex
-  );
-  return skeletonData;
+  GlState& glState = GlState::get();
+  if (state.lineVaoId == 0) {
+    glGenVertexArrays(1, &state.lineVaoId);
+    glState.bindVertexArray(state.lineVaoId);
+    glEnableVertexAttribArray(0);
+    glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, 0);
+    glVertexAttribBinding(0, 0);
+  }
+  glState.bindVertexArray(state.lineVaoId);
+  glBindVertexBuffer(0, state.ringBufferId, lineOffset, 3 * sizeof(float));
+  glDrawArrays(GL_LINES, 0, lineCount);
 }
 
-static void _drawNode(
-  ShaderProgram& shaderProgram,
-  const AssetManager& assets, size_t assetId,
-  const std::vector<fx::gltf::Node>& nodes, uint32_t nodeIndex,
-  const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection
+// Switches to the packet's program variant, setting its texture units
+// the first time it is used in this submission
+static void _useVariant(
+  ShaderVariants& shaders,
+  std::array<std::optional<SubmitUniforms>, ShaderVariants::VARIANT_COUNT>& variantUniforms,
+  SubmitState& state, uint32_t shaderFeatures
 ) {
-  const fx::gltf::Document& document = *assets.getAsset(assetId);
-  const fx::gltf::Node& node = nodes[nodeIndex];
-  bool DRAW_SKELETON = false;
+  if (shaderFeatures == state.shaderFeatures) {
+    return;
+  }
+  ShaderProgram& shaderProgram = shaders.get(shaderFeatures);
+  GlState::get().useProgram(shaderProgram.getProgramId());
+  state.stats.programChanges++;
 
-  glm::mat4 nodeModel = _getNextModel(model, node);
+  auto& uniforms = variantUniforms[shaderFeatures];
+  if (!uniforms) {
+    uniforms.emplace(shaderProgram);
+    glUniform1i(uniforms->texture, 0);
+    glUniform1i(uniforms->normalMap, 1);
+  }
 
-  if (node.mesh != -1) {
-    std::vector<glm::mat4> joints;
-    std::vector<glm::mat4>* jointsPtr = nullptr;
+  state.shaderFeatures = shaderFeatures;
+}
 
-    if (node.skin != -1) {
-      const fx::gltf::Skin& skin = document.skins[node.skin];
+// dynamicBase locates the list's dynamic data in the ring buffer
+static void _submitPacket(
+  SubmitState& state, const DrawList& drawList, const DrawPacket& packet,
+  GLintptr dynamicBase
+) {
+  const Material& material = *packet.material;
+  assert(material.isLoaded());
 
-      std::vector<float> bufferData;
-      joints = _getSkeleton(nodes, skin.joints, skin.skeleton, &bufferData);
-      jointsPtr = &joints;
-      BufferView* skeleton = createBufferView(bufferData);
+  GlState& glState = GlState::get();
+  glState.bindBufferRange(
+    GL_UNIFORM_BUFFER, DRAW_DATA_BINDING, state.ringBufferId,
+    dynamicBase + packet.drawDataOffset, sizeof(DrawDataBlock)
+  );
 
-      const Accessor& inverseBindMatrices = *assets.getAccessor(
-        assetId, skin.inverseBindMatrices
-      );
+  // Only skinned variants have a palette, and only skinned nodes use them
+  if (packet.shaderFeatures & ShaderVariants::HAS_SKINNING) {
+    assert(packet.jointCount > 0);
+    glState.bindBufferRange(
+      GL_UNIFORM_BUFFER, JOINT_PALETTE_BINDING, state.ringBufferId,
+      dynamicBase + packet.jointOffset, JOINT_PALETTE_SIZE
+    );
+  }
 
-      assert(joints.size() == inverseBindMatrices.count);
-      for (size_t i = 0; i < joints.size(); ++i) {
-        std::array<float, 16> inverseBindMatrixData;
-        for (size_t j = 0; j < 16; ++j) {
-          inverseBindMatrixData[j] = inverseBindMatrices.getComponent(i, j);
-        }
-        joints[i] = joints[i] * glm::make_mat4(inverseBindMatrixData.data());
-      }
+  // Bindless variants sample through the handles of the DrawData block,
+  // array variants keep the same arrays bound across materials
+  const std::pair<uint32_t, const TextureData*> textures[] = {
+    { ShaderVariants::HAS_BASE_COLOR_TEXTURE, material.baseColorTexture },
+    { ShaderVariants::HAS_NORMAL_MAP, material.normalMap }
+  };
+  bool bindless = packet.shaderFeatures & ShaderVariants::USE_BINDLESS_TEXTURES;
+  bool arrays = packet.shaderFeatures & ShaderVariants::USE_TEXTURE_ARRAYS;
+  for (GLuint unit = 0; unit < 2; ++unit) {
+    if (bindless || !(packet.shaderFeatures & textures[unit].first)) {
+      continue;
+    }
+    const TextureData& texture = *textures[unit].second;
+    GLuint texId = arrays ? texture.arrayTexId : texture.texId;
+    glState.bindTexture(unit, arrays ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D, texId);
+    if (texId != state.textures[unit]) {
+      state.textures[unit] = texId;
+      state.stats.textureChanges++;
+    }
+  }
+  state.stats.drawCalls++;
 
-      if (DRAW_SKELETON) {
-        Accessor accessor = {
-          skeleton,
-          0,
-          bufferData.size() / 3,
-          Accessor::Type::Vec3,
-          Accessor::ComponentType::Float,
-        };
-        MeshPrimitive skeletonMesh = {
-          MeshPrimitive::Mode::Lines,
-          { { "POSITION", &accessor } }
-        };
-        skeletonMesh.loadToGpu(
-          { { "POSITION", 0 } }
-        );
-        // FIXME
-        TextureData defaultColorTexture = {
-          std::vector<uint8_t>(4, 255),
-          1, 1,
-          fx::gltf::Sampler {}
-        };
-        TextureData defaultNormalMap = {
-          { 0, 0, 255, 255 },
-          1, 1,
-          fx::gltf::Sampler {}
-        };
-        Material mat {
-          glm::vec4(1),
-          &defaultColorTexture,
-          &defaultNormalMap
-        };
-        mat.loadToGpu();
-
-        _drawMeshPrimitive(
-          shaderProgram,
-          skeletonMesh, mat,
-          nullptr,
-          nodeModel, view, projection
-        );
-
-        glDeleteBuffers(1, &skeleton->vboId);
-      }
+  if (packet.meshPrimitive) {
+    assert(packet.meshPrimitive->isLoaded());
+    assert(packet.meshPrimitive->attributes.count("POSITION") > 0);
+    _drawMeshPrimitive(
+      *packet.meshPrimitive, packet.lod,
+      drawList.rangeCounts.data() + packet.rangeOffset,
+      drawList.rangeOffsets.data() + packet.rangeOffset,
+      packet.rangeCount
+    );
+  }
+  else {
+    _drawSkeletonLines(state, dynamicBase + packet.lineOffset, packet.lineCount);
+  }
+}
+
+void submitDrawLists(
+  ShaderVariants& shaders,
+  const std::vector<DrawList>& drawLists,
+  GpuRingBuffer& ringBuffer,
+  const glm::mat4& view, const glm::mat4& projection,
+  const LightGrid* lightGrid,
+  SubmitStats* stats
+) {
+  ProfileZone zone("submit");
+  GpuProfileZone gpuZone("submit");
+
+  if (lightGrid == nullptr) {
+    // The light the scenes were lit by before there were light lists
+    static LightGrid defaultLightGrid(1, 1, 1);
+    static const std::vector<Light> defaultLights = {
+      Light { glm::vec3(1, 2, 3) }
+    };
+    defaultLightGrid.update(defaultLights, view, projection);
+    lightGrid = &defaultLightGrid;
+  }
+
+  GpuRingAllocation frameData = ringBuffer.allocate(sizeof(FrameDataBlock));
+  if (!frameData.isValid()) {
+    return;
+  }
+  FrameDataBlock frameBlock;
+  frameBlock.view = view;
+  frameBlock.projection = projection;
+  frameBlock.viewProjection = projection * view;
+  glm::mat3 viewNormal = glm::transpose(glm::inverse(glm::mat3(view)));
+  for (int c = 0; c < 3; ++c) {
+    frameBlock.viewNormal[c] = _std140(viewNormal[c]);
+  }
+  frameBlock.clusterCounts = lightGrid->getClusterCounts();
+  frameBlock.clusterParameters = lightGrid->getClusterParameters();
+  memcpy(frameData.data, &frameBlock, sizeof(frameBlock));
+
+  // Empty lists still bind a range, GL rejects empty ones
+  const std::pair<const void*, size_t> lightData[] = {
+    { lightGrid->getLights().data(), lightGrid->getLights().size() * sizeof(LightGrid::GpuLight) },
+    { lightGrid->getClusters().data(), lightGrid->getClusters().size() * sizeof(uint32_t) },
+    { lightGrid->getLightIndices().data(), lightGrid->getLightIndices().size() * sizeof(uint32_t) }
+  };
+  GpuRingAllocation lightAllocations[3];
+  for (int i = 0; i < 3; ++i) {
+    lightAllocations[i] = ringBuffer.allocate(std::max<size_t>(lightData[i].second, 16));
+    if (!lightAllocations[i].isValid()) {
+      return;
     }
+    memcpy(lightAllocations[i].data, lightData[i].first, lightData[i].second);
+  }
 
-    if (!DRAW_SKELETON) {
-      _drawMesh(
-        shaderProgram,
-        assets, assetId, node.mesh,
-        jointsPtr,
-        nodeModel, view, projection
-      );
+  // Lists extracted without the ring buffer bring their data along, a
+  // list that does not fit is dropped
+  thread_local std::vector<GLintptr> threadDynamicBases;
+  std::vector<GLintptr>& dynamicBases = threadDynamicBases;
+  dynamicBases.assign(drawLists.size(), 0);
+  for (size_t i = 0; i < drawLists.size(); ++i) {
+    const std::vector<uint8_t>& data = drawLists[i].dynamicData;
+    if (data.empty()) {
+      continue;
     }
+    GpuRingAllocation allocation = ringBuffer.allocate(data.size());
+    if (allocation.isValid()) {
+      memcpy(allocation.data, data.data(), data.size());
+    }
+    dynamicBases[i] = allocation.isValid() ? allocation.offset : -1;
   }
+  ringBuffer.flush();
 
-  for (uint32_t childIndex: nodes[nodeIndex].children) {
-    _drawNode(
-      shaderProgram,
-      assets, assetId,
-      nodes, childIndex,
-      nodeModel, view, projection
+  std::array<std::optional<SubmitUniforms>, ShaderVariants::VARIANT_COUNT> variantUniforms;
+  SubmitState state;
+  state.ringBufferId = ringBuffer.getBufferId();
+  GlState& glState = GlState::get();
+  glState.bindBufferRange(
+    GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, state.ringBufferId,
+    frameData.offset, sizeof(FrameDataBlock)
+  );
+  const GLuint lightBindings[] = {
+    LIGHTS_BINDING, LIGHT_CLUSTERS_BINDING, LIGHT_INDICES_BINDING
+  };
+  for (int i = 0; i < 3; ++i) {
+    glState.bindBufferRange(
+      GL_SHADER_STORAGE_BUFFER, lightBindings[i], state.ringBufferId,
+      lightAllocations[i].offset, lightAllocations[i].size
     );
   }
+
+  for (size_t i = 0; i < drawLists.size(); ++i) {
+    if (dynamicBases[i] < 0) {
+      continue;
+    }
+    for (const DrawPacket& packet: drawLists[i].packets) {
+      _useVariant(shaders, variantUniforms, state, packet.shaderFeatures);
+      _submitPacket(state, drawLists[i], packet, dynamicBases[i]);
+    }
+  }
+
+  if (state.lineVaoId != 0) {
+    glState.deleteVertexArray(state.lineVaoId);
+  }
+  if (stats) {
+    *stats = state.stats;
+  }
+}
+
+void draw(
+  ShaderVariants& shaders, GpuRingBuffer& ringBuffer,
+  const MeshPrimitive& meshPrimitive, const Material& material,
+  const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection
+) {
+  std::vector<DrawList> drawLists(1);
+  DrawPacket packet;
+  packet.meshPrimitive = &meshPrimitive;
+  packet.material = &material;
+  // Without placeholders to compare against, any texture is sampled
+  packet.shaderFeatures = ShaderVariants::selectFeatures(
+    meshPrimitive, material, Material {}, false
+  );
+  NodeTransforms transforms {
+    model, glm::transpose(glm::inverse(glm::mat3(model)))
+  };
+  _writeDrawData(nullptr, drawLists[0], transforms, packet);
+  drawLists[0].packets.push_back(packet);
+  submitDrawLists(shaders, drawLists, ringBuffer, view, projection);
 }
 
 void draw(
-  ShaderProgram& shaderProgram,
+  ShaderVariants& shaders, GpuRingBuffer& ringBuffer,
   const AssetManager& assets, size_t assetId,
+  TransformHierarchy& hierarchy,
   const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection,
-  float elapsedTime
+  float elapsedTime,
+  DrawStats* stats,
+  ThreadPool* threadPool,
+  LodSelection* lodSelection
 ) {
-  shaderProgram.use();
-
-  const fx::gltf::Document& document = *assets.getAsset(assetId);
-  std::vector<fx::gltf::Node> nodes = document.animations.size() > 0
-    ? _getAnimatedNodes(assets, assetId, 0, elapsedTime)
-    : document.nodes;
-
-  for (uint32_t rootNode: document.scenes[0].nodes) {
-    _drawNode(
-      shaderProgram,
-      assets, assetId,
-      nodes, rootNode,
-      model, view, projection
-    );
-  }
-
-  shaderProgram.disable();
+  static std::vector<DrawList> drawLists;
+  extractDrawLists(
+    assets, assetId,
+    hierarchy,
+    model, view, projection,
+    elapsedTime,
+    drawLists,
+    threadPool,
+    stats,
+    lodSelection,
+    nullptr,
+    &ringBuffer
+  );
+  submitDrawLists(shaders, drawLists, ringBuffer, view, projection);
 }
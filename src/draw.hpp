@@ -2,23 +2,186 @@
 #ifndef DRAW_H
 #define DRAW_H
 
+#include <glm/mat3x3.hpp>
 #include <glm/mat4x4.hpp>
 
+#include <vector>
+
 #include "AssetManager.hpp"
-#include "ShaderProgram.hpp"
+#include "ShaderVariants.hpp"
 #include "Primitives.hpp"
+#include "TransformHierarchy.hpp"
+#include "ThreadPool.hpp"
+#include "TextureStreamer.hpp"
+#include "GpuAllocator.hpp"
+#include "World.hpp"
+#include "Occlusion.hpp"
+#include "LightGrid.hpp"
+
+struct DrawStats {
+  uint32_t visiblePrimitives = 0;
+  uint32_t culledPrimitives = 0;
+  // Rejected as a whole, without visiting their nodes
+  uint32_t culledSubtrees = 0;
+  // World matrices recomputed this frame
+  uint32_t updatedNodes = 0;
+  // At the selected levels of detail
+  uint32_t submittedTriangles = 0;
+  // Of visible primitives, not submitted
+  uint32_t culledMeshlets = 0;
+  uint32_t culledMeshletTriangles = 0;
+  // Of a world, hidden or rejected by their bounds
+  uint32_t culledInstances = 0;
+  // Of a world, in the frustum but behind occluders
+  uint32_t occludedInstances = 0;
+
+  void add(const DrawStats& other);
+};
+
+// State changes between the draw calls of a submission
+struct SubmitStats {
+  uint32_t drawCalls = 0;
+  uint32_t programChanges = 0;
+  // Of the textures bound for the draws, bindless draws bind none
+  uint32_t textureChanges = 0;
+};
+
+// Everything needed to issue one draw call, computed without touching GL
+struct DrawPacket {
+  // null for debug skeleton lines
+  const MeshPrimitive* meshPrimitive = nullptr;
+  const Material* material = nullptr;
+
+  // Dynamic data of the draw, as byte offsets in the ring buffer it was
+  // extracted to, or in DrawList::dynamicData. DrawData block, per
+  // packet.
+  GLintptr drawDataOffset = 0;
+  // JointPalette block, jointCount is 0 when not skinned
+  GLintptr jointOffset = 0;
+  uint32_t jointCount = 0;
+  // Vertices of the skeleton lines
+  GLintptr lineOffset = 0;
+  uint32_t lineCount = 0;
+
+  // ShaderVariants feature bits of the program to draw with
+  uint32_t shaderFeatures = 0;
+
+  // Level of detail of meshPrimitive
+  uint32_t lod = 0;
+
+  // Range in DrawList::rangeCounts and rangeOffsets of the index ranges
+  // left by meshlet culling, rangeCount is 0 to draw all the indices
+  uint32_t rangeOffset = 0;
+  uint32_t rangeCount = 0;
+};
+
+// Output of a single extraction task, so workers never share a list
+struct DrawList {
+  // Joint palettes are padded to the shader's array size
+  static constexpr uint32_t MAX_JOINTS = 16;
+
+  std::vector<DrawPacket> packets;
+  // Index counts and byte offsets, as glMultiDrawElements takes them
+  std::vector<GLsizei> rangeCounts;
+  std::vector<const void*> rangeOffsets;
+  // Levels the packets sample their textures at
+  std::vector<TextureRequest> textureRequests;
+  // Dynamic data of the packets when extracted without a ring buffer,
+  // copied into one at submission
+  std::vector<uint8_t> dynamicData;
+
+  DrawStats stats;
+
+  // Keeps the allocations for the next frame
+  void clear();
+};
+
+// Picks the coarsest level of detail of each node whose simplification
+// error stays under a number of pixels on screen. Kept across frames, to
+// switch levels with some hysteresis.
+struct LodSelection {
+  float errorThreshold = 1;
+  float viewportHeight = 800;
+  // A coarser level is only taken once its error is under this fraction
+  // of the threshold, so nodes near the limit do not pop back and forth
+  float hysteresis = 0.75f;
+
+  // Current level of each hierarchy slot
+  std::vector<uint8_t> levels;
+};
+
+// Animates and updates the hierarchy, then culls it and fills one draw
+// list per hierarchy task. With a texture streamer, the lists also get
+// the mip levels their textures need, to hand to it before submitting.
+// With a ring buffer, which must be in a frame, the workers write the
+// dynamic data of the draws straight into it; draws that do not fit are
+// dropped. Makes no GL calls.
+void extractDrawLists(
+  const AssetManager& assets, size_t assetId,
+  TransformHierarchy& hierarchy,
+  const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection,
+  float elapsedTime,
+  std::vector<DrawList>& drawLists,
+  ThreadPool* threadPool = nullptr,
+  DrawStats* stats = nullptr,
+  LodSelection* lodSelection = nullptr,
+  const TextureStreamer* textureStreamer = nullptr,
+  GpuRingBuffer* ringBuffer = nullptr
+);
+
+// Culls the instances of the world through its BVH, then fills draw
+// lists as above, each with a group of consecutive instances, or with
+// the tasks of a large one. Runs after the world's systems. Static
+// instances are drawn with the rest pose of their asset, and each
+// instance keeps its own levels of detail. With an occlusion buffer, the
+// visible occluder instances are rasterized into it, and the other
+// instances they hide are culled too.
+void extractDrawLists(
+  const AssetManager& assets, World& world,
+  const glm::mat4& view, const glm::mat4& projection,
+  std::vector<DrawList>& drawLists,
+  ThreadPool* threadPool = nullptr,
+  DrawStats* stats = nullptr,
+  const LodSelection* lodSelection = nullptr,
+  const TextureStreamer* textureStreamer = nullptr,
+  GpuRingBuffer* ringBuffer = nullptr,
+  OcclusionBuffer* occlusionBuffer = nullptr
+);
+
+// Writes the FrameData block, then issues the draw calls of the lists,
+// in order, switching program variants as needed. The ring buffer must
+// be in the frame the lists were extracted in, it also takes the lists'
+// own dynamic data and the light lists. The light grid must have been
+// updated with the same view and projection, without one the scene is
+// lit by a single point light. The state changes of the submission are
+// counted into stats. Must run on the thread owning the GL context.
+void submitDrawLists(
+  ShaderVariants& shaders,
+  const std::vector<DrawList>& drawLists,
+  GpuRingBuffer& ringBuffer,
+  const glm::mat4& view, const glm::mat4& projection,
+  const LightGrid* lightGrid = nullptr,
+  SubmitStats* stats = nullptr
+);
 
+// The ring buffer must be in a frame
 void draw(
-  ShaderProgram& shaderProgram,
+  ShaderVariants& shaders, GpuRingBuffer& ringBuffer,
   const MeshPrimitive& meshPrimitive, const Material& material,
   const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection
 );
 
+// Extraction and submission in one call, the ring buffer must be in a
+// frame
 void draw(
-  ShaderProgram& shaderProgram,
+  ShaderVariants& shaders, GpuRingBuffer& ringBuffer,
   const AssetManager& assets, size_t assetId,
+  TransformHierarchy& hierarchy,
   const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection,
-  float elapsedTime
+  float elapsedTime,
+  DrawStats* stats = nullptr,
+  ThreadPool* threadPool = nullptr,
+  LodSelection* lodSelection = nullptr
 );
 
 #endif // !DRAW_H
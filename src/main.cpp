@@ -3,6 +3,10 @@
 #include <cstdio>
 #include <chrono>
 #include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cmath>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -11,37 +15,177 @@
 #include "AssetManager.hpp"
 #include "Primitives.hpp"
 #include "draw.hpp"
+#include "ThreadPool.hpp"
+#include "Profiler.hpp"
+#include "Headless.hpp"
+#include "TextureStreamer.hpp"
+#include "World.hpp"
+#include "GlState.hpp"
+#include "TextureArrays.hpp"
+
+// Nearest rank, sortedTimes must not be empty
+static double _percentile(const std::vector<double>& sortedTimes, double percent) {
+  size_t rank = (size_t)(percent / 100 * (sortedTimes.size() - 1) + 0.5);
+  return sortedTimes[rank];
+}
 
 int main(int argc, char** argv)
 {
-  if (argc != 2) {
-    printf("Usage: %s <asset-path>", argv[0]);
+  // 0 uses every hardware thread
+  uint32_t threadCount = 0;
+  std::string tracePath;
+  // Headless runs a fixed number of frames, 0 opens a window
+  uint32_t headlessFrames = 0;
+  std::string screenshotPath;
+  bool optimize = false;
+  bool quantize = false;
+  bool meshlets = false;
+  // Triangle BVHs are built, and clicks report what they hit
+  bool picking = false;
+  // Pixels of simplification error allowed, negative keeps full detail
+  float lodThreshold = -1;
+  // Megabytes of texture levels kept on the GPU, negative keeps them all
+  float textureBudget = -1;
+  // Textures packed into arrays, referenced by handle when bindless.
+  // Packed textures cannot be streamed.
+  bool textureArrays = false;
+  bool bindless = false;
+  // Object space simplification error of the occluders, negative turns
+  // occlusion culling off. The instances of the first asset occlude the
+  // others.
+  float occluderError = -1;
+  // Scattered over the grid, 0 keeps the single default light
+  uint32_t lightCount = 0;
+  // Of each asset, laid out on a grid
+  uint32_t instanceCount = 1;
+  std::vector<std::string> assetPaths;
+  int firstOption = 1;
+  for (; firstOption < argc && argv[firstOption][0] != '-'; ++firstOption) {
+    assetPaths.push_back(argv[firstOption]);
+  }
+  bool validArgs = !assetPaths.empty();
+  for (int i = firstOption; validArgs && i < argc; ++i) {
+    std::string option = argv[i];
+    if (option == "--optimize") {
+      optimize = true;
+      continue;
+    }
+    if (option == "--quantize") {
+      quantize = true;
+      continue;
+    }
+    if (option == "--meshlets") {
+      meshlets = true;
+      continue;
+    }
+    if (option == "--picking") {
+      picking = true;
+      continue;
+    }
+    if (option == "--texture-arrays" || option == "--bindless") {
+      textureArrays = true;
+      bindless = bindless || option == "--bindless";
+      continue;
+    }
+    // Every other option takes a value
+    validArgs = (i + 1 < argc);
+    const char* value = validArgs ? argv[++i] : "";
+    if (validArgs && option == "--threads") {
+      threadCount = std::stoul(value);
+    }
+    else if (validArgs && option == "--profile") {
+      tracePath = value;
+    }
+    else if (validArgs && option == "--headless") {
+      headlessFrames = std::stoul(value);
+      validArgs = (headlessFrames > 0);
+    }
+    else if (validArgs && option == "--screenshot") {
+      screenshotPath = value;
+    }
+    else if (validArgs && option == "--lods") {
+      lodThreshold = std::stof(value);
+      validArgs = (lodThreshold >= 0);
+    }
+    else if (validArgs && option == "--texture-budget") {
+      textureBudget = std::stof(value);
+      validArgs = (textureBudget >= 0);
+    }
+    else if (validArgs && option == "--occlusion") {
+      occluderError = std::stof(value);
+      validArgs = (occluderError >= 0);
+    }
+    else if (validArgs && option == "--lights") {
+      lightCount = std::stoul(value);
+    }
+    else if (validArgs && option == "--instances") {
+      instanceCount = std::stoul(value);
+      validArgs = (instanceCount > 0);
+    }
+    else {
+      validArgs = false;
+    }
+  }
+  if (
+    !validArgs || (!screenshotPath.empty() && headlessFrames == 0)
+    || (textureArrays && textureBudget >= 0)
+  ) {
+    printf(
+      "Usage: %s <asset-path>... [--instances <count-per-asset>]"
+      " [--threads <count>] [--profile <trace.json>]"
+      " [--headless <frame-count> [--screenshot <last-frame.png>]]"
+      " [--optimize] [--quantize] [--lods <error-pixels>] [--meshlets]"
+      " [--texture-budget <megabytes> | --texture-arrays | --bindless] [--picking]"
+      " [--occlusion <occluder-error>] [--lights <count>]",
+      argv[0]
+    );
     return 1;
   }
+  bool headless = (headlessFrames > 0);
+
   try {
     // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
 
-    if (!glfwInit()) {
-      throw std::runtime_error("Error initializing glfw");
+    int width = 800;
+    int height = 800;
+    GLFWwindow* window = nullptr;
+    std::unique_ptr<HeadlessContext> headlessContext;
+
+    if (headless) {
+      headlessContext = std::make_unique<HeadlessContext>(4, 3);
     }
+    else {
+      if (!glfwInit()) {
+        throw std::runtime_error("Error initializing glfw");
+      }
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+      glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+      glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+      glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-    int width = 800;
-    int height = 800;
-    GLFWwindow* window = glfwCreateWindow(
-      width, height, "3D Game Engine", nullptr, nullptr
-    );
+      window = glfwCreateWindow(
+        width, height, "3D Game Engine", nullptr, nullptr
+      );
 
-    if (!window) {
-      glfwTerminate();
-      throw std::runtime_error("Error creating glfw window");
+      if (!window) {
+        glfwTerminate();
+        throw std::runtime_error("Error creating glfw window");
+      }
+
+      glfwMakeContextCurrent(window);
     }
 
-    glfwMakeContextCurrent(window);
-    if (glewInit() != GLEW_OK) {
+    // Core profiles need this with GLEW before 2.0
+    glewExperimental = GL_TRUE;
+    GLenum glewStatus = glewInit();
+    // A GLX build of GLEW loads the GL entry points, then fails to find an
+    // X display, which a surfaceless context does not need
+    if (
+      glewStatus != GLEW_OK
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+      && !(headless && glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)
+#endif
+    ) {
       throw std::runtime_error("Error initializing glew");
     }
 
@@ -52,74 +196,529 @@ int main(int argc, char** argv)
     glfwSetKeyCallback(window, key_callback);
     */
 
-    // enable vsync
-    glfwSwapInterval(1);
+    if (window) {
+      // enable vsync
+      glfwSwapInterval(1);
+    }
 
     printf(
-      "OpenGL %s, GLSL %s\n",
-      glGetString(GL_VERSION), glGetString(GL_SHADING_LANGUAGE_VERSION)
+      "OpenGL %s, GLSL %s, %s\n",
+      glGetString(GL_VERSION), glGetString(GL_SHADING_LANGUAGE_VERSION),
+      glGetString(GL_RENDERER)
     );
 
-    MeshPrimitive::AttributeMap attributeMap = {
-      { "POSITION", 0 },
-      { "NORMAL", 1 },
-      { "TEXCOORD_0", 2 },
-      { "JOINTS_0", 3 },
-      { "WEIGHTS_0", 4 }
-    };
+    // GPU resources must be released before the context is destroyed
+    {
+      std::unique_ptr<OffscreenTarget> offscreenTarget;
+      if (headless) {
+        offscreenTarget = std::make_unique<OffscreenTarget>(width, height);
+      }
 
-    std::string assetPath = argv[1];
-    AssetManager assets;
-    int assetId = assets.loadAsset(assetPath);
+      MeshPrimitive::AttributeMap attributeMap = {
+        { "POSITION", 0 },
+        { "NORMAL", 1 },
+        { "TEXCOORD_0", 2 },
+        { "JOINTS_0", 3 },
+        { "WEIGHTS_0", 4 },
+        { "TANGENT", 5 }
+      };
 
-    assets.gpuLoadAll(attributeMap);
+      ThreadPool threadPool(threadCount);
+      AssetManager assets;
+      LodSelection lodSelection;
+      if (lodThreshold >= 0) {
+        lodSelection.errorThreshold = lodThreshold;
+        lodSelection.viewportHeight = height;
+      }
+      // Streamed textures only load their coarse levels, before
+      // gpuLoadAll loads the others whole
+      std::unique_ptr<TextureStreamer> textureStreamer;
+      if (textureBudget >= 0) {
+        textureStreamer = std::make_unique<TextureStreamer>(
+          (size_t)(textureBudget * 1024 * 1024)
+        );
+        textureStreamer->setViewportHeight(height);
+      }
 
-    auto shaderProgram = new ShaderProgram();
-    shaderProgram->initFromFiles("dist/phong.vert", "dist/phong.frag");
-    shaderProgram->addUniform("mvp");
-    shaderProgram->addUniform("modelView");
-    shaderProgram->addUniform("normalMatrix");
-    shaderProgram->addUniform("cc_lightPos");
-    shaderProgram->addUniform("c_materialColor");
-    shaderProgram->addUniform("textureId");
+      std::vector<size_t> assetIds;
+      for (const std::string& assetPath: assetPaths) {
+        auto loadStart = std::chrono::steady_clock::now();
+        size_t assetId = assets.loadAsset(assetPath, true, false, &threadPool);
+        assetIds.push_back(assetId);
+        printf(
+          "Loaded %s in %.2f ms\n", assetPath.c_str(),
+          std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - loadStart
+          ).count()
+        );
 
-    for (size_t i = 0; i < 16; ++i) {
-      shaderProgram->addUniform("oc_jointMatrices[" + std::to_string(i) + "]");
-    }
+        if (optimize) {
+          MeshOptimizationReport report = assets.optimizeMeshes(assetId);
+          printf(
+            "Optimized %zu primitives (%zu skipped), %zu triangles: ACMR %.3f -> %.3f,"
+            " ATVR %.3f -> %.3f, index bytes %zu -> %zu\n",
+            report.primitiveCount, report.skippedPrimitives, report.triangleCount,
+            report.acmrBefore(), report.acmrAfter(),
+            report.atvrBefore(), report.atvrAfter(),
+            report.indexBytesBefore, report.indexBytesAfter
+          );
+        }
+        if (meshlets) {
+          printf("Built %zu meshlets\n", assets.buildMeshlets(assetId));
+        }
+        // After the optimizer, which reorders vertices, and before the
+        // quantization, so simplification sees full precision positions
+        if (lodThreshold >= 0) {
+          size_t lodCount = assets.generateLods(assetId);
+          printf("Generated %zu levels of detail\n", lodCount);
+        }
+        if (quantize) {
+          QuantizationReport report = assets.quantizeAttributes(assetId);
+          printf(
+            "Quantized %zu attributes: %zu -> %zu bytes (%zu saved), max error"
+            " position %g, normal %.3f deg, texcoord %g, weight %g\n",
+            report.attributeCount, report.originalBytes, report.quantizedBytes,
+            report.savedBytes(),
+            report.maxPositionError, report.maxNormalError,
+            report.maxTexcoordError, report.maxWeightError
+          );
+        }
+        if (picking) {
+          auto bvhStart = std::chrono::steady_clock::now();
+          TriangleBvhReport report = assets.buildTriangleBvhs(
+            assetId, &threadPool, "bvh_cache"
+          );
+          printf(
+            "Triangle BVHs of %zu primitives (%zu cached), %zu triangles,"
+            " %zu nodes, in %.2f ms\n",
+            report.primitiveCount, report.cachedCount,
+            report.triangleCount, report.nodeCount,
+            std::chrono::duration<double, std::milli>(
+              std::chrono::steady_clock::now() - bvhStart
+            ).count()
+          );
+        }
+        // Only the first asset occludes
+        if (occluderError >= 0 && assetIds.size() == 1) {
+          printf(
+            "Occluder meshes of %zu triangles\n",
+            assets.buildOccluderMeshes(assetId, occluderError)
+          );
+        }
+        if (textureStreamer) {
+          textureStreamer->addTextures(assets.getTextures(assetId), &threadPool);
+        }
+      }
+      if (textureStreamer) {
+        const TextureStreamingStats& textureStats = textureStreamer->getStats();
+        printf(
+          "Streaming %u textures: %.1f of %.1f MB resident\n",
+          textureStats.textureCount,
+          textureStats.residentBytes / 1048576.0, textureStats.fullBytes / 1048576.0
+        );
+      }
+      // Repacked before gpuLoadAll, which skips the packed textures
+      TextureArrays packedTextures;
+      if (textureArrays) {
+        auto packStart = std::chrono::steady_clock::now();
+        std::vector<TextureData*> textures;
+        for (size_t assetId: assetIds) {
+          std::vector<TextureData*> assetTextures = assets.getTextures(assetId);
+          textures.insert(textures.end(), assetTextures.begin(), assetTextures.end());
+        }
+        packedTextures.addTextures(textures, bindless, &threadPool);
+        const TextureArrayStats& arrayStats = packedTextures.getStats();
+        printf(
+          "Packed %u textures into %u arrays, %.1f MB, in %.2f ms%s\n",
+          arrayStats.textureCount, arrayStats.arrayCount,
+          arrayStats.bytes / 1048576.0,
+          std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - packStart
+          ).count(),
+          arrayStats.bindless ? ", bindless" : ""
+        );
+        if (bindless && !arrayStats.bindless && arrayStats.textureCount > 0) {
+          printf("No ARB_bindless_texture, binding the arrays instead\n");
+        }
+      }
+      assets.gpuLoadAll(attributeMap);
 
-    glm::vec3 cameraPos = { 3, 3, 3 };
+      // Instances of every asset, interleaved on a square grid, spaced
+      // by the largest asset. Skinned assets have no finite bounds.
+      World world(assets);
+      float spacing = 0;
+      for (size_t assetId: assetIds) {
+        world.addAsset(assetId);
+        const Aabb& bounds = world.getRestBounds(assetId);
+        if (!bounds.isEmpty() && !bounds.isInfinite()) {
+          spacing = std::max(spacing, 2 * glm::length(bounds.getExtents()));
+        }
+      }
+      spacing = spacing > 0 ? spacing : 2;
+      uint32_t totalInstances = instanceCount * assetIds.size();
+      uint32_t gridSize = (uint32_t)std::ceil(std::sqrt((double)totalInstances));
+      float gridOffset = (gridSize - 1) * spacing / 2;
+      for (uint32_t i = 0; i < totalInstances; ++i) {
+        size_t assetId = assetIds[i % assetIds.size()];
+        glm::vec3 position(
+          (i % gridSize) * spacing - gridOffset, 0, (i / gridSize) * spacing - gridOffset
+        );
+        InstanceId id = world.add(assetId, glm::translate(glm::mat4(1), position));
+        if (!assets.getAsset(assetId)->animations.empty()) {
+          world.setAnimation(id, 0);
+        }
+        world.setOccluder(id, occluderError >= 0 && assetId == assetIds[0]);
+      }
+      printf("World of %u instances\n", world.size());
 
-    glm::mat4 model = glm::mat4(1);
-    glm::mat4 view = glm::lookAt(cameraPos, {0, 0, 0}, {0, 1, 0});
-    glm::mat4 projection = glm::perspective(
-      45.0f, 1.0f * width / height, 0.1f, 500.0f
-    );
+      // Low quasi-random sequence over the grid, every tenth light a spot
+      // pointing down. Ranges reach a few instances away, and intensities
+      // leave room for the overlaps.
+      std::vector<Light> lights(lightCount);
+      for (uint32_t i = 0; i < lightCount; ++i) {
+        float u = std::fmod(0.5f + i * 0.7548777f, 1.0f);
+        float v = std::fmod(0.5f + i * 0.5698403f, 1.0f);
+        float hue = std::fmod(i * 0.618034f, 1.0f) * 6.2831853f;
+        Light& light = lights[i];
+        light.position = glm::vec3(
+          (u - 0.5f) * (gridOffset * 2 + spacing), spacing * 0.75f, (v - 0.5f) * (gridOffset * 2 + spacing)
+        );
+        light.range = spacing * 2;
+        light.color = 0.6f * glm::vec3(
+          0.5f + 0.5f * std::cos(hue), 0.5f + 0.5f * std::cos(hue - 2.0943951f),
+          0.5f + 0.5f * std::cos(hue + 2.0943951f)
+        );
+        if (i % 10 == 0) {
+          light.direction = glm::vec3(0, -1, 0);
+          light.innerConeAngle = 0.5f;
+          light.outerConeAngle = 0.7f;
+          light.range = spacing * 3;
+        }
+      }
+      LightGrid lightGrid;
+      lightGrid.setViewportSize(width, height);
 
-    auto startTime = std::chrono::steady_clock::now();
+      printf("Extracting on %u threads\n", threadPool.getThreadCount());
+      // Kept across frames to reuse their allocations
+      std::vector<DrawList> drawLists;
+      // Transforms and joint palettes of the frames in flight, grown if
+      // a frame needs more
+      GpuRingBuffer ringBuffer(4 << 20);
+      OcclusionBuffer occlusionBuffer;
 
-    while (!glfwWindowShouldClose(window))
-    {
-      glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
-      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-      glEnable(GL_DEPTH_TEST);
-
-      auto elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
-
-      // DRAW
-      draw(
-        *shaderProgram,
-        assets, assetId,
-        model, view, projection,
-        elapsedTime.count() / 1000.f
+      for (GLenum target: { GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER }) {
+        GpuPoolStats stats = assets.getGpuBuffers().getPool(target).getStats();
+        printf(
+          "%s pool: %zu allocations in %zu blocks, %.1f%% used, %.1f%% fragmented\n",
+          target == GL_ARRAY_BUFFER ? "Vertex" : "Index",
+          stats.allocationCount, stats.blockCount,
+          stats.utilization() * 100, stats.fragmentation() * 100
+        );
+      }
+
+      // Startup cost of the shaders, cold on the first launch and warm
+      // once the binary cache is filled. Instanced variants are only
+      // built if something draws with them.
+      auto shaderStart = std::chrono::steady_clock::now();
+      ShaderProgram::setBinaryCacheDirectory("shader_cache");
+      ShaderVariants shaders("dist/phong.vert", "dist/phong.frag");
+      // Vertex and texture formats are the same for every draw
+      uint32_t fixedFeatures = (
+        (quantize ? ShaderVariants::HAS_OCTAHEDRAL_NORMALS : 0)
+        | (textureArrays ? ShaderVariants::USE_TEXTURE_ARRAYS : 0)
+        | (packedTextures.getStats().bindless ? ShaderVariants::USE_BINDLESS_TEXTURES : 0)
+      );
+      shaders.compile(
+        ShaderVariants::HAS_SKINNING
+        | ShaderVariants::HAS_NORMAL_MAP
+        | ShaderVariants::HAS_BASE_COLOR_TEXTURE,
+        fixedFeatures
       );
+      printf(
+        "Shader variants ready in %.2f ms (binary cache %s)\n",
+        std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - shaderStart
+        ).count(),
+        shaders.get(
+          fixedFeatures & ~ShaderVariants::TEXTURE_ACCESS_FEATURES
+        ).isLoadedFromCache() ? "warm" : "cold"
+      );
+
+      // Backed away to see the whole grid
+      glm::vec3 cameraPos = glm::vec3(3 + gridOffset);
+
+      glm::mat4 view = glm::lookAt(cameraPos, {0, 0, 0}, {0, 1, 0});
+      glm::mat4 projection = glm::perspective(
+        45.0f, 1.0f * width / height, 0.1f, 500.0f + 4 * gridOffset
+      );
+
+#ifndef NDEBUG
+      shaders.get(0).validate();
+#endif
+
+      Profiler& profiler = Profiler::get();
+      profiler.setEnabled(!tracePath.empty());
+      profiler.setCapturing(!tracePath.empty());
+
+      auto startTime = std::chrono::steady_clock::now();
+      auto lastStatsTime = startTime;
+      std::vector<double> frameTimes;
+      frameTimes.reserve(headlessFrames);
+      DrawStats lastStats;
+      SubmitStats submitStats;
+      float lastAnimTime = 0;
+      bool wasPressed = false;
 
-      glfwSwapBuffers(window);
-      glfwPollEvents();
-      // glfwWaitEvents();
+      for (
+        uint32_t frame = 0;
+        headless ? frame < headlessFrames : !glfwWindowShouldClose(window);
+        ++frame
+      ) {
+        auto frameStart = std::chrono::steady_clock::now();
+
+        // Frame zones must be closed before the profiler collects them
+        {
+          ProfileZone frameZone("frame");
+          if (offscreenTarget) {
+            offscreenTarget->bind();
+          }
+          {
+            GpuProfileZone gpuZone("clear");
+            glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+          }
+          GlState::get().setEnabled(GL_DEPTH_TEST, true);
+
+          // Headless runs step at a fixed 60 Hz, so the frames, and the
+          // screenshot, do not depend on how fast they render
+          float animTime = headless
+            ? frame / 60.f
+            : std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - startTime
+            ).count() / 1000.f;
+
+          // DRAW
+          DrawStats stats;
+          ringBuffer.beginFrame();
+          auto extractStart = std::chrono::steady_clock::now();
+          world.animate(animTime - lastAnimTime, &threadPool);
+          world.updateBounds(&threadPool);
+          lastAnimTime = animTime;
+          extractDrawLists(
+            assets, world,
+            view, projection,
+            drawLists,
+            &threadPool,
+            &stats,
+            lodThreshold >= 0 ? &lodSelection : nullptr,
+            textureStreamer.get(),
+            &ringBuffer,
+            occluderError >= 0 ? &occlusionBuffer : nullptr
+          );
+          auto extractTime = std::chrono::steady_clock::now() - extractStart;
+          lastStats = stats;
+          if (textureStreamer) {
+            for (const DrawList& drawList: drawLists) {
+              textureStreamer->request(drawList.textureRequests);
+            }
+            textureStreamer->update();
+          }
+          if (lightCount > 0) {
+            lightGrid.update(lights, view, projection, &threadPool);
+          }
+          submitDrawLists(
+            shaders, drawLists, ringBuffer, view, projection,
+            lightCount > 0 ? &lightGrid : nullptr, &submitStats
+          );
+          ringBuffer.endFrame();
+          GlState::get().endFrame();
+
+          // On release, through the cursor from the near plane
+          bool pressed = window && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+          if (picking && wasPressed && !pressed) {
+            double cursorX, cursorY;
+            glfwGetCursorPos(window, &cursorX, &cursorY);
+            float ndcX = 2 * cursorX / width - 1;
+            float ndcY = 1 - 2 * cursorY / height;
+            glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+            glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1, 1);
+            glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1, 1);
+            Ray ray;
+            ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+            ray.direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - ray.origin);
+
+            RaycastHit hit;
+            if (world.raycast(ray, hit)) {
+              printf(
+                "Hit instance %u, triangle %u at (%.3f, %.3f), %.3f away\n",
+                world.getIndex(hit.instance), hit.triangle,
+                hit.barycentrics.x, hit.barycentrics.y, hit.distance
+              );
+            }
+            else {
+              printf("No hit\n");
+            }
+          }
+          wasPressed = pressed;
+
+          if (window && std::chrono::steady_clock::now() - lastStatsTime > std::chrono::seconds(1)) {
+            lastStatsTime = std::chrono::steady_clock::now();
+            std::string title = (
+              "3D Game Engine - "
+              + std::to_string(stats.culledInstances) + " culled instances, "
+              + std::to_string(stats.occludedInstances) + " occluded, "
+              + std::to_string(stats.visiblePrimitives) + " visible, "
+              + std::to_string(stats.culledPrimitives) + " culled primitives ("
+              + std::to_string(stats.culledSubtrees) + " subtrees), "
+              + std::to_string(stats.submittedTriangles) + " triangles ("
+              + std::to_string(stats.culledMeshletTriangles) + " culled in "
+              + std::to_string(stats.culledMeshlets) + " meshlets), extraction "
+              + std::to_string(
+                std::chrono::duration_cast<std::chrono::microseconds>(extractTime).count()
+              ) + " us"
+            );
+            glfwSetWindowTitle(window, title.c_str());
+
+            for (const ProfileStageSummary& stage: profiler.getSummary()) {
+              printf(
+                "%s %-24s avg %7.3f ms, max %7.3f ms\n",
+                stage.isGpu ? "GPU" : "CPU", stage.name.c_str(),
+                stage.averageMs, stage.maxMs
+              );
+            }
+            const GlStateStats& glStats = GlState::get().getFrameStats();
+            printf(
+              "GL state: %u calls issued, %u elided\n",
+              glStats.issuedCalls, glStats.elidedCalls
+            );
+            printf(
+              "Submit: %u draws, %u program changes, %u texture changes\n",
+              submitStats.drawCalls, submitStats.programChanges,
+              submitStats.textureChanges
+            );
+            if (occluderError >= 0) {
+              const OcclusionStats& occlusionStats = occlusionBuffer.getStats();
+              printf(
+                "Occlusion: %u occluders, %u of %u triangles rasterized in %.3f ms,"
+                " %u of %u instances occluded in %.3f ms\n",
+                occlusionStats.occluderCount, occlusionStats.rasterizedTriangles,
+                occlusionStats.occluderTriangles, occlusionStats.rasterizeMs,
+                occlusionStats.occludedBoxes, occlusionStats.testedBoxes,
+                occlusionStats.testMs
+              );
+            }
+            if (lightCount > 0) {
+              const LightGridStats& lightStats = lightGrid.getStats();
+              printf(
+                "Lights: %u in %u clusters, %u indices, at most %u per cluster,"
+                " assigned in %.3f ms\n",
+                lightStats.lightCount, lightStats.clusterCount,
+                lightStats.lightIndexCount, lightStats.maxClusterLights,
+                lightStats.assignMs
+              );
+            }
+            if (textureStreamer) {
+              const TextureStreamingStats& textureStats = textureStreamer->getStats();
+              printf(
+                "Textures: %.1f MB resident, %u misses, %u levels uploaded,"
+                " %u evicted\n",
+                textureStats.residentBytes / 1048576.0, textureStats.misses,
+                textureStats.uploadedLevels, textureStats.evictedLevels
+              );
+            }
+          }
+
+          if (window) {
+            ProfileZone swapZone("swap");
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+            // glfwWaitEvents();
+          }
+          else {
+            // Nothing paces the frames without a swap chain, wait for the
+            // GPU so each frame time includes its rendering
+            ProfileZone finishZone("finish");
+            glFinish();
+          }
+        }
+        profiler.endFrame();
+
+        frameTimes.push_back(std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - frameStart
+        ).count());
+      }
+
+      if (headless) {
+        std::sort(frameTimes.begin(), frameTimes.end());
+        printf(
+          "%u frames: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+          headlessFrames,
+          _percentile(frameTimes, 50), _percentile(frameTimes, 95),
+          _percentile(frameTimes, 99), frameTimes.back()
+        );
+        uint32_t meshletCandidates = (
+          lastStats.submittedTriangles + lastStats.culledMeshletTriangles
+        );
+        printf(
+          "Last frame: %u of %u instances culled, %u visible primitives,"
+          " %u triangles submitted, %u meshlets culled (%.1f%% of the"
+          " triangles left by node culling)\n",
+          lastStats.culledInstances, world.size(),
+          lastStats.visiblePrimitives, lastStats.submittedTriangles,
+          lastStats.culledMeshlets,
+          meshletCandidates > 0
+            ? 100.0 * lastStats.culledMeshletTriangles / meshletCandidates
+            : 0.0
+        );
+        GpuRingStats ringStats = ringBuffer.getStats();
+        printf(
+          "Ring buffer: %.1f of %.1f KB per frame (%s), %u failed allocations,"
+          " %u frames waited for the GPU\n",
+          ringStats.requestedBytes / 1024.0, ringStats.frameSize / 1024.0,
+          ringStats.persistent ? "persistent" : "staged",
+          ringStats.failedAllocations, ringStats.stalledFrames
+        );
+        printf(
+          "Submit: %u draws, %u program changes, %u texture changes\n",
+          submitStats.drawCalls, submitStats.programChanges,
+          submitStats.textureChanges
+        );
+        if (textureStreamer) {
+          const TextureStreamingStats& textureStats = textureStreamer->getStats();
+          printf(
+            "Textures: %.1f of %.1f MB resident (budget %.1f MB),"
+            " %u of %u requested, %u missing a finer level\n",
+            textureStats.residentBytes / 1048576.0, textureStats.fullBytes / 1048576.0,
+            textureStats.budgetBytes / 1048576.0,
+            textureStats.requestedTextures, textureStats.textureCount,
+            textureStats.misses
+          );
+        }
+      }
+
+      if (!screenshotPath.empty()) {
+        if (offscreenTarget->writePng(screenshotPath)) {
+          printf("Last frame written to %s\n", screenshotPath.c_str());
+        }
+        else {
+          fprintf(stderr, "Could not write %s\n", screenshotPath.c_str());
+        }
+      }
+
+      if (!tracePath.empty()) {
+        if (profiler.writeTrace(tracePath)) {
+          printf("Trace written to %s\n", tracePath.c_str());
+        }
+        else {
+          fprintf(stderr, "Could not write trace to %s\n", tracePath.c_str());
+        }
+      }
     }
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if (window) {
+      glfwDestroyWindow(window);
+      glfwTerminate();
+    }
   }
   catch (const std::exception& err) {
     std::cerr << "An error occured: " << err.what() << std::endl;